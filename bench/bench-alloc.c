@@ -0,0 +1,264 @@
+// Microbenchmarks of StackAllocator against glibc malloc and a trivial
+// bump allocator, built and run by `make bench-alloc`.
+//
+// Each workload is replayed against every allocator and timed as the
+// fastest of several repetitions. Every allocation is written to so
+// that allocators handing out untouched memory don't get a head start.
+//
+//   small   fixed 16 byte allocations, then a full reset
+//   mixed   mostly 8-256 byte allocations with occasional large
+//           instruction arrays, like libtcg_alloc() sees when lifting
+//   marker  marker, worklist plus a few small nodes, reset to marker,
+//           the pattern of find_sources() under is_stack_ld_fancy()
+//   walk    fill many blocks, reset, then repeatedly allocate a size
+//           none of them fit so alloc() walks the whole block list
+
+#define _POSIX_C_SOURCE 200809L
+#include "../src/stack_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
+#define REPETITIONS 5
+#define MAX_LIVE (1u << 20)
+#define BUMP_SIZE ((size_t) 1 << 30)
+
+typedef enum AllocKind {
+    ALLOC_STACK = 0,
+    ALLOC_MALLOC,
+    ALLOC_BUMP,
+    NUM_ALLOC_KINDS,
+} AllocKind;
+
+static const char *alloc_names[NUM_ALLOC_KINDS] = {
+    [ALLOC_STACK]  = "stack",
+    [ALLOC_MALLOC] = "malloc",
+    [ALLOC_BUMP]   = "bump",
+};
+
+// Common interface over the allocators. malloc has no bulk reset, so
+// live allocations are remembered and freed on reset.
+typedef struct Allocator {
+    AllocKind kind;
+    StackAllocator stack;
+    uint8_t *bump;
+    size_t bump_used;
+    void **live;
+    size_t num_live;
+} Allocator;
+
+typedef struct Marker {
+    StackMarker stack;
+    size_t bump_used;
+    size_t num_live;
+} Marker;
+
+static inline void *allocate(Allocator *a, size_t size) {
+    uint8_t *ptr;
+    switch (a->kind) {
+    case ALLOC_STACK:
+        ptr = stack_alloc(&a->stack, size);
+        break;
+    case ALLOC_MALLOC:
+        ptr = malloc(size);
+        a->live[a->num_live++ & (MAX_LIVE - 1)] = ptr;
+        break;
+    case ALLOC_BUMP:
+    default:
+        ptr = a->bump + a->bump_used;
+        a->bump_used += size;
+        break;
+    }
+    ptr[0] = (uint8_t) size;
+    return ptr;
+}
+
+static inline Marker marker(Allocator *a) {
+    Marker m = {0};
+    switch (a->kind) {
+    case ALLOC_STACK:  m.stack = stack_marker(&a->stack); break;
+    case ALLOC_MALLOC: m.num_live = a->num_live; break;
+    case ALLOC_BUMP:   m.bump_used = a->bump_used; break;
+    default: break;
+    }
+    return m;
+}
+
+static inline void reset_to_marker(Allocator *a, Marker m) {
+    switch (a->kind) {
+    case ALLOC_STACK:
+        stack_reset_to_marker(&a->stack, m.stack);
+        break;
+    case ALLOC_MALLOC:
+        while (a->num_live > m.num_live) {
+            free(a->live[--a->num_live & (MAX_LIVE - 1)]);
+        }
+        break;
+    case ALLOC_BUMP:
+        a->bump_used = m.bump_used;
+        break;
+    default:
+        break;
+    }
+}
+
+// Starts a workload from an empty allocator, so that blocks left over
+// from earlier workloads don't change what the stack allocator walks
+static void release(Allocator *a) {
+    if (a->kind == ALLOC_STACK) {
+        stack_free_all(&a->stack);
+        a->stack = (StackAllocator) {0};
+    } else {
+        reset_to_marker(a, (Marker) {0});
+    }
+}
+
+static inline void reset(Allocator *a) {
+    if (a->kind == ALLOC_STACK) {
+        stack_reset(&a->stack);
+    } else {
+        reset_to_marker(a, (Marker) {0});
+    }
+}
+
+// xorshift64, deterministic so that every allocator sees the same sizes
+static inline uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static inline size_t mixed_size(uint64_t *state) {
+    uint64_t r = next_random(state);
+    if ((r & 255) == 0) {
+        // Instruction arrays of a large block
+        return 4096 + (r >> 8) % (60*1024);
+    }
+    return 8 + (r >> 8) % 249;
+}
+
+static size_t workload_small(Allocator *a) {
+    const size_t count = 200000;
+    for (size_t i = 0; i < count; ++i) {
+        allocate(a, 16);
+    }
+    reset(a);
+    return count;
+}
+
+static size_t workload_mixed(Allocator *a) {
+    const size_t count = 100000;
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < count; ++i) {
+        allocate(a, mixed_size(&state));
+    }
+    reset(a);
+    return count;
+}
+
+static size_t workload_marker(Allocator *a) {
+    const size_t cycles = 20000;
+    size_t count = 0;
+    uint64_t state = 1;
+    // Some long lived data below the markers
+    for (size_t i = 0; i < 64; ++i) {
+        allocate(a, 64);
+    }
+    for (size_t i = 0; i < cycles; ++i) {
+        Marker m = marker(a);
+        // Source queue of find_sources(), 512 entries
+        allocate(a, 512*64);
+        size_t n = 2 + next_random(&state) % 6;
+        for (size_t j = 0; j < n; ++j) {
+            allocate(a, 48);
+        }
+        count += n + 1;
+        reset_to_marker(a, m);
+    }
+    reset(a);
+    return count + 64;
+}
+
+static size_t workload_walk(Allocator *a) {
+    const size_t fill = 8000;
+    const size_t cycles = 2000;
+    Marker m = marker(a);
+    for (size_t i = 0; i < fill; ++i) {
+        allocate(a, 1000);
+    }
+    // Fits none of the filled blocks, so every allocation walks past
+    // all of them
+    for (size_t i = 0; i < cycles; ++i) {
+        reset_to_marker(a, m);
+        allocate(a, 5000);
+    }
+    reset(a);
+    return fill + cycles;
+}
+
+typedef struct Workload {
+    const char *name;
+    size_t (*run)(Allocator *a);
+} Workload;
+
+static const Workload workloads[] = {
+    {"small",  workload_small},
+    {"mixed",  workload_mixed},
+    {"marker", workload_marker},
+    {"walk",   workload_walk},
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+int main(void) {
+    Allocator allocators[NUM_ALLOC_KINDS] = {0};
+    for (size_t k = 0; k < NUM_ALLOC_KINDS; ++k) {
+        allocators[k].kind = k;
+    }
+    allocators[ALLOC_MALLOC].live = malloc(MAX_LIVE*sizeof(void *));
+    allocators[ALLOC_BUMP].bump = malloc(BUMP_SIZE);
+    if (allocators[ALLOC_MALLOC].live == NULL ||
+        allocators[ALLOC_BUMP].bump == NULL) {
+        fprintf(stderr, "[error]: Failed to allocate benchmark buffers\n");
+        return 1;
+    }
+
+    printf("%-10s%-10s%12s%12s%14s%12s\n", "workload", "allocator",
+           "allocs", "ns/alloc", "Mallocs/s", "vs stack");
+    for (size_t w = 0; w < ARRLEN(workloads); ++w) {
+        double stack_ns = 0.0;
+        for (size_t k = 0; k < NUM_ALLOC_KINDS; ++k) {
+            Allocator *a = &allocators[k];
+            release(a);
+            // The first run warms up caches and, for the stack
+            // allocator, the block list that later runs reuse
+            size_t count = workloads[w].run(a);
+            uint64_t best = UINT64_MAX;
+            for (size_t r = 0; r < REPETITIONS; ++r) {
+                uint64_t begin = now_ns();
+                workloads[w].run(a);
+                uint64_t elapsed = now_ns() - begin;
+                best = (elapsed < best) ? elapsed : best;
+            }
+            double ns = (double) best/count;
+            if (k == ALLOC_STACK) {
+                stack_ns = ns;
+            }
+            printf("%-10s%-10s%12lu%12.2f%14.1f%11.2fx\n", workloads[w].name,
+                   alloc_names[k], count, ns, 1e3/ns, ns/stack_ns);
+        }
+    }
+
+    release(&allocators[ALLOC_STACK]);
+    free(allocators[ALLOC_MALLOC].live);
+    free(allocators[ALLOC_BUMP].bump);
+    return 0;
+}
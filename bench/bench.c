@@ -0,0 +1,328 @@
+// Benchmark driver, runs dump-ir over each entry of a corpus list with
+// --stats-json and --mem-report json, and reports throughput and memory
+// use against a stored baseline.
+//
+//   bench [options] <dump-ir> <corpus.txt>
+//
+// Corpus lines are "<name> <file> <dump-ir arguments>...", # starts a
+// comment. Baselines start with a "# bench baseline <version>" line
+// followed by lines of
+//
+//   <name> <ops/s> <blocks/s> <peak rss kiB> <arena kiB>
+//
+// Throughput below, or memory use above, the baseline by more than the
+// threshold counts as a regression and makes bench exit with 1.
+
+#define _DEFAULT_SOURCE
+#include "../src/cmdline.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
+#define MAX_ARGS 64
+#define MAX_ENTRIES 256
+// Bumped when dump-ir changes in ways that make earlier baselines
+// meaningless, such as v2 dropping the max-stack trace on stdout that
+// v1 timings of -m entries were dominated by
+#define BASELINE_VERSION 2
+
+typedef struct BenchResult {
+    char name[64];
+    uint64_t total_ns;
+    uint64_t tcg_ops;
+    uint64_t blocks;
+    uint64_t peak_rss_kib;
+    uint64_t arena_kib;
+} BenchResult;
+
+typedef struct Baseline {
+    char name[64];
+    double ops_per_sec;
+    double blocks_per_sec;
+    double peak_rss_kib;
+    double arena_kib;
+} Baseline;
+
+static inline double ops_per_sec(const BenchResult *r) {
+    return (r->total_ns > 0) ? 1e9*r->tcg_ops/r->total_ns : 0.0;
+}
+
+static inline double blocks_per_sec(const BenchResult *r) {
+    return (r->total_ns > 0) ? 1e9*r->blocks/r->total_ns : 0.0;
+}
+
+// Returns the integer following key in the report, 0 if it is missing
+static uint64_t report_value(const char *report, const char *key) {
+    const char *p = strstr(report, key);
+    return (p != NULL) ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+// Runs dump-ir once with stdout discarded and collects stderr, returns
+// false if it could not be run or failed.
+static bool run_once(char **argv, BenchResult *result) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    size_t size = 0;
+    size_t cap = 4096;
+    char *report = malloc(cap);
+    for (;;) {
+        if (cap - size < 1024) {
+            cap *= 2;
+            report = realloc(report, cap);
+        }
+        ssize_t n = read(fds[0], report + size, cap - size - 1);
+        if (n <= 0) {
+            break;
+        }
+        size += n;
+    }
+    report[size] = 0;
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    pid_t waited;
+    do {
+        waited = wait4(pid, &status, 0, &usage);
+    } while (waited == -1);
+
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+              strstr(report, "\"total_ns\":") != NULL;
+    if (ok) {
+        result->total_ns = report_value(report, "\"total_ns\":");
+        result->tcg_ops = report_value(report, "\"tcg-ops\":");
+        result->blocks = report_value(report, "\"tbs-lifted\":");
+        result->peak_rss_kib = usage.ru_maxrss;
+        const char *p = strstr(report, "\"persistent\":");
+        const char *t = strstr(report, "\"temporary\":");
+        if (p != NULL && t != NULL) {
+            result->arena_kib = (report_value(p, "\"size\":") +
+                                 report_value(t, "\"size\":"))/1024;
+        }
+    } else {
+        fprintf(stderr, "[error]: %s failed:\n%s", argv[0], report);
+    }
+    free(report);
+    return ok;
+}
+
+// Sets *stale and returns 0 for baselines of another BASELINE_VERSION
+static size_t read_baseline(const char *path, Baseline *baseline, size_t max,
+                            bool *stale) {
+    FILE *fd = fopen(path, "r");
+    if (fd == NULL) {
+        return 0;
+    }
+    size_t count = 0;
+    char line[512];
+    int version = 0;
+    if (fgets(line, sizeof(line), fd) == NULL ||
+        sscanf(line, "# bench baseline %d", &version) != 1 ||
+        version != BASELINE_VERSION) {
+        *stale = true;
+        fclose(fd);
+        return 0;
+    }
+    while (count < max && fgets(line, sizeof(line), fd) != NULL) {
+        Baseline *b = &baseline[count];
+        if (line[0] == '#' ||
+            sscanf(line, "%63s %lf %lf %lf %lf", b->name, &b->ops_per_sec,
+                   &b->blocks_per_sec, &b->peak_rss_kib, &b->arena_kib) != 5) {
+            continue;
+        }
+        ++count;
+    }
+    fclose(fd);
+    return count;
+}
+
+static bool write_baseline(const char *path, BenchResult *results, size_t count) {
+    FILE *fd = fopen(path, "w");
+    if (fd == NULL) {
+        fprintf(stderr, "[error]: Failed to open %s\n", path);
+        return false;
+    }
+    fprintf(fd, "# bench baseline %d\n", BASELINE_VERSION);
+    fputs("# name ops/s blocks/s peak-rss-kib arena-kib\n", fd);
+    for (size_t i = 0; i < count; ++i) {
+        BenchResult *r = &results[i];
+        fprintf(fd, "%s %.0f %.0f %lu %lu\n", r->name, ops_per_sec(r),
+                blocks_per_sec(r), r->peak_rss_kib, r->arena_kib);
+    }
+    fclose(fd);
+    return true;
+}
+
+// Relative change from baseline in percent, positive is worse
+static double regression(double current, double base, bool higher_is_better) {
+    if (base <= 0.0) {
+        return 0.0;
+    }
+    double change = 100.0*(current - base)/base;
+    return (higher_is_better) ? -change : change;
+}
+
+int main(int argc, char **argv) {
+    bool help = false;
+    bool update = false;
+    const char *dump_ir = NULL;
+    const char *corpus = NULL;
+    const char *baseline_path = "bench/baseline.txt";
+    unsigned long runs = 5;
+    unsigned long threshold = 10;
+
+    CmdLineOption pos_options[] = {
+        {"[dump-ir]", "", "string", "dump-ir binary to benchmark", CMDLINE_OPTION_STR, .str = &dump_ir, .required = true},
+        {"[corpus]",  "", "string", "corpus list, one \"name file args...\" per line", CMDLINE_OPTION_STR, .str = &corpus, .required = true},
+    };
+    CmdLineOption named_options[] = {
+        {"--help",      "-h", "",      "show help message", CMDLINE_OPTION_BOOL, .b = &help},
+        {"--runs",      "-n", "ulong", "run each entry ulong times and keep the fastest run", CMDLINE_OPTION_ULONG, .ulong = &runs},
+        {"--threshold", "-t", "ulong", "report regressions larger than ulong percent", CMDLINE_OPTION_ULONG, .ulong = &threshold},
+        {"--baseline",  "-b", "file",  "baseline to compare against", CMDLINE_OPTION_STR, .str = &baseline_path},
+        {"--update",    "-u", "",      "write the results to the baseline instead of comparing", CMDLINE_OPTION_BOOL, .b = &update},
+    };
+    if (!parse_options(pos_options, ARRLEN(pos_options),
+                       named_options, ARRLEN(named_options),
+                       argc, argv)
+        || help || dump_ir == NULL || corpus == NULL || runs == 0) {
+        fprintf(stderr, "[error]: Failed parsing options\n\n");
+        print_help(stderr,
+                   pos_options, ARRLEN(pos_options),
+                   named_options, ARRLEN(named_options));
+        return 2;
+    }
+
+    FILE *fd = fopen(corpus, "r");
+    if (fd == NULL) {
+        fprintf(stderr, "[error]: Failed to open %s\n", corpus);
+        return 2;
+    }
+
+    static Baseline baseline[MAX_ENTRIES];
+    static BenchResult results[MAX_ENTRIES];
+    bool stale = false;
+    size_t num_baseline = (update) ? 0 : read_baseline(baseline_path, baseline, MAX_ENTRIES, &stale);
+    size_t num_results = 0;
+    bool failed = false;
+
+    printf("%-12s%10s%12s%14s%12s%12s%12s\n", "name", "ms", "Mops/s",
+           "kblocks/s", "rss kiB", "arena kiB", "vs base");
+    char line[4096];
+    while (num_results < MAX_ENTRIES && fgets(line, sizeof(line), fd) != NULL) {
+        char *args[MAX_ARGS];
+        size_t num_args = 0;
+        args[num_args++] = (char *) dump_ir;
+        char *name = strtok(line, " \t\n");
+        if (name == NULL || name[0] == '#') {
+            continue;
+        }
+        for (char *tok = strtok(NULL, " \t\n");
+             tok != NULL && num_args < MAX_ARGS - 5;
+             tok = strtok(NULL, " \t\n")) {
+            args[num_args++] = tok;
+        }
+        args[num_args++] = "--stats-json";
+        args[num_args++] = "--mem-report";
+        args[num_args++] = "json";
+        args[num_args] = NULL;
+
+        struct stat st;
+        if (num_args < 5 || stat(args[1], &st) == -1) {
+            printf("%-12s  skipped, %s not found\n", name, (num_args > 4) ? args[1] : "file");
+            continue;
+        }
+
+        BenchResult best = {0};
+        bool ok = true;
+        for (unsigned long i = 0; i < runs && ok; ++i) {
+            BenchResult r = {0};
+            ok = run_once(args, &r);
+            if (i == 0 || r.total_ns < best.total_ns) {
+                best.total_ns = r.total_ns;
+            }
+            if (i == 0 || r.peak_rss_kib < best.peak_rss_kib) {
+                best.peak_rss_kib = r.peak_rss_kib;
+            }
+            best.tcg_ops = r.tcg_ops;
+            best.blocks = r.blocks;
+            best.arena_kib = r.arena_kib;
+        }
+        if (!ok) {
+            printf("%-12s  failed\n", name);
+            failed = true;
+            continue;
+        }
+        snprintf(best.name, sizeof(best.name), "%s", name);
+        results[num_results++] = best;
+
+        printf("%-12s%10.3f%12.3f%14.3f%12lu%12lu", name, best.total_ns/1e6,
+               ops_per_sec(&best)/1e6, blocks_per_sec(&best)/1e3,
+               best.peak_rss_kib, best.arena_kib);
+
+        const Baseline *base = NULL;
+        for (size_t i = 0; i < num_baseline; ++i) {
+            if (strcmp(baseline[i].name, name) == 0) {
+                base = &baseline[i];
+            }
+        }
+        if (base == NULL) {
+            printf("%12s\n", "-");
+            continue;
+        }
+        double worst = regression(ops_per_sec(&best), base->ops_per_sec, true);
+        const char *what = "ops/s";
+        struct { double change; const char *what; } others[] = {
+            {regression(blocks_per_sec(&best), base->blocks_per_sec, true), "blocks/s"},
+            {regression(best.peak_rss_kib, base->peak_rss_kib, false), "rss"},
+            {regression(best.arena_kib, base->arena_kib, false), "arena"},
+        };
+        for (size_t i = 0; i < ARRLEN(others); ++i) {
+            if (others[i].change > worst) {
+                worst = others[i].change;
+                what = others[i].what;
+            }
+        }
+        printf("%+11.1f%%", -regression(ops_per_sec(&best), base->ops_per_sec, true));
+        if (worst > (double) threshold) {
+            printf("  REGRESSION %s %+.1f%%", what, worst);
+            failed = true;
+        }
+        putchar('\n');
+    }
+    fclose(fd);
+
+    if (update) {
+        if (!write_baseline(baseline_path, results, num_results)) {
+            return 2;
+        }
+        printf("\nWrote baseline %s\n", baseline_path);
+    } else if (stale) {
+        printf("\nBaseline %s is from an older version of bench, record a new one with --update\n", baseline_path);
+    } else if (num_baseline == 0) {
+        printf("\nNo baseline at %s, record one with --update\n", baseline_path);
+    }
+
+    return (failed) ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+// Benchmark corpus, built for each architecture by `make bench-corpus`.
+// The functions cover what the analyses spend their time on: a large
+// switch, loops, calls between functions and stack allocated arrays.
+// Nothing here is meant to be run.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NOINLINE __attribute__((noinline))
+
+enum {
+    OP_PUSH, OP_POP, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_AND, OP_OR,
+    OP_XOR, OP_SHL, OP_SHR, OP_JMP, OP_JZ, OP_LOAD, OP_STORE, OP_CALL,
+    OP_RET, OP_HALT,
+};
+
+NOINLINE int64_t corpus_interpret(const uint8_t *code, size_t size,
+                                  int64_t *memory, size_t memory_size) {
+    int64_t stack[64];
+    size_t frames[16];
+    size_t sp = 0;
+    size_t fp = 0;
+    size_t pc = 0;
+    while (pc < size) {
+        uint8_t op = code[pc++];
+        int64_t a = (sp > 0) ? stack[sp-1] : 0;
+        int64_t b = (sp > 1) ? stack[sp-2] : 0;
+        switch (op) {
+        case OP_PUSH:  stack[sp++ & 63] = code[pc++]; break;
+        case OP_POP:   sp -= (sp > 0); break;
+        case OP_ADD:   stack[--sp - 1] = b + a; break;
+        case OP_SUB:   stack[--sp - 1] = b - a; break;
+        case OP_MUL:   stack[--sp - 1] = b * a; break;
+        case OP_DIV:   stack[--sp - 1] = (a != 0) ? b / a : 0; break;
+        case OP_AND:   stack[--sp - 1] = b & a; break;
+        case OP_OR:    stack[--sp - 1] = b | a; break;
+        case OP_XOR:   stack[--sp - 1] = b ^ a; break;
+        case OP_SHL:   stack[--sp - 1] = b << (a & 63); break;
+        case OP_SHR:   stack[--sp - 1] = b >> (a & 63); break;
+        case OP_JMP:   pc = code[pc]; break;
+        case OP_JZ:    pc = (a == 0) ? code[pc] : pc + 1; --sp; break;
+        case OP_LOAD:  stack[sp-1] = memory[(size_t) a % memory_size]; break;
+        case OP_STORE: memory[(size_t) a % memory_size] = b; sp -= 2; break;
+        case OP_CALL:  frames[fp++ & 15] = pc + 1; pc = code[pc]; break;
+        case OP_RET:   pc = (fp > 0) ? frames[--fp] : size; break;
+        case OP_HALT:  return a;
+        default:       return -1;
+        }
+    }
+    return (sp > 0) ? stack[sp-1] : 0;
+}
+
+NOINLINE uint32_t corpus_crc32(const uint8_t *data, size_t size) {
+    uint32_t table[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
+NOINLINE void corpus_sort(int64_t *values, size_t count) {
+    for (size_t gap = count/2; gap > 0; gap /= 2) {
+        for (size_t i = gap; i < count; ++i) {
+            int64_t v = values[i];
+            size_t j = i;
+            while (j >= gap && values[j - gap] > v) {
+                values[j] = values[j - gap];
+                j -= gap;
+            }
+            values[j] = v;
+        }
+    }
+}
+
+NOINLINE int64_t corpus_matmul(const int64_t *a, const int64_t *b, size_t n) {
+    int64_t c[8][8] = {0};
+    n = (n > 8) ? 8 : n;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t k = 0; k < n; ++k) {
+                c[i][j] += a[i*n + k] * b[k*n + j];
+            }
+        }
+    }
+    int64_t trace = 0;
+    for (size_t i = 0; i < n; ++i) {
+        trace += c[i][i];
+    }
+    return trace;
+}
+
+NOINLINE int64_t corpus_fib(int n) {
+    return (n < 2) ? n : corpus_fib(n - 1) + corpus_fib(n - 2);
+}
+
+int main(int argc, char **argv) {
+    uint8_t code[32] = {OP_PUSH, 2, OP_PUSH, 3, OP_ADD, OP_HALT};
+    int64_t memory[16] = {0};
+    int64_t values[16];
+    for (size_t i = 0; i < 16; ++i) {
+        values[i] = (int64_t) (16 - i) * argc;
+    }
+    corpus_sort(values, 16);
+    int64_t r = corpus_interpret(code, sizeof(code), memory, 16);
+    r += corpus_crc32((const uint8_t *) argv[0], 8);
+    r += corpus_matmul(values, values, 4);
+    r += corpus_fib(argc + 10);
+    return (int) r;
+}
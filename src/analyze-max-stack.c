@@ -1,5 +1,8 @@
 #include "analyze-max-stack.h"
+#include "callgraph.h"
 #include "common.h"
+#include "loadelf.h"
+#include "stats.h"
 #include <qemu/libtcg/libtcg.h>
 #include <stdio.h>
 
@@ -34,7 +37,9 @@ MfpEdge mfp_pop(MfpEdgeQueue *queue) {
 static MfpStackState mfp_transfer_max_stack_size(LibTcgInterface *libtcg,
                                                  Memory *memory,
                                                  TbNode *root, TbNode *n,
-                                                 bool stack_grows_down) {
+                                                 const ElfSymbolTable *symbols,
+                                                 bool stack_grows_down,
+                                                 bool indirect_exits) {
     (void) stack_grows_down;
     LibTcgArchInfo arch_info = libtcg->get_arch_info();
     MfpStackState new_state = n->stack_state[0];
@@ -57,7 +62,12 @@ static MfpStackState mfp_transfer_max_stack_size(LibTcgInterface *libtcg,
             bool is_direct;
             uint64_t address;
             if (is_pc_write(arch_info, inst, &is_direct, &address)) {
-                if (!is_direct || find_tb_containing(root, address) == NULL) {
+                // Known functions outside of the CFG are assumed to follow
+                // the ABI and leave the frame of the caller alone
+                bool known_target = is_direct &&
+                                    (find_tb_containing(root, address) != NULL ||
+                                     (symbols != NULL && elf_symbol_at(symbols, address) != NULL));
+                if (!known_target && (is_direct || !indirect_exits)) {
                     new_state.max_ld_size = STACK_SIZE_TOP;
                     new_state.max_st_size = STACK_SIZE_TOP;
                 }
@@ -68,10 +78,13 @@ static MfpStackState mfp_transfer_max_stack_size(LibTcgInterface *libtcg,
     return new_state;
 }
 
-void compute_max_stack_size(LibTcgInterface *libtcg,
-                            Memory *memory,
-                            TbNode *root,
-                            bool stack_grows_down) {
+static MfpStackState max_stack_size(LibTcgInterface *libtcg,
+                                    Memory *memory,
+                                    TbNode *root,
+                                    const ElfSymbolTable *symbols,
+                                    bool stack_grows_down,
+                                    bool indirect_exits) {
+    uint64_t t = stats_begin();
     StackMarker marker = stack_marker(&memory->temporary);
 
     MfpEdgeQueue queue = {0};
@@ -80,10 +93,11 @@ void compute_max_stack_size(LibTcgInterface *libtcg,
     }
 
     queue.len *= 10;
-    queue.edges = stack_alloc(&memory->temporary, queue.len * sizeof(MfpEdge));
+    queue.edges = stack_alloc_tagged(&memory->temporary, queue.len * sizeof(MfpEdge), MEM_TAG_WORKLIST);
     for (TbNode *n = root; n != NULL; n = n->next) {
         const int64_t init_stack_size = (n == root) ? 0 : STACK_SIZE_BOTTOM;
-        n->stack_state = stack_alloc(&memory->temporary, sizeof(MfpStackState)*n->tb.instruction_count);
+        // Outlive the analysis along with the CFG, for the output
+        n->stack_state = stack_alloc_tagged(&memory->persistent, sizeof(MfpStackState)*n->tb.instruction_count, MEM_TAG_STACK_STATE);
         n->stack_state[0].max_st_size = init_stack_size;
         n->stack_state[0].max_ld_size = init_stack_size;
         for (size_t i = 0; i < n->num_succ; ++i) {
@@ -96,16 +110,16 @@ void compute_max_stack_size(LibTcgInterface *libtcg,
 
     while (queue.used > 0) {
         MfpEdge edge = mfp_pop(&queue);
+        stats_add(STATS_WORKLIST_POPS, 1);
 
         // transfer
-        printf("  node: %lx\n", edge.src->address);
-        printf("    [0] %ld %ld\n", edge.src->stack_state[0].max_ld_size, edge.src->stack_state[0].max_st_size);
         MfpStackState new_state = mfp_transfer_max_stack_size(libtcg,
                                                               memory,
                                                               root,
                                                               edge.src,
-                                                              stack_grows_down);
-        printf("    [1] %ld %ld\n", new_state.max_ld_size, new_state.max_st_size);
+                                                              symbols,
+                                                              stack_grows_down,
+                                                              indirect_exits);
 
         bool less_than = new_state.max_ld_size <= edge.dst->stack_state[0].max_ld_size &&
                          new_state.max_st_size <= edge.dst->stack_state[0].max_st_size;
@@ -122,11 +136,84 @@ void compute_max_stack_size(LibTcgInterface *libtcg,
         }
     }
 
+    MfpStackState summary = {
+        .max_ld_size = STACK_SIZE_BOTTOM,
+        .max_st_size = STACK_SIZE_BOTTOM,
+    };
     for (TbNode *n = root; n != NULL; n = n->next) {
-        MfpStackState s = mfp_transfer_max_stack_size(libtcg, memory, root, n, stack_grows_down);
-        printf("final %lx %ld %ld\n", n->address, s.max_ld_size, s.max_st_size);
+        MfpStackState s = mfp_transfer_max_stack_size(libtcg, memory, root, n, symbols, stack_grows_down, indirect_exits);
+        summary.max_ld_size = MAX(summary.max_ld_size, s.max_ld_size);
+        summary.max_st_size = MAX(summary.max_st_size, s.max_st_size);
     }
 
     //free(queue.edges);
     stack_reset_to_marker(&memory->temporary, marker);
+    stats_end(STATS_TIMER_MAX_STACK, t);
+    return summary;
+}
+
+MfpStackState compute_max_stack_size(LibTcgInterface *libtcg,
+                                     Memory *memory,
+                                     TbNode *root,
+                                     const ElfSymbolTable *symbols,
+                                     bool stack_grows_down) {
+    return max_stack_size(libtcg, memory, root, symbols, stack_grows_down, false);
+}
+
+MfpStackState compute_frame_stack_size(LibTcgInterface *libtcg,
+                                       Memory *memory,
+                                       TbNode *root,
+                                       const ElfSymbolTable *symbols,
+                                       bool stack_grows_down) {
+    return max_stack_size(libtcg, memory, root, symbols, stack_grows_down, true);
+}
+
+typedef struct CallStackDepth {
+    const MfpStackState *local;
+    int64_t *depth;
+} CallStackDepth;
+
+static int64_t local_depth(MfpStackState s) {
+    if (s.max_ld_size == STACK_SIZE_TOP || s.max_st_size == STACK_SIZE_TOP) {
+        return STACK_SIZE_TOP;
+    }
+    // A stack that isn't touched at all, STACK_SIZE_BOTTOM, counts as 0
+    return MAX(MAX(s.max_ld_size, s.max_st_size), 0);
+}
+
+static void call_stack_depth_scc(void *arg, const CallGraph *graph,
+                                 uint32_t scc) {
+    CallStackDepth *d = arg;
+    const uint32_t *members = graph->members;
+    if (graph->recursive[scc]) {
+        for (uint32_t i = graph->scc_offsets[scc]; i < graph->scc_offsets[scc+1]; ++i) {
+            d->depth[members[i]] = STACK_SIZE_TOP;
+        }
+        return;
+    }
+
+    uint32_t f = members[graph->scc_offsets[scc]];
+    int64_t own = (graph->lifted[f]) ? local_depth(d->local[f]) : STACK_SIZE_TOP;
+    int64_t depth = own;
+    for (uint32_t j = graph->offsets[f]; j < graph->offsets[f+1] && depth != STACK_SIZE_TOP; ++j) {
+        int64_t callee = d->depth[graph->callees[j]];
+        if (callee == STACK_SIZE_TOP) {
+            depth = STACK_SIZE_TOP;
+        } else if (graph->kinds[j] == CALL_TAIL) {
+            depth = MAX(depth, callee);
+        } else {
+            depth = MAX(depth, own + callee);
+        }
+    }
+    d->depth[f] = depth;
+}
+
+void compute_call_stack_depth(const CallGraph *graph, StackAllocator *stack,
+                              const MfpStackState *local, int64_t *depth,
+                              size_t num_threads) {
+    CallStackDepth d = {
+        .local = local,
+        .depth = depth,
+    };
+    callgraph_schedule(graph, stack, num_threads, call_stack_depth_scc, &d);
 }
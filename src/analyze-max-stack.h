@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define STACK_SIZE_BOTTOM -1
 #define STACK_SIZE_TOP INT64_MAX
@@ -9,8 +11,37 @@ typedef struct LibTcgInterface LibTcgInterface;
 typedef struct StackAllocator StackAllocator;
 typedef struct TbNode TbNode;
 typedef struct Memory Memory;
+typedef struct MfpStackState MfpStackState;
+typedef struct ElfSymbolTable ElfSymbolTable;
+typedef struct CallGraph CallGraph;
 
-void compute_max_stack_size(LibTcgInterface *libtcg,
-                            Memory *memory,
-                            TbNode *root,
-                            bool stack_grows_down);
+// Returns the largest stack offsets read and written anywhere in the
+// CFG, STACK_SIZE_TOP if unknown. Direct jumps out of the CFG to one of
+// symbols are treated as calls that don't touch the stack of the
+// caller, symbols may be NULL. The state of every instruction is left
+// in stack_state of its node, allocated in memory->persistent.
+MfpStackState compute_max_stack_size(LibTcgInterface *libtcg,
+                                     Memory *memory,
+                                     TbNode *root,
+                                     const ElfSymbolTable *symbols,
+                                     bool stack_grows_down);
+
+// Same as compute_max_stack_size() for the CFG of a whole function,
+// whose indirect jumps leave it, as returns or tail calls through a
+// pointer, rather than run unknown code on its frame.
+MfpStackState compute_frame_stack_size(LibTcgInterface *libtcg,
+                                       Memory *memory,
+                                       TbNode *root,
+                                       const ElfSymbolTable *symbols,
+                                       bool stack_grows_down);
+
+// Upper bound of the stack used by each function of graph along with
+// everything it calls, from the results of compute_frame_stack_size() for
+// each function in local. A call adds the depth of the callee to the
+// largest offset used by the caller, a tail call replaces the frame of
+// the caller. Recursion, calls to functions that weren't lifted and
+// unknown local results give STACK_SIZE_TOP. SCCs are run bottom-up on
+// up to num_threads threads, see callgraph_schedule().
+void compute_call_stack_depth(const CallGraph *graph, StackAllocator *stack,
+                              const MfpStackState *local, int64_t *depth,
+                              size_t num_threads);
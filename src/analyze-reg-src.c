@@ -1,5 +1,6 @@
 #include "analyze-reg-src.h"
 #include "common.h"
+#include "stats.h"
 #include <qemu/libtcg/libtcg.h>
 #include <assert.h>
 #include <stdint.h>
@@ -87,6 +88,12 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
                       TbNode *n,
                       uint64_t inst_index,
                       uint64_t arg_index) {
+    // find_sources() recurses through is_stack_*_fancy(), only the
+    // outermost call on each thread is timed
+    static _Thread_local size_t depth = 0;
+    uint64_t t = (depth++ == 0) ? stats_begin() : 0;
+    stats_add(STATS_FIND_SOURCES_CALLS, 1);
+
     LibTcgInstruction *inst = &n->tb.list[inst_index];
     assert(arg_index >= inst->nb_oargs);
     arg_index -= inst->nb_oargs;
@@ -95,16 +102,16 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
     LibTcgArgument *arg = &inst->input_args[arg_index];
     assert(arg->kind == LIBTCG_ARG_TEMP);
 
-    SrcInfo *info_root = stack_alloc_zero(&memory->persistent, sizeof(SrcInfo));
+    SrcInfo *info_root = stack_alloc_zero_tagged(&memory->persistent, sizeof(SrcInfo), MEM_TAG_SRC_INFO);
     info_root->node = n;
     info_root->inst_index = inst_index;
     info_root->op_index = -1;
-    info_root->children = stack_alloc_zero(&memory->persistent, sizeof(SrcInfo)*inst->nb_iargs);
+    info_root->children = stack_alloc_zero_tagged(&memory->persistent, sizeof(SrcInfo)*inst->nb_iargs, MEM_TAG_SRC_INFO);
 
     StackMarker marker = stack_marker(&memory->temporary);
 
     SrcQueue srcs = {
-        .srcs = stack_alloc(&memory->temporary, 512*sizeof(Src)),
+        .srcs = stack_alloc_tagged(&memory->temporary, 512*sizeof(Src), MEM_TAG_WORKLIST),
         .len = 512,
     };
 
@@ -124,6 +131,7 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
     while (srcs.used > 0) {
         Src src = src_pop(&srcs);
         assert(src.index > 0);
+        stats_add(STATS_WORKLIST_POPS, 1);
 
         int8_t op_index = -1;
         LibTcgTemp *out = NULL;
@@ -153,6 +161,8 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
                 break;
             }
         }
+        // Instructions src.index-1 down to i, i itself only if it matched
+        stats_add(STATS_FIND_SOURCES_SCANNED, src.index - i - (out == NULL));
 
         if (out != NULL) {
             LibTcgInstruction *inst = &src.node->tb.list[i];
@@ -161,14 +171,14 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
             {
                 SrcInfoBranch *child = &src.info->children[src.info_origin];
                 if (child->branches == NULL) {
-                    child->branches = stack_alloc_zero(&memory->persistent, sizeof(SrcInfo)*SRC_INFO_MAX_BRANCHES_PER_CHILD);
+                    child->branches = stack_alloc_zero_tagged(&memory->persistent, sizeof(SrcInfo)*SRC_INFO_MAX_BRANCHES_PER_CHILD, MEM_TAG_SRC_INFO);
                 }
                 info = &child->branches[child->num_branches++];
             }
             info->node = src.node;
             info->inst_index = i;
             info->op_index = op_index;
-            info->children = stack_alloc_zero(&memory->persistent, sizeof(SrcInfo)*inst->nb_iargs);
+            info->children = stack_alloc_zero_tagged(&memory->persistent, sizeof(SrcInfo)*inst->nb_iargs, MEM_TAG_SRC_INFO);
 
             int64_t offset;
             if (is_stack_ld_fancy(arch_info, memory, src.node, inst, i, &offset)) {
@@ -241,5 +251,24 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
 
     stack_reset_to_marker(&memory->temporary, marker);
 
+    if (--depth == 0) {
+        stats_end(STATS_TIMER_FIND_SOURCES, t);
+    }
     return info_root;
 }
+
+void flatten_sources(StackAllocator *stack, SrcInfo *info) {
+    LibTcgInstruction *inst = &info->node->tb.list[info->inst_index];
+    if (info->node->reg_src_info == NULL) {
+        info->node->reg_src_info = stack_alloc_zero_tagged(stack, sizeof(SrcInfo *)*info->node->tb.instruction_count, MEM_TAG_SRC_INFO);
+    }
+    info->node->reg_src_info[info->inst_index] = info;
+    for (int i = 0; i < inst->nb_iargs; ++i) {
+        if (info->children[i].num_branches == 0) {
+            continue;
+        }
+        for (size_t j = 0; j < info->children[i].num_branches; ++j) {
+            flatten_sources(stack, &info->children[i].branches[j]);
+        }
+    }
+}
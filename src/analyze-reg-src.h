@@ -24,3 +24,7 @@ SrcInfo *find_sources(LibTcgArchInfo arch_info,
                       TbNode *n,
                       uint64_t inst_index,
                       uint64_t arg_index);
+
+// Points reg_src_info of each node at the SrcInfo of its instructions
+// in the tree returned by find_sources(), allocating the arrays on stack.
+void flatten_sources(StackAllocator *stack, SrcInfo *info);
@@ -0,0 +1,241 @@
+#include "arch-detect.h"
+#include "common.h"
+#include "lifter-pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Most direct jump targets remembered per candidate
+#define MAX_TARGETS 4096
+
+static const char *arch_names[LIBTCG_ARCH_NUM] = {
+    [LIBTCG_ARCH_NONE]         = "none",
+    [LIBTCG_ARCH_AARCH64]      = "aarch64",
+    [LIBTCG_ARCH_AARCH64_BE]   = "aarch64_be",
+    [LIBTCG_ARCH_ALPHA]        = "alpha",
+    [LIBTCG_ARCH_ARM]          = "arm",
+    [LIBTCG_ARCH_ARMEB]        = "armeb",
+    [LIBTCG_ARCH_CRIS]         = "cris",
+    [LIBTCG_ARCH_HEXAGON]      = "hexagon",
+    [LIBTCG_ARCH_HPPA]         = "hppa",
+    [LIBTCG_ARCH_I386]         = "i386",
+    [LIBTCG_ARCH_LOONGARCH64]  = "loongarch64",
+    [LIBTCG_ARCH_M68K]         = "m68k",
+    [LIBTCG_ARCH_MICROBLAZE]   = "microblaze",
+    [LIBTCG_ARCH_MICROBLAZEEL] = "microblazeel",
+    [LIBTCG_ARCH_MIPS]         = "mips",
+    [LIBTCG_ARCH_MIPS64]       = "mips64",
+    [LIBTCG_ARCH_MIPS64EL]     = "mips64el",
+    [LIBTCG_ARCH_MIPSEL]       = "mipsel",
+    [LIBTCG_ARCH_MIPSN32]      = "mipsn32",
+    [LIBTCG_ARCH_MIPSN32EL]    = "mipsn32el",
+    [LIBTCG_ARCH_NIOS2]        = "nios2",
+    [LIBTCG_ARCH_OR1K]         = "or1k",
+    [LIBTCG_ARCH_PPC]          = "ppc",
+    [LIBTCG_ARCH_PPC64]        = "ppc64",
+    [LIBTCG_ARCH_PPC64LE]      = "ppc64le",
+    [LIBTCG_ARCH_RISCV32]      = "riscv32",
+    [LIBTCG_ARCH_RISCV64]      = "riscv64",
+    [LIBTCG_ARCH_S390X]        = "s390x",
+    [LIBTCG_ARCH_SH4]          = "sh4",
+    [LIBTCG_ARCH_SH4EB]        = "sh4eb",
+    [LIBTCG_ARCH_SPARC]        = "sparc",
+    [LIBTCG_ARCH_SPARC32PLUS]  = "sparc32plus",
+    [LIBTCG_ARCH_SPARC64]      = "sparc64",
+    [LIBTCG_ARCH_X86_64]       = "x86_64",
+    [LIBTCG_ARCH_XTENSA]       = "xtensa",
+    [LIBTCG_ARCH_XTENSAEB]     = "xtensaeb",
+};
+
+const char *arch_to_str(LibTcgArch arch) {
+    if (arch < 0 || arch >= LIBTCG_ARCH_NUM || arch_names[arch] == NULL) {
+        return "unknown";
+    }
+    return arch_names[arch];
+}
+
+typedef struct DetectJob {
+    LibTcgArch arch;
+    LibTcgDesc *desc;
+    const uint8_t *data;
+    size_t size;
+    uint64_t address;
+    uint32_t flags;
+    // ARM is scored twice, as ARM and as Thumb
+    ArchScore scores[2];
+    size_t num_scores;
+    pthread_t thread;
+    bool started;
+} DetectJob;
+
+// Sweeps the sample block by block like cfg_lift(). Blocks ending in an
+// exception helper stopped at an undefined instruction, which counts
+// against the candidate. Random bytes decoded with the wrong lifter
+// mostly give short blocks like that, and jumps to addresses that
+// aren't instruction starts.
+static ArchScore score_sample(Lifter *lifter, StackAllocator *stack,
+                              const DetectJob *job, uint32_t flags) {
+    LibTcgArchInfo arch_info = lifter->libtcg.get_arch_info();
+    StackMarker marker = stack_marker(stack);
+    const uint64_t begin = job->address;
+    const uint64_t end = job->address + job->size;
+    uint8_t *is_start = stack_alloc_zero(stack, job->size);
+    uint64_t *targets = stack_alloc(stack, MAX_TARGETS*sizeof(uint64_t));
+    size_t num_targets = 0;
+    size_t decoded = 0;
+    size_t num_starts = 0;
+    size_t num_valid_starts = 0;
+
+    size_t off = 0;
+    while (off < job->size) {
+        StackMarker tb_marker = stack_marker(stack);
+        uint64_t tb_address = begin + off;
+        LibTcgTranslationBlock tb = lifter->libtcg.translate_block(lifter->context,
+                                                                   job->data + off,
+                                                                   job->size - off,
+                                                                   tb_address,
+                                                                   flags);
+        if (tb.size_in_bytes == 0) {
+            stack_reset_to_marker(stack, tb_marker);
+            ++off;
+            continue;
+        }
+
+        const uint64_t tb_end = tb_address + tb.size_in_bytes;
+        uint64_t last_start = tb_address;
+        bool has_start = false;
+        bool undefined = false;
+        for (size_t i = 0; i < tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &tb.list[i];
+            bool is_direct;
+            uint64_t target;
+            if (inst->opcode == LIBTCG_op_insn_start) {
+                uint64_t pc = inst->constant_args[0].constant;
+                ++num_starts;
+                if (pc >= tb_address && pc < tb_end &&
+                    (!has_start || pc > last_start)) {
+                    ++num_valid_starts;
+                    is_start[pc - begin] = 1;
+                    last_start = pc;
+                    has_start = true;
+                }
+            } else if (inst->opcode == LIBTCG_op_call) {
+                LibTcgHelperInfo info = lifter->libtcg.get_helper_info(inst);
+                if (info.func_name != NULL &&
+                    strstr(info.func_name, "exception") != NULL) {
+                    undefined = true;
+                }
+            } else if (is_pc_write(arch_info, inst, &is_direct, &target) &&
+                       is_direct && target >= begin && target < end &&
+                       target != tb_end && num_targets < MAX_TARGETS) {
+                // Fallthroughs are excluded, they match by construction
+                targets[num_targets++] = target;
+            }
+        }
+        decoded += (undefined) ? last_start - tb_address : tb.size_in_bytes;
+        off += tb.size_in_bytes;
+        stack_reset_to_marker(stack, tb_marker);
+    }
+
+    size_t num_hits = 0;
+    for (size_t i = 0; i < num_targets; ++i) {
+        num_hits += is_start[targets[i] - begin];
+    }
+    stack_reset_to_marker(stack, marker);
+
+    ArchScore score = {
+        .arch = job->arch,
+        .flags = flags,
+        .decoded = (double) decoded/job->size,
+        .valid_starts = (num_starts > 0) ? (double) num_valid_starts/num_starts : 0.0,
+        // Samples without jumps into themselves are neither evidence
+        // for nor against a candidate
+        .flow = (num_hits + 1.0)/(num_targets + 2.0),
+    };
+    score.score = 0.5*score.decoded + 0.2*score.valid_starts + 0.3*score.flow;
+    return score;
+}
+
+static void score_job(Lifter *lifter, StackAllocator *stack, DetectJob *job) {
+    job->scores[job->num_scores++] = score_sample(lifter, stack, job,
+                                                  job->flags & ~LIBTCG_TRANSLATE_ARM_THUMB);
+    if (job->arch == LIBTCG_ARCH_ARM) {
+        job->scores[job->num_scores++] = score_sample(lifter, stack, job,
+                                                      job->flags | LIBTCG_TRANSLATE_ARM_THUMB);
+    }
+}
+
+// Lifts into an arena of its own, which is freed with the lifter
+static void *detect_thread(void *arg) {
+    DetectJob *job = arg;
+    StackAllocator stack = {0};
+    lifter_set_arena(&stack);
+    Lifter lifter = {0};
+    libtcg_open(job->arch, job->desc, &lifter.libtcg, &lifter.context);
+    // Lifters that aren't built are left out
+    if (lifter.context != NULL) {
+        score_job(&lifter, &stack, job);
+        libtcg_close(job->arch);
+    }
+    stack_free_all(&stack);
+    return NULL;
+}
+
+static int compare_scores(const void *a, const void *b) {
+    const ArchScore *sa = a;
+    const ArchScore *sb = b;
+    if (sa->score != sb->score) {
+        return (sa->score > sb->score) ? -1 : 1;
+    }
+    // Keep ties in candidate order, ARM before Thumb
+    if (sa->arch != sb->arch) {
+        return (sa->arch < sb->arch) ? -1 : 1;
+    }
+    return (sa->flags < sb->flags) ? -1 : (sa->flags > sb->flags);
+}
+
+size_t arch_detect(LifterPool *pool, StackAllocator *stack,
+                   const uint8_t *data, size_t size, uint64_t address,
+                   uint32_t flags, ArchScore *scores) {
+    DetectJob jobs[LIBTCG_ARCH_NUM] = {0};
+    for (int arch = LIBTCG_ARCH_NONE + 1; arch < LIBTCG_ARCH_NUM; ++arch) {
+        DetectJob *job = &jobs[arch];
+        *job = (DetectJob) {
+            .arch = arch,
+            .desc = &pool->desc,
+            .data = data,
+            .size = MIN(size, ARCH_DETECT_SAMPLE_SIZE),
+            .address = address,
+            .flags = flags,
+        };
+        if (job->size == 0 || pool->lifters[arch].context != NULL) {
+            continue;
+        }
+        job->started = (pthread_create(&job->thread, NULL, detect_thread, job) == 0);
+        if (!job->started) {
+            detect_thread(job);
+            lifter_set_arena(stack);
+        }
+    }
+
+    // Lifters of the pool allocate through the caller, so they are only
+    // used from this thread
+    for (int arch = LIBTCG_ARCH_NONE + 1; arch < LIBTCG_ARCH_NUM; ++arch) {
+        if (jobs[arch].size > 0 && pool->lifters[arch].context != NULL) {
+            score_job(&pool->lifters[arch], stack, &jobs[arch]);
+        }
+    }
+
+    size_t count = 0;
+    for (int arch = LIBTCG_ARCH_NONE + 1; arch < LIBTCG_ARCH_NUM; ++arch) {
+        DetectJob *job = &jobs[arch];
+        if (job->started) {
+            pthread_join(job->thread, NULL);
+        }
+        for (size_t i = 0; i < job->num_scores && count < ARCH_DETECT_MAX_CANDIDATES; ++i) {
+            scores[count++] = job->scores[i];
+        }
+    }
+    qsort(scores, count, sizeof(ArchScore), compare_scores);
+    return count;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <qemu/libtcg/libtcg.h>
+#include <qemu/libtcg/libtcg_loader.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct StackAllocator StackAllocator;
+typedef struct LifterPool LifterPool;
+
+// Bytes from the start of the input that each candidate lifts
+#define ARCH_DETECT_SAMPLE_SIZE (64*1024)
+// Every architecture, plus Thumb as a second ARM candidate
+#define ARCH_DETECT_MAX_CANDIDATES LIBTCG_ARCH_NUM
+
+typedef struct ArchScore {
+    LibTcgArch arch;
+    // LIBTCG_TRANSLATE_ARM_THUMB for the Thumb candidate
+    uint32_t flags;
+    // Fraction of sample bytes translated without reaching an undefined
+    // instruction
+    double decoded;
+    // Fraction of insn_start ops that lie inside their block, in
+    // ascending order
+    double valid_starts;
+    // Fraction of direct jumps into the sample that land on the start
+    // of a translated instruction
+    double flow;
+    double score;
+} ArchScore;
+
+// Lifts the first ARCH_DETECT_SAMPLE_SIZE bytes of data with every
+// available lifter and scores how plausible the result is as code.
+// Each architecture runs in its own thread with a lifter and arena of
+// its own, which are closed again before returning. pool must allocate
+// through lifter_alloc(). Architectures already open in pool are scored
+// on the calling thread instead, stack must be its lifter arena.
+//
+// Writes the scores of the available candidates to scores, best first,
+// and returns their number.
+size_t arch_detect(LifterPool *pool, StackAllocator *stack,
+                   const uint8_t *data, size_t size, uint64_t address,
+                   uint32_t flags, ArchScore *scores);
+
+// Name of arch as accepted by libtcg_arch_from_str()
+const char *arch_to_str(LibTcgArch arch);
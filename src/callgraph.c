@@ -0,0 +1,525 @@
+#include "callgraph.h"
+#include "cfg.h"
+#include "common.h"
+#include "graphviz.h"
+#include "json-export.h"
+#include "output.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNVISITED UINT32_MAX
+// Temps tracked per block as holding the return address
+#define MAX_RETURN_TEMPS 8
+
+static bool is_store(LibTcgOpcode opcode) {
+    return opcode == LIBTCG_op_qemu_st_a32_i32 ||
+           opcode == LIBTCG_op_qemu_st_a64_i32 ||
+           opcode == LIBTCG_op_qemu_st_a32_i64 ||
+           opcode == LIBTCG_op_qemu_st_a64_i64;
+}
+
+static bool is_return_address(LibTcgTemp *temp, LibTcgTemp **temps,
+                              size_t num_temps, uint64_t address) {
+    // Thumb return addresses have the lowest bit set
+    if (temp->kind == LIBTCG_TEMP_CONST) {
+        return ((uint64_t) temp->val & ~((uint64_t) 1)) == address;
+    }
+    for (size_t i = 0; i < num_temps; ++i) {
+        if (temps[i] == temp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether n stores the address following it, directly or through a
+// temp, to memory or to a global such as a link register
+static bool stores_return_address(TbNode *n) {
+    const uint64_t address = n->address + n->tb.size_in_bytes;
+    LibTcgTemp *temps[MAX_RETURN_TEMPS];
+    size_t num_temps = 0;
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
+        if (inst->nb_iargs == 0 || inst->input_args[0].kind != LIBTCG_ARG_TEMP) {
+            continue;
+        }
+        LibTcgTemp *src = inst->input_args[0].temp;
+        if (is_store(inst->opcode)) {
+            if (is_return_address(src, temps, num_temps, address)) {
+                return true;
+            }
+        } else if ((inst->opcode == LIBTCG_op_mov_i32 ||
+                    inst->opcode == LIBTCG_op_mov_i64) &&
+                   inst->output_args[0].kind == LIBTCG_ARG_TEMP &&
+                   is_return_address(src, temps, num_temps, address)) {
+            LibTcgTemp *dst = inst->output_args[0].temp;
+            if (dst->kind == LIBTCG_TEMP_GLOBAL) {
+                return true;
+            }
+            if (num_temps < MAX_RETURN_TEMPS) {
+                temps[num_temps++] = dst;
+            }
+        }
+    }
+    return false;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Calls out of the CFG of function, as callee << 1 | kind, sorted and
+// unique by callee, calls before tail calls
+static size_t find_calls(LibTcgArchInfo arch_info, StackAllocator *stack,
+                         const ElfSymbolTable *symbols, uint32_t function,
+                         TbNode *root, uint64_t **calls_out) {
+    size_t max_calls = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        max_calls += n->tb.instruction_count;
+    }
+    uint64_t *calls = stack_alloc(stack, max_calls*sizeof(uint64_t));
+    size_t num_calls = 0;
+
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        const uint64_t end = n->address + n->tb.size_in_bytes;
+        bool has_return = false;
+        bool checked = false;
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            bool is_direct;
+            uint64_t target;
+            if (!is_pc_write(arch_info, &n->tb.list[i], &is_direct, &target) ||
+                !is_direct) {
+                continue;
+            }
+            const ElfSymbol *sym = elf_symbol_at(symbols, target);
+            if (sym == NULL) {
+                continue;
+            }
+            if (!checked) {
+                has_return = stores_return_address(n);
+                checked = true;
+            }
+            uint32_t callee = sym - symbols->symbols;
+            if (has_return) {
+                calls[num_calls++] = (uint64_t) callee << 1 | CALL_DIRECT;
+            } else if (callee != function && target != end) {
+                // Jumps to the start of the function itself are loops,
+                // and to the end of the block fallthroughs
+                calls[num_calls++] = (uint64_t) callee << 1 | CALL_TAIL;
+            }
+        }
+    }
+
+    qsort(calls, num_calls, sizeof(uint64_t), compare_u64);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < num_calls; ++i) {
+        if (num_unique == 0 || calls[num_unique-1] >> 1 != calls[i] >> 1) {
+            calls[num_unique++] = calls[i];
+        }
+    }
+    *calls_out = calls;
+    return num_unique;
+}
+
+typedef struct TarjanFrame {
+    uint32_t node;
+    uint32_t edge;
+} TarjanFrame;
+
+// Iterative version of Tarjan's algorithm over the CSR edges. SCCs are
+// numbered as they are completed, which is after every SCC they reach.
+static void find_sccs(StackAllocator *stack, CallGraph *graph) {
+    const size_t n = graph->num_functions;
+    StackMarker marker = stack_marker(stack);
+    uint32_t *index      = stack_alloc(stack, n*sizeof(uint32_t));
+    uint32_t *lowlink    = stack_alloc(stack, n*sizeof(uint32_t));
+    bool *on_stack       = stack_alloc_zero(stack, n*sizeof(bool));
+    uint32_t *scc_stack  = stack_alloc(stack, n*sizeof(uint32_t));
+    TarjanFrame *frames  = stack_alloc(stack, n*sizeof(TarjanFrame));
+    memset(index, 0xff, n*sizeof(uint32_t));
+
+    uint32_t next_index = 0;
+    size_t scc_top = 0;
+    graph->num_sccs = 0;
+
+    for (uint32_t start = 0; start < n; ++start) {
+        if (index[start] != UNVISITED) {
+            continue;
+        }
+
+        size_t frame_top = 0;
+        index[start] = lowlink[start] = next_index++;
+        scc_stack[scc_top++] = start;
+        on_stack[start] = true;
+        frames[frame_top++] = (TarjanFrame) {start, graph->offsets[start]};
+
+        while (frame_top > 0) {
+            TarjanFrame *frame = &frames[frame_top-1];
+            uint32_t v = frame->node;
+            if (frame->edge < graph->offsets[v+1]) {
+                uint32_t w = graph->callees[frame->edge++];
+                if (index[w] == UNVISITED) {
+                    index[w] = lowlink[w] = next_index++;
+                    scc_stack[scc_top++] = w;
+                    on_stack[w] = true;
+                    frames[frame_top++] = (TarjanFrame) {w, graph->offsets[w]};
+                } else if (on_stack[w]) {
+                    lowlink[v] = MIN(lowlink[v], index[w]);
+                }
+                continue;
+            }
+
+            if (lowlink[v] == index[v]) {
+                uint32_t w;
+                do {
+                    w = scc_stack[--scc_top];
+                    on_stack[w] = false;
+                    graph->scc[w] = graph->num_sccs;
+                } while (w != v);
+                ++graph->num_sccs;
+            }
+
+            --frame_top;
+            if (frame_top > 0) {
+                uint32_t parent = frames[frame_top-1].node;
+                lowlink[parent] = MIN(lowlink[parent], lowlink[v]);
+            }
+        }
+    }
+    stack_reset_to_marker(stack, marker);
+}
+
+// Groups functions by SCC and adds the edges between SCCs
+static void condense(StackAllocator *stack, CallGraph *graph) {
+    const size_t num_sccs = graph->num_sccs;
+    graph->scc_offsets = stack_alloc_zero(stack, (num_sccs+1)*sizeof(uint32_t));
+    graph->members = stack_alloc(stack, graph->num_functions*sizeof(uint32_t));
+    for (size_t i = 0; i < graph->num_functions; ++i) {
+        ++graph->scc_offsets[graph->scc[i] + 1];
+    }
+    for (size_t i = 0; i < num_sccs; ++i) {
+        graph->scc_offsets[i+1] += graph->scc_offsets[i];
+    }
+    uint32_t *fill = stack_alloc(stack, num_sccs*sizeof(uint32_t));
+    memcpy(fill, graph->scc_offsets, num_sccs*sizeof(uint32_t));
+    for (size_t i = 0; i < graph->num_functions; ++i) {
+        graph->members[fill[graph->scc[i]]++] = i;
+    }
+
+    // Each SCC is added once per caller, the last caller to add it is
+    // remembered in fill
+    memset(fill, 0xff, num_sccs*sizeof(uint32_t));
+    graph->dag_offsets = stack_alloc(stack, (num_sccs+1)*sizeof(uint32_t));
+    graph->dag_callees = stack_alloc(stack, MAX(graph->num_edges, 1)*sizeof(uint32_t));
+    graph->recursive = stack_alloc_zero(stack, num_sccs*sizeof(bool));
+    uint32_t num_dag_edges = 0;
+    for (uint32_t s = 0; s < num_sccs; ++s) {
+        graph->dag_offsets[s] = num_dag_edges;
+        graph->recursive[s] = graph->scc_offsets[s+1] - graph->scc_offsets[s] > 1;
+        for (uint32_t i = graph->scc_offsets[s]; i < graph->scc_offsets[s+1]; ++i) {
+            uint32_t f = graph->members[i];
+            for (uint32_t j = graph->offsets[f]; j < graph->offsets[f+1]; ++j) {
+                uint32_t callee = graph->scc[graph->callees[j]];
+                if (callee == s) {
+                    graph->recursive[s] = true;
+                } else if (fill[callee] != s) {
+                    fill[callee] = s;
+                    graph->dag_callees[num_dag_edges++] = callee;
+                }
+            }
+        }
+    }
+    graph->dag_offsets[num_sccs] = num_dag_edges;
+}
+
+CallGraph callgraph_build(LibTcgInterface *libtcg, LibTcgContext *context,
+                          Memory *memory, ElfData *data,
+                          const ElfSymbolTable *symbols,
+                          const ElfModeMap *modes, uint32_t flags,
+                          CallGraphVisitFn *visit, void *arg) {
+    LibTcgArchInfo arch_info = libtcg->get_arch_info();
+    const size_t n = symbols->count;
+    CallGraph graph = {
+        .num_functions = n,
+        .symbols = symbols,
+        .lifted = stack_alloc_zero(&memory->persistent, n*sizeof(bool)),
+        .offsets = stack_alloc(&memory->persistent, (n+1)*sizeof(uint32_t)),
+        .scc = stack_alloc(&memory->persistent, n*sizeof(uint32_t)),
+    };
+
+    // Calls of each function are kept in temporary until all are known
+    StackMarker temporary_marker = stack_marker(&memory->temporary);
+    uint64_t **calls = stack_alloc(&memory->temporary, n*sizeof(uint64_t *));
+    for (uint32_t i = 0; i < n; ++i) {
+        const ElfSymbol *sym = &symbols->symbols[i];
+        graph.offsets[i] = graph.num_edges;
+        ElfByteView view;
+        if (sym->kind == ELF_SYMBOL_PLT || sym->size == 0 ||
+            !elf_address_range(data, sym->address, sym->size, &view)) {
+            continue;
+        }
+
+        StackMarker marker = stack_marker(&memory->persistent);
+        TbNode *root = cfg_lift(libtcg, context, NULL, &memory->persistent,
+                                view.data, view.size, view.address, flags,
+                                modes);
+        cfg_build(libtcg, &memory->persistent, root);
+        graph.lifted[i] = true;
+
+        uint64_t *found;
+        size_t num_found = find_calls(arch_info, &memory->persistent,
+                                      symbols, i, root, &found);
+        if (visit != NULL) {
+            visit(arg, i, root);
+        }
+        calls[i] = stack_alloc(&memory->temporary, num_found*sizeof(uint64_t));
+        memcpy(calls[i], found, num_found*sizeof(uint64_t));
+        graph.num_edges += num_found;
+        stack_reset_to_marker(&memory->persistent, marker);
+    }
+    graph.offsets[n] = graph.num_edges;
+
+    graph.callees = stack_alloc(&memory->persistent, MAX(graph.num_edges, 1)*sizeof(uint32_t));
+    graph.kinds = stack_alloc(&memory->persistent, MAX(graph.num_edges, 1)*sizeof(uint8_t));
+    for (uint32_t i = 0; i < n; ++i) {
+        for (uint32_t j = graph.offsets[i]; j < graph.offsets[i+1]; ++j) {
+            uint64_t call = calls[i][j - graph.offsets[i]];
+            graph.callees[j] = call >> 1;
+            graph.kinds[j] = call & 1;
+        }
+    }
+    stack_reset_to_marker(&memory->temporary, temporary_marker);
+
+    find_sccs(&memory->temporary, &graph);
+    condense(&memory->persistent, &graph);
+    return graph;
+}
+
+typedef struct Scheduler {
+    const CallGraph *graph;
+    CallGraphSccFn *fn;
+    void *arg;
+    // Callers of each SCC in the condensation, in the same form as
+    // CallGraph::dag_callees
+    uint32_t *caller_offsets;
+    uint32_t *callers;
+    // Callee SCCs of each SCC that haven't been run yet
+    uint32_t *pending;
+    // SCCs whose callees have all been run
+    uint32_t *ready;
+    size_t num_ready;
+    size_t num_done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Scheduler;
+
+static void *schedule_thread(void *arg) {
+    Scheduler *s = arg;
+    const size_t num_sccs = s->graph->num_sccs;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->num_ready == 0 && s->num_done < num_sccs) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->num_ready == 0) {
+            break;
+        }
+        uint32_t scc = s->ready[--s->num_ready];
+        pthread_mutex_unlock(&s->lock);
+        s->fn(s->arg, s->graph, scc);
+        pthread_mutex_lock(&s->lock);
+
+        ++s->num_done;
+        for (uint32_t i = s->caller_offsets[scc]; i < s->caller_offsets[scc+1]; ++i) {
+            uint32_t caller = s->callers[i];
+            if (--s->pending[caller] == 0) {
+                s->ready[s->num_ready++] = caller;
+            }
+        }
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+void callgraph_schedule(const CallGraph *graph, StackAllocator *stack,
+                        size_t num_threads, CallGraphSccFn *fn, void *arg) {
+    const size_t num_sccs = graph->num_sccs;
+    if (num_threads <= 1 || num_sccs <= 1) {
+        for (uint32_t i = 0; i < num_sccs; ++i) {
+            fn(arg, graph, i);
+        }
+        return;
+    }
+
+    StackMarker marker = stack_marker(stack);
+    const size_t num_dag_edges = graph->dag_offsets[num_sccs];
+    Scheduler s = {
+        .graph = graph,
+        .fn = fn,
+        .arg = arg,
+        .caller_offsets = stack_alloc_zero(stack, (num_sccs+1)*sizeof(uint32_t)),
+        .callers = stack_alloc(stack, MAX(num_dag_edges, 1)*sizeof(uint32_t)),
+        .pending = stack_alloc(stack, num_sccs*sizeof(uint32_t)),
+        .ready = stack_alloc(stack, num_sccs*sizeof(uint32_t)),
+    };
+    for (uint32_t i = 0; i < num_dag_edges; ++i) {
+        ++s.caller_offsets[graph->dag_callees[i] + 1];
+    }
+    for (size_t i = 0; i < num_sccs; ++i) {
+        s.caller_offsets[i+1] += s.caller_offsets[i];
+    }
+    uint32_t *fill = stack_alloc(stack, num_sccs*sizeof(uint32_t));
+    memcpy(fill, s.caller_offsets, num_sccs*sizeof(uint32_t));
+    for (uint32_t caller = 0; caller < num_sccs; ++caller) {
+        for (uint32_t i = graph->dag_offsets[caller]; i < graph->dag_offsets[caller+1]; ++i) {
+            s.callers[fill[graph->dag_callees[i]]++] = caller;
+        }
+    }
+    // Popped from the back, so leaves run in ascending order
+    for (uint32_t i = num_sccs; i-- > 0;) {
+        s.pending[i] = graph->dag_offsets[i+1] - graph->dag_offsets[i];
+        if (s.pending[i] == 0) {
+            s.ready[s.num_ready++] = i;
+        }
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    pthread_t *threads = stack_alloc(stack, (num_threads-1)*sizeof(pthread_t));
+    size_t num_started = 0;
+    while (num_started < num_threads-1 &&
+           pthread_create(&threads[num_started], NULL, schedule_thread, &s) == 0) {
+        ++num_started;
+    }
+    schedule_thread(&s);
+    for (size_t i = 0; i < num_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    stack_reset_to_marker(stack, marker);
+}
+
+void callgraph_output_dot(const CallGraph *graph, Output *out,
+                          const char **labels) {
+    const ElfSymbol *symbols = graph->symbols->symbols;
+    OUTPUT_LIT(out, "digraph {\n");
+    OUTPUT_LIT(out, "graph [fontname = \"inconsolata\"];\n");
+    OUTPUT_LIT(out, "node [fontname = \"inconsolata\", shape = \"box\"];\n");
+    for (uint32_t s = 0; s < graph->num_sccs; ++s) {
+        bool cluster = graph->scc_offsets[s+1] - graph->scc_offsets[s] > 1;
+        if (cluster) {
+            OUTPUT_LIT(out, "subgraph cluster_scc");
+            output_u64(out, s);
+            OUTPUT_LIT(out, " {\nstyle = \"dashed\";\n");
+        }
+        for (uint32_t i = graph->scc_offsets[s]; i < graph->scc_offsets[s+1]; ++i) {
+            uint32_t f = graph->members[i];
+            OUTPUT_LIT(out, "\"");
+            output_hex(out, symbols[f].address);
+            OUTPUT_LIT(out, "\" [label=\"");
+            output_quoted_escaped(out, symbols[f].name);
+            if (labels != NULL && labels[f] != NULL) {
+                OUTPUT_LIT(out, "\\n");
+                output_quoted_escaped(out, labels[f]);
+            }
+            output_char(out, '"');
+            if (!graph->lifted[f]) {
+                OUTPUT_LIT(out, ", style = \"dashed\"");
+            }
+            OUTPUT_LIT(out, "];\n");
+        }
+        if (cluster) {
+            OUTPUT_LIT(out, "}\n");
+        }
+    }
+    for (uint32_t f = 0; f < graph->num_functions; ++f) {
+        for (uint32_t j = graph->offsets[f]; j < graph->offsets[f+1]; ++j) {
+            OUTPUT_LIT(out, "\"");
+            output_hex(out, symbols[f].address);
+            OUTPUT_LIT(out, "\" -> \"");
+            output_hex(out, symbols[graph->callees[j]].address);
+            output_char(out, '"');
+            if (graph->kinds[j] == CALL_TAIL) {
+                OUTPUT_LIT(out, " [style = dashed]");
+            }
+            output_char(out, '\n');
+        }
+    }
+    OUTPUT_LIT(out, "}\n");
+}
+
+static void json_bool(Output *out, bool value) {
+    if (value) {
+        OUTPUT_LIT(out, "true");
+    } else {
+        OUTPUT_LIT(out, "false");
+    }
+}
+
+static void json_address(Output *out, uint64_t address) {
+    OUTPUT_LIT(out, "\"0x");
+    output_hex(out, address);
+    output_char(out, '"');
+}
+
+void callgraph_output_json(const CallGraph *graph, Output *out,
+                           const char **extra) {
+    const ElfSymbol *symbols = graph->symbols->symbols;
+    for (uint32_t f = 0; f < graph->num_functions; ++f) {
+        OUTPUT_LIT(out, "{\"type\":\"function\",\"id\":");
+        output_u64(out, f);
+        OUTPUT_LIT(out, ",\"name\":");
+        json_string(out, symbols[f].name);
+        OUTPUT_LIT(out, ",\"address\":");
+        json_address(out, symbols[f].address);
+        OUTPUT_LIT(out, ",\"size\":");
+        output_u64(out, symbols[f].size);
+        OUTPUT_LIT(out, ",\"lifted\":");
+        json_bool(out, graph->lifted[f]);
+        OUTPUT_LIT(out, ",\"scc\":");
+        output_u64(out, graph->scc[f]);
+        if (extra != NULL && extra[f] != NULL) {
+            output_str(out, extra[f]);
+        }
+        OUTPUT_LIT(out, "}\n");
+    }
+    for (uint32_t f = 0; f < graph->num_functions; ++f) {
+        for (uint32_t j = graph->offsets[f]; j < graph->offsets[f+1]; ++j) {
+            OUTPUT_LIT(out, "{\"type\":\"call\",\"src\":");
+            json_address(out, symbols[f].address);
+            OUTPUT_LIT(out, ",\"dst\":");
+            json_address(out, symbols[graph->callees[j]].address);
+            if (graph->kinds[j] == CALL_TAIL) {
+                OUTPUT_LIT(out, ",\"kind\":\"tail\"}\n");
+            } else {
+                OUTPUT_LIT(out, ",\"kind\":\"call\"}\n");
+            }
+        }
+    }
+    for (uint32_t s = 0; s < graph->num_sccs; ++s) {
+        OUTPUT_LIT(out, "{\"type\":\"scc\",\"id\":");
+        output_u64(out, s);
+        OUTPUT_LIT(out, ",\"functions\":[");
+        for (uint32_t i = graph->scc_offsets[s]; i < graph->scc_offsets[s+1]; ++i) {
+            if (i > graph->scc_offsets[s]) {
+                output_char(out, ',');
+            }
+            output_u64(out, graph->members[i]);
+        }
+        OUTPUT_LIT(out, "],\"callees\":[");
+        for (uint32_t i = graph->dag_offsets[s]; i < graph->dag_offsets[s+1]; ++i) {
+            if (i > graph->dag_offsets[s]) {
+                output_char(out, ',');
+            }
+            output_u64(out, graph->dag_callees[i]);
+        }
+        OUTPUT_LIT(out, "],\"recursive\":");
+        json_bool(out, graph->recursive[s]);
+        OUTPUT_LIT(out, "}\n");
+    }
+}
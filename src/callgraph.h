@@ -0,0 +1,95 @@
+#pragma once
+
+#include "loadelf.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Memory Memory;
+typedef struct Output Output;
+typedef struct TbNode TbNode;
+typedef struct StackAllocator StackAllocator;
+
+typedef enum CallKind {
+    // Direct jump to a function start along with a store of the return
+    // address, to memory or to a link register
+    CALL_DIRECT = 0,
+    // Direct jump to the start of another function without one
+    CALL_TAIL,
+} CallKind;
+
+// Calls between the functions of an ElfSymbolTable, function i being
+// symbols[i]. Edges are stored in compressed sparse row form: the
+// callees of function i are callees[offsets[i]] to
+// callees[offsets[i+1]-1], sorted and unique, with the kind of each in
+// kinds. A callee that is called as well as tail called is a call.
+typedef struct CallGraph {
+    size_t num_functions;
+    const ElfSymbolTable *symbols;
+    // Functions that had bytes to lift, PLT stubs and symbols without a
+    // size or file data don't
+    bool *lifted;
+    uint32_t *offsets;
+    uint32_t *callees;
+    uint8_t *kinds;
+    size_t num_edges;
+
+    // Strongly connected components, numbered callees first: SCC i only
+    // calls itself and SCCs below i, so ascending order is bottom-up.
+    size_t num_sccs;
+    uint32_t *scc;
+    // Functions of SCC i are members[scc_offsets[i]] to
+    // members[scc_offsets[i+1]-1], in address order
+    uint32_t *scc_offsets;
+    uint32_t *members;
+    // Condensation DAG in the same form, the SCCs that SCC i calls
+    // other than itself
+    uint32_t *dag_offsets;
+    uint32_t *dag_callees;
+    // Whether SCC i calls itself, true for all SCCs of more than one
+    // function
+    bool *recursive;
+} CallGraph;
+
+// Called with the CFG of each lifted function before it is released
+typedef void CallGraphVisitFn(void *arg, uint32_t function, TbNode *root);
+
+// Lifts every function of symbols other than PLT stubs, one at a time,
+// and collects the calls out of it. Calls are told from other direct
+// jumps by a store of the address following the block. Only the graph
+// is kept, in memory->persistent. visit may be NULL.
+CallGraph callgraph_build(LibTcgInterface *libtcg, LibTcgContext *context,
+                          Memory *memory, ElfData *data,
+                          const ElfSymbolTable *symbols,
+                          const ElfModeMap *modes, uint32_t flags,
+                          CallGraphVisitFn *visit, void *arg);
+
+typedef void CallGraphSccFn(void *arg, const CallGraph *graph, uint32_t scc);
+
+// Calls fn once for every SCC, each only after fn has returned for all
+// SCCs it calls. Independent SCCs are run on up to num_threads threads
+// including the calling one, so fn must be thread safe for different
+// SCCs. With num_threads <= 1 SCCs are run in ascending order. The
+// schedule is kept in stack, which fn must not use.
+void callgraph_schedule(const CallGraph *graph, StackAllocator *stack,
+                        size_t num_threads, CallGraphSccFn *fn, void *arg);
+
+// Writes the graph in DOT format, one node per function grouped into
+// clusters by SCC where those hold more than one function. Tail calls
+// are dashed. If labels is non-NULL, labels[i] is added below the name
+// of function i, NULL entries are skipped.
+void callgraph_output_dot(const CallGraph *graph, Output *out,
+                          const char **labels);
+
+// Writes the graph as JSON lines, one record per line:
+//
+//   {"type":"function","id":N,"name":"..","address":"0x..","size":N,"lifted":B,"scc":N}
+//   {"type":"call","src":"0x..","dst":"0x..","kind":"call"|"tail"}
+//   {"type":"scc","id":N,"functions":[N,...],"callees":[N,...],"recursive":B}
+//
+// Function ids index the symbol table, SCC ids are in bottom-up order.
+// If extra is non-NULL, extra[i] holds additional fields for function
+// i, written as is before the closing brace, such as ,"key":value.
+void callgraph_output_json(const CallGraph *graph, Output *out,
+                           const char **extra);
@@ -0,0 +1,155 @@
+#include "cfg-partition.h"
+#include "common.h"
+#include "loadelf.h"
+#include <string.h>
+
+#define UNVISITED UINT32_MAX
+
+typedef struct TarjanFrame {
+    TbNode *node;
+    size_t edge;
+} TarjanFrame;
+
+// Iterative version of Tarjan's algorithm, returns the SCC of each node
+// indexed by TbNode::id.
+static uint32_t *find_sccs(StackAllocator *stack, TbNode *root,
+                           size_t num_nodes, size_t *num_sccs) {
+    uint32_t *index   = stack_alloc(stack, num_nodes*sizeof(uint32_t));
+    uint32_t *lowlink = stack_alloc(stack, num_nodes*sizeof(uint32_t));
+    uint32_t *scc     = stack_alloc(stack, num_nodes*sizeof(uint32_t));
+    bool *on_stack    = stack_alloc_zero(stack, num_nodes*sizeof(bool));
+    TbNode **scc_stack = stack_alloc(stack, num_nodes*sizeof(TbNode *));
+    TarjanFrame *frames = stack_alloc(stack, num_nodes*sizeof(TarjanFrame));
+    memset(index, 0xff, num_nodes*sizeof(uint32_t));
+
+    uint32_t next_index = 0;
+    size_t scc_top = 0;
+    *num_sccs = 0;
+
+    for (TbNode *start = root; start != NULL; start = start->next) {
+        if (index[start->id] != UNVISITED) {
+            continue;
+        }
+
+        size_t frame_top = 0;
+        index[start->id] = lowlink[start->id] = next_index++;
+        scc_stack[scc_top++] = start;
+        on_stack[start->id] = true;
+        frames[frame_top++] = (TarjanFrame) {start, 0};
+
+        while (frame_top > 0) {
+            TarjanFrame *frame = &frames[frame_top-1];
+            TbNode *v = frame->node;
+            if (frame->edge < v->num_succ) {
+                TbNode *w = v->succ[frame->edge++].dst_node;
+                if (index[w->id] == UNVISITED) {
+                    index[w->id] = lowlink[w->id] = next_index++;
+                    scc_stack[scc_top++] = w;
+                    on_stack[w->id] = true;
+                    frames[frame_top++] = (TarjanFrame) {w, 0};
+                } else if (on_stack[w->id]) {
+                    lowlink[v->id] = MIN(lowlink[v->id], index[w->id]);
+                }
+                continue;
+            }
+
+            if (lowlink[v->id] == index[v->id]) {
+                TbNode *w;
+                do {
+                    w = scc_stack[--scc_top];
+                    on_stack[w->id] = false;
+                    scc[w->id] = *num_sccs;
+                } while (w != v);
+                ++*num_sccs;
+            }
+
+            --frame_top;
+            if (frame_top > 0) {
+                TbNode *parent = frames[frame_top-1].node;
+                lowlink[parent->id] = MIN(lowlink[parent->id], lowlink[v->id]);
+            }
+        }
+    }
+
+    return scc;
+}
+
+// Buckets nodes by partition, keeping address order within each
+static void bucket_nodes(StackAllocator *stack, TbNode *root,
+                         CfgPartition *partition) {
+    partition->offsets = stack_alloc_zero(stack, (partition->num_partitions+1)*sizeof(size_t));
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        ++partition->offsets[partition->node_partition[n->id] + 1];
+    }
+    for (size_t i = 0; i < partition->num_partitions; ++i) {
+        partition->offsets[i+1] += partition->offsets[i];
+    }
+    size_t *fill = stack_alloc(stack, partition->num_partitions*sizeof(size_t));
+    memcpy(fill, partition->offsets, partition->num_partitions*sizeof(size_t));
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        partition->nodes[fill[partition->node_partition[n->id]]++] = n;
+    }
+}
+
+CfgPartition cfg_partition_scc(StackAllocator *stack, TbNode *root,
+                               size_t num_nodes, size_t max_nodes) {
+    CfgPartition partition = {
+        .num_nodes = num_nodes,
+        .node_partition = stack_alloc(stack, num_nodes*sizeof(uint32_t)),
+        .nodes = stack_alloc(stack, num_nodes*sizeof(TbNode *)),
+    };
+
+    size_t num_sccs = 0;
+    uint32_t *scc = find_sccs(stack, root, num_nodes, &num_sccs);
+
+    size_t *scc_size = stack_alloc_zero(stack, num_sccs*sizeof(size_t));
+    uint32_t *scc_partition = stack_alloc(stack, num_sccs*sizeof(uint32_t));
+    memset(scc_partition, 0xff, num_sccs*sizeof(uint32_t));
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        ++scc_size[scc[n->id]];
+    }
+
+    size_t current_size = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        uint32_t s = scc[n->id];
+        if (scc_partition[s] == UNVISITED) {
+            if (partition.num_partitions == 0 ||
+                (current_size > 0 && current_size + scc_size[s] > max_nodes)) {
+                ++partition.num_partitions;
+                current_size = 0;
+            }
+            scc_partition[s] = partition.num_partitions - 1;
+            current_size += scc_size[s];
+        }
+        partition.node_partition[n->id] = scc_partition[s];
+    }
+
+    bucket_nodes(stack, root, &partition);
+    return partition;
+}
+
+CfgPartition cfg_partition_functions(StackAllocator *stack, TbNode *root,
+                                     size_t num_nodes,
+                                     const ElfSymbolTable *symbols) {
+    CfgPartition partition = {
+        .num_nodes = num_nodes,
+        .node_partition = stack_alloc(stack, num_nodes*sizeof(uint32_t)),
+        .nodes = stack_alloc(stack, num_nodes*sizeof(TbNode *)),
+        .names = stack_alloc(stack, num_nodes*sizeof(const char *)),
+    };
+
+    // Nodes are in address order, so the nodes of a function are
+    // consecutive
+    const ElfSymbol *prev = NULL;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        const ElfSymbol *sym = elf_symbol_containing(symbols, n->address);
+        if (partition.num_partitions == 0 || sym != prev) {
+            partition.names[partition.num_partitions++] = (sym != NULL) ? sym->name : NULL;
+            prev = sym;
+        }
+        partition.node_partition[n->id] = partition.num_partitions - 1;
+    }
+
+    bucket_nodes(stack, root, &partition);
+    return partition;
+}
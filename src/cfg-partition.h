@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct TbNode TbNode;
+typedef struct StackAllocator StackAllocator;
+typedef struct ElfSymbolTable ElfSymbolTable;
+
+// Assignment of CFG nodes to partitions that are small enough to be
+// laid out and viewed on their own.
+typedef struct CfgPartition {
+    size_t num_nodes;
+    size_t num_partitions;
+    // Partition of each node, indexed by TbNode::id
+    uint32_t *node_partition;
+    // Nodes grouped by partition, partition i holds
+    // nodes[offsets[i]] to nodes[offsets[i+1]-1] in address order.
+    TbNode **nodes;
+    size_t *offsets;
+    // Name of each partition, NULL if partitions are unnamed or for
+    // unnamed partitions
+    const char **names;
+} CfgPartition;
+
+// Partitions the CFG along strongly connected components, which are
+// never split. SCCs are packed into partitions in address order until
+// a partition would exceed max_nodes.
+CfgPartition cfg_partition_scc(StackAllocator *stack, TbNode *root,
+                               size_t num_nodes, size_t max_nodes);
+
+// Partitions the CFG by the function symbol containing each node, in
+// order of the first node of each function. Consecutive nodes outside
+// of any function share an unnamed partition.
+CfgPartition cfg_partition_functions(StackAllocator *stack, TbNode *root,
+                                     size_t num_nodes,
+                                     const ElfSymbolTable *symbols);
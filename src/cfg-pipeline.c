@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cfg-pipeline.h"
+#include "cfg.h"
+#include "common.h"
+#include "lifter-pool.h"
+#include "spsc-queue.h"
+#include "stats.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// Failed queue operations retried before yielding to the other side
+#define SPIN_COUNT 64
+
+typedef struct Translator {
+    LibTcgInterface *libtcg;
+    LibTcgContext *context;
+    DedupCache *dedup;
+    StackAllocator *stack;
+    const CfgRange *ranges;
+    size_t num_ranges;
+    uint32_t flags;
+    const ElfModeMap *modes;
+    SpscQueue *queue;
+    // Of the translation thread, merged once it is joined
+    Stats stats;
+} Translator;
+
+// How far translation has come, blocks before end of range have all
+// been received
+typedef struct Frontier {
+    size_t range;
+    uint64_t end;
+    bool done;
+} Frontier;
+
+static void push_wait(SpscQueue *q, void *item) {
+    for (unsigned spins = 0; !spsc_push(q, item); ++spins) {
+        if (spins >= SPIN_COUNT) {
+            sched_yield();
+        }
+    }
+}
+
+static void *pop_wait(SpscQueue *q) {
+    void *item;
+    for (unsigned spins = 0; !spsc_pop(q, &item); ++spins) {
+        if (spins >= SPIN_COUNT) {
+            sched_yield();
+        }
+    }
+    return item;
+}
+
+// Pushes every block of every range, followed by NULL
+static void *translate_thread(void *arg) {
+    Translator *t = arg;
+    lifter_set_arena(t->stack);
+    stats.enabled = t->stats.enabled;
+    for (size_t i = 0; i < t->num_ranges; ++i) {
+        const CfgRange *r = &t->ranges[i];
+        size_t off = 0;
+        TbNode *n;
+        while ((n = cfg_lift_next(t->libtcg, t->context, t->dedup, t->stack,
+                                  r->data, r->size, r->address, t->flags,
+                                  t->modes, &off)) != NULL) {
+            push_wait(t->queue, n);
+        }
+    }
+    push_wait(t->queue, NULL);
+    t->stats = stats;
+    return NULL;
+}
+
+// Index of the range containing address, searching from first on,
+// num_ranges if there is none
+static size_t range_of(const CfgRange *ranges, size_t num_ranges,
+                       size_t first, uint64_t address) {
+    for (size_t i = first; i < num_ranges; ++i) {
+        if (address >= ranges[i].address &&
+            address < ranges[i].address + ranges[i].size) {
+            return i;
+        }
+    }
+    return num_ranges;
+}
+
+// Whether the blocks containing the direct jump targets of n, if any,
+// have been received. Targets outside of all ranges never will be.
+static bool targets_received(LibTcgArchInfo arch_info,
+                             const CfgRange *ranges, size_t num_ranges,
+                             const Frontier *frontier, TbNode *n) {
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        bool is_direct;
+        uint64_t address;
+        if (!is_pc_write(arch_info, &n->tb.list[i], &is_direct, &address) ||
+            !is_direct) {
+            continue;
+        }
+        size_t r = range_of(ranges, num_ranges, 0, address);
+        if (r == num_ranges) {
+            continue;
+        }
+        if (r > frontier->range ||
+            (r == frontier->range && address >= frontier->end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// cfg_pipeline() without the overlap
+static TbNode *lift_and_build(LibTcgInterface *libtcg, LibTcgContext *context,
+                              DedupCache *dedup, StackAllocator *lift_stack,
+                              StackAllocator *stack,
+                              const CfgRange *ranges, size_t num_ranges,
+                              uint32_t flags, const ElfModeMap *modes) {
+    TbNode *root = NULL;
+    TbNode **tail = &root;
+    for (size_t i = 0; i < num_ranges; ++i) {
+        *tail = cfg_lift(libtcg, context, dedup, lift_stack,
+                         ranges[i].data, ranges[i].size,
+                         ranges[i].address, flags, modes);
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+    }
+    cfg_build(libtcg, stack, root);
+    stack_adopt(stack, lift_stack);
+    return root;
+}
+
+TbNode *cfg_pipeline(LibTcgInterface *libtcg, LibTcgContext *context,
+                     DedupCache *dedup, StackAllocator *lift_stack,
+                     StackAllocator *stack,
+                     const CfgRange *ranges, size_t num_ranges,
+                     uint32_t flags, const ElfModeMap *modes) {
+    // The stages would only take turns on a single CPU
+    if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+        return lift_and_build(libtcg, context, dedup, lift_stack, stack,
+                              ranges, num_ranges, flags, modes);
+    }
+
+    SpscQueue queue;
+    spsc_init(&queue);
+    Translator translator = {
+        .libtcg = libtcg,
+        .context = context,
+        .dedup = dedup,
+        .stack = lift_stack,
+        .ranges = ranges,
+        .num_ranges = num_ranges,
+        .flags = flags,
+        .modes = modes,
+        .queue = &queue,
+        .stats = {.enabled = stats.enabled},
+    };
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, translate_thread, &translator) != 0) {
+        return lift_and_build(libtcg, context, dedup, lift_stack, stack,
+                              ranges, num_ranges, flags, modes);
+    }
+
+    uint64_t t = stats_begin();
+    LibTcgArchInfo arch_info = libtcg->get_arch_info();
+    TbNode *root = NULL;
+    // Last block received, and the first one without edges
+    TbNode *last = NULL;
+    TbNode *pending = NULL;
+    Frontier frontier = {0};
+    for (;;) {
+        while (pending != NULL) {
+            if (!frontier.done &&
+                (pending->next == NULL ||
+                 !targets_received(arch_info, ranges, num_ranges,
+                                   &frontier, pending))) {
+                break;
+            }
+            cfg_build_node(libtcg, stack, root, pending);
+            pending = pending->next;
+        }
+        if (frontier.done) {
+            break;
+        }
+
+        TbNode *n = pop_wait(&queue);
+        if (n == NULL) {
+            frontier.done = true;
+            continue;
+        }
+        // Blocks split off the last block are linked after it
+        while (last != NULL && last->next != NULL) {
+            last = last->next;
+        }
+        if (last == NULL) {
+            root = n;
+        } else {
+            last->next = n;
+        }
+        last = n;
+        if (pending == NULL) {
+            pending = n;
+        }
+        frontier.range = range_of(ranges, num_ranges, frontier.range, n->address);
+        frontier.end = n->address + n->tb.size_in_bytes;
+    }
+
+    pthread_join(thread, NULL);
+    stats_merge(&translator.stats);
+    stack_adopt(stack, lift_stack);
+    stats_end(STATS_TIMER_CFG, t);
+    return root;
+}
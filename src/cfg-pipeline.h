@@ -0,0 +1,36 @@
+#pragma once
+
+#include <qemu/libtcg/libtcg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct StackAllocator StackAllocator;
+typedef struct DedupCache DedupCache;
+typedef struct TbNode TbNode;
+typedef struct ElfModeMap ElfModeMap;
+
+typedef struct CfgRange {
+    const uint8_t *data;
+    size_t size;
+    uint64_t address;
+} CfgRange;
+
+// Same as cfg_lift() over each range, with the blocks chained in range
+// order, followed by cfg_build(), but translation runs on a separate
+// thread. Blocks are handed to the calling thread through a lock-free
+// single-producer/single-consumer queue as soon as they are translated,
+// and the calling thread adds their edges in list order while later
+// blocks are still being translated. A block waits for its successor
+// and for every block its direct jumps could land in, so the CFG is the
+// same as the sequential one.
+//
+// The translation thread allocates blocks and IR from lift_stack,
+// through lifter_alloc(), so the lifter must allocate through it and
+// dedup, if non-NULL, must have been created on lift_stack. Blocks split
+// while building are allocated from stack, which adopts lift_stack once
+// translation is done.
+TbNode *cfg_pipeline(LibTcgInterface *libtcg, LibTcgContext *context,
+                     DedupCache *dedup, StackAllocator *lift_stack,
+                     StackAllocator *stack,
+                     const CfgRange *ranges, size_t num_ranges,
+                     uint32_t flags, const ElfModeMap *modes);
@@ -0,0 +1,222 @@
+#include "cfg.h"
+#include "common.h"
+#include "loadelf.h"
+#include "dedup.h"
+#include "stats.h"
+
+static void add_edge(TbNode *src, TbNode *dst,
+              size_t instruction_index,
+              EdgeType type) {
+    for (int i = src->num_succ-1; i >= 0; --i) {
+        if (src->succ[i].dst_node == dst) {
+            return;
+        }
+    }
+
+    stats_add(STATS_EDGES, 1);
+
+    // add src -> dst edge
+    assert(src->num_succ < MAX_EDGES);
+    src->succ[src->num_succ++] = (Edge) {
+        .src_instruction = instruction_index,
+        .dst_node = dst,
+        .type = type,
+    };
+
+    // add src <- dst edge
+    assert(dst->num_pred < MAX_EDGES);
+    dst->pred[dst->num_pred++] = (Edge) {
+        .src_instruction = 0,
+        .dst_node = src,
+        .type = type,
+    };
+}
+
+TbNode *cfg_lift_next(LibTcgInterface *libtcg, LibTcgContext *context,
+                      DedupCache *dedup, StackAllocator *stack,
+                      const uint8_t *data, size_t size, uint64_t address,
+                      uint32_t flags, const ElfModeMap *modes, size_t *off_ptr) {
+    size_t off = *off_ptr;
+    while (off < size) {
+        uint64_t tb_address = address + off;
+        size_t tb_size = size - off;
+        uint32_t tb_flags = flags;
+        ElfMode mode = ELF_MODE_DEFAULT;
+        if (modes != NULL) {
+            uint64_t mode_end;
+            mode = elf_mode_at(modes, tb_address, &mode_end);
+            if (mode_end - tb_address < tb_size) {
+                tb_size = mode_end - tb_address;
+            }
+            if (mode == ELF_MODE_DATA) {
+                off += tb_size;
+                continue;
+            } else if (mode == ELF_MODE_THUMB) {
+                tb_flags |= LIBTCG_TRANSLATE_ARM_THUMB;
+            } else if (mode == ELF_MODE_ARM) {
+                tb_flags &= ~LIBTCG_TRANSLATE_ARM_THUMB;
+            }
+        }
+
+        LibTcgTranslationBlock tb;
+        uint64_t t = stats_begin();
+        // The dedup cache only holds blocks lifted with its own flags
+        if (dedup != NULL && tb_flags == flags) {
+            tb = dedup_translate(dedup, libtcg, context,
+                                 data + off, tb_size, tb_address);
+        } else {
+            tb = libtcg->translate_block(context,
+                                         data + off,
+                                         tb_size,
+                                         tb_address,
+                                         tb_flags);
+        }
+        stats_end(STATS_TIMER_TRANSLATE, t);
+        // An instruction straddling a mode change can't be translated,
+        // continue with the next mode
+        if (tb.size_in_bytes == 0 && mode != ELF_MODE_DEFAULT) {
+            off += tb_size;
+            continue;
+        }
+        off += tb.size_in_bytes;
+        if (tb.instruction_count == 0) {
+            continue;
+        }
+        stats_add(STATS_TBS_LIFTED, 1);
+        stats_add(STATS_TCG_OPS, tb.instruction_count);
+
+        TbNode *n = stack_alloc_tagged(stack, sizeof(TbNode), MEM_TAG_TB_NODE);
+        *n = (TbNode) {
+            .address = tb_address,
+            .tb = tb,
+        };
+        *off_ptr = off;
+        return n;
+    }
+    *off_ptr = off;
+    return NULL;
+}
+
+TbNode *cfg_lift(LibTcgInterface *libtcg, LibTcgContext *context,
+                 DedupCache *dedup, StackAllocator *stack,
+                 const uint8_t *data, size_t size, uint64_t address,
+                 uint32_t flags, const ElfModeMap *modes) {
+    TbNode *root = NULL;
+    TbNode *top = NULL;
+    size_t off = 0;
+    TbNode *n;
+    while ((n = cfg_lift_next(libtcg, context, dedup, stack, data, size,
+                              address, flags, modes, &off)) != NULL) {
+        if (root == NULL) {
+            root = n;
+            top = n;
+        } else {
+            top->next = n;
+            top = n;
+        }
+    }
+    return root;
+}
+
+void cfg_build_node(LibTcgInterface *libtcg, StackAllocator *stack,
+                    TbNode *root, TbNode *n) {
+    LibTcgArchInfo arch_info = libtcg->get_arch_info();
+    size_t num_indirect_jumps = 0;
+    size_t num_jumps = 0;
+    uint64_t jumps[16] = {0};
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
+
+        bool is_direct;
+        uint64_t address;
+        if (is_pc_write(arch_info, inst, &is_direct, &address)) {
+            if (is_direct) {
+                jumps[num_jumps++] = address;
+            } else {
+                ++num_indirect_jumps;
+            }
+        } else if (inst->opcode == LIBTCG_op_exit_tb) {
+            ++n->num_exits;
+        }
+    }
+
+    if (n->num_exits > 0) {
+        for (size_t i = 0; i < num_jumps; ++i) {
+            uint64_t address = jumps[i];
+            TbNode *succ = find_tb_containing(root, address);
+            if (succ == NULL) {
+                continue;
+            }
+            if (address == succ->address) {
+                add_edge(n, succ, 0, DIRECT);
+            } else {
+                int j = find_instruction_from_address(succ, address);
+                if (j == -1) {
+                    continue;
+                }
+
+                stats_add(STATS_BLOCK_SPLITS, 1);
+                size_t total_size = succ->tb.size_in_bytes;
+                size_t instruction_count = succ->tb.instruction_count;
+                TbNode *new_node = stack_alloc_tagged(stack,
+                                                      sizeof(TbNode),
+                                                      MEM_TAG_TB_NODE);
+                *new_node = *succ;
+
+                succ->tb.instruction_count = j;
+                succ->tb.size_in_bytes = address - succ->address;
+                succ->next = new_node;
+                succ->split_into_next = true;
+
+                new_node->address = address;
+                new_node->tb.instruction_count = instruction_count - j;
+                new_node->tb.list += j;
+                new_node->tb.size_in_bytes = total_size - (address - succ->address);
+
+                for (size_t i = 0; i < succ->num_succ;) {
+                    if (succ->succ[i].src_instruction >= succ->tb.instruction_count) {
+
+                        succ->succ[i] = succ->succ[succ->num_succ-1];
+                        --succ->num_succ;
+
+                    } else {
+
+                        ++i;
+                    }
+                }
+
+                succ->num_succ = 0;
+                new_node->num_pred = 0;
+
+                for (size_t i = 0; i < new_node->num_succ; ++i) {
+                    new_node->succ[i].src_instruction -= succ->tb.instruction_count;
+                }
+                for (size_t i = 0; i < new_node->num_succ; ++i) {
+                    TbNode *n = new_node->succ[i].dst_node;
+                    for (size_t j = 0; j < n->num_pred; ++j) {
+                        if (n->pred[j].dst_node == succ) {
+                            n->pred[j].dst_node = new_node;
+                        }
+                    }
+                }
+
+                add_edge(succ, new_node, j-1, FALLTHROUGH);
+                if (n->address != succ->address) {
+                    add_edge(n,    new_node, 0, DIRECT);
+                }
+            }
+        }
+    }
+
+    if (n->next && (n->num_exits == 0 || (num_jumps + num_indirect_jumps) < n->num_exits)) {
+        add_edge(n, n->next, n->tb.instruction_count-1, FALLTHROUGH);
+    }
+}
+
+void cfg_build(LibTcgInterface *libtcg, StackAllocator *stack, TbNode *root) {
+    uint64_t t = stats_begin();
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        cfg_build_node(libtcg, stack, root, n);
+    }
+    stats_end(STATS_TIMER_CFG, t);
+}
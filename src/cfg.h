@@ -0,0 +1,39 @@
+#pragma once
+
+#include <qemu/libtcg/libtcg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct StackAllocator StackAllocator;
+typedef struct DedupCache DedupCache;
+typedef struct TbNode TbNode;
+typedef struct ElfModeMap ElfModeMap;
+
+// Translates size bytes at data, starting at guest address address,
+// into a list of blocks in address order. Bytes that fail to translate
+// are skipped. If dedup is non-NULL blocks are translated through it.
+//
+// If modes is non-NULL each block is translated as ARM or Thumb
+// according to it, blocks don't cross mode changes and data ranges are
+// skipped. Ranges of the default mode use flags as given.
+TbNode *cfg_lift(LibTcgInterface *libtcg, LibTcgContext *context,
+                 DedupCache *dedup, StackAllocator *stack,
+                 const uint8_t *data, size_t size, uint64_t address,
+                 uint32_t flags, const ElfModeMap *modes);
+
+// Single step of cfg_lift(), translates the next block at or after
+// *off and advances *off past it. Returns NULL at the end of data.
+TbNode *cfg_lift_next(LibTcgInterface *libtcg, LibTcgContext *context,
+                      DedupCache *dedup, StackAllocator *stack,
+                      const uint8_t *data, size_t size, uint64_t address,
+                      uint32_t flags, const ElfModeMap *modes, size_t *off);
+
+// Adds edges for direct jumps and fallthroughs between the blocks of
+// cfg_lift(). Blocks that are jumped into are split at the target.
+void cfg_build(LibTcgInterface *libtcg, StackAllocator *stack, TbNode *root);
+
+// Single step of cfg_build(), adds the edges of n. Calling it for every
+// block in list order is the same as cfg_build(), jump targets are
+// looked up in the blocks from root onward.
+void cfg_build_node(LibTcgInterface *libtcg, StackAllocator *stack,
+                    TbNode *root, TbNode *n);
@@ -11,7 +11,7 @@ static void print_pos_cmdline_option(FILE *fd, CmdLineOption *option) {
     fprintf(fd, "%16s%8s    %s\n", option->long_name, option->format, option->desc);
 }
 
-static bool parse_option(CmdLineOption *option, const char *value) {
+bool parse_option(CmdLineOption *option, const char *value) {
     option->parsed = true;
     switch (option->type) {
     case CMDLINE_OPTION_STR:
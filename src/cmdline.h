@@ -36,6 +36,10 @@ typedef struct CmdLineOption {
     bool parsed;
 } CmdLineOption;
 
+// Parses value into the destination of a single option, value may be
+// NULL for CMDLINE_OPTION_BOOL.
+bool parse_option(CmdLineOption *option, const char *value);
+
 bool parse_options(CmdLineOption *pos_options,   size_t num_pos_options,
                    CmdLineOption *named_options, size_t num_named_options,
                    int argc, char **argv);
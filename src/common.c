@@ -43,6 +43,14 @@ TbNode *find_tb_containing(TbNode *n, uint64_t address) {
     return NULL;
 }
 
+size_t number_nodes(TbNode *root) {
+    size_t num_nodes = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        n->id = num_nodes++;
+    }
+    return num_nodes;
+}
+
 int find_instruction_from_address(TbNode *n, uint64_t address) {
     size_t i = 0;
     for (; i < n->tb.instruction_count; ++i) {
@@ -39,6 +39,15 @@ typedef struct Edge {
     EdgeType type;
 } Edge;
 
+// Edge to a block outside of the lifted list, such as one lifted in
+// another --window
+typedef struct ExternalEdge {
+    uint64_t src;
+    uint64_t dst;
+    size_t src_instruction;
+    EdgeType type;
+} ExternalEdge;
+
 typedef struct MfpStackState {
     int64_t max_st_size;
     int64_t max_ld_size;
@@ -46,9 +55,14 @@ typedef struct MfpStackState {
 
 typedef struct TbNode {
     uint64_t address;
+    // Dense index into per-node arrays, assigned by number_nodes()
+    size_t id;
     LibTcgTranslationBlock tb;
     struct TbNode *next;
     size_t num_exits;
+    // Set by cfg_build() when it splits this node's TB in two, the rest
+    // of which continues in next along with the temps of the TB
+    bool split_into_next;
     size_t num_succ;
     size_t num_pred;
     Edge succ[MAX_EDGES];
@@ -70,6 +84,7 @@ bool is_pc_write(LibTcgArchInfo arch, LibTcgInstruction *inst,
 bool is_jump(LibTcgInterface *libtcg, LibTcgInstruction *inst,
              bool *is_direct, uint64_t *address);
 TbNode *find_tb_containing(TbNode *n, uint64_t address);
+size_t number_nodes(TbNode *root);
 int find_instruction_from_address(TbNode *n, uint64_t address);
 bool is_stack_ld_fancy(LibTcgArchInfo arch_info,
                        Memory *memory,
@@ -0,0 +1,286 @@
+#include "dedup.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+
+// Number of leading bytes hashed to find candidate blocks, blocks are
+// then compared in full.
+#define DEDUP_PREFIX_SIZE 16
+#define DEDUP_INITIAL_BUCKETS 1024
+// Lifters end blocks at guest page boundaries
+#define DEDUP_PAGE_SIZE 4096
+
+typedef enum DedupState {
+    // Only lifted once, position dependent constants unknown
+    DEDUP_UNVERIFIED = 0,
+    DEDUP_VERIFIED,
+    DEDUP_REJECTED,
+} DedupState;
+
+typedef enum RelocKind {
+    RELOC_CARG,
+    RELOC_IARG,
+} RelocKind;
+
+// Argument that holds address + some constant
+typedef struct Reloc {
+    uint32_t inst;
+    uint8_t kind;
+    uint8_t arg;
+} Reloc;
+
+typedef struct DedupEntry {
+    uint64_t prefix_hash;
+    const uint8_t *bytes;
+    uint64_t address;
+    LibTcgTranslationBlock tb;
+    DedupState state;
+    Reloc *relocs;
+    size_t num_relocs;
+    struct DedupEntry *next;
+} DedupEntry;
+
+struct DedupCache {
+    StackAllocator *stack;
+    uint64_t seed;
+    DedupEntry **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+    DedupStats stats;
+};
+
+static uint64_t hash_prefix(uint64_t seed, const uint8_t *data) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+    for (size_t i = 0; i < DEDUP_PREFIX_SIZE; ++i) {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Relocations learned from one pair of copies only hold for constants
+// that move linearly with the address. PC-relative values the lifter
+// masks, such as the page of an AArch64 ADRP or the word aligned PC of
+// an ARM Thumb literal load, only do so between copies at the same
+// offset within a page, which also have the same 4 byte alignment and
+// see the same page boundaries. Copies at other offsets get entries of
+// their own.
+static inline bool same_page_offset(uint64_t a, uint64_t b) {
+    return (a % DEDUP_PAGE_SIZE) == (b % DEDUP_PAGE_SIZE);
+}
+
+DedupCache *dedup_create(StackAllocator *stack, uint32_t arch, uint32_t flags) {
+    DedupCache *cache = stack_alloc_zero_tagged(stack, sizeof(DedupCache), MEM_TAG_OTHER);
+    cache->stack = stack;
+    cache->seed = ((uint64_t) arch << 32) | flags;
+    cache->num_buckets = DEDUP_INITIAL_BUCKETS;
+    cache->buckets = stack_alloc_zero_tagged(stack, cache->num_buckets*sizeof(DedupEntry *), MEM_TAG_OTHER);
+    return cache;
+}
+
+static void insert(DedupCache *cache, DedupEntry *entry) {
+    if (cache->num_entries >= cache->num_buckets) {
+        size_t num_buckets = 2*cache->num_buckets;
+        DedupEntry **buckets = stack_alloc_zero_tagged(cache->stack, num_buckets*sizeof(DedupEntry *), MEM_TAG_OTHER);
+        for (size_t i = 0; i < cache->num_buckets; ++i) {
+            DedupEntry *e = cache->buckets[i];
+            while (e != NULL) {
+                DedupEntry *next = e->next;
+                size_t b = e->prefix_hash & (num_buckets - 1);
+                e->next = buckets[b];
+                buckets[b] = e;
+                e = next;
+            }
+        }
+        cache->buckets = buckets;
+        cache->num_buckets = num_buckets;
+    }
+    size_t b = entry->prefix_hash & (cache->num_buckets - 1);
+    entry->next = cache->buckets[b];
+    cache->buckets[b] = entry;
+    ++cache->num_entries;
+}
+
+static DedupEntry *find(DedupCache *cache, uint64_t prefix_hash,
+                        const uint8_t *data, size_t size, uint64_t address) {
+    size_t b = prefix_hash & (cache->num_buckets - 1);
+    for (DedupEntry *e = cache->buckets[b]; e != NULL; e = e->next) {
+        if (e->prefix_hash == prefix_hash &&
+            e->tb.size_in_bytes <= size &&
+            same_page_offset(e->address, address) &&
+            memcmp(e->bytes, data, e->tb.size_in_bytes) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static inline bool same_temp(LibTcgArgument *a, LibTcgArgument *b) {
+    if (a->kind != b->kind) {
+        return false;
+    }
+    if (a->kind != LIBTCG_ARG_TEMP) {
+        return a->constant == b->constant;
+    }
+    return a->temp->kind == b->temp->kind &&
+           a->temp->index == b->temp->index &&
+           (a->temp->kind != LIBTCG_TEMP_CONST || a->temp->val == b->temp->val);
+}
+
+// Compares the IR of an entry against the same bytes lifted at another
+// address and records which arguments moved along with the block.
+static void learn_relocs(DedupCache *cache, DedupEntry *e,
+                         LibTcgTranslationBlock *tb, uint64_t address) {
+    uint64_t delta = address - e->address;
+    e->state = DEDUP_REJECTED;
+    if (tb->instruction_count != e->tb.instruction_count ||
+        tb->size_in_bytes != e->tb.size_in_bytes) {
+        return;
+    }
+
+    size_t num_relocs = 0;
+    size_t max_relocs = 0;
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < tb->instruction_count; ++i) {
+            LibTcgInstruction *a = &e->tb.list[i];
+            LibTcgInstruction *b = &tb->list[i];
+            if (a->opcode != b->opcode ||
+                a->nb_oargs != b->nb_oargs ||
+                a->nb_iargs != b->nb_iargs ||
+                a->nb_cargs != b->nb_cargs) {
+                return;
+            }
+            for (int j = 0; j < a->nb_oargs; ++j) {
+                if (!same_temp(&a->output_args[j], &b->output_args[j])) {
+                    return;
+                }
+            }
+            for (int j = 0; j < a->nb_iargs; ++j) {
+                LibTcgArgument *x = &a->input_args[j];
+                LibTcgArgument *y = &b->input_args[j];
+                if (same_temp(x, y)) {
+                    continue;
+                }
+                if (x->kind == LIBTCG_ARG_TEMP && y->kind == LIBTCG_ARG_TEMP &&
+                    x->temp->kind == LIBTCG_TEMP_CONST &&
+                    y->temp->kind == LIBTCG_TEMP_CONST &&
+                    y->temp->val - x->temp->val == delta) {
+                    if (pass == 1) {
+                        e->relocs[num_relocs] = (Reloc) {i, RELOC_IARG, j};
+                    }
+                    ++num_relocs;
+                    continue;
+                }
+                return;
+            }
+            for (int j = 0; j < a->nb_cargs; ++j) {
+                uint64_t x = a->constant_args[j].constant;
+                uint64_t y = b->constant_args[j].constant;
+                if (x == y) {
+                    continue;
+                }
+                if (y - x == delta) {
+                    if (pass == 1) {
+                        e->relocs[num_relocs] = (Reloc) {i, RELOC_CARG, j};
+                    }
+                    ++num_relocs;
+                    continue;
+                }
+                return;
+            }
+        }
+        // First pass counts, second pass records
+        if (pass == 0) {
+            max_relocs = num_relocs;
+            e->relocs = stack_alloc_tagged(cache->stack, max_relocs*sizeof(Reloc), MEM_TAG_OTHER);
+            num_relocs = 0;
+        }
+    }
+    assert(num_relocs == max_relocs);
+    e->num_relocs = num_relocs;
+    e->state = DEDUP_VERIFIED;
+}
+
+static LibTcgTranslationBlock rebase(DedupCache *cache, DedupEntry *e, uint64_t address) {
+    uint64_t delta = address - e->address;
+    size_t count = e->tb.instruction_count;
+    LibTcgInstruction *list = stack_alloc_tagged(cache->stack, count*sizeof(LibTcgInstruction), MEM_TAG_LIBTCG_IR);
+    memcpy(list, e->tb.list, count*sizeof(LibTcgInstruction));
+
+    for (size_t i = 0; i < e->num_relocs; ++i) {
+        Reloc *r = &e->relocs[i];
+        LibTcgInstruction *inst = &list[r->inst];
+        if (r->kind == RELOC_CARG) {
+            inst->constant_args[r->arg].constant += delta;
+            continue;
+        }
+        // Constant temps may be shared between instructions, so every
+        // use gets its own copy.
+        LibTcgTemp *temp = stack_alloc_tagged(cache->stack, sizeof(LibTcgTemp), MEM_TAG_LIBTCG_IR);
+        *temp = *inst->input_args[r->arg].temp;
+        temp->val += delta;
+        if (temp->name[0] == '$') {
+            snprintf(temp->name, sizeof(temp->name), "$0x%lx", temp->val);
+        }
+        inst->input_args[r->arg].temp = temp;
+    }
+
+    return (LibTcgTranslationBlock) {
+        .list = list,
+        .instruction_count = count,
+        .size_in_bytes = e->tb.size_in_bytes,
+    };
+}
+
+LibTcgTranslationBlock dedup_translate(DedupCache *cache,
+                                       LibTcgInterface *libtcg,
+                                       LibTcgContext *context,
+                                       const uint8_t *data,
+                                       size_t size,
+                                       uint64_t address) {
+    uint32_t flags = (uint32_t) cache->seed;
+    if (size < DEDUP_PREFIX_SIZE) {
+        ++cache->stats.num_lifted;
+        return libtcg->translate_block(context, data, size, address, flags);
+    }
+
+    uint64_t prefix_hash = hash_prefix(cache->seed, data);
+    DedupEntry *e = find(cache, prefix_hash, data, size, address);
+    if (e != NULL && e->state == DEDUP_VERIFIED) {
+        ++cache->stats.num_reused;
+        return rebase(cache, e, address);
+    }
+
+    LibTcgTranslationBlock tb = libtcg->translate_block(context, data, size, address, flags);
+    ++cache->stats.num_lifted;
+
+    if (e != NULL) {
+        if (e->state == DEDUP_UNVERIFIED) {
+            learn_relocs(cache, e, &tb, address);
+            if (e->state == DEDUP_REJECTED) {
+                ++cache->stats.num_rejected;
+            }
+        }
+        return tb;
+    }
+
+    // Blocks cut short by the end of input would lift differently
+    // elsewhere
+    if (tb.instruction_count == 0 ||
+        tb.size_in_bytes < DEDUP_PREFIX_SIZE ||
+        tb.size_in_bytes >= size) {
+        return tb;
+    }
+
+    DedupEntry *entry = stack_alloc_zero_tagged(cache->stack, sizeof(DedupEntry), MEM_TAG_OTHER);
+    entry->prefix_hash = prefix_hash;
+    entry->bytes = data;
+    entry->address = address;
+    entry->tb = tb;
+    insert(cache, entry);
+    return tb;
+}
+
+DedupStats dedup_stats(DedupCache *cache) {
+    return cache->stats;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <qemu/libtcg/libtcg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct StackAllocator StackAllocator;
+typedef struct DedupCache DedupCache;
+
+typedef struct DedupStats {
+    // Blocks lifted by libtcg
+    size_t num_lifted;
+    // Blocks served as rebased copies of an earlier block
+    size_t num_reused;
+    // Groups of identical bytes that don't lift to rebasable IR
+    size_t num_rejected;
+} DedupStats;
+
+// Cache of lifted blocks keyed by their raw bytes, arch and translate
+// flags. stack must outlive all blocks returned by dedup_translate().
+DedupCache *dedup_create(StackAllocator *stack, uint32_t arch, uint32_t flags);
+
+// Drop-in replacement for libtcg->translate_block(). If the bytes at
+// data start with those of an earlier block at the same offset within
+// a guest page, the IR of that block is copied with its position
+// dependent constants rebased to address instead of being lifted
+// again.
+//
+// Which constants depend on the address is learned by lifting the
+// first duplicate of every block and comparing the two; constants
+// that differ by exactly the distance between the two blocks are
+// rebased, any other difference disables reuse for those bytes.
+// Copies at other page offsets are cached separately, as constants
+// derived from a masked address don't move along with them.
+LibTcgTranslationBlock dedup_translate(DedupCache *cache,
+                                       LibTcgInterface *libtcg,
+                                       LibTcgContext *context,
+                                       const uint8_t *data,
+                                       size_t size,
+                                       uint64_t address);
+
+DedupStats dedup_stats(DedupCache *cache);
@@ -7,6 +7,22 @@
 #include "analyze-max-stack.h"
 #include "graphviz.h"
 #include "stack_alloc.h"
+#include "profile.h"
+#include "stats.h"
+#include "output.h"
+#include "cfg-partition.h"
+#include "json-export.h"
+#include "irfile-writer.h"
+#include "passes.h"
+#include "dedup.h"
+#include "cfg.h"
+#include "incremental.h"
+#include "server.h"
+#include "lifter-pool.h"
+#include "arch-detect.h"
+#include "cfg-pipeline.h"
+#include "window.h"
+#include "callgraph.h"
 #include <qemu/libtcg/libtcg.h>
 #include <qemu/libtcg/libtcg_loader.h>
 #include <stdlib.h>
@@ -15,90 +31,390 @@
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#define STREAM_BUFFER_SIZE (1024*1024)
+// Minimum amount of buffered input required before translating in
+// --stream mode, ensures blocks are not cut short by the end of the
+// currently buffered data.
+#define STREAM_LOOKAHEAD (64*1024)
+
+// Longest request line and most arguments of a --fork-server request
+#define FORK_SERVER_MAX_REQUEST 4096
+#define FORK_SERVER_MAX_ARGS 64
 
 static Memory memory = {0};
 
-static void *libtcg_alloc(size_t size) {
-    return stack_alloc(&memory.persistent, size);
+// Lifters of the process. The --fork-server parent opens them up front
+// and the children it forks for each request inherit them.
+static LifterPool lifters;
+static bool is_fork_server_child = false;
+
+// Translates and dumps IR of stdin while it is being read. Only a fixed
+// size window of input and the IR of a single block is resident at a
+// time.
+static bool stream_dump_ir(LibTcgInterface *libtcg, LibTcgContext *context,
+                           Output *out, uint64_t address, uint32_t flags) {
+    FILE *fd = reopen_stdin_binary();
+    uint8_t *buffer = stack_alloc_tagged(&memory.persistent, STREAM_BUFFER_SIZE, MEM_TAG_INPUT);
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+    bool ok = true;
+    while (ok && (!eof || begin < end)) {
+        if (!eof) {
+            memmove(buffer, buffer + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            // Reads whatever is available rather than waiting for the
+            // whole buffer to fill up, translation starts as soon as
+            // STREAM_LOOKAHEAD bytes are in.
+            while (end < STREAM_LOOKAHEAD) {
+                ssize_t bytes_read = read(fileno(fd), buffer + end, STREAM_BUFFER_SIZE - end);
+                if (bytes_read < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes_read < 0) {
+                    fprintf(stderr, "[error]: Failed to read stdin: %s\n", strerror(errno));
+                    ok = false;
+                }
+                if (bytes_read <= 0) {
+                    eof = true;
+                    break;
+                }
+                end += bytes_read;
+            }
+        }
+
+        while (ok && begin < end && (eof || end - begin >= STREAM_LOOKAHEAD)) {
+            StackMarker marker = stack_marker(&memory.persistent);
+            uint64_t t = stats_begin();
+            LibTcgTranslationBlock tb = libtcg->translate_block(context,
+                                                                buffer + begin,
+                                                                end - begin,
+                                                                address,
+                                                                flags);
+            stats_end(STATS_TIMER_TRANSLATE, t);
+            stats_add(STATS_TBS_LIFTED, tb.instruction_count > 0);
+            stats_add(STATS_TCG_OPS, tb.instruction_count);
+            output_tb_ir(out, libtcg, &tb);
+            stack_reset_to_marker(&memory.persistent, marker);
+            if (tb.size_in_bytes == 0) {
+                fprintf(stderr, "[error]: Failed to translate input at 0x%lx\n", address);
+                ok = false;
+                break;
+            }
+            begin += tb.size_in_bytes;
+            address += tb.size_in_bytes;
+        }
+    }
+    fclose(fd);
+    return ok;
+}
+
+typedef struct CallGraphStack {
+    LibTcgInterface *libtcg;
+    Memory *memory;
+    const ElfSymbolTable *symbols;
+    MfpStackState *local;
+} CallGraphStack;
+
+static void analyze_function_stack(void *arg, uint32_t function, TbNode *root) {
+    CallGraphStack *s = arg;
+    bool stack_grows_down = true;
+    s->local[function] = compute_frame_stack_size(s->libtcg, s->memory, root,
+                                                  s->symbols, stack_grows_down);
 }
 
-static void flatten_sources(StackAllocator *stack, SrcInfo *info) {
-    LibTcgInstruction *inst = &info->node->tb.list[info->inst_index];
-    if (info->node->reg_src_info == NULL) {
-        info->node->reg_src_info = stack_alloc_zero(stack, sizeof(SrcInfo *)*info->node->tb.instruction_count);
+// Builds the call graph of all functions and writes it to dot_path
+// and/or json_path. With analyze_max_stack, each function is labeled
+// with its own stack use and with the stack use through its calls.
+static bool dump_callgraph(LibTcgInterface *libtcg, LibTcgContext *context,
+                           Memory *memory, ElfData *data,
+                           const ElfSymbolTable *symbols,
+                           const ElfModeMap *modes, uint32_t flags,
+                           bool analyze_max_stack,
+                           const char *dot_path, const char *json_path) {
+    CallGraphStack stack = {
+        .libtcg = libtcg,
+        .memory = memory,
+        .symbols = symbols,
+    };
+    if (analyze_max_stack) {
+        stack.local = stack_alloc(&memory->persistent, symbols->count*sizeof(MfpStackState));
     }
-    info->node->reg_src_info[info->inst_index] = info;
-    for (int i = 0; i < inst->nb_iargs; ++i) {
-        if (info->children[i].num_branches == 0) {
+    CallGraph graph = callgraph_build(libtcg, context, memory, data, symbols,
+                                      modes, flags,
+                                      analyze_max_stack ? analyze_function_stack : NULL,
+                                      &stack);
+
+    const char **labels = NULL;
+    const char **extra = NULL;
+    if (analyze_max_stack) {
+        int64_t *depth = stack_alloc(&memory->persistent, graph.num_functions*sizeof(int64_t));
+        // The per-function analysis already ran in callgraph_build(),
+        // combining the results is a few MAX() per SCC and not worth
+        // handing out to threads
+        compute_call_stack_depth(&graph, &memory->temporary, stack.local, depth, 1);
+
+        labels = stack_alloc(&memory->persistent, graph.num_functions*sizeof(const char *));
+        extra = stack_alloc(&memory->persistent, graph.num_functions*sizeof(const char *));
+        for (size_t i = 0; i < graph.num_functions; ++i) {
+            char own[32] = "?";
+            char total[32] = "?";
+            char own_json[32] = "null";
+            char total_json[32] = "null";
+            if (graph.lifted[i] &&
+                stack.local[i].max_ld_size != STACK_SIZE_TOP &&
+                stack.local[i].max_st_size != STACK_SIZE_TOP) {
+                int64_t size = MAX(MAX(stack.local[i].max_ld_size, stack.local[i].max_st_size), 0);
+                snprintf(own, sizeof(own), "%ld", size);
+                snprintf(own_json, sizeof(own_json), "%ld", size);
+            }
+            if (depth[i] != STACK_SIZE_TOP) {
+                snprintf(total, sizeof(total), "%ld", depth[i]);
+                snprintf(total_json, sizeof(total_json), "%ld", depth[i]);
+            }
+            char buf[128];
+            int len = snprintf(buf, sizeof(buf), "stack %s, through calls %s", own, total);
+            labels[i] = memcpy(stack_alloc(&memory->persistent, len + 1), buf, len + 1);
+            len = snprintf(buf, sizeof(buf), ",\"max_stack\":%s,\"max_stack_calls\":%s",
+                           own_json, total_json);
+            extra[i] = memcpy(stack_alloc(&memory->persistent, len + 1), buf, len + 1);
+        }
+    }
+
+    const char *paths[2] = {dot_path, json_path};
+    for (size_t i = 0; i < ARRLEN(paths); ++i) {
+        if (paths[i] == NULL) {
             continue;
         }
-        for (size_t j = 0; j < info->children[i].num_branches; ++j) {
-            flatten_sources(stack, &info->children[i].branches[j]);
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "[error]: Failed to open %s\n", paths[i]);
+            return false;
+        }
+        Output out;
+        output_init(&out, &memory->persistent, fd, OUTPUT_BUFFER_SIZE);
+        if (paths[i] == dot_path) {
+            callgraph_output_dot(&graph, &out, labels);
+        } else {
+            callgraph_output_json(&graph, &out, extra);
+        }
+        bool ok = output_flush(&out);
+        close(fd);
+        if (!ok) {
+            fprintf(stderr, "[error]: Failed to write %s\n", paths[i]);
+            return false;
         }
     }
+    return true;
 }
 
-static void add_edge(TbNode *src, TbNode *dst,
-              size_t instruction_index,
-              EdgeType type) {
-    for (int i = src->num_succ-1; i >= 0; --i) {
-        if (src->succ[i].dst_node == dst) {
-            return;
+static int run(int argc, char **argv);
+
+// Parses --arch for raw input, "auto" gives LIBTCG_ARCH_NONE and leaves
+// the architecture to arch_detect()
+static bool parse_arch(const char *arch_name, LibTcgArch *arch) {
+    if (arch_name == NULL) {
+        fprintf(stderr, "[error]: Specify an architecture with --arch\n\n");
+        return false;
+    }
+    if (strcmp(arch_name, "auto") == 0) {
+        *arch = LIBTCG_ARCH_NONE;
+        return true;
+    }
+    *arch = libtcg_arch_from_str(arch_name);
+    if (*arch == LIBTCG_ARCH_NONE) {
+        fprintf(stderr, "[error]: Invalid architecture\n\n");
+        return false;
+    }
+    return true;
+}
+
+// Opens the lifters of a comma separated list of archs once and then
+// runs each line of stdin, a list of dump-ir arguments without the
+// program name, in a forked child. Children start with the lifters
+// initialized, and a crash in one of them only fails that request.
+// Requests are run one at a time so that their output isn't interleaved.
+static int fork_server(const char *arch_names) {
+    char names[256];
+    snprintf(names, sizeof(names), "%s", arch_names);
+    for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        LibTcgArch arch = libtcg_arch_from_str(name);
+        if (arch == LIBTCG_ARCH_NONE) {
+            fprintf(stderr, "[error]: Invalid architecture %s\n", name);
+            return -1;
         }
+        lifter_pool_get(&lifters, arch);
     }
 
-    // add src -> dst edge
-    assert(src->num_succ < MAX_EDGES);
-    src->succ[src->num_succ++] = (Edge) {
-        .src_instruction = instruction_index,
-        .dst_node = dst,
-        .type = type,
-    };
+    size_t num_requests = 0;
+    size_t num_failed = 0;
+    char line[FORK_SERVER_MAX_REQUEST];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        // Lines that don't fit are rejected as a whole rather than run
+        // in pieces
+        if (strchr(line, '\n') == NULL && !feof(stdin)) {
+            int c;
+            while ((c = getchar()) != EOF && c != '\n') {
+            }
+            ++num_requests;
+            ++num_failed;
+            fprintf(stderr, "[error]: Request %lu is longer than %d bytes\n", num_requests, FORK_SERVER_MAX_REQUEST - 2);
+            continue;
+        }
 
-    // add src <- dst edge
-    assert(dst->num_pred < MAX_EDGES);
-    dst->pred[dst->num_pred++] = (Edge) {
-        .src_instruction = 0,
-        .dst_node = src,
-        .type = type,
-    };
+        char *args[FORK_SERVER_MAX_ARGS + 1];
+        int num_args = 0;
+        args[num_args++] = "dump-ir";
+        char *tok = strtok(line, " \t\r\n");
+        while (tok != NULL && num_args < FORK_SERVER_MAX_ARGS) {
+            args[num_args++] = tok;
+            tok = strtok(NULL, " \t\r\n");
+        }
+        if (num_args == 1) {
+            continue;
+        }
+        args[num_args] = NULL;
+        ++num_requests;
+        if (tok != NULL) {
+            fprintf(stderr, "[error]: Request %lu has more than %d arguments\n", num_requests, FORK_SERVER_MAX_ARGS - 1);
+            ++num_failed;
+            continue;
+        }
+
+        // Buffered output would otherwise be written by both processes
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "[error]: Failed to fork request %lu: %s\n", num_requests, strerror(errno));
+            ++num_failed;
+            break;
+        }
+        if (pid == 0) {
+            // stdin is the control pipe
+            int null = open("/dev/null", O_RDONLY);
+            dup2(null, STDIN_FILENO);
+            close(null);
+            is_fork_server_child = true;
+            exit(run(num_args, args));
+        }
+
+        int status;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "[error]: Request %lu killed by signal %d\n", num_requests, WTERMSIG(status));
+            ++num_failed;
+        } else if (WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "[error]: Request %lu failed\n", num_requests);
+            ++num_failed;
+        }
+    }
+
+    lifter_pool_close(&lifters);
+    stack_free_all(&memory.persistent);
+    stack_free_all(&memory.temporary);
+    return (num_failed == 0) ? 0 : -1;
 }
 
 int main(int argc, char **argv) {
+    lifter_set_arena(&memory.persistent);
+    lifter_pool_init(&lifters, (LibTcgDesc) {
+        .mem_alloc = lifter_alloc,
+    });
+    return run(argc, argv);
+}
+
+static int run(int argc, char **argv) {
     bool help = false;
     bool bytes = false;
+    bool stream = false;
     bool dump_ir = false;
     bool analyze_max_stack = false;
     bool optimize = false;
     bool h2tcg = false;
     bool debug = false;
+    bool dedup = false;
     unsigned long offset = 0;
+    // The option parser rejects ULONG_MAX, so it marks an absent --address
+    unsigned long vaddr = ULONG_MAX;
+    bool segments = false;
+    bool print_stats = false;
+    bool print_stats_json = false;
+    bool cfg_by_function = false;
+    bool fork_server_mode = false;
+    bool pipelined = false;
     unsigned long size = 0;
     const char *file = NULL;
     const char *section = NULL;
     const char *function = NULL;
     const char *arch_name = NULL;
     const char *dump_cfg = NULL;
+    const char *cfg_split = NULL;
+    const char *dump_json = NULL;
+    const char *dump_bin = NULL;
+    const char *passes = NULL;
+    const char *incremental = NULL;
+    const char *serve_path = NULL;
+    const char *callgraph_dot = NULL;
+    const char *callgraph_json = NULL;
+    const char *query_path = NULL;
+    unsigned long cfg_max_blocks = 0;
+    unsigned long cfg_collapse = 0;
+    unsigned long window_size = 0;
+    const char *mem_report_format = NULL;
+    const char *output_file = NULL;
+    unsigned long output_fd = STDOUT_FILENO;
     CmdLineRegTuple analyze_reg_src = {0};
 
     CmdLineOption pos_options[] = {
-        {"[file]", "", "string", "file to read bytes from, used with --offset/--length, --section, --function", CMDLINE_OPTION_STR, .str = &file},
+        {"[file]", "", "string", "file to read bytes from, used with --offset/--length, --address, --segments, --section, --function", CMDLINE_OPTION_STR, .str = &file},
     };
     CmdLineOption named_options[] = {
         {"--help",      "-h", "",       "show help message",                                                   CMDLINE_OPTION_BOOL,  .b = &help},
         {"--offset",    "-o", "hex",    "given [file], translate region at --offset/--length",                 CMDLINE_OPTION_HEX, .ulong = &offset},
         {"--length",    "-l", "ulong",  "given [file], translate region at --offset/--length",                 CMDLINE_OPTION_ULONG, .ulong = &size},
+        {"--address",   "-A", "hex",    "given ELF [file], translate --length bytes at virtual address, or up to the end of its segment", CMDLINE_OPTION_HEX, .ulong = &vaddr},
+        {"--segments",  "-g", "",       "given ELF [file], translate all executable PT_LOAD segments, works without section headers", CMDLINE_OPTION_BOOL, .b = &segments},
         {"--section",   "-s", "string", "given [file], translate ELF section",                                 CMDLINE_OPTION_STR,   .str = &section},
         {"--function",  "-f", "string", "given [file], translate ELF function (requires symbols)",             CMDLINE_OPTION_STR,   .str = &function},
         {"--bytes",     "-b", "",       "translate bytes from stdin, requires --arch",                         CMDLINE_OPTION_BOOL,  .b = &bytes},
-        {"--arch",      "-a", "string", "given bytes or [file]/--offset/--length, specify input architecture", CMDLINE_OPTION_STR,   .str = &arch_name},
+        {"--stream",    "-S", "",       "given --bytes and --dump-ir, translate stdin while it is being read",  CMDLINE_OPTION_BOOL,  .b = &stream},
+        {"--arch",      "-a", "string", "given bytes or [file]/--offset/--length, specify input architecture, auto picks the one that best decodes the input", CMDLINE_OPTION_STR,   .str = &arch_name},
         {"--dump-ir",   "-i", "",       "dump lifted IR to stdout", CMDLINE_OPTION_BOOL,   .b = &dump_ir},
+        {"--output",    "-O", "file",   "write --dump-ir output to file instead of stdout", CMDLINE_OPTION_STR, .str = &output_file},
+        {"--output-fd", "-F", "ulong",  "write --dump-ir output to an already open file descriptor", CMDLINE_OPTION_ULONG, .ulong = &output_fd},
         {"--dump-cfg",  "-c", "[out.dot]", "compute CFG and dump to [out.dot] in Graphviz's DOT format", CMDLINE_OPTION_STR,   .str = &dump_cfg},
+        {"--dump-json", "-j", "[out.json]", "compute CFG and write IR, edges and analysis results to [out.json] as JSON lines", CMDLINE_OPTION_STR, .str = &dump_json},
+        {"--dump-bin",  "-I", "[out.ir]", "compute CFG and write IR, edges and stack states to [out.ir] in the mmap-able format of irfile.h", CMDLINE_OPTION_STR, .str = &dump_bin},
+        {"--cfg-max-blocks", "-B", "ulong", "given --dump-cfg, group the CFG into subgraph clusters of SCCs with at most ulong blocks each", CMDLINE_OPTION_ULONG, .ulong = &cfg_max_blocks},
+        {"--cfg-split", "-D", "[dir]", "compute CFG and write each --cfg-max-blocks partition (one per SCC by default) to a separate file in [dir], along with index.txt", CMDLINE_OPTION_STR, .str = &cfg_split},
+        {"--cfg-by-function", "-y", "", "given ELF [file] and --dump-cfg or --cfg-split, partition the CFG by containing function symbol instead of by SCC", CMDLINE_OPTION_BOOL, .b = &cfg_by_function},
+        {"--cfg-collapse", "-C", "ulong", "in CFG output, replace blocks with more than ulong instructions with summary nodes", CMDLINE_OPTION_ULONG, .ulong = &cfg_collapse},
         {"--analyze-max-stack",  "-m", "", "analyze maximum stack offset that is read/written for each lifted instruction, dumped along with CFG/IR", CMDLINE_OPTION_BOOL,   .b = &analyze_max_stack},
         {"--analyze-reg-src",  "-r", "hex:ulong:ulong", "find instructions that contribute to the value of given TCG register", CMDLINE_OPTION_REG_TUPLE,   .reg_tuple = &analyze_reg_src},
+        {"--dedup",     "-U", "", "lift byte-identical blocks once and reuse their IR rebased to each address", CMDLINE_OPTION_BOOL, .b = &dedup},
+        {"--pipeline",  "-e", "", "when building a CFG, translate blocks on a separate thread while edges are added on the main thread", CMDLINE_OPTION_BOOL, .b = &pipelined},
+        {"--window",    "-w", "ulong", "lift, analyze and output ulong bytes at a time, releasing each window before the next, edges between windows are written as external stubs", CMDLINE_OPTION_ULONG, .ulong = &window_size},
+        {"--passes",    "-P", "list", "run comma separated IR passes over the CFG: constprop,copyprop,dce,insn-dce, timings are printed with --debug", CMDLINE_OPTION_STR, .str = &passes},
+        {"--dump-callgraph", "-G", "[out.dot]", "given ELF [file], lift all functions and write their call graph to [out.dot], with --analyze-max-stack along with stack use through calls", CMDLINE_OPTION_STR, .str = &callgraph_dot},
+        {"--dump-callgraph-json", "-W", "[out.json]", "same as --dump-callgraph, written as JSON lines, see src/callgraph.h", CMDLINE_OPTION_STR, .str = &callgraph_json},
+        {"--incremental", "-n", "manifest", "given [file], analyze all ELF functions, reusing results of functions unchanged since the run that wrote manifest, and update it", CMDLINE_OPTION_STR, .str = &incremental},
+        {"--serve",     "-L", "socket", "given ELF [file], keep it and lifted CFGs loaded and answer requests on Unix domain socket, see src/server.h", CMDLINE_OPTION_STR, .str = &serve_path},
+        {"--query",     "-q", "socket", "send each line of stdin as a request to the --serve server at socket and print the responses", CMDLINE_OPTION_STR, .str = &query_path},
+        {"--fork-server", "-k", "",   "given --arch, open the lifters of a comma separated list of archs once and run each line of stdin as dump-ir arguments in a forked child", CMDLINE_OPTION_BOOL, .b = &fork_server_mode},
         {"--optimize",  "-p", "", "optimize lifted TCG", CMDLINE_OPTION_BOOL, .b = &optimize},
         {"--h2tcg",     "-t", "", "use auto-generated TCG variants of helpers (EXPERIMENTAL)", CMDLINE_OPTION_BOOL, .b = &h2tcg},
         {"--debug",     "-d", "", "Enable debug logging", CMDLINE_OPTION_BOOL, .b = &debug},
+        {"--stats",     "-T", "", "print time spent per phase and counters of lifted blocks, edges and analysis work to stderr at exit", CMDLINE_OPTION_BOOL, .b = &print_stats},
+        {"--stats-json", "-J", "", "same as --stats, formatted as JSON", CMDLINE_OPTION_BOOL, .b = &print_stats_json},
+        {"--mem-report", "-M", "text|json", "print arena usage per phase and allocation tag to stderr at exit", CMDLINE_OPTION_STR, .str = &mem_report_format},
     };
     if (!parse_options(pos_options, ARRLEN(pos_options),
                        named_options, ARRLEN(named_options),
@@ -108,19 +424,145 @@ int main(int argc, char **argv) {
         goto error;
     }
 
+    if (cfg_by_function && cfg_max_blocks > 0) {
+        fprintf(stderr, "[error]: --cfg-by-function and --cfg-max-blocks are mutually exclusive\n\n");
+        goto error;
+    }
+
+    if (window_size > 0 &&
+        (cfg_split != NULL || cfg_max_blocks > 0 || cfg_by_function ||
+         dump_bin != NULL || analyze_reg_src.present || dedup || pipelined ||
+         stream || incremental != NULL || serve_path != NULL)) {
+        fprintf(stderr, "[error]: --window only supports --dump-ir, --dump-cfg, --dump-json, --passes and --analyze-max-stack\n\n");
+        goto error;
+    }
+
+    if (print_stats || print_stats_json) {
+        stats_enable();
+    }
+
+    MemReportFormat report_format = MEM_REPORT_TEXT;
+    if (mem_report_format != NULL &&
+        !mem_report_format_from_str(mem_report_format, &report_format)) {
+        fprintf(stderr, "[error]: Invalid --mem-report format, expected text or json\n\n");
+        goto error;
+    }
+
+    PassPipeline pipeline = {0};
+    if (passes != NULL && !pass_pipeline_from_str(passes, &pipeline)) {
+        goto error;
+    }
+
+    if (fork_server_mode) {
+        if (is_fork_server_child) {
+            fprintf(stderr, "[error]: --fork-server can't be used in a request\n\n");
+            goto error;
+        }
+        if (arch_name == NULL) {
+            fprintf(stderr, "[error]: --fork-server requires --arch\n\n");
+            goto error;
+        }
+        return fork_server(arch_name);
+    }
+
+    Output out;
+    if (output_file != NULL) {
+        int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "[error]: Failed to open output file %s\n\n", output_file);
+            goto error;
+        }
+        output_fd = fd;
+    }
+    output_init(&out, &memory.persistent, output_fd, OUTPUT_BUFFER_SIZE);
+    // Cleared by failed writes, which make the exit status nonzero
+    bool ok = true;
+
+    if (query_path != NULL) {
+        ok = query(query_path, stdin, &out);
+        ok = output_flush(&out) && ok;
+        if (output_file != NULL) {
+            close(output_fd);
+        }
+        stack_free_all(&memory.persistent);
+        stack_free_all(&memory.temporary);
+        return (ok) ? 0 : -1;
+    }
+
+    profile_begin(&memory, PHASE_LOAD);
+    uint64_t load_begin = stats_begin();
+
     ElfData data = {0};
     ElfByteView view;
     ByteView data_view;
     LibTcgArch arch;
     if (file) {
-        if (size > 0) {
-            if (arch_name == NULL) {
-                fprintf(stderr, "[error]: Specify an architecture with --arch\n\n");
+        if (incremental != NULL) {
+            if (size > 0 || vaddr != ULONG_MAX || segments ||
+                function != NULL || section != NULL || dedup ||
+                dump_ir || dump_cfg != NULL || cfg_split != NULL ||
+                dump_json != NULL || dump_bin != NULL || passes != NULL ||
+                analyze_reg_src.present || serve_path != NULL ||
+                callgraph_dot != NULL || callgraph_json != NULL) {
+                fprintf(stderr, "[error]: --incremental only supports --analyze-max-stack\n\n");
                 goto error;
             }
-            arch = libtcg_arch_from_str(arch_name);
-            if (arch == LIBTCG_ARCH_NONE) {
-                fprintf(stderr, "[error]: Invalid architecture\n\n");
+            if (!elf_data(&memory.persistent, file, &data)) {
+                return -1;
+            }
+            arch = data.arch;
+            view = (ElfByteView) {0};
+        } else if (serve_path != NULL) {
+            if (size > 0 || vaddr != ULONG_MAX || segments ||
+                function != NULL || section != NULL || dedup ||
+                dump_ir || dump_cfg != NULL || cfg_split != NULL ||
+                dump_json != NULL || dump_bin != NULL || passes != NULL ||
+                analyze_reg_src.present || analyze_max_stack ||
+                callgraph_dot != NULL || callgraph_json != NULL) {
+                fprintf(stderr, "[error]: --serve takes targets and analyses per request\n\n");
+                goto error;
+            }
+            if (!elf_data(&memory.persistent, file, &data)) {
+                return -1;
+            }
+            arch = data.arch;
+            view = (ElfByteView) {0};
+        } else if (callgraph_dot != NULL || callgraph_json != NULL) {
+            if (size > 0 || vaddr != ULONG_MAX || segments ||
+                function != NULL || section != NULL || dedup ||
+                dump_ir || dump_cfg != NULL || cfg_split != NULL ||
+                dump_json != NULL || dump_bin != NULL || passes != NULL ||
+                analyze_reg_src.present || window_size > 0) {
+                fprintf(stderr, "[error]: --dump-callgraph covers all functions and only supports --analyze-max-stack\n\n");
+                goto error;
+            }
+            if (!elf_data(&memory.persistent, file, &data)) {
+                return -1;
+            }
+            arch = data.arch;
+            view = (ElfByteView) {0};
+        } else if (vaddr != ULONG_MAX) {
+            if (!elf_data(&memory.persistent, file, &data)) {
+                return -1;
+            }
+            arch = data.arch;
+            // Thumb addresses have the lowest bit set
+            uint64_t address = vaddr;
+            if (arch == LIBTCG_ARCH_ARM) {
+                address &= ~((uint64_t) 1);
+            }
+            if (!elf_address_range(&data, address, size, &view)) {
+                return -1;
+            }
+            view.address = vaddr;
+        } else if (segments) {
+            if (!elf_data(&memory.persistent, file, &data)) {
+                return -1;
+            }
+            arch = data.arch;
+            view = (ElfByteView) {0};
+        } else if (size > 0) {
+            if (!parse_arch(arch_name, &arch)) {
                 goto error;
             }
             data_view = read_bytes_from_file(&memory.persistent,
@@ -148,37 +590,103 @@ int main(int argc, char **argv) {
                 return -1;
             }
         } else {
-            fprintf(stderr, "[error]: Please specify either --offset/--length, --function, --section\n\n");
+            fprintf(stderr, "[error]: Please specify either --offset/--length, --address, --segments, --function, --section\n\n");
             goto error;
         }
     } else if (bytes) {
-        if (arch_name == NULL) {
-            fprintf(stderr, "[error]: Specify an architecture with --arch\n\n");
-            goto error;
-        }
-        arch = libtcg_arch_from_str(arch_name);
-        if (arch == LIBTCG_ARCH_NONE) {
-            fprintf(stderr, "[error]: Invalid architecture\n\n");
-            goto error;
-        }
-        data_view = read_bytes_from_stdin(&memory.persistent);
-        if (data_view.data == NULL) {
-            fprintf(stderr, "[error]: Failed to read data from stdin\n\n");
+        if (!parse_arch(arch_name, &arch)) {
             goto error;
         }
         view.address = 0;
-        view.data = data_view.data;
-        view.size = data_view.size;
+        if (stream) {
+            if (!dump_ir || dump_cfg != NULL || cfg_split != NULL || dump_json != NULL || dump_bin != NULL || passes != NULL) {
+                fprintf(stderr, "[error]: --stream only supports --dump-ir\n\n");
+                goto error;
+            }
+            if (arch == LIBTCG_ARCH_NONE) {
+                fprintf(stderr, "[error]: --arch auto needs all of stdin and can't be used with --stream\n\n");
+                goto error;
+            }
+            view.data = NULL;
+            view.size = 0;
+        } else {
+            data_view = read_bytes_from_stdin(&memory.persistent);
+            if (data_view.data == NULL) {
+                fprintf(stderr, "[error]: Failed to read data from stdin\n\n");
+                goto error;
+            }
+            view.data = data_view.data;
+            view.size = data_view.size;
+        }
     } else {
         fprintf(stderr, "[error]: Please specify either [file] or --bytes\n\n");
         goto error;
     }
 
-    LibTcgInterface libtcg;
-    LibTcgContext *context;
-    libtcg_open(arch, &(LibTcgDesc){
-        .mem_alloc = libtcg_alloc,
-    }, &libtcg, &context);
+    if (arch == LIBTCG_ARCH_NONE) {
+        uint64_t t = stats_begin();
+        ArchScore scores[ARCH_DETECT_MAX_CANDIDATES];
+        size_t count = arch_detect(&lifters, &memory.persistent,
+                                   view.data, view.size, view.address,
+                                   0, scores);
+        stats_end(STATS_TIMER_ARCH_DETECT, t);
+        if (count == 0) {
+            fprintf(stderr, "[error]: No lifter translated the input\n");
+            stack_free_all(&memory.persistent);
+            stack_free_all(&memory.temporary);
+            return -1;
+        }
+        if (debug) {
+            fprintf(stderr, "%-14s%10s%10s%10s%10s\n", "arch", "score",
+                    "decoded", "starts", "flow");
+            for (size_t i = 0; i < count; ++i) {
+                const ArchScore *s = &scores[i];
+                char name[32];
+                snprintf(name, sizeof(name), "%s%s", arch_to_str(s->arch),
+                         (s->flags & LIBTCG_TRANSLATE_ARM_THUMB) ? " (thumb)" : "");
+                fprintf(stderr, "%-14s%10.3f%10.3f%10.3f%10.3f\n", name,
+                        s->score, s->decoded, s->valid_starts, s->flow);
+            }
+        }
+        fprintf(stderr, "Detected architecture %s%s, score %.3f\n",
+                arch_to_str(scores[0].arch),
+                (scores[0].flags & LIBTCG_TRANSLATE_ARM_THUMB) ? " (thumb)" : "",
+                scores[0].score);
+        arch = scores[0].arch;
+        // Picked up below like the lowest bit of a Thumb address
+        if (scores[0].flags & LIBTCG_TRANSLATE_ARM_THUMB) {
+            view.address |= 1;
+        }
+    }
+
+    // Names direct jump targets in the output, and lets the analyses
+    // summarize calls to known functions
+    ElfSymbolTable symbols = {0};
+    if (data.buffer != NULL) {
+        elf_symbol_table(&memory.persistent, &data, &symbols);
+    }
+    // Picks ARM or Thumb per block in ARM ELF files
+    ElfModeMap mode_map = {0};
+    if (data.buffer != NULL) {
+        elf_mode_map(&memory.persistent, &data, &mode_map);
+    }
+    const ElfModeMap *modes = (mode_map.count > 0) ? &mode_map : NULL;
+    if ((callgraph_dot != NULL || callgraph_json != NULL) && symbols.count == 0) {
+        fprintf(stderr, "[error]: --dump-callgraph requires an ELF file with function symbols\n");
+        return -1;
+    }
+    if (cfg_by_function && symbols.count == 0) {
+        fprintf(stderr, "[error]: --cfg-by-function requires an ELF file with function symbols\n");
+        return -1;
+    }
+
+    stats_end(STATS_TIMER_ELF_LOAD, load_begin);
+    profile_end(&memory);
+
+    profile_begin(&memory, PHASE_LIFT);
+    Lifter *lifter = lifter_pool_get(&lifters, arch);
+    LibTcgInterface libtcg = lifter->libtcg;
+    LibTcgContext *context = lifter->context;
 
     uint32_t flags = 0;
     if (optimize) {
@@ -192,139 +700,211 @@ int main(int argc, char **argv) {
         view.address &= ~((uint64_t) 1);
     }
 
-    TbNode *root = NULL;
-    TbNode *top = NULL;
-    size_t off = 0;
-    while (off < view.size) {
-        uint64_t address = view.address + off;
-        LibTcgTranslationBlock tb = libtcg.translate_block(context,
-                                                           view.data + off,
-                                                           view.size - off,
-                                                           address,
-                                                           flags);
-        off += tb.size_in_bytes;
-        if (tb.instruction_count == 0) {
-            continue;
+    DedupCache *dedup_cache = NULL;
+    if (incremental != NULL) {
+        IncrementalStats stats;
+        ok = incremental_run(&libtcg, context, &memory, &data, flags,
+                             analyze_max_stack, incremental, &stats);
+        profile_end(&memory);
+        if (!ok) {
+            lifter_pool_close(&lifters);
+            stack_free_all(&memory.persistent);
+            stack_free_all(&memory.temporary);
+            return -1;
+        }
+        if (debug) {
+            printf("Incremental: %lu functions, %lu changed, %lu callers re-analyzed, %lu reused, %lu removed\n",
+                   stats.num_functions, stats.num_changed, stats.num_callers,
+                   stats.num_reused, stats.num_removed);
         }
+        goto done;
+    }
 
-        TbNode *n = stack_alloc(&memory.persistent, sizeof(TbNode));
-        *n = (TbNode) {
-            .address = address,
-            .tb = tb,
-        };
+    if (serve_path != NULL) {
+        ok = serve(&libtcg, context, &memory, &data, &symbols, modes,
+                   flags, serve_path);
+        profile_end(&memory);
+        if (!ok) {
+            lifter_pool_close(&lifters);
+            stack_free_all(&memory.persistent);
+            stack_free_all(&memory.temporary);
+            return -1;
+        }
+        goto done;
+    }
 
-        if (root == NULL) {
-            root = n;
-            top = n;
-        } else {
-            top->next = n;
-            top = n;
+    if (callgraph_dot != NULL || callgraph_json != NULL) {
+        ok = dump_callgraph(&libtcg, context, &memory, &data, &symbols,
+                            modes, flags, analyze_max_stack,
+                            callgraph_dot, callgraph_json);
+        profile_end(&memory);
+        if (!ok) {
+            lifter_pool_close(&lifters);
+            stack_free_all(&memory.persistent);
+            stack_free_all(&memory.temporary);
+            return -1;
         }
+        goto done;
     }
 
-    if (dump_cfg != NULL) {
-        LibTcgArchInfo arch_info = libtcg.get_arch_info();
-        size_t num_indirect_jumps = 0;
-        size_t num_jumps = 0;
-        uint64_t jumps[16] = {0};
-        for (TbNode *n = root; n != NULL; n = n->next) {
-            num_indirect_jumps = 0;
-            num_jumps = 0;
-
-            for (size_t i = 0; i < n->tb.instruction_count; ++i) {
-                LibTcgInstruction *inst = &n->tb.list[i];
-
-                bool is_direct;
-                uint64_t address;
-                if (is_pc_write(arch_info, inst, &is_direct, &address)) {
-                    if (is_direct) {
-                        jumps[num_jumps++] = address;
-                    } else {
-                        ++num_indirect_jumps;
-                    }
-                } else if (inst->opcode == LIBTCG_op_exit_tb) {
-                    ++n->num_exits;
+    bool build_cfg = dump_cfg != NULL || cfg_split != NULL || dump_json != NULL ||
+                     dump_bin != NULL || passes != NULL;
+    // The --pipeline translation thread allocates blocks from an arena of
+    // its own until they are handed over, see cfg_pipeline()
+    bool use_pipeline = pipelined && build_cfg;
+    StackAllocator lift_stack = {0};
+
+    if (dedup) {
+        dedup_cache = dedup_create((use_pipeline) ? &lift_stack : &memory.persistent,
+                                   arch, flags);
+    }
+
+    if (bytes && stream) {
+        ok = stream_dump_ir(&libtcg, context, &out, view.address, flags);
+        ok = output_flush(&out) && ok;
+        profile_end(&memory);
+        if (!ok) {
+            lifter_pool_close(&lifters);
+            stack_free_all(&memory.persistent);
+            stack_free_all(&memory.temporary);
+            return -1;
+        }
+        goto done;
+    }
+
+    // --pipeline and --window lift the executable segments or the view
+    CfgRange *ranges = NULL;
+    size_t num_ranges = 0;
+    if (use_pipeline || window_size > 0) {
+        ranges = stack_alloc(&memory.persistent,
+                             MAX(data.num_segments, 1)*sizeof(CfgRange));
+        if (segments) {
+            for (size_t i = 0; i < data.num_segments; ++i) {
+                ElfSegment *seg = &data.segments[i];
+                if (seg->executable) {
+                    ranges[num_ranges++] = (CfgRange) {
+                        data.buffer + seg->offset, seg->file_size, seg->address,
+                    };
                 }
             }
+        } else {
+            ranges[num_ranges++] = (CfgRange) {view.data, view.size, view.address};
+        }
+    }
 
-            if (n->num_exits > 0) {
-                for (size_t i = 0; i < num_jumps; ++i) {
-                    uint64_t address = jumps[i];
-                    TbNode *succ = find_tb_containing(root, address);
-                    if (succ == NULL) {
-                        continue;
-                    }
-                    if (address == succ->address) {
-                        add_edge(n, succ, 0, DIRECT);
-                    } else {
-                        int j = find_instruction_from_address(succ, address);
-                        if (j == -1) {
-                            continue;
-                        }
-
-                        size_t total_size = succ->tb.size_in_bytes;
-                        size_t instruction_count = succ->tb.instruction_count;
-                        TbNode *new_node = stack_alloc(&memory.persistent,
-                                                       sizeof(TbNode));
-                        *new_node = *succ;
-
-                        succ->tb.instruction_count = j;
-                        succ->tb.size_in_bytes = address - succ->address;
-                        succ->next = new_node;
-
-                        new_node->address = address;
-                        new_node->tb.instruction_count = instruction_count - j;
-                        new_node->tb.list += j;
-                        new_node->tb.size_in_bytes = total_size - (address - succ->address);
-
-                        for (size_t i = 0; i < succ->num_succ;) {
-                            if (succ->succ[i].src_instruction >= succ->tb.instruction_count) {
-
-                                succ->succ[i] = succ->succ[succ->num_succ-1];
-                                --succ->num_succ;
-
-                            } else {
-
-                                ++i;
-                            }
-                        }
-
-                        succ->num_succ = 0;
-                        new_node->num_pred = 0;
-
-                        for (size_t i = 0; i < new_node->num_succ; ++i) {
-                            new_node->succ[i].src_instruction -= succ->tb.instruction_count;
-                        }
-                        for (size_t i = 0; i < new_node->num_succ; ++i) {
-                            TbNode *n = new_node->succ[i].dst_node;
-                            for (size_t j = 0; j < n->num_pred; ++j) {
-                                if (n->pred[j].dst_node == succ) {
-                                    n->pred[j].dst_node = new_node;
-                                }
-                            }
-                        }
-
-                        add_edge(succ, new_node, j-1, FALLTHROUGH);
-                        if (n->address != succ->address) {
-                            add_edge(n,    new_node, 0, DIRECT);
-                        }
-                    }
+    if (window_size > 0) {
+        profile_end(&memory);
+        Output dot_out;
+        Output json_out;
+        WindowSettings settings = {
+            .max_size = window_size,
+            .symbols = &symbols,
+            .modes = modes,
+            .flags = flags,
+            .build_cfg = build_cfg || analyze_max_stack,
+            .passes = (passes != NULL) ? &pipeline : NULL,
+            .pass_report = debug ? stderr : NULL,
+            .analyze_max_stack = analyze_max_stack,
+            .ir_out = (dump_ir) ? &out : NULL,
+            .graphviz = {
+                .nodesep = 1.0f,
+                .ranksep = 1.0f,
+                .dashed_fallthrough_edges = false,
+                .compact_args = true,
+                .collapse_threshold = cfg_collapse,
+                .symbols = &symbols,
+            },
+        };
+        if (dump_cfg != NULL) {
+            int fd = open(dump_cfg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "[error]: Failed to open %s\n", dump_cfg);
+                ok = false;
+                goto done;
+            }
+            output_init(&dot_out, &memory.persistent, fd, OUTPUT_BUFFER_SIZE);
+            settings.dot_out = &dot_out;
+        }
+        if (dump_json != NULL) {
+            int fd = open(dump_json, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "[error]: Failed to open %s\n", dump_json);
+                if (settings.dot_out != NULL) {
+                    close(dot_out.fd);
                 }
+                ok = false;
+                goto done;
             }
+            output_init(&json_out, &memory.persistent, fd, OUTPUT_BUFFER_SIZE);
+            settings.json_out = &json_out;
+        }
+
+        window_run(&libtcg, context, &memory, ranges, num_ranges, &settings);
+
+        ok = output_flush(&out) && ok;
+        if (settings.dot_out != NULL) {
+            ok = output_flush(&dot_out) && ok;
+            close(dot_out.fd);
+        }
+        if (settings.json_out != NULL) {
+            ok = output_flush(&json_out) && ok;
+            close(json_out.fd);
+        }
+        goto done;
+    }
 
-            if (n->next && (n->num_exits == 0 || (num_jumps + num_indirect_jumps) < n->num_exits)) {
-                add_edge(n, n->next, n->tb.instruction_count-1, FALLTHROUGH);
+    TbNode *root = NULL;
+    if (use_pipeline) {
+        root = cfg_pipeline(&libtcg, context, dedup_cache, &lift_stack,
+                            &memory.persistent, ranges, num_ranges, flags, modes);
+    } else if (segments) {
+        // Blocks of all segments are chained into a single list
+        TbNode **tail = &root;
+        for (size_t i = 0; i < data.num_segments; ++i) {
+            ElfSegment *seg = &data.segments[i];
+            if (!seg->executable) {
+                continue;
+            }
+            *tail = cfg_lift(&libtcg, context, dedup_cache, &memory.persistent,
+                             data.buffer + seg->offset, seg->file_size,
+                             seg->address, flags, modes);
+            while (*tail != NULL) {
+                tail = &(*tail)->next;
             }
         }
+    } else {
+        root = cfg_lift(&libtcg, context, dedup_cache, &memory.persistent,
+                        view.data, view.size, view.address, flags, modes);
+    }
+
+    profile_end(&memory);
+
+    if (build_cfg) {
+        profile_begin(&memory, PHASE_CFG);
+        LibTcgArchInfo arch_info = libtcg.get_arch_info();
+        if (!use_pipeline) {
+            cfg_build(&libtcg, &memory.persistent, root);
+        }
+        profile_end(&memory);
+
+        if (passes != NULL) {
+            profile_begin(&memory, PHASE_PASSES);
+            uint64_t t = stats_begin();
+            run_passes(&libtcg, &memory, root, &pipeline, debug ? stderr : NULL);
+            stats_end(STATS_TIMER_PASSES, t);
+            profile_end(&memory);
+        }
 
         TbNode *reg_src_node = NULL;
         int reg_src_index = 0;
         if (analyze_reg_src.present) {
+            profile_begin(&memory, PHASE_REG_SRC);
             uint64_t address = analyze_reg_src.src_instruction_address;
             reg_src_node = find_tb_containing(root, address);
             reg_src_index = find_instruction_from_address(reg_src_node, address);
             if (reg_src_index == -1) {
-                return -1;
+                ok = false;
+                goto done;
             }
             reg_src_index += analyze_reg_src.tcg_instruction_offset;
             SrcInfo *info = find_sources(arch_info,
@@ -333,32 +913,134 @@ int main(int argc, char **argv) {
                                          reg_src_index,
                                          analyze_reg_src.operand_index);
             flatten_sources(&memory.temporary, info);
+            profile_end(&memory);
         }
 
         if (analyze_max_stack) {
+            profile_begin(&memory, PHASE_MAX_STACK);
             bool stack_grows_down = true;
             compute_max_stack_size(&libtcg, &memory,
-                                   root, stack_grows_down);
-        }
-
-        FILE *fd = fopen(dump_cfg, "w");
-        graphviz_output(&libtcg, &memory.persistent,
-                        (GraphvizSettings) {
-                            .nodesep = 1.0f,
-                            .ranksep = 1.0f,
-                            .dashed_fallthrough_edges = false,
-                            .compact_args = true,
-                        },
-                        fd, root, analyze_max_stack, analyze_reg_src, reg_src_node, reg_src_index);
-        fclose(fd);
+                                   root, &symbols, stack_grows_down);
+            profile_end(&memory);
+        }
+
+        profile_begin(&memory, PHASE_OUTPUT);
+        uint64_t output_begin = stats_begin();
+        if (dump_ir && passes != NULL) {
+            for (TbNode *n = root; n != NULL; n = n->next) {
+                output_tb_ir(&out, &libtcg, &n->tb);
+            }
+            ok = output_flush(&out) && ok;
+        }
+        if (dump_cfg != NULL || cfg_split != NULL) {
+            GraphvizSettings settings = {
+                .nodesep = 1.0f,
+                .ranksep = 1.0f,
+                .dashed_fallthrough_edges = false,
+                .compact_args = true,
+                .collapse_threshold = cfg_collapse,
+                .symbols = &symbols,
+            };
+            bool partitioned = cfg_split != NULL || cfg_max_blocks > 0 || cfg_by_function;
+            CfgPartition partition;
+            if (partitioned) {
+                size_t num_nodes = number_nodes(root);
+                if (cfg_by_function) {
+                    partition = cfg_partition_functions(&memory.temporary, root,
+                                                        num_nodes, &symbols);
+                } else {
+                    // Without --cfg-max-blocks SCCs are not packed
+                    // together, each gets a partition of its own
+                    size_t max_blocks = (cfg_max_blocks > 0) ? cfg_max_blocks : 1;
+                    partition = cfg_partition_scc(&memory.temporary, root,
+                                                  num_nodes, max_blocks);
+                }
+            }
+            if (dump_cfg != NULL) {
+                int fd = open(dump_cfg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1) {
+                    fprintf(stderr, "[error]: Failed to open %s\n", dump_cfg);
+                    ok = false;
+                    goto done;
+                }
+                Output dot_out;
+                output_init(&dot_out, &memory.persistent, fd, OUTPUT_BUFFER_SIZE);
+                if (partitioned) {
+                    ok = graphviz_output_partitioned(&libtcg, &memory.persistent, settings,
+                                                     &dot_out, NULL, &partition,
+                                                     analyze_max_stack, analyze_reg_src,
+                                                     reg_src_node, reg_src_index) && ok;
+                } else {
+                    graphviz_output(&libtcg, &memory.persistent, settings,
+                                    &dot_out, root, analyze_max_stack, analyze_reg_src, reg_src_node, reg_src_index);
+                    ok = output_flush(&dot_out) && ok;
+                }
+                close(fd);
+            }
+            if (cfg_split != NULL) {
+                // Opens a file per partition itself
+                Output split_out;
+                output_init(&split_out, &memory.persistent, -1, OUTPUT_BUFFER_SIZE);
+                ok = graphviz_output_partitioned(&libtcg, &memory.persistent, settings,
+                                                 &split_out, cfg_split, &partition,
+                                                 analyze_max_stack, analyze_reg_src,
+                                                 reg_src_node, reg_src_index) && ok;
+            }
+        }
+
+        if (dump_json != NULL) {
+            int fd = open(dump_json, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "[error]: Failed to open %s\n", dump_json);
+                ok = false;
+                goto done;
+            }
+            Output json_out;
+            output_init(&json_out, &memory.persistent, fd, OUTPUT_BUFFER_SIZE);
+            json_export(&libtcg, &json_out, root,
+                        analyze_max_stack, analyze_reg_src.present);
+            ok = output_flush(&json_out) && ok;
+            close(fd);
+        }
+
+        if (dump_bin != NULL) {
+            int fd = open(dump_bin, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "[error]: Failed to open %s\n", dump_bin);
+                ok = false;
+                goto done;
+            }
+            Output bin_out;
+            output_init(&bin_out, &memory.persistent, fd, OUTPUT_BUFFER_SIZE);
+            StackMarker marker = stack_marker(&memory.temporary);
+            irfile_write(&libtcg, &memory.temporary, &bin_out, arch, root,
+                         analyze_max_stack);
+            stack_reset_to_marker(&memory.temporary, marker);
+            ok = output_flush(&bin_out) && ok;
+            close(fd);
+        }
+        stats_end(STATS_TIMER_OUTPUT, output_begin);
+        profile_end(&memory);
     } else if (dump_ir) {
-        char buf[128] = {0};
+        profile_begin(&memory, PHASE_OUTPUT);
+        uint64_t t = stats_begin();
         for (TbNode *n = root; n != NULL; n = n->next) {
-            for (size_t i = 0; i < n->tb.instruction_count; ++i) {
-                libtcg.dump_instruction_to_buffer(&n->tb.list[i], buf, ARRLEN(buf));
-                puts(buf);
-            }
+            output_tb_ir(&out, &libtcg, &n->tb);
         }
+        ok = output_flush(&out) && ok;
+        stats_end(STATS_TIMER_OUTPUT, t);
+        profile_end(&memory);
+    }
+
+done:
+    if (output_file != NULL) {
+        close(output_fd);
+    }
+
+    if (debug && dedup_cache != NULL) {
+        DedupStats stats = dedup_stats(dedup_cache);
+        printf("Dedup: %lu blocks lifted, %lu reused, %lu rejected\n",
+               stats.num_lifted, stats.num_reused, stats.num_rejected);
     }
 
     if (debug) {
@@ -370,10 +1052,21 @@ int main(int argc, char **argv) {
         printf("  temporary memory %lu/%lu kiB in %lu blocks\n", size.total_used/1024, size.total_size/1024, size.num_blocks);
     }
 
-    libtcg_close(arch);
+    if (print_stats) {
+        stats_report(stderr, STATS_TEXT);
+    }
+    if (print_stats_json) {
+        stats_report(stderr, STATS_JSON);
+    }
+
+    if (mem_report_format != NULL) {
+        mem_report(stderr, &memory, report_format);
+    }
+
+    lifter_pool_close(&lifters);
     stack_free_all(&memory.persistent);
     stack_free_all(&memory.temporary);
-    return 0;
+    return (ok) ? 0 : -1;
 
 error:
     print_help(stderr,
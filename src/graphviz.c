@@ -3,9 +3,22 @@
 #include "analyze-reg-src.h"
 #include "analyze-max-stack.h"
 #include "color.h"
+#include "output.h"
+#include "cfg-partition.h"
+#include "loadelf.h"
 #include <qemu/libtcg/libtcg.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Length of a "#rrggbbaa" color string
+#define COLOR_STR_LEN 9
+
+// Size of the buffers handed to libtcg's dump functions
+#define DUMP_BUFFER_SIZE 256
 
 typedef enum ColorName {
     COLOR_INSTRUCTION = 0,
@@ -14,338 +27,690 @@ typedef enum ColorName {
     COLOR_COMMENT,
     COLOR_BASE,
     COLOR_BORDER,
+    NUM_COLORS,
 } ColorName;
 
 typedef struct ColorData {
     ColorHSL hsl;
     float alpha;
-    const char *str;
+    char str[COLOR_STR_LEN+1];
 } ColorData;
 
 static ColorData colors_default[] = {
-    [COLOR_INSTRUCTION] = {{0.0f,   0.5f,  0.45f}, 1.0f, NULL},
-    [COLOR_REGISTER]    = {{183.0f, 0.55f, 0.40f}, 1.0f, NULL},
-    [COLOR_CONSTANT]    = {{28.0f,  0.50f, 0.45f}, 1.0f, NULL},
-    [COLOR_COMMENT]     = {{120.0f, 0.50f, 0.35f}, 1.0f, NULL},
-    [COLOR_BASE]        = {{183.0f, 0.55f, 0.20f}, 1.0f, NULL},
-    [COLOR_BORDER]      = {{183.0f, 0.55f, 0.20f}, 1.0f, NULL},
+    [COLOR_INSTRUCTION] = {{0.0f,   0.5f,  0.45f}, 1.0f, ""},
+    [COLOR_REGISTER]    = {{183.0f, 0.55f, 0.40f}, 1.0f, ""},
+    [COLOR_CONSTANT]    = {{28.0f,  0.50f, 0.45f}, 1.0f, ""},
+    [COLOR_COMMENT]     = {{120.0f, 0.50f, 0.35f}, 1.0f, ""},
+    [COLOR_BASE]        = {{183.0f, 0.55f, 0.20f}, 1.0f, ""},
+    [COLOR_BORDER]      = {{183.0f, 0.55f, 0.20f}, 1.0f, ""},
 };
 
 static ColorData colors_dim[] = {
-    [COLOR_INSTRUCTION] = {{0.0f,   0.5f,  0.7f*0.45f}, 0.25f, NULL},
-    [COLOR_REGISTER]    = {{183.0f, 0.55f, 0.7f*0.40f}, 0.25f, NULL},
-    [COLOR_CONSTANT]    = {{28.0f,  0.50f, 0.7f*0.45f}, 0.25f, NULL},
-    [COLOR_COMMENT]     = {{120.0f, 0.50f, 0.7f*0.35f}, 0.25f, NULL},
-    [COLOR_BASE]        = {{183.0f, 0.55f, 0.7f*0.20f}, 0.25f, NULL},
-    [COLOR_BORDER]      = {{183.0f, 0.55f, 0.20f},      0.25f, NULL},
+    [COLOR_INSTRUCTION] = {{0.0f,   0.5f,  0.7f*0.45f}, 0.25f, ""},
+    [COLOR_REGISTER]    = {{183.0f, 0.55f, 0.7f*0.40f}, 0.25f, ""},
+    [COLOR_CONSTANT]    = {{28.0f,  0.50f, 0.7f*0.45f}, 0.25f, ""},
+    [COLOR_COMMENT]     = {{120.0f, 0.50f, 0.7f*0.35f}, 0.25f, ""},
+    [COLOR_BASE]        = {{183.0f, 0.55f, 0.7f*0.20f}, 0.25f, ""},
+    [COLOR_BORDER]      = {{183.0f, 0.55f, 0.20f},      0.25f, ""},
 };
 
+// Register highlight colors only depend on the temp index, cache
+// the formatted strings per index.
+typedef struct HighlightColor {
+    bool valid;
+    char bg[COLOR_STR_LEN+1];
+    char fg[COLOR_STR_LEN+1];
+} HighlightColor;
+
+typedef struct HighlightCache {
+    HighlightColor *colors;
+    size_t len;
+} HighlightCache;
+
 static inline float reg_src_hue(uint32_t index) {
     return fmodf(index * 360.0f/7.123f, 360.0f);
 }
 
-static const char *hsl_to_str(StackAllocator *stack,
-                              ColorHSL hsl,
-                              float alpha) {
+static void hsl_to_str(char *buf, ColorHSL hsl, float alpha) {
+    static const char digits[] = "0123456789abcdef";
     ColorRGB rgb = hsl_to_rgb(hsl);
-    char *buf = stack_alloc(stack, 10*sizeof(char));
     uint8_t a = 255.0f*alpha;
-    snprintf(buf, 10, "#%02x%02x%02x%02x", rgb.r, rgb.g, rgb.b, a);
-    return buf;
+    uint8_t bytes[] = {rgb.r, rgb.g, rgb.b, a};
+    buf[0] = '#';
+    for (size_t i = 0; i < ARRLEN(bytes); ++i) {
+        buf[1 + 2*i] = digits[bytes[i] >> 4];
+        buf[2 + 2*i] = digits[bytes[i] & 0xf];
+    }
+    buf[COLOR_STR_LEN] = 0;
+}
+
+static void palette_init(void) {
+    if (colors_default[0].str[0] != 0) {
+        return;
+    }
+    for (size_t i = 0; i < NUM_COLORS; ++i) {
+        hsl_to_str(colors_default[i].str, colors_default[i].hsl, colors_default[i].alpha);
+        hsl_to_str(colors_dim[i].str, colors_dim[i].hsl, colors_dim[i].alpha);
+    }
 }
 
-static const char *color_str(StackAllocator *stack,
-                             ColorData *colors,
-                             ColorName name) {
-    if (colors[name].str == NULL) {
-        colors[name].str = hsl_to_str(stack, colors[name].hsl, colors[name].alpha);
+static HighlightColor *highlight_color(StackAllocator *stack,
+                                       HighlightCache *cache,
+                                       uint32_t index) {
+    if (unlikely(index >= cache->len)) {
+        size_t len = MAX(2*cache->len, MAX(64, (size_t) index + 1));
+        HighlightColor *colors = stack_alloc_zero_tagged(stack, len*sizeof(HighlightColor), MEM_TAG_DOT_COLOR);
+        if (cache->len > 0) {
+            memcpy(colors, cache->colors, cache->len*sizeof(HighlightColor));
+        }
+        cache->colors = colors;
+        cache->len = len;
     }
-    return colors[name].str;
+    HighlightColor *color = &cache->colors[index];
+    if (!color->valid) {
+        float hue = reg_src_hue(index);
+        hsl_to_str(color->bg, (ColorHSL){.h = hue, .s = 0.5f, .l = 0.9f}, 1.0f);
+        hsl_to_str(color->fg, (ColorHSL){.h = hue, .s = 0.7f, .l = 0.5f}, 1.0f);
+        color->valid = true;
+    }
+    return color;
+}
+
+static inline void output_color(Output *out, const char *color) {
+    output_write(out, color, COLOR_STR_LEN);
+}
+
+static inline void output_dumped(Output *out, char *buf, size_t size) {
+    const char *nul = memchr(buf, 0, size);
+    output_commit(out, (nul != NULL) ? (size_t) (nul - buf) : size - 1);
 }
 
-static void font_begin(FILE *fd, bool bold, const char *str_col) {
-    fprintf(fd, "<font color=\"%s\">", str_col);
+// Symbol names may contain C++ template brackets
+static void output_html_escaped(Output *out, const char *str) {
+    for (; *str != 0; ++str) {
+        switch (*str) {
+        case '<': OUTPUT_LIT(out, "&lt;");  break;
+        case '>': OUTPUT_LIT(out, "&gt;");  break;
+        case '&': OUTPUT_LIT(out, "&amp;"); break;
+        case '"': OUTPUT_LIT(out, "&quot;"); break;
+        default:  output_char(out, *str);  break;
+        }
+    }
+}
+
+void output_quoted_escaped(Output *out, const char *str) {
+    for (; *str != 0; ++str) {
+        if (*str == '"' || *str == '\\') {
+            output_char(out, '\\');
+        }
+        output_char(out, *str);
+    }
+}
+
+static void font_begin(Output *out, bool bold, const char *str_col) {
+    OUTPUT_LIT(out, "<font color=\"");
+    output_color(out, str_col);
+    OUTPUT_LIT(out, "\">");
     if (bold) {
-        fputs("<b>", fd);
+        OUTPUT_LIT(out, "<b>");
     }
 }
 
-static void font_end(FILE *fd, bool bold) {
+static void font_end(Output *out, bool bold) {
     if (bold) {
-        fputs("</b>", fd);
+        OUTPUT_LIT(out, "</b>");
     }
-    fputs("</font>", fd);
+    OUTPUT_LIT(out, "</font>");
 }
 
-void graphviz_output(LibTcgInterface *libtcg, StackAllocator *stack,
-                     GraphvizSettings settings,
-                     FILE *fd, TbNode *root, bool analyze_max_stack,
-                     CmdLineRegTuple analyze_reg_src, TbNode *reg_src_node,
-                     int reg_src_index) {
-    assert(fd != NULL);
+static inline ColorName temp_color_name(LibTcgTempKind kind) {
+    switch (kind) {
+    case LIBTCG_TEMP_CONST:
+        return COLOR_CONSTANT;
+    case LIBTCG_TEMP_GLOBAL:
+        return COLOR_REGISTER;
+    default:
+        return COLOR_BASE;
+    }
+}
+
+typedef struct DotContext {
+    LibTcgInterface *libtcg;
+    LibTcgArchInfo arch_info;
+    StackAllocator *stack;
+    GraphvizSettings settings;
+    Output *out;
+    bool analyze_max_stack;
+    CmdLineRegTuple analyze_reg_src;
+    TbNode *reg_src_node;
+    int reg_src_index;
+    HighlightCache highlight_cache;
+} DotContext;
+
+static void emit_header(DotContext *ctx) {
+    Output *out = ctx->out;
+    palette_init();
+    OUTPUT_LIT(out, "digraph {\n");
+    {
+        char *buf = output_reserve(out, 128);
+        int len = snprintf(buf, 128, "nodesep = %f\nranksep = %f\n", ctx->settings.nodesep, ctx->settings.ranksep);
+        output_commit(out, MIN(len, 127));
+    }
+    OUTPUT_LIT(out, "graph [fontname = \"inconsolata\"];\n");
+    OUTPUT_LIT(out, "node [fontname = \"inconsolata\" pencolor=\"");
+    output_color(out, colors_default[COLOR_BORDER].str);
+    OUTPUT_LIT(out, "\"];\n");
+    OUTPUT_LIT(out, "edge [fontname = \"inconsolata\", penwidth=2, color=\"");
+    output_color(out, colors_default[COLOR_BORDER].str);
+    OUTPUT_LIT(out, "\"];\n");
+}
+
+// Blocks above GraphvizSettings::collapse_threshold instructions are
+// replaced by a single line summary to keep layout time down.
+static void emit_summary_node(DotContext *ctx, TbNode *n) {
+    Output *out = ctx->out;
+    OUTPUT_LIT(out, "\"");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, "\" [shape = \"box\", style = \"dashed\", label=<");
+    font_begin(out, false, colors_default[COLOR_COMMENT].str);
+    OUTPUT_LIT(out, "0x");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, ": ");
+    output_u64(out, n->tb.instruction_count);
+    OUTPUT_LIT(out, " ops, ");
+    output_u64(out, n->tb.size_in_bytes);
+    OUTPUT_LIT(out, " bytes");
+    font_end(out, false);
+    OUTPUT_LIT(out, ">];\n");
+}
+
+static void emit_edge(DotContext *ctx, TbNode *n, Edge *edge) {
+    Output *out = ctx->out;
+    OUTPUT_LIT(out, "\"");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, "\":s -> \"");
+    output_hex(out, edge->dst_node->address);
+    OUTPUT_LIT(out, "\":n");
+    if (edge->type == FALLTHROUGH &&
+        ctx->settings.dashed_fallthrough_edges) {
+        OUTPUT_LIT(out, " [style = dashed]");
+    }
+    output_char(out, '\n');
+}
 
-    LibTcgArchInfo arch_info = libtcg->get_arch_info();
+// Names the function containing the block as "name+0xoff" above its
+// instructions.
+static void emit_function_row(DotContext *ctx, TbNode *n) {
+    if (ctx->settings.symbols == NULL) {
+        return;
+    }
+    const ElfSymbol *sym = elf_symbol_containing(ctx->settings.symbols, n->address);
+    if (sym == NULL) {
+        return;
+    }
+    Output *out = ctx->out;
+    OUTPUT_LIT(out, "<tr><td align=\"left\" sides=\"b\" border=\"1\"");
+    if (ctx->analyze_max_stack) {
+        OUTPUT_LIT(out, " colspan=\"3\"");
+    }
+    OUTPUT_LIT(out, ">");
+    font_begin(out, true, colors_default[COLOR_COMMENT].str);
+    output_html_escaped(out, sym->name);
+    if (n->address != sym->address) {
+        OUTPUT_LIT(out, "+0x");
+        output_hex(out, n->address - sym->address);
+    }
+    font_end(out, true);
+    OUTPUT_LIT(out, "</td></tr>\n");
+}
 
+static void emit_node(DotContext *ctx, TbNode *n) {
+    Output *out = ctx->out;
     ColorData *colors = colors_default;
 
-    fputs("digraph {\n", fd);
-    fprintf(fd, "nodesep = %f\n", settings.nodesep);
-    fprintf(fd, "ranksep = %f\n", settings.ranksep);
-    fputs("graph [fontname = \"inconsolata\"];\n", fd);
-    fprintf(fd, "node [fontname = \"inconsolata\" pencolor=\"%s\"];\n", color_str(stack, colors, COLOR_BORDER));
-    fprintf(fd, "edge [fontname = \"inconsolata\", penwidth=2, color=\"%s\"];\n", color_str(stack, colors, COLOR_BORDER));
+    if (ctx->settings.collapse_threshold > 0 &&
+        n->tb.instruction_count > ctx->settings.collapse_threshold) {
+        emit_summary_node(ctx, n);
+        return;
+    }
 
-    char buf[256] = {0};
-    for (TbNode *n = root; n != NULL; n = n->next) {
-        fprintf(fd, "\"%lx\" [shape = \"none\", label=<\n", n->address);
+    OUTPUT_LIT(out, "\"");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, "\" [shape = \"none\", label=<\n");
 
-        fprintf(fd, "<table border=\"2\" cellborder=\"0\" cellspacing=\"0\">");
-        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
-            LibTcgInstruction *inst = &n->tb.list[i];
+    OUTPUT_LIT(out, "<table border=\"2\" cellborder=\"0\" cellspacing=\"0\">");
+    emit_function_row(ctx, n);
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
 
-            bool is_src_inst = (n == reg_src_node && i == (size_t)reg_src_index);
+        bool is_src_inst = (n == ctx->reg_src_node && i == (size_t)ctx->reg_src_index);
 
-            fputs("<tr>\n", fd);
+        OUTPUT_LIT(out, "<tr>\n");
 
-            SrcInfo *src_info = NULL;
-            if (analyze_reg_src.present) {
-                colors = colors_dim;
+        SrcInfo *src_info = NULL;
+        if (ctx->analyze_reg_src.present) {
+            colors = colors_dim;
 
-                if (is_src_inst) {
-                    colors = colors_default;
-                    src_info = n->reg_src_info[i];
-                } else if (n->reg_src_info != NULL &&
-                    n->reg_src_info[i] != NULL) {
-                    src_info = n->reg_src_info[i];
-                    colors = colors_default;
-                }
+            if (is_src_inst) {
+                colors = colors_default;
+                src_info = n->reg_src_info[i];
+            } else if (n->reg_src_info != NULL &&
+                n->reg_src_info[i] != NULL) {
+                src_info = n->reg_src_info[i];
+                colors = colors_default;
             }
+        }
 
-            if (analyze_max_stack) {
-                int64_t r = n->stack_state[i].max_ld_size;
-                int64_t w = n->stack_state[i].max_st_size;
+        if (ctx->analyze_max_stack) {
+            int64_t r = n->stack_state[i].max_ld_size;
+            int64_t w = n->stack_state[i].max_st_size;
 
-                fprintf(fd, "<td cellspacing=\"3\" border=\"0\" align=\"left\">");
-                font_begin(fd, false, color_str(stack, colors, COLOR_COMMENT));
-                if (inst->opcode == LIBTCG_op_insn_start) {
-                    fprintf(fd, "r");
-                } else if (r == STACK_SIZE_TOP) {
-                    fprintf(fd, "?");
-                } else {
-                    fprintf(fd, "%ld", r);
-                }
-                font_end(fd, false);
-                fprintf(fd, "</td>");
-
-                fprintf(fd, "<td cellspacing=\"3\" border=\"0\" align=\"left\">");
-                font_begin(fd, false, color_str(stack, colors, COLOR_COMMENT));
-                if (inst->opcode == LIBTCG_op_insn_start) {
-                    fprintf(fd, "w");
-                } else if (r == STACK_SIZE_TOP) {
-                    fprintf(fd, "?");
-                } else {
-                    fprintf(fd, "%ld", w);
+            OUTPUT_LIT(out, "<td cellspacing=\"3\" border=\"0\" align=\"left\">");
+            font_begin(out, false, colors[COLOR_COMMENT].str);
+            if (inst->opcode == LIBTCG_op_insn_start) {
+                output_char(out, 'r');
+            } else if (r == STACK_SIZE_TOP) {
+                output_char(out, '?');
+            } else {
+                output_i64(out, r);
+            }
+            font_end(out, false);
+            OUTPUT_LIT(out, "</td>");
+
+            OUTPUT_LIT(out, "<td cellspacing=\"3\" border=\"0\" align=\"left\">");
+            font_begin(out, false, colors[COLOR_COMMENT].str);
+            if (inst->opcode == LIBTCG_op_insn_start) {
+                output_char(out, 'w');
+            } else if (r == STACK_SIZE_TOP) {
+                output_char(out, '?');
+            } else {
+                output_i64(out, w);
+            }
+            font_end(out, false);
+            OUTPUT_LIT(out, "</td>");
+        }
+
+        OUTPUT_LIT(out, "<td cellspacing=\"3\" align=\"left\"");
+        if (src_info != NULL) {
+            LibTcgArgument *arg;
+            if (src_info->op_index >= 0) {
+                arg = &inst->output_args[src_info->op_index];
+            } else if (is_src_inst) {
+                int index = ctx->analyze_reg_src.operand_index;
+                if (index >= inst->nb_oargs) {
+                     index -= inst->nb_oargs;
                 }
-                font_end(fd, false);
-                fprintf(fd, "</td>");
+                arg = &inst->output_args[index];
+            } else {
+                arg = &inst->input_args[1];
+            }
+            OUTPUT_LIT(out, " bgcolor=\"");
+            output_color(out, highlight_color(ctx->stack, &ctx->highlight_cache, arg->temp->index)->bg);
+            OUTPUT_LIT(out, "\"");
+        }
+        if (is_src_inst) {
+            OUTPUT_LIT(out, " sides=\"tb\" border=\"2\"");
+        } else {
+            OUTPUT_LIT(out, " sides=\"tb\" border=\"0\"");
+        }
+        OUTPUT_LIT(out, ">\n");
+
+        if (inst->opcode == LIBTCG_op_insn_start) {
+            font_begin(out, false, colors[COLOR_COMMENT].str);
+            char *buf = output_reserve(out, DUMP_BUFFER_SIZE);
+            buf[0] = 0;
+            ctx->libtcg->dump_instruction_to_buffer(inst, buf, DUMP_BUFFER_SIZE);
+            output_dumped(out, buf, DUMP_BUFFER_SIZE);
+            font_end(out, false);
+        } else {
+            font_begin(out, false, colors[COLOR_INSTRUCTION].str);
+            char *buf = output_reserve(out, DUMP_BUFFER_SIZE);
+            buf[0] = 0;
+            ctx->libtcg->dump_instruction_name_to_buffer(inst, buf, DUMP_BUFFER_SIZE);
+            output_dumped(out, buf, DUMP_BUFFER_SIZE);
+            output_char(out, ' ');
+            font_end(out, false);
+
+            if (inst->opcode == LIBTCG_op_call) {
+                LibTcgHelperInfo info = ctx->libtcg->get_helper_info(inst);
+                font_begin(out, false, colors[COLOR_REGISTER].str);
+                output_str(out, info.func_name);
+                output_char(out, ' ');
+                font_end(out, false);
             }
 
-            fputs("<td cellspacing=\"3\" align=\"left\"", fd);
-            if (src_info != NULL) {
-                LibTcgArgument *arg;
-                if (src_info->op_index >= 0) {
-                    arg = &inst->output_args[src_info->op_index];
-                } else if (is_src_inst) {
-                    int index = analyze_reg_src.operand_index;
-                    if (index >= inst->nb_oargs) {
-                         index -= inst->nb_oargs;
-                    }
-                    arg = &inst->output_args[index];
-                } else {
-                    arg = &inst->input_args[1];
+            for (int i = 0; i < inst->nb_oargs; ++i) {
+                if (i > 0) {
+                    font_begin(out, false, colors[COLOR_BASE].str);
+                    OUTPUT_LIT(out, ", ");
+                    font_end(out, false);
+                }
+                LibTcgTemp *temp = inst->output_args[i].temp;
+
+                bool highlight = unlikely(src_info != NULL && src_info->op_index == i);
+                bool is_src_op = unlikely(is_src_inst && src_info != NULL && ctx->analyze_reg_src.operand_index == i);
+                const char *str_col = (highlight)
+                    ? highlight_color(ctx->stack, &ctx->highlight_cache, temp->index)->fg
+                    : colors[temp_color_name(temp->kind)].str;
+
+                font_begin(out, highlight, str_col);
+                if (is_src_op) {
+                    output_char(out, '[');
+                }
+                output_str(out, temp->name);
+                if (is_src_op) {
+                    output_char(out, ']');
                 }
-                fprintf(fd, " bgcolor=\"%s\"", hsl_to_str(stack, (ColorHSL){
-                    .h = reg_src_hue(arg->temp->index),
-                    .s = 0.5f,
-                    .l = 0.9f,
-                }, 1.0f));
+                font_end(out, highlight);
             }
-            int border = (is_src_inst) ? 2 : 0;
-            fprintf(fd, " sides=\"tb\" border=\"%d\"", border);
-            fputs(">\n", fd);
 
-            if (inst->opcode == LIBTCG_op_insn_start) {
-                font_begin(fd, false, color_str(stack, colors, COLOR_COMMENT));
-                memset(buf, 0, 256);
-                libtcg->dump_instruction_to_buffer(inst, buf, 256);
-                fputs(buf, fd);
-                font_end(fd, false);
-            } else {
-                font_begin(fd, false, color_str(stack, colors, COLOR_INSTRUCTION));
-                memset(buf, 0, 256);
-                libtcg->dump_instruction_name_to_buffer(inst, buf, 256);
-                fputs(buf, fd);
-                fputs(" ", fd);
-                font_end(fd, false);
-
-                if (inst->opcode == LIBTCG_op_call) {
-                    LibTcgHelperInfo info = libtcg->get_helper_info(inst);
-                    font_begin(fd, false, color_str(stack, colors, COLOR_REGISTER));
-                    fputs(info.func_name, fd);
-                    fputs(" ", fd);
-                    font_end(fd, false);
+            for (int i = 0; i < inst->nb_iargs; ++i) {
+                if (i > 0 || inst->nb_oargs > 0) {
+                    font_begin(out, false, colors[COLOR_BASE].str);
+                    OUTPUT_LIT(out, ", ");
+                    font_end(out, false);
                 }
+                LibTcgTemp *temp = inst->input_args[i].temp;
 
-                if (inst->nb_oargs > 0) {
-                    for (int i = 0; i < inst->nb_oargs; ++i) {
-                        if (i > 0) {
-                            font_begin(fd, false, color_str(stack, colors, COLOR_BASE));
-                            fprintf(fd, ", ");
-                            font_end(fd, false);
-                        }
-                        LibTcgTempKind kind = inst->output_args[i].temp->kind;
-                        ColorName color_name;
-                        switch (kind) {
-                        case LIBTCG_TEMP_CONST:
-                            color_name = COLOR_CONSTANT;
-                            break;
-                        case LIBTCG_TEMP_GLOBAL:
-                            color_name = COLOR_REGISTER;
-                            break;
-                        default:
-                            color_name = COLOR_BASE;
-                        }
-
-                        bool highlight = unlikely(src_info != NULL && src_info->op_index == i);
-                        bool is_src_op = unlikely(is_src_inst && src_info != NULL && analyze_reg_src.operand_index == i);
-                        const char *str_col = NULL;
-                        if (highlight) {
-                            str_col = hsl_to_str(stack, (ColorHSL){
-                                .h = reg_src_hue(inst->output_args[i].temp->index),
-                                .s = 0.7f,
-                                .l = 0.5f,
-                            }, 1.0f);
-                        } else {
-                            str_col = color_str(stack, colors, color_name);
-                        }
-
-                        font_begin(fd, highlight, str_col);
-                        if (is_src_op) {
-                            fputs("[", fd);
-                        }
-                        fprintf(fd, "%s", inst->output_args[i].temp->name);
-                        if (is_src_op) {
-                            fputs("]", fd);
-                        }
-                        font_end(fd, highlight);
+                bool highlight = unlikely(src_info != NULL && src_info->op_index == i);
+                bool is_src_op = unlikely(is_src_inst && src_info != NULL && ctx->analyze_reg_src.operand_index == i);
+                const char *str_col = (highlight)
+                    ? highlight_color(ctx->stack, &ctx->highlight_cache, temp->index)->fg
+                    : colors[temp_color_name(temp->kind)].str;
+
+                font_begin(out, highlight, str_col);
+                if (is_src_op) {
+                    output_char(out, '[');
+                }
+                if (ctx->settings.compact_args &&
+                    temp->kind == LIBTCG_TEMP_CONST) {
+                    if (is_pc_write(ctx->arch_info, inst, NULL, NULL)) {
+                        OUTPUT_LIT(out, "$0x");
+                        output_hex(out, temp->val);
+                    } else {
+                        output_char(out, '$');
+                        output_i64(out, temp->val);
                     }
+                } else {
+                    output_str(out, temp->name);
                 }
-
-                if (inst->nb_iargs > 0) {
-                    for (int i = 0; i < inst->nb_iargs; ++i) {
-                        if (i > 0 || inst->nb_oargs > 0) {
-                            font_begin(fd, false, color_str(stack, colors, COLOR_BASE));
-                            fprintf(fd, ", ");
-                            font_end(fd, false);
-                        }
-                        LibTcgTempKind kind = inst->input_args[i].temp->kind;
-                        ColorName color_name;
-                        switch (kind) {
-                        case LIBTCG_TEMP_CONST:
-                            color_name = COLOR_CONSTANT;
-                            break;
-                        case LIBTCG_TEMP_GLOBAL:
-                            color_name = COLOR_REGISTER;
-                            break;
-                        default:
-                            color_name = COLOR_BASE;
-                        }
-
-                        bool highlight = unlikely(src_info != NULL && src_info->op_index == i);
-                        bool is_src_op = unlikely(is_src_inst && src_info != NULL && analyze_reg_src.operand_index == i);
-                        const char *str_col = NULL;
-                        if (highlight) {
-                            str_col = hsl_to_str(stack, (ColorHSL){
-                                .h = reg_src_hue(inst->input_args[i].temp->index),
-                                .s = 0.7f,
-                                .l = 0.5f,
-                            }, 1.0f);
-                        } else {
-                            str_col = color_str(stack, colors, color_name);
-                        }
-
-                        font_begin(fd, highlight, str_col);
-                        if (is_src_op) {
-                            fputs("[", fd);
-                        }
-                        if (settings.compact_args &&
-                            inst->input_args[i].temp->kind == LIBTCG_TEMP_CONST) {
-                            if (is_pc_write(arch_info, inst, NULL, NULL)) {
-                                fprintf(fd, "$0x%lx", inst->input_args[i].temp->val);
-                            } else {
-                                fprintf(fd, "$%ld", inst->input_args[i].temp->val);
-                            }
-                        } else {
-                            fprintf(fd, "%s", inst->input_args[i].temp->name);
-                        }
-                        if (is_src_op) {
-                            fputs("]", fd);
-                        }
-                        font_end(fd, highlight);
+                if (is_src_op) {
+                    output_char(out, ']');
+                }
+                font_end(out, highlight);
+
+                if (ctx->settings.symbols != NULL &&
+                    temp->kind == LIBTCG_TEMP_CONST &&
+                    is_pc_write(ctx->arch_info, inst, NULL, NULL)) {
+                    const ElfSymbol *sym = elf_symbol_at(ctx->settings.symbols, temp->val);
+                    if (sym != NULL) {
+                        font_begin(out, false, colors[COLOR_COMMENT].str);
+                        OUTPUT_LIT(out, " &lt;");
+                        output_html_escaped(out, sym->name);
+                        OUTPUT_LIT(out, "&gt;");
+                        font_end(out, false);
                     }
                 }
+            }
 
-                bool is_ld = inst->opcode == LIBTCG_op_qemu_ld_a32_i32 ||
-                             inst->opcode == LIBTCG_op_qemu_ld_a64_i32 ||
-                             inst->opcode == LIBTCG_op_qemu_ld_a32_i64 ||
-                             inst->opcode == LIBTCG_op_qemu_ld_a64_i64;
-
-                bool is_st = inst->opcode == LIBTCG_op_qemu_st_a32_i32 ||
-                             inst->opcode == LIBTCG_op_qemu_st_a64_i32 ||
-                             inst->opcode == LIBTCG_op_qemu_st_a32_i64 ||
-                             inst->opcode == LIBTCG_op_qemu_st_a64_i64;
-
-                if (inst->nb_cargs > 0 && !(settings.compact_args && (is_ld || is_st))) {
-                    for (int i = 0; i < inst->nb_cargs; ++i) {
-                        if (i > 0 || inst->nb_oargs + inst->nb_iargs > 0) {
-                            font_begin(fd, false, color_str(stack, colors, COLOR_BASE));
-                            fprintf(fd, ", ");
-                            font_end(fd, false);
-                        }
-
-                        memset(buf, 0, ARRLEN(buf));
-                        libtcg->dump_constant_arg_to_buffer(&inst->constant_args[i], buf, ARRLEN(buf));
-                        font_begin(fd, false, color_str(stack, colors, COLOR_CONSTANT));
-                        fprintf(fd, "%s", buf);
-                        font_end(fd, false);
+            bool is_ld = inst->opcode == LIBTCG_op_qemu_ld_a32_i32 ||
+                         inst->opcode == LIBTCG_op_qemu_ld_a64_i32 ||
+                         inst->opcode == LIBTCG_op_qemu_ld_a32_i64 ||
+                         inst->opcode == LIBTCG_op_qemu_ld_a64_i64;
+
+            bool is_st = inst->opcode == LIBTCG_op_qemu_st_a32_i32 ||
+                         inst->opcode == LIBTCG_op_qemu_st_a64_i32 ||
+                         inst->opcode == LIBTCG_op_qemu_st_a32_i64 ||
+                         inst->opcode == LIBTCG_op_qemu_st_a64_i64;
+
+            if (inst->nb_cargs > 0 && !(ctx->settings.compact_args && (is_ld || is_st))) {
+                for (int i = 0; i < inst->nb_cargs; ++i) {
+                    if (i > 0 || inst->nb_oargs + inst->nb_iargs > 0) {
+                        font_begin(out, false, colors[COLOR_BASE].str);
+                        OUTPUT_LIT(out, ", ");
+                        font_end(out, false);
                     }
+
+                    font_begin(out, false, colors[COLOR_CONSTANT].str);
+                    char *buf = output_reserve(out, DUMP_BUFFER_SIZE);
+                    buf[0] = 0;
+                    ctx->libtcg->dump_constant_arg_to_buffer(&inst->constant_args[i], buf, DUMP_BUFFER_SIZE);
+                    output_dumped(out, buf, DUMP_BUFFER_SIZE);
+                    font_end(out, false);
                 }
-                fputs("  ", fd);
             }
-
-            fputs("</td>", fd);
-            fputs("</tr>\n", fd);
+            OUTPUT_LIT(out, "  ");
         }
-        fputs("</table>", fd);
-        fputs(">];\n", fd);
+
+        OUTPUT_LIT(out, "</td>");
+        OUTPUT_LIT(out, "</tr>\n");
+    }
+    OUTPUT_LIT(out, "</table>");
+    OUTPUT_LIT(out, ">];\n");
+}
+
+void graphviz_output(LibTcgInterface *libtcg, StackAllocator *stack,
+                     GraphvizSettings settings,
+                     Output *out, TbNode *root, bool analyze_max_stack,
+                     CmdLineRegTuple analyze_reg_src, TbNode *reg_src_node,
+                     int reg_src_index) {
+    assert(out != NULL);
+
+    DotContext ctx = {
+        .libtcg = libtcg,
+        .arch_info = libtcg->get_arch_info(),
+        .stack = stack,
+        .settings = settings,
+        .out = out,
+        .analyze_max_stack = analyze_max_stack,
+        .analyze_reg_src = analyze_reg_src,
+        .reg_src_node = reg_src_node,
+        .reg_src_index = reg_src_index,
+    };
+
+    emit_header(&ctx);
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        emit_node(&ctx, n);
     }
     for (TbNode *n = root; n != NULL; n = n->next) {
         for (size_t i = 0; i < n->num_succ; ++i) {
-            if (n->succ[i].type == FALLTHROUGH) {
-                const char *dashed = (settings.dashed_fallthrough_edges) ? 
-                                         " [style = dashed]"
-                                     :
-                                         "";
-                fprintf(fd, "\"%lx\":s -> \"%lx\":n%s\n",
-                        n->address,
-                        n->succ[i].dst_node->address,
-                        dashed);
-            } else {
-                fprintf(fd, "\"%lx\":s -> \"%lx\":n\n",
-                        n->address,
-                        n->succ[i].dst_node->address);
+            emit_edge(&ctx, n, &n->succ[i]);
+        }
+    }
+    for (size_t i = 0; i < settings.num_external; ++i) {
+        const ExternalEdge *edge = &settings.external[i];
+        OUTPUT_LIT(out, "\"ext_");
+        output_hex(out, edge->dst);
+        OUTPUT_LIT(out, "\" [shape = \"box\", style = \"dashed\", label=\"0x");
+        output_hex(out, edge->dst);
+        OUTPUT_LIT(out, " (external)\"];\n\"");
+        output_hex(out, edge->src);
+        OUTPUT_LIT(out, "\":s -> \"ext_");
+        output_hex(out, edge->dst);
+        OUTPUT_LIT(out, "\"\n");
+    }
+    OUTPUT_LIT(out, "}\n");
+}
+
+static void emit_stub_node(DotContext *ctx, TbNode *n, uint32_t partition) {
+    Output *out = ctx->out;
+    OUTPUT_LIT(out, "\"ext_");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, "\" [shape = \"box\", style = \"dashed\", label=\"0x");
+    output_hex(out, n->address);
+    OUTPUT_LIT(out, " (part-");
+    output_u64(out, partition);
+    OUTPUT_LIT(out, ".dot)\"];\n");
+}
+
+static bool close_output_file(Output *out) {
+    if (out->fd == -1) {
+        out->used = 0;
+        return true;
+    }
+    bool ok = output_flush(out);
+    close(out->fd);
+    out->fd = -1;
+    return ok;
+}
+
+// Finishes the file out is writing to, if any, and opens dir/name
+// instead. Fails if either step fails.
+static bool switch_output_file(Output *out, const char *dir, const char *name) {
+    bool ok = true;
+    if (out->fd != -1) {
+        ok = output_flush(out);
+        close(out->fd);
+    }
+    char path[4096];
+    snprintf(path, ARRLEN(path), "%s/%s", dir, name);
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd == -1) {
+        fprintf(stderr, "[error]: Failed to open %s\n", path);
+        return false;
+    }
+    return ok;
+}
+
+bool graphviz_output_partitioned(LibTcgInterface *libtcg, StackAllocator *stack,
+                                 GraphvizSettings settings,
+                                 Output *out, const char *split_dir,
+                                 CfgPartition *partition,
+                                 bool analyze_max_stack,
+                                 CmdLineRegTuple analyze_reg_src,
+                                 TbNode *reg_src_node, int reg_src_index) {
+    assert(out != NULL);
+
+    DotContext ctx = {
+        .libtcg = libtcg,
+        .arch_info = libtcg->get_arch_info(),
+        .stack = stack,
+        .settings = settings,
+        .out = out,
+        .analyze_max_stack = analyze_max_stack,
+        .analyze_reg_src = analyze_reg_src,
+        .reg_src_node = reg_src_node,
+        .reg_src_index = reg_src_index,
+    };
+
+    if (split_dir == NULL) {
+        emit_header(&ctx);
+        for (size_t p = 0; p < partition->num_partitions; ++p) {
+            TbNode *first = partition->nodes[partition->offsets[p]];
+            TbNode *last = partition->nodes[partition->offsets[p+1]-1];
+            OUTPUT_LIT(out, "subgraph cluster_");
+            output_u64(out, p);
+            OUTPUT_LIT(out, " {\nlabel = \"");
+            if (partition->names != NULL && partition->names[p] != NULL) {
+                output_quoted_escaped(out, partition->names[p]);
+                output_char(out, ' ');
+            }
+            OUTPUT_LIT(out, "0x");
+            output_hex(out, first->address);
+            OUTPUT_LIT(out, " - 0x");
+            output_hex(out, last->address + last->tb.size_in_bytes);
+            OUTPUT_LIT(out, "\";\n");
+            for (size_t i = partition->offsets[p]; i < partition->offsets[p+1]; ++i) {
+                emit_node(&ctx, partition->nodes[i]);
+            }
+            OUTPUT_LIT(out, "}\n");
+        }
+        for (size_t i = 0; i < partition->num_nodes; ++i) {
+            TbNode *n = partition->nodes[i];
+            for (size_t j = 0; j < n->num_succ; ++j) {
+                emit_edge(&ctx, n, &n->succ[j]);
+            }
+        }
+        OUTPUT_LIT(out, "}\n");
+        return output_flush(out);
+    }
+
+    // Split files are opened and closed here, never the caller's
+    assert(out->fd == -1);
+    if (mkdir(split_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "[error]: Failed to create directory %s\n", split_dir);
+        return false;
+    }
+
+    char name[64];
+    for (size_t p = 0; p < partition->num_partitions; ++p) {
+        snprintf(name, ARRLEN(name), "part-%lu.dot", p);
+        if (!switch_output_file(out, split_dir, name)) {
+            close_output_file(out);
+            return false;
+        }
+
+        emit_header(&ctx);
+        for (size_t i = partition->offsets[p]; i < partition->offsets[p+1]; ++i) {
+            emit_node(&ctx, partition->nodes[i]);
+        }
+        for (size_t i = partition->offsets[p]; i < partition->offsets[p+1]; ++i) {
+            TbNode *n = partition->nodes[i];
+            for (size_t j = 0; j < n->num_succ; ++j) {
+                TbNode *dst = n->succ[j].dst_node;
+                uint32_t dst_partition = partition->node_partition[dst->id];
+                if (dst_partition == p) {
+                    emit_edge(&ctx, n, &n->succ[j]);
+                    continue;
+                }
+                emit_stub_node(&ctx, dst, dst_partition);
+                OUTPUT_LIT(out, "\"");
+                output_hex(out, n->address);
+                OUTPUT_LIT(out, "\":s -> \"ext_");
+                output_hex(out, dst->address);
+                OUTPUT_LIT(out, "\"\n");
             }
+            for (size_t j = 0; j < n->num_pred; ++j) {
+                TbNode *src = n->pred[j].dst_node;
+                uint32_t src_partition = partition->node_partition[src->id];
+                if (src_partition == p) {
+                    continue;
+                }
+                emit_stub_node(&ctx, src, src_partition);
+                OUTPUT_LIT(out, "\"ext_");
+                output_hex(out, src->address);
+                OUTPUT_LIT(out, "\" -> \"");
+                output_hex(out, n->address);
+                OUTPUT_LIT(out, "\":n\n");
+            }
+        }
+        OUTPUT_LIT(out, "}\n");
+    }
+
+    if (!switch_output_file(out, split_dir, "index.txt")) {
+        close_output_file(out);
+        return false;
+    }
+    OUTPUT_LIT(out, "# file\tstart\tend\tblocks\tinstructions");
+    if (partition->names != NULL) {
+        OUTPUT_LIT(out, "\tfunction");
+    }
+    output_char(out, '\n');
+    for (size_t p = 0; p < partition->num_partitions; ++p) {
+        uint64_t start = UINT64_MAX;
+        uint64_t end = 0;
+        size_t num_instructions = 0;
+        for (size_t i = partition->offsets[p]; i < partition->offsets[p+1]; ++i) {
+            TbNode *n = partition->nodes[i];
+            start = MIN(start, n->address);
+            end = MAX(end, n->address + n->tb.size_in_bytes);
+            num_instructions += n->tb.instruction_count;
+        }
+        OUTPUT_LIT(out, "part-");
+        output_u64(out, p);
+        OUTPUT_LIT(out, ".dot\t0x");
+        output_hex(out, start);
+        OUTPUT_LIT(out, "\t0x");
+        output_hex(out, end);
+        output_char(out, '\t');
+        output_u64(out, partition->offsets[p+1] - partition->offsets[p]);
+        output_char(out, '\t');
+        output_u64(out, num_instructions);
+        if (partition->names != NULL) {
+            output_char(out, '\t');
+            output_str(out, (partition->names[p] != NULL) ? partition->names[p] : "-");
         }
+        output_char(out, '\n');
     }
-    fputs("}\n", fd);
+    return close_output_file(out);
 }
@@ -4,9 +4,13 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+typedef struct Output Output;
+typedef struct CfgPartition CfgPartition;
 typedef struct TbNode TbNode;
 typedef struct LibTcgInterface LibTcgInterface;
 typedef struct StackAllocator StackAllocator;
+typedef struct ElfSymbolTable ElfSymbolTable;
+typedef struct ExternalEdge ExternalEdge;
 
 typedef struct GraphvizSettings {
     float nodesep;
@@ -15,10 +19,37 @@ typedef struct GraphvizSettings {
     // Emit constants as signed integers, rather then hex,
     // skip constant instruction args. on loads/stores.
     bool compact_args;
+    // Replace blocks with more instructions than this with a summary
+    // node, 0 disables collapsing.
+    size_t collapse_threshold;
+    // Names the targets of direct jumps, may be NULL
+    const ElfSymbolTable *symbols;
+    // Drawn to dashed stub nodes by graphviz_output(), may be NULL
+    const ExternalEdge *external;
+    size_t num_external;
 } GraphvizSettings;
 
 void graphviz_output(LibTcgInterface *libtcg, StackAllocator *stack,
                      GraphvizSettings settings,
-                     FILE *fd, TbNode *root, bool analyze_max_stack,
+                     Output *out, TbNode *root, bool analyze_max_stack,
                      CmdLineRegTuple analyze_reg_src, TbNode *reg_src_node,
                      int reg_src_index);
+
+// Emits the CFG grouped by partition. If split_dir is NULL, partitions
+// are written as "subgraph cluster_*" blocks to out, otherwise each
+// partition is written to split_dir/part-N.dot with edges leaving the
+// partition drawn to stub nodes, along with an index.txt listing the
+// address range and size of each file. In the latter case out only
+// provides the buffer, must not have a file of its own (fd -1), and is
+// pointed to each file in turn. Returns false if any write fails.
+bool graphviz_output_partitioned(LibTcgInterface *libtcg, StackAllocator *stack,
+                                 GraphvizSettings settings,
+                                 Output *out, const char *split_dir,
+                                 CfgPartition *partition,
+                                 bool analyze_max_stack,
+                                 CmdLineRegTuple analyze_reg_src,
+                                 TbNode *reg_src_node, int reg_src_index);
+
+// Escapes str for use inside a "double quoted" DOT string, without
+// writing the quotes
+void output_quoted_escaped(Output *out, const char *str);
@@ -0,0 +1,555 @@
+#include "incremental.h"
+#include "common.h"
+#include "cfg.h"
+#include "analyze-max-stack.h"
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC "dump-ir-manifest"
+#define MANIFEST_VERSION 1
+// Longest "#N" suffix added to duplicate symbol names
+#define MAX_KEY_SUFFIX 16
+
+typedef enum FunctionState {
+    FUNCTION_UNCHANGED = 0,
+    FUNCTION_CHANGED,
+    FUNCTION_CALLER,
+} FunctionState;
+
+// Per function results, as stored in the manifest
+typedef struct FunctionRecord {
+    const char *key;
+    uint64_t address;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t num_blocks;
+    uint64_t num_insts;
+    int64_t max_ld_size;
+    int64_t max_st_size;
+    size_t num_callees;
+    const char **callees;
+} FunctionRecord;
+
+// Fixed size open addressing map from names to indices into an array
+// of records, sized up front to at most 50% load.
+typedef struct KeyTable {
+    const char **keys;
+    uint32_t *values;
+    size_t size;
+} KeyTable;
+
+typedef struct Manifest {
+    uint32_t arch;
+    uint32_t flags;
+    bool analyze_max_stack;
+    FunctionRecord *records;
+    size_t num_records;
+    KeyTable lookup;
+} Manifest;
+
+typedef struct AddressRange {
+    uint64_t begin;
+    uint64_t end;
+    uint32_t index;
+} AddressRange;
+
+static uint64_t hash_bytes(const uint8_t *data, size_t size) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t hash_str(const char *str) {
+    return hash_bytes((const uint8_t *) str, strlen(str));
+}
+
+static void key_table_init(StackAllocator *stack, KeyTable *table, size_t count) {
+    size_t size = 16;
+    while (size < 2*count) {
+        size *= 2;
+    }
+    *table = (KeyTable) {
+        .keys = stack_alloc_zero_tagged(stack, size*sizeof(const char *), MEM_TAG_OTHER),
+        .values = stack_alloc_tagged(stack, size*sizeof(uint32_t), MEM_TAG_OTHER),
+        .size = size,
+    };
+}
+
+static size_t key_table_slot(KeyTable *table, const char *key) {
+    size_t mask = table->size - 1;
+    size_t i = hash_str(key) & mask;
+    while (table->keys[i] != NULL && strcmp(table->keys[i], key) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Returns false if key is already present
+static bool key_table_insert(KeyTable *table, const char *key, uint32_t value) {
+    size_t slot = key_table_slot(table, key);
+    if (table->keys[slot] != NULL) {
+        return false;
+    }
+    table->keys[slot] = key;
+    table->values[slot] = value;
+    return true;
+}
+
+static int64_t key_table_find(KeyTable *table, const char *key) {
+    if (table->size == 0) {
+        return -1;
+    }
+    size_t slot = key_table_slot(table, key);
+    if (table->keys[slot] == NULL) {
+        return -1;
+    }
+    return table->values[slot];
+}
+
+static char *next_token(char **str) {
+    char *s = *str;
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    if (*s == 0) {
+        *str = s;
+        return NULL;
+    }
+    char *token = s;
+    while (*s != 0 && *s != ' ' && *s != '\t') {
+        ++s;
+    }
+    if (*s != 0) {
+        *s++ = 0;
+    }
+    *str = s;
+    return token;
+}
+
+static bool parse_u64(char **str, int base, uint64_t *value) {
+    char *token = next_token(str);
+    if (token == NULL) {
+        return false;
+    }
+    char *end;
+    *value = strtoull(token, &end, base);
+    return *end == 0;
+}
+
+static bool parse_i64(char **str, int64_t *value) {
+    char *token = next_token(str);
+    if (token == NULL) {
+        return false;
+    }
+    char *end;
+    *value = strtoll(token, &end, 10);
+    return *end == 0;
+}
+
+static bool parse_record(StackAllocator *stack, char *line, FunctionRecord *r) {
+    r->key = next_token(&line);
+    if (r->key == NULL ||
+        !parse_u64(&line, 16, &r->address) ||
+        !parse_u64(&line, 10, &r->size) ||
+        !parse_u64(&line, 16, &r->hash) ||
+        !parse_u64(&line, 10, &r->num_blocks) ||
+        !parse_u64(&line, 10, &r->num_insts) ||
+        !parse_i64(&line, &r->max_ld_size) ||
+        !parse_i64(&line, &r->max_st_size)) {
+        return false;
+    }
+    uint64_t num_callees;
+    if (!parse_u64(&line, 10, &num_callees) || num_callees > strlen(line)) {
+        return false;
+    }
+    r->num_callees = num_callees;
+    r->callees = stack_alloc_tagged(stack, num_callees*sizeof(const char *), MEM_TAG_OTHER);
+    for (size_t i = 0; i < num_callees; ++i) {
+        r->callees[i] = next_token(&line);
+        if (r->callees[i] == NULL) {
+            return false;
+        }
+    }
+    return next_token(&line) == NULL;
+}
+
+// Reads the manifest at path into manifest. A missing file results in
+// an empty manifest, a malformed one is an error.
+static bool read_manifest(StackAllocator *stack, const char *path, Manifest *manifest) {
+    *manifest = (Manifest) {0};
+    FILE *fd = fopen(path, "rb");
+    if (fd == NULL) {
+        return true;
+    }
+    fseek(fd, 0, SEEK_END);
+    size_t size = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    char *buffer = stack_alloc_tagged(stack, size + 1, MEM_TAG_INPUT);
+    size_t bytes_read = fread(buffer, 1, size, fd);
+    fclose(fd);
+    if (bytes_read != size) {
+        fprintf(stderr, "[error]: Failed to read manifest %s\n", path);
+        return false;
+    }
+    buffer[size] = 0;
+
+    size_t num_lines = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (buffer[i] == '\n') {
+            buffer[i] = 0;
+            ++num_lines;
+        }
+    }
+
+    // Tokens are terminated in place, so the start of the next line is
+    // found before parsing the current one
+    char *line = buffer;
+    char *end = buffer + size;
+    char *next = line + strlen(line) + 1;
+    char *magic = next_token(&line);
+    uint64_t version, arch, flags, analyze_max_stack;
+    if (magic == NULL || strcmp(magic, MANIFEST_MAGIC) != 0 ||
+        !parse_u64(&line, 10, &version) || version != MANIFEST_VERSION ||
+        !parse_u64(&line, 10, &arch) ||
+        !parse_u64(&line, 10, &flags) ||
+        !parse_u64(&line, 10, &analyze_max_stack)) {
+        fprintf(stderr, "[error]: %s is not a dump-ir manifest\n", path);
+        return false;
+    }
+    manifest->arch = arch;
+    manifest->flags = flags;
+    manifest->analyze_max_stack = analyze_max_stack != 0;
+
+    manifest->records = stack_alloc_tagged(stack, num_lines*sizeof(FunctionRecord), MEM_TAG_OTHER);
+    key_table_init(stack, &manifest->lookup, num_lines);
+    for (line = next; line < end; line = next) {
+        next = line + strlen(line) + 1;
+        if (*line == 0) {
+            continue;
+        }
+        FunctionRecord *r = &manifest->records[manifest->num_records];
+        if (!parse_record(stack, line, r) ||
+            !key_table_insert(&manifest->lookup, r->key, manifest->num_records)) {
+            fprintf(stderr, "[error]: Malformed record in manifest %s\n", path);
+            return false;
+        }
+        ++manifest->num_records;
+    }
+    return true;
+}
+
+static bool write_manifest(Memory *memory, const char *path, Manifest *manifest) {
+    // Written to a temporary file first so that an interrupted run
+    // keeps the old manifest
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = stack_alloc_tagged(&memory->temporary, len, MEM_TAG_OTHER);
+    snprintf(tmp_path, len, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "[error]: Failed to open %s\n", tmp_path);
+        return false;
+    }
+
+    Output out;
+    output_init(&out, &memory->persistent, fd, OUTPUT_BUFFER_SIZE);
+    OUTPUT_LIT(&out, MANIFEST_MAGIC " ");
+    output_u64(&out, MANIFEST_VERSION);
+    output_char(&out, ' ');
+    output_u64(&out, manifest->arch);
+    output_char(&out, ' ');
+    output_u64(&out, manifest->flags);
+    output_char(&out, ' ');
+    output_u64(&out, manifest->analyze_max_stack);
+    output_char(&out, '\n');
+    for (size_t i = 0; i < manifest->num_records; ++i) {
+        FunctionRecord *r = &manifest->records[i];
+        output_str(&out, r->key);
+        output_char(&out, ' ');
+        output_hex(&out, r->address);
+        output_char(&out, ' ');
+        output_u64(&out, r->size);
+        output_char(&out, ' ');
+        output_hex(&out, r->hash);
+        output_char(&out, ' ');
+        output_u64(&out, r->num_blocks);
+        output_char(&out, ' ');
+        output_u64(&out, r->num_insts);
+        output_char(&out, ' ');
+        output_i64(&out, r->max_ld_size);
+        output_char(&out, ' ');
+        output_i64(&out, r->max_st_size);
+        output_char(&out, ' ');
+        output_u64(&out, r->num_callees);
+        for (size_t j = 0; j < r->num_callees; ++j) {
+            output_char(&out, ' ');
+            output_str(&out, r->callees[j]);
+        }
+        output_char(&out, '\n');
+    }
+    bool ok = output_flush(&out);
+    close(fd);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[error]: Failed to write manifest %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const AddressRange *x = a;
+    const AddressRange *y = b;
+    return (x->begin > y->begin) - (x->begin < y->begin);
+}
+
+// Returns the function starting closest below address that contains
+// it, ranges is sorted by begin.
+static int64_t find_function(AddressRange *ranges, size_t count, uint64_t address) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (ranges[mid].begin <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || address >= ranges[lo-1].end) {
+        return -1;
+    }
+    return ranges[lo-1].index;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Lifts and analyzes a single function. All IR is dropped afterwards,
+// only the summary in r is kept.
+static void analyze_function(LibTcgInterface *libtcg, LibTcgContext *context,
+                             Memory *memory, LibTcgArch arch, uint32_t flags,
+                             bool analyze_max_stack,
+                             const ElfSymbolTable *symbols, ElfFunction *fn,
+                             AddressRange *ranges, size_t num_ranges,
+                             const char **keys, FunctionRecord *r) {
+    StackMarker marker = stack_marker(&memory->persistent);
+    StackMarker temporary_marker = stack_marker(&memory->temporary);
+
+    uint64_t address = fn->view.address;
+    if (arch == LIBTCG_ARCH_ARM && ((address & 1) != 0)) {
+        flags |= LIBTCG_TRANSLATE_ARM_THUMB;
+        address &= ~((uint64_t) 1);
+    }
+
+    TbNode *root = cfg_lift(libtcg, context, NULL, &memory->persistent,
+                            fn->view.data, fn->view.size, address, flags,
+                            NULL);
+    cfg_build(libtcg, &memory->persistent, root);
+
+    r->num_blocks = 0;
+    r->num_insts = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        ++r->num_blocks;
+        r->num_insts += n->tb.instruction_count;
+    }
+
+    // Direct jumps that leave the function
+    LibTcgArchInfo arch_info = libtcg->get_arch_info();
+    uint32_t *callees = stack_alloc_tagged(&memory->temporary, r->num_insts*sizeof(uint32_t), MEM_TAG_OTHER);
+    size_t num_callees = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            bool is_direct;
+            uint64_t target;
+            if (!is_pc_write(arch_info, &n->tb.list[i], &is_direct, &target) ||
+                !is_direct ||
+                (target >= address && target < address + fn->view.size)) {
+                continue;
+            }
+            int64_t callee = find_function(ranges, num_ranges, target);
+            if (callee != -1) {
+                callees[num_callees++] = callee;
+            }
+        }
+    }
+
+    r->max_ld_size = STACK_SIZE_BOTTOM;
+    r->max_st_size = STACK_SIZE_BOTTOM;
+    if (analyze_max_stack && root != NULL) {
+        bool stack_grows_down = true;
+        MfpStackState s = compute_max_stack_size(libtcg, memory, root,
+                                                 symbols, stack_grows_down);
+        r->max_ld_size = s.max_ld_size;
+        r->max_st_size = s.max_st_size;
+    }
+
+    stack_reset_to_marker(&memory->persistent, marker);
+
+    qsort(callees, num_callees, sizeof(uint32_t), compare_u32);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < num_callees; ++i) {
+        if (num_unique == 0 || callees[num_unique-1] != callees[i]) {
+            callees[num_unique++] = callees[i];
+        }
+    }
+    r->num_callees = num_unique;
+    r->callees = stack_alloc_tagged(&memory->persistent, num_unique*sizeof(const char *), MEM_TAG_OTHER);
+    for (size_t i = 0; i < num_unique; ++i) {
+        r->callees[i] = keys[callees[i]];
+    }
+
+    stack_reset_to_marker(&memory->temporary, temporary_marker);
+}
+
+bool incremental_run(LibTcgInterface *libtcg, LibTcgContext *context,
+                     Memory *memory, ElfData *data, uint32_t flags,
+                     bool analyze_max_stack, const char *manifest,
+                     IncrementalStats *stats) {
+    StackAllocator *stack = &memory->persistent;
+    *stats = (IncrementalStats) {0};
+
+    ElfFunction *functions;
+    size_t num_functions = elf_functions(stack, data, &functions);
+    if (num_functions == 0) {
+        fprintf(stderr, "[error]: No function symbols found\n");
+        return false;
+    }
+    stats->num_functions = num_functions;
+
+    // Unique names
+    const char **keys = stack_alloc_tagged(stack, num_functions*sizeof(const char *), MEM_TAG_OTHER);
+    KeyTable lookup;
+    key_table_init(stack, &lookup, num_functions);
+    for (size_t i = 0; i < num_functions; ++i) {
+        keys[i] = functions[i].name;
+        for (size_t n = 2; !key_table_insert(&lookup, keys[i], i); ++n) {
+            size_t len = strlen(functions[i].name) + MAX_KEY_SUFFIX;
+            char *key = stack_alloc_tagged(stack, len, MEM_TAG_OTHER);
+            snprintf(key, len, "%s#%lu", functions[i].name, n);
+            keys[i] = key;
+        }
+    }
+
+    ElfSymbolTable symbols;
+    elf_symbol_table(stack, data, &symbols);
+
+    AddressRange *ranges = stack_alloc_tagged(stack, num_functions*sizeof(AddressRange), MEM_TAG_OTHER);
+    for (size_t i = 0; i < num_functions; ++i) {
+        uint64_t address = functions[i].view.address;
+        if (data->arch == LIBTCG_ARCH_ARM) {
+            address &= ~((uint64_t) 1);
+        }
+        ranges[i] = (AddressRange) {
+            .begin = address,
+            .end = address + functions[i].view.size,
+            .index = i,
+        };
+    }
+    qsort(ranges, num_functions, sizeof(AddressRange), compare_ranges);
+
+    Manifest old;
+    if (!read_manifest(stack, manifest, &old)) {
+        return false;
+    }
+    if (old.arch != data->arch || old.flags != flags ||
+        old.analyze_max_stack != analyze_max_stack) {
+        old.num_records = 0;
+        old.lookup.size = 0;
+    }
+
+    FunctionRecord *records = stack_alloc_zero_tagged(stack, num_functions*sizeof(FunctionRecord), MEM_TAG_OTHER);
+    uint8_t *state = stack_alloc_tagged(stack, num_functions, MEM_TAG_OTHER);
+    int64_t *prev = stack_alloc_tagged(stack, num_functions*sizeof(int64_t), MEM_TAG_OTHER);
+    for (size_t i = 0; i < num_functions; ++i) {
+        ElfByteView *view = &functions[i].view;
+        records[i].key = keys[i];
+        records[i].address = view->address;
+        records[i].size = view->size;
+        records[i].hash = hash_bytes(view->data, view->size);
+
+        prev[i] = key_table_find(&old.lookup, keys[i]);
+        if (prev[i] == -1) {
+            state[i] = FUNCTION_CHANGED;
+            continue;
+        }
+        FunctionRecord *r = &old.records[prev[i]];
+        state[i] = (r->hash != records[i].hash || r->size != records[i].size)
+                 ? FUNCTION_CHANGED
+                 : FUNCTION_UNCHANGED;
+        if (state[i] != FUNCTION_UNCHANGED || r->address == view->address) {
+            continue;
+        }
+        uint64_t delta = view->address - r->address;
+        for (size_t j = 0; j < r->num_callees; ++j) {
+            int64_t callee = key_table_find(&lookup, r->callees[j]);
+            int64_t old_callee = key_table_find(&old.lookup, r->callees[j]);
+            if (callee == -1 || old_callee == -1 ||
+                functions[callee].view.address - old.records[old_callee].address != delta) {
+                state[i] = FUNCTION_CHANGED;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < old.num_records; ++i) {
+        FunctionRecord *r = &old.records[i];
+        int64_t caller = key_table_find(&lookup, r->key);
+        if (caller == -1) {
+            ++stats->num_removed;
+            continue;
+        }
+        if (state[caller] != FUNCTION_UNCHANGED) {
+            continue;
+        }
+        for (size_t j = 0; j < r->num_callees; ++j) {
+            int64_t callee = key_table_find(&lookup, r->callees[j]);
+            if (callee == -1 || state[callee] == FUNCTION_CHANGED) {
+                state[caller] = FUNCTION_CALLER;
+                break;
+            }
+        }
+    }
+
+    LibTcgArch arch = data->arch;
+    for (size_t i = 0; i < num_functions; ++i) {
+        FunctionRecord *r = &records[i];
+        if (state[i] == FUNCTION_UNCHANGED) {
+            FunctionRecord *p = &old.records[prev[i]];
+            r->num_blocks = p->num_blocks;
+            r->num_insts = p->num_insts;
+            r->max_ld_size = p->max_ld_size;
+            r->max_st_size = p->max_st_size;
+            r->num_callees = p->num_callees;
+            r->callees = p->callees;
+            ++stats->num_reused;
+            continue;
+        }
+        if (state[i] == FUNCTION_CHANGED) {
+            ++stats->num_changed;
+        } else {
+            ++stats->num_callers;
+        }
+        analyze_function(libtcg, context, memory, arch, flags,
+                         analyze_max_stack, &symbols, &functions[i],
+                         ranges, num_functions, keys, r);
+    }
+
+    Manifest new = {
+        .arch = arch,
+        .flags = flags,
+        .analyze_max_stack = analyze_max_stack,
+        .records = records,
+        .num_records = num_functions,
+    };
+    return write_manifest(memory, manifest, &new);
+}
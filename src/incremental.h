@@ -0,0 +1,48 @@
+#pragma once
+
+#include "loadelf.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Memory Memory;
+
+typedef struct IncrementalStats {
+    size_t num_functions;
+    // New functions and functions whose bytes differ from the manifest
+    size_t num_changed;
+    // Unchanged functions re-analyzed since one of their callees changed
+    size_t num_callers;
+    // Functions whose results were copied from the manifest
+    size_t num_reused;
+    // Functions in the manifest that no longer exist
+    size_t num_removed;
+} IncrementalStats;
+
+// Analyzes every function symbol of data, reusing the results stored
+// in manifest by an earlier run where possible, and then overwrites
+// manifest with the results of this run. A missing manifest, or one
+// written with a different arch, translate flags or set of analyses,
+// analyzes everything.
+//
+// The manifest is a text file with a header line followed by one line
+// per function:
+//
+//   dump-ir-manifest 1 <arch> <flags> <analyze max stack 0|1>
+//   <name> <address> <size> <hash> <blocks> <insts> <max ld> <max st> <n> <callee>...
+//
+// address and hash are hex, hash being FNV-1a of the function bytes.
+// The n callees are the names of functions that are the target of a
+// direct jump out of the function. Names of symbols that occur more
+// than once get a #2, #3, ... suffix in symbol table order.
+//
+// A function is re-analyzed if its bytes changed, or if it moved by a
+// different distance than any of its callees, as jumps between them
+// are encoded relative to the pc. Callers of changed or removed
+// functions are re-analyzed as well, since their callee list is
+// resolved through the changed symbols.
+bool incremental_run(LibTcgInterface *libtcg, LibTcgContext *context,
+                     Memory *memory, ElfData *data, uint32_t flags,
+                     bool analyze_max_stack, const char *manifest,
+                     IncrementalStats *stats);
@@ -0,0 +1,373 @@
+#include "irfile-writer.h"
+#include "irfile.h"
+#include "common.h"
+#include "output.h"
+#include "profile.h"
+#include <string.h>
+
+#define DUMP_BUFFER_SIZE 256
+#define INITIAL_TABLE_SIZE 1024
+#define INITIAL_STRTAB_SIZE (64*1024)
+
+// Open addressing map from non-zero 64-bit keys to 32-bit indices,
+// doubled in the arena at 50% load.
+typedef struct InternTable {
+    uint64_t *keys;
+    uint32_t *values;
+    size_t size;
+    size_t count;
+} InternTable;
+
+typedef struct StringTable {
+    char *data;
+    size_t used;
+    size_t size;
+    // Keyed by string hash, collisions are resolved by comparing the
+    // stored string.
+    InternTable lookup;
+} StringTable;
+
+typedef struct Writer {
+    StackAllocator *stack;
+    LibTcgInterface *libtcg;
+    InternTable temp_lookup;
+    InternTable op_lookup;
+    StringTable strings;
+    IrFileTemp *temps;
+    size_t num_temps;
+    size_t temps_size;
+    size_t num_blocks;
+    size_t num_insts;
+    size_t num_args;
+    size_t num_edges;
+} Writer;
+
+static inline uint64_t hash_u64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t hash_str(const char *str) {
+    // FNV-1a, never 0 so it can be used as a key
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *str != 0; ++str) {
+        h = (h ^ (uint8_t) *str) * 0x100000001b3ull;
+    }
+    return h | 1;
+}
+
+static void table_init(StackAllocator *stack, InternTable *table, size_t size) {
+    *table = (InternTable) {
+        .keys = stack_alloc_zero_tagged(stack, size*sizeof(uint64_t), MEM_TAG_OTHER),
+        .values = stack_alloc_tagged(stack, size*sizeof(uint32_t), MEM_TAG_OTHER),
+        .size = size,
+    };
+}
+
+static size_t table_slot(InternTable *table, uint64_t key) {
+    size_t mask = table->size - 1;
+    size_t i = hash_u64(key) & mask;
+    while (table->keys[i] != 0 && table->keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void table_insert(StackAllocator *stack, InternTable *table,
+                         uint64_t key, uint32_t value) {
+    if (2*(table->count + 1) > table->size) {
+        InternTable old = *table;
+        table_init(stack, table, 2*old.size);
+        for (size_t i = 0; i < old.size; ++i) {
+            if (old.keys[i] != 0) {
+                size_t slot = table_slot(table, old.keys[i]);
+                table->keys[slot] = old.keys[i];
+                table->values[slot] = old.values[i];
+            }
+        }
+        table->count = old.count;
+    }
+    size_t slot = table_slot(table, key);
+    table->keys[slot] = key;
+    table->values[slot] = value;
+    ++table->count;
+}
+
+static uint32_t intern_string(StackAllocator *stack, StringTable *strings,
+                              const char *str) {
+    // Distinct strings with the same hash are stored under h+2, h+4, ...
+    // keeping the key odd and thus non-zero.
+    uint64_t key = hash_str(str);
+    for (;; key += 2) {
+        size_t slot = table_slot(&strings->lookup, key);
+        if (strings->lookup.keys[slot] == 0) {
+            break;
+        }
+        uint32_t offset = strings->lookup.values[slot];
+        if (strcmp(strings->data + offset, str) == 0) {
+            return offset;
+        }
+    }
+
+    size_t len = strlen(str) + 1;
+    if (strings->used + len > strings->size) {
+        size_t size = MAX(2*strings->size, strings->used + len);
+        char *data = stack_alloc_tagged(stack, size, MEM_TAG_OTHER);
+        memcpy(data, strings->data, strings->used);
+        strings->data = data;
+        strings->size = size;
+    }
+    uint32_t offset = strings->used;
+    memcpy(strings->data + offset, str, len);
+    strings->used += len;
+    table_insert(stack, &strings->lookup, key, offset);
+    return offset;
+}
+
+static uint32_t intern_temp(Writer *w, LibTcgTemp *temp) {
+    uint64_t key = (uintptr_t) temp;
+    size_t slot = table_slot(&w->temp_lookup, key);
+    if (w->temp_lookup.keys[slot] != 0) {
+        return w->temp_lookup.values[slot];
+    }
+
+    if (w->num_temps == w->temps_size) {
+        size_t size = 2*w->temps_size;
+        IrFileTemp *temps = stack_alloc_tagged(w->stack, size*sizeof(IrFileTemp), MEM_TAG_OTHER);
+        memcpy(temps, w->temps, w->num_temps*sizeof(IrFileTemp));
+        w->temps = temps;
+        w->temps_size = size;
+    }
+    int64_t value = 0;
+    if (temp->kind == LIBTCG_TEMP_CONST) {
+        value = temp->val;
+    } else if (temp->kind == LIBTCG_TEMP_GLOBAL) {
+        value = temp->mem_offset;
+    }
+    uint32_t index = w->num_temps++;
+    w->temps[index] = (IrFileTemp) {
+        .name = intern_string(w->stack, &w->strings, temp->name),
+        .kind = temp->kind,
+        .value = value,
+    };
+    table_insert(w->stack, &w->temp_lookup, key, index);
+    return index;
+}
+
+static uint32_t intern_op(Writer *w, LibTcgInstruction *inst) {
+    uint64_t key = (uint64_t) inst->opcode + 1;
+    size_t slot = table_slot(&w->op_lookup, key);
+    if (w->op_lookup.keys[slot] != 0) {
+        return w->op_lookup.values[slot];
+    }
+    char name[DUMP_BUFFER_SIZE] = {0};
+    w->libtcg->dump_instruction_name_to_buffer(inst, name, ARRLEN(name));
+    uint32_t offset = intern_string(w->stack, &w->strings, name);
+    table_insert(w->stack, &w->op_lookup, key, offset);
+    return offset;
+}
+
+static inline uint32_t temp_index(Writer *w, LibTcgTemp *temp) {
+    return w->temp_lookup.values[table_slot(&w->temp_lookup, (uintptr_t) temp)];
+}
+
+static inline IrFileArg file_arg(Writer *w, LibTcgArgument *arg) {
+    if (arg->kind == LIBTCG_ARG_TEMP) {
+        return (IrFileArg) {.value = temp_index(w, arg->temp), .kind = IRFILE_ARG_TEMP};
+    }
+    return (IrFileArg) {.value = arg->constant, .kind = IRFILE_ARG_CONSTANT};
+}
+
+static size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t) 7;
+}
+
+// Absent sections have offset 0 and are skipped.
+static void pad_to(Output *out, size_t *offset, size_t target) {
+    static const uint8_t zeros[8] = {0};
+    if (target < *offset) {
+        return;
+    }
+    output_write(out, zeros, target - *offset);
+    *offset = target;
+}
+
+void irfile_write(LibTcgInterface *libtcg, StackAllocator *stack, Output *out,
+                  LibTcgArch arch, TbNode *root, bool analyze_max_stack) {
+    Writer w = {
+        .stack = stack,
+        .libtcg = libtcg,
+        .temps = stack_alloc_tagged(stack, INITIAL_TABLE_SIZE*sizeof(IrFileTemp), MEM_TAG_OTHER),
+        .temps_size = INITIAL_TABLE_SIZE,
+        .strings = {
+            .data = stack_alloc_tagged(stack, INITIAL_STRTAB_SIZE, MEM_TAG_OTHER),
+            .size = INITIAL_STRTAB_SIZE,
+        },
+    };
+    table_init(stack, &w.temp_lookup, INITIAL_TABLE_SIZE);
+    table_init(stack, &w.op_lookup, INITIAL_TABLE_SIZE);
+    table_init(stack, &w.strings.lookup, INITIAL_TABLE_SIZE);
+    // Offset 0 is the empty string
+    intern_string(stack, &w.strings, "");
+
+    // First pass: count records and build the temp and string tables,
+    // both have to be written before the instructions referencing them.
+    size_t num_nodes = number_nodes(root);
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+            intern_op(&w, inst);
+            for (int j = 0; j < inst->nb_oargs; ++j) {
+                if (inst->output_args[j].kind == LIBTCG_ARG_TEMP) {
+                    intern_temp(&w, inst->output_args[j].temp);
+                }
+            }
+            for (int j = 0; j < inst->nb_iargs; ++j) {
+                if (inst->input_args[j].kind == LIBTCG_ARG_TEMP) {
+                    intern_temp(&w, inst->input_args[j].temp);
+                }
+            }
+            w.num_args += inst->nb_oargs + inst->nb_iargs + inst->nb_cargs;
+        }
+        w.num_insts += n->tb.instruction_count;
+        w.num_edges += n->num_succ;
+    }
+    w.num_blocks = num_nodes;
+
+    const struct {
+        size_t count;
+        size_t record_size;
+    } layout[IRFILE_NUM_SECTIONS] = {
+        [IRFILE_SECTION_STRINGS]      = {w.strings.used, 1},
+        [IRFILE_SECTION_TEMPS]        = {w.num_temps,    sizeof(IrFileTemp)},
+        [IRFILE_SECTION_BLOCKS]       = {w.num_blocks,   sizeof(IrFileBlock)},
+        [IRFILE_SECTION_INSTS]        = {w.num_insts,    sizeof(IrFileInst)},
+        [IRFILE_SECTION_ARGS]         = {w.num_args,     sizeof(IrFileArg)},
+        [IRFILE_SECTION_EDGES]        = {w.num_edges,    sizeof(IrFileEdge)},
+        [IRFILE_SECTION_STACK_STATES] = {analyze_max_stack ? w.num_insts : 0,
+                                         sizeof(IrFileStackState)},
+    };
+
+    IrFileHeader header = {
+        .magic = IRFILE_MAGIC,
+        .version = IRFILE_VERSION,
+        .byte_order = IRFILE_BYTE_ORDER,
+        .arch = arch,
+    };
+    size_t offset = align8(sizeof(header));
+    for (size_t i = 0; i < IRFILE_NUM_SECTIONS; ++i) {
+        if (layout[i].count == 0) {
+            continue;
+        }
+        header.sections[i] = (IrFileSection) {
+            .offset = offset,
+            .count = layout[i].count,
+        };
+        offset = align8(offset + layout[i].count*layout[i].record_size);
+    }
+
+    // Second pass: stream the sections in order
+    offset = 0;
+    output_write(out, &header, sizeof(header));
+    offset += sizeof(header);
+
+    pad_to(out, &offset, header.sections[IRFILE_SECTION_STRINGS].offset);
+    output_write(out, w.strings.data, w.strings.used);
+    offset += w.strings.used;
+
+    pad_to(out, &offset, header.sections[IRFILE_SECTION_TEMPS].offset);
+    output_write(out, w.temps, w.num_temps*sizeof(IrFileTemp));
+    offset += w.num_temps*sizeof(IrFileTemp);
+
+    pad_to(out, &offset, header.sections[IRFILE_SECTION_BLOCKS].offset);
+    uint32_t first_inst = 0;
+    uint32_t first_edge = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        IrFileBlock block = {
+            .address = n->address,
+            .size_in_bytes = n->tb.size_in_bytes,
+            .first_inst = first_inst,
+            .num_insts = n->tb.instruction_count,
+            .first_edge = first_edge,
+            .num_edges = n->num_succ,
+        };
+        output_write(out, &block, sizeof(block));
+        first_inst += n->tb.instruction_count;
+        first_edge += n->num_succ;
+    }
+    offset += w.num_blocks*sizeof(IrFileBlock);
+
+    pad_to(out, &offset, header.sections[IRFILE_SECTION_INSTS].offset);
+    uint32_t first_arg = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+            IrFileInst record = {
+                .opcode = inst->opcode,
+                .nb_oargs = inst->nb_oargs,
+                .nb_iargs = inst->nb_iargs,
+                .nb_cargs = inst->nb_cargs,
+                .first_arg = first_arg,
+                .name = intern_op(&w, inst),
+            };
+            output_write(out, &record, sizeof(record));
+            first_arg += inst->nb_oargs + inst->nb_iargs + inst->nb_cargs;
+        }
+    }
+    offset += w.num_insts*sizeof(IrFileInst);
+
+    pad_to(out, &offset, header.sections[IRFILE_SECTION_ARGS].offset);
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+            for (int j = 0; j < inst->nb_oargs; ++j) {
+                IrFileArg arg = file_arg(&w, &inst->output_args[j]);
+                output_write(out, &arg, sizeof(arg));
+            }
+            for (int j = 0; j < inst->nb_iargs; ++j) {
+                IrFileArg arg = file_arg(&w, &inst->input_args[j]);
+                output_write(out, &arg, sizeof(arg));
+            }
+            for (int j = 0; j < inst->nb_cargs; ++j) {
+                IrFileArg arg = {
+                    .value = inst->constant_args[j].constant,
+                    .kind = IRFILE_ARG_CONSTANT,
+                };
+                output_write(out, &arg, sizeof(arg));
+            }
+        }
+    }
+    offset += w.num_args*sizeof(IrFileArg);
+
+    if (w.num_edges > 0) {
+        pad_to(out, &offset, header.sections[IRFILE_SECTION_EDGES].offset);
+        for (TbNode *n = root; n != NULL; n = n->next) {
+            for (size_t i = 0; i < n->num_succ; ++i) {
+                Edge *edge = &n->succ[i];
+                IrFileEdge record = {
+                    .src_block = n->id,
+                    .dst_block = edge->dst_node->id,
+                    .src_instruction = edge->src_instruction,
+                    .type = edge->type,
+                };
+                output_write(out, &record, sizeof(record));
+            }
+        }
+        offset += w.num_edges*sizeof(IrFileEdge);
+    }
+
+    if (analyze_max_stack && w.num_insts > 0) {
+        pad_to(out, &offset, header.sections[IRFILE_SECTION_STACK_STATES].offset);
+        for (TbNode *n = root; n != NULL; n = n->next) {
+            for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+                IrFileStackState record = {
+                    .max_ld_size = n->stack_state[i].max_ld_size,
+                    .max_st_size = n->stack_state[i].max_st_size,
+                };
+                output_write(out, &record, sizeof(record));
+            }
+        }
+    }
+}
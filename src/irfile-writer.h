@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include <qemu/libtcg/libtcg.h>
+#include <qemu/libtcg/libtcg_loader.h>
+
+typedef struct Output Output;
+typedef struct TbNode TbNode;
+typedef struct StackAllocator StackAllocator;
+
+// Serializes the CFG starting at root in the format described in
+// irfile.h. Temps are interned by identity and their names, along with
+// opcode names, deduplicated into the string table. stack is used for
+// scratch data and can be reset afterwards.
+void irfile_write(LibTcgInterface *libtcg, StackAllocator *stack, Output *out,
+                  LibTcgArch arch, TbNode *root, bool analyze_max_stack);
@@ -0,0 +1,166 @@
+#include "irfile.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const size_t record_sizes[IRFILE_NUM_SECTIONS] = {
+    [IRFILE_SECTION_STRINGS]      = 1,
+    [IRFILE_SECTION_TEMPS]        = sizeof(IrFileTemp),
+    [IRFILE_SECTION_BLOCKS]       = sizeof(IrFileBlock),
+    [IRFILE_SECTION_INSTS]        = sizeof(IrFileInst),
+    [IRFILE_SECTION_ARGS]         = sizeof(IrFileArg),
+    [IRFILE_SECTION_EDGES]        = sizeof(IrFileEdge),
+    [IRFILE_SECTION_STACK_STATES] = sizeof(IrFileStackState),
+};
+
+static const void *section(IrFile *file, IrFileSectionKind kind) {
+    const IrFileSection *s = &file->header->sections[kind];
+    return (s->count > 0) ? file->data + s->offset : NULL;
+}
+
+static bool validate_header(IrFile *file, const char *path) {
+    if (file->size < sizeof(IrFileHeader)) {
+        fprintf(stderr, "[error]: %s is too small to be an IR file\n", path);
+        return false;
+    }
+    const IrFileHeader *header = file->header;
+    if (memcmp(header->magic, IRFILE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "[error]: %s is not an IR file\n", path);
+        return false;
+    }
+    if (header->byte_order != IRFILE_BYTE_ORDER) {
+        fprintf(stderr, "[error]: %s was written with a different byte order\n", path);
+        return false;
+    }
+    if (header->version != IRFILE_VERSION) {
+        fprintf(stderr, "[error]: %s has unsupported version %u\n", path, header->version);
+        return false;
+    }
+    for (size_t i = 0; i < IRFILE_NUM_SECTIONS; ++i) {
+        const IrFileSection *s = &header->sections[i];
+        if (s->offset % 8 != 0 ||
+            s->offset > file->size ||
+            s->count > (file->size - s->offset) / record_sizes[i]) {
+            fprintf(stderr, "[error]: %s has a truncated or corrupt section %lu\n", path, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether [first, first+count) lies within [0, size)
+static inline bool in_bounds(uint64_t first, uint64_t count, uint64_t size) {
+    return first <= size && count <= size - first;
+}
+
+static bool corrupt(const char *path, const char *what) {
+    fprintf(stderr, "[error]: %s is corrupt, %s\n", path, what);
+    return false;
+}
+
+// Checks every index and string offset stored in the records, so that
+// accessors never read outside of the file
+static bool validate_records(IrFile *file, const char *path) {
+    if (file->num_strings > 0 && file->strings[file->num_strings - 1] != 0) {
+        return corrupt(path, "unterminated string table");
+    }
+    for (size_t i = 0; i < file->num_temps; ++i) {
+        if (file->temps[i].name >= file->num_strings) {
+            return corrupt(path, "temp name out of bounds");
+        }
+    }
+    for (size_t i = 0; i < file->num_blocks; ++i) {
+        const IrFileBlock *block = &file->blocks[i];
+        if (!in_bounds(block->first_inst, block->num_insts, file->num_insts) ||
+            !in_bounds(block->first_edge, block->num_edges, file->num_edges)) {
+            return corrupt(path, "block instructions or edges out of bounds");
+        }
+    }
+    for (size_t i = 0; i < file->num_insts; ++i) {
+        const IrFileInst *inst = &file->insts[i];
+        uint64_t num_args = (uint64_t) inst->nb_oargs + inst->nb_iargs + inst->nb_cargs;
+        if (inst->name >= file->num_strings ||
+            !in_bounds(inst->first_arg, num_args, file->num_args)) {
+            return corrupt(path, "instruction name or arguments out of bounds");
+        }
+    }
+    for (size_t i = 0; i < file->num_args; ++i) {
+        const IrFileArg *arg = &file->args[i];
+        if ((arg->kind != IRFILE_ARG_TEMP && arg->kind != IRFILE_ARG_CONSTANT) ||
+            (arg->kind == IRFILE_ARG_TEMP && arg->value >= file->num_temps)) {
+            return corrupt(path, "invalid argument");
+        }
+    }
+    for (size_t i = 0; i < file->num_edges; ++i) {
+        const IrFileEdge *edge = &file->edges[i];
+        if (edge->src_block >= file->num_blocks ||
+            edge->dst_block >= file->num_blocks) {
+            return corrupt(path, "edge out of bounds");
+        }
+    }
+    if (file->stack_states != NULL &&
+        file->header->sections[IRFILE_SECTION_STACK_STATES].count != file->num_insts) {
+        return corrupt(path, "stack states do not match instructions");
+    }
+    return true;
+}
+
+bool irfile_open(const char *path, IrFile *file) {
+    *file = (IrFile) {0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "[error]: Failed to open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "[error]: Failed to mmap %s\n", path);
+        return false;
+    }
+
+    file->data = data;
+    file->size = st.st_size;
+    file->header = data;
+    if (!validate_header(file, path)) {
+        irfile_close(file);
+        return false;
+    }
+
+    const IrFileSection *sections = file->header->sections;
+    file->strings      = section(file, IRFILE_SECTION_STRINGS);
+    file->temps        = section(file, IRFILE_SECTION_TEMPS);
+    file->blocks       = section(file, IRFILE_SECTION_BLOCKS);
+    file->insts        = section(file, IRFILE_SECTION_INSTS);
+    file->args         = section(file, IRFILE_SECTION_ARGS);
+    file->edges        = section(file, IRFILE_SECTION_EDGES);
+    file->stack_states = section(file, IRFILE_SECTION_STACK_STATES);
+    file->num_strings  = sections[IRFILE_SECTION_STRINGS].count;
+    file->num_temps    = sections[IRFILE_SECTION_TEMPS].count;
+    file->num_blocks   = sections[IRFILE_SECTION_BLOCKS].count;
+    file->num_insts    = sections[IRFILE_SECTION_INSTS].count;
+    file->num_args     = sections[IRFILE_SECTION_ARGS].count;
+    file->num_edges    = sections[IRFILE_SECTION_EDGES].count;
+    if (!validate_records(file, path)) {
+        irfile_close(file);
+        return false;
+    }
+
+    return true;
+}
+
+void irfile_close(IrFile *file) {
+    if (file->data != NULL) {
+        munmap((void *) file->data, file->size);
+    }
+    *file = (IrFile) {0};
+}
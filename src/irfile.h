@@ -0,0 +1,191 @@
+#pragma once
+
+// Versioned binary container for lifted IR and CFGs, written by
+// dump-ir --dump-bin. The reader side in irfile.c has no dependency on
+// libtcg and can be built on its own as libirfile.a.
+//
+// Layout, all integers in the byte order given by IrFileHeader::byte_order:
+//
+//   IrFileHeader
+//   sections at 8-byte aligned offsets given by IrFileHeader::sections,
+//   each a flat array of the records below:
+//
+//   STRINGS      char[]           NUL-terminated strings, referenced by offset
+//   TEMPS        IrFileTemp[]     interned temps
+//   BLOCKS       IrFileBlock[]    translation blocks in address order
+//   INSTS        IrFileInst[]     instructions of all blocks back to back
+//   ARGS         IrFileArg[]      per instruction: oargs, iargs, cargs
+//   EDGES        IrFileEdge[]     CFG edges grouped by source block
+//   STACK_STATES IrFileStackState[] optional, parallel to INSTS
+//
+// Optional sections have offset and count 0 when absent. irfile_open()
+// checks that sections lie within the file and that every index and
+// string offset stored in a record is in bounds, so the accessors below
+// can be used on any file it accepts.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IRFILE_MAGIC      "LTCGIR\0"
+#define IRFILE_VERSION    2
+#define IRFILE_BYTE_ORDER 0x01020304u
+
+typedef enum IrFileSectionKind {
+    IRFILE_SECTION_STRINGS = 0,
+    IRFILE_SECTION_TEMPS,
+    IRFILE_SECTION_BLOCKS,
+    IRFILE_SECTION_INSTS,
+    IRFILE_SECTION_ARGS,
+    IRFILE_SECTION_EDGES,
+    IRFILE_SECTION_STACK_STATES,
+    IRFILE_NUM_SECTIONS,
+} IrFileSectionKind;
+
+typedef struct IrFileSection {
+    uint64_t offset;
+    // Number of records, bytes for IRFILE_SECTION_STRINGS
+    uint64_t count;
+} IrFileSection;
+
+typedef struct IrFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // LibTcgArch of the lifter that produced the IR
+    uint32_t arch;
+    uint32_t reserved;
+    IrFileSection sections[IRFILE_NUM_SECTIONS];
+} IrFileHeader;
+
+typedef struct IrFileTemp {
+    // Offset into IRFILE_SECTION_STRINGS
+    uint32_t name;
+    // LibTcgTempKind
+    uint8_t kind;
+    uint8_t reserved[3];
+    // Value of constants, env offset of globals
+    int64_t value;
+} IrFileTemp;
+
+typedef struct IrFileBlock {
+    uint64_t address;
+    uint32_t size_in_bytes;
+    uint32_t first_inst;
+    uint32_t num_insts;
+    uint32_t first_edge;
+    uint32_t num_edges;
+    uint32_t reserved;
+} IrFileBlock;
+
+typedef struct IrFileInst {
+    // LibTcgOpcode, only meaningful for the same libtcg version,
+    // prefer name.
+    uint16_t opcode;
+    uint8_t nb_oargs;
+    uint8_t nb_iargs;
+    uint8_t nb_cargs;
+    uint8_t reserved[3];
+    // Index of the first argument in IRFILE_SECTION_ARGS
+    uint32_t first_arg;
+    // Offset of the opcode name into IRFILE_SECTION_STRINGS
+    uint32_t name;
+} IrFileInst;
+
+typedef enum IrFileArgKind {
+    // value is an index into IRFILE_SECTION_TEMPS
+    IRFILE_ARG_TEMP = 0,
+    // value is the constant itself, for all cargs and for iargs that
+    // are not temps
+    IRFILE_ARG_CONSTANT,
+} IrFileArgKind;
+
+typedef struct IrFileArg {
+    uint64_t value;
+    // IrFileArgKind
+    uint32_t kind;
+    uint32_t reserved;
+} IrFileArg;
+
+typedef struct IrFileEdge {
+    uint32_t src_block;
+    uint32_t dst_block;
+    // As recorded by CFG construction, not checked by irfile_open()
+    uint32_t src_instruction;
+    // EdgeType
+    uint32_t type;
+} IrFileEdge;
+
+typedef struct IrFileStackState {
+    int64_t max_ld_size;
+    int64_t max_st_size;
+} IrFileStackState;
+
+// Read-only view of an mmap'ed file, records are accessed in place.
+typedef struct IrFile {
+    const uint8_t *data;
+    size_t size;
+    const IrFileHeader *header;
+    const char *strings;
+    const IrFileTemp *temps;
+    const IrFileBlock *blocks;
+    const IrFileInst *insts;
+    const IrFileArg *args;
+    const IrFileEdge *edges;
+    const IrFileStackState *stack_states;
+    size_t num_strings;
+    size_t num_temps;
+    size_t num_blocks;
+    size_t num_insts;
+    size_t num_args;
+    size_t num_edges;
+} IrFile;
+
+bool irfile_open(const char *path, IrFile *file);
+void irfile_close(IrFile *file);
+
+static inline const char *irfile_string(const IrFile *file, uint32_t offset) {
+    return file->strings + offset;
+}
+
+static inline const IrFileInst *irfile_block_insts(const IrFile *file,
+                                                   const IrFileBlock *block) {
+    return &file->insts[block->first_inst];
+}
+
+static inline const IrFileEdge *irfile_block_edges(const IrFile *file,
+                                                   const IrFileBlock *block) {
+    return &file->edges[block->first_edge];
+}
+
+static inline const IrFileTemp *irfile_arg_temp(const IrFile *file,
+                                                const IrFileArg *arg) {
+    return (arg->kind == IRFILE_ARG_TEMP) ? &file->temps[arg->value] : NULL;
+}
+
+// NULL if the argument is a constant, see irfile_iarg_value()
+static inline const IrFileTemp *irfile_oarg(const IrFile *file,
+                                            const IrFileInst *inst,
+                                            size_t i) {
+    return irfile_arg_temp(file, &file->args[inst->first_arg + i]);
+}
+
+// NULL if the argument is a constant, see irfile_iarg_value()
+static inline const IrFileTemp *irfile_iarg(const IrFile *file,
+                                            const IrFileInst *inst,
+                                            size_t i) {
+    return irfile_arg_temp(file, &file->args[inst->first_arg + inst->nb_oargs + i]);
+}
+
+// Value of a constant iarg
+static inline uint64_t irfile_iarg_value(const IrFile *file,
+                                         const IrFileInst *inst,
+                                         size_t i) {
+    return file->args[inst->first_arg + inst->nb_oargs + i].value;
+}
+
+static inline uint64_t irfile_carg(const IrFile *file,
+                                   const IrFileInst *inst,
+                                   size_t i) {
+    return file->args[inst->first_arg + inst->nb_oargs + inst->nb_iargs + i].value;
+}
@@ -0,0 +1,211 @@
+#include "json-export.h"
+#include "common.h"
+#include "output.h"
+#include "analyze-max-stack.h"
+#include "analyze-reg-src.h"
+#include <qemu/libtcg/libtcg.h>
+#include <string.h>
+
+#define DUMP_BUFFER_SIZE 256
+
+static const char *edge_type_names[] = {
+    [DIRECT]      = "direct",
+    [INDIRECT]    = "indirect",
+    [FALLTHROUGH] = "fallthrough",
+};
+
+static const char *temp_kind_name(LibTcgTempKind kind) {
+    switch (kind) {
+    case LIBTCG_TEMP_EBB:    return "ebb";
+    case LIBTCG_TEMP_TB:     return "tb";
+    case LIBTCG_TEMP_GLOBAL: return "global";
+    case LIBTCG_TEMP_FIXED:  return "fixed";
+    case LIBTCG_TEMP_CONST:  return "const";
+    default:                 return "unknown";
+    }
+}
+
+void json_string(Output *out, const char *str) {
+    static const char digits[] = "0123456789abcdef";
+    output_char(out, '"');
+    const char *begin = str;
+    for (; *str != 0; ++str) {
+        unsigned char c = *str;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        output_write(out, begin, str - begin);
+        begin = str + 1;
+        switch (c) {
+        case '"':  OUTPUT_LIT(out, "\\\""); break;
+        case '\\': OUTPUT_LIT(out, "\\\\"); break;
+        case '\n': OUTPUT_LIT(out, "\\n");  break;
+        case '\t': OUTPUT_LIT(out, "\\t");  break;
+        default:
+            OUTPUT_LIT(out, "\\u00");
+            output_char(out, digits[c >> 4]);
+            output_char(out, digits[c & 0xf]);
+        }
+    }
+    output_write(out, begin, str - begin);
+    output_char(out, '"');
+}
+
+static void json_address(Output *out, uint64_t address) {
+    OUTPUT_LIT(out, "\"0x");
+    output_hex(out, address);
+    output_char(out, '"');
+}
+
+static void json_temp_arg(Output *out, LibTcgArgument *arg) {
+    if (arg->kind != LIBTCG_ARG_TEMP) {
+        OUTPUT_LIT(out, "null");
+        return;
+    }
+    if (arg->temp->kind == LIBTCG_TEMP_CONST) {
+        OUTPUT_LIT(out, "{\"const\":");
+        output_i64(out, arg->temp->val);
+    } else {
+        OUTPUT_LIT(out, "{\"temp\":");
+        json_string(out, arg->temp->name);
+        OUTPUT_LIT(out, ",\"kind\":\"");
+        output_str(out, temp_kind_name(arg->temp->kind));
+        output_char(out, '"');
+    }
+    output_char(out, '}');
+}
+
+static void json_block(LibTcgInterface *libtcg, Output *out, TbNode *n) {
+    OUTPUT_LIT(out, "{\"type\":\"block\",\"address\":");
+    json_address(out, n->address);
+    OUTPUT_LIT(out, ",\"size\":");
+    output_u64(out, n->tb.size_in_bytes);
+    OUTPUT_LIT(out, ",\"ops\":[");
+
+    uint64_t address = n->address;
+    char name[DUMP_BUFFER_SIZE];
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
+        if (inst->opcode == LIBTCG_op_insn_start) {
+            address = inst->constant_args[0].constant;
+        }
+
+        name[0] = 0;
+        libtcg->dump_instruction_name_to_buffer(inst, name, ARRLEN(name));
+        if (i > 0) {
+            output_char(out, ',');
+        }
+        OUTPUT_LIT(out, "{\"op\":");
+        json_string(out, name);
+        OUTPUT_LIT(out, ",\"addr\":");
+        json_address(out, address);
+
+        OUTPUT_LIT(out, ",\"oargs\":[");
+        for (int j = 0; j < inst->nb_oargs; ++j) {
+            if (j > 0) {
+                output_char(out, ',');
+            }
+            json_temp_arg(out, &inst->output_args[j]);
+        }
+        OUTPUT_LIT(out, "],\"iargs\":[");
+        for (int j = 0; j < inst->nb_iargs; ++j) {
+            if (j > 0) {
+                output_char(out, ',');
+            }
+            json_temp_arg(out, &inst->input_args[j]);
+        }
+        OUTPUT_LIT(out, "],\"cargs\":[");
+        for (int j = 0; j < inst->nb_cargs; ++j) {
+            if (j > 0) {
+                output_char(out, ',');
+            }
+            output_i64(out, inst->constant_args[j].constant);
+        }
+        OUTPUT_LIT(out, "]}");
+    }
+    OUTPUT_LIT(out, "]}\n");
+}
+
+static void json_edges(Output *out, TbNode *n) {
+    for (size_t i = 0; i < n->num_succ; ++i) {
+        Edge *edge = &n->succ[i];
+        OUTPUT_LIT(out, "{\"type\":\"edge\",\"src\":");
+        json_address(out, n->address);
+        OUTPUT_LIT(out, ",\"dst\":");
+        json_address(out, edge->dst_node->address);
+        OUTPUT_LIT(out, ",\"kind\":\"");
+        output_str(out, edge_type_names[edge->type]);
+        OUTPUT_LIT(out, "\",\"src_instruction\":");
+        output_u64(out, edge->src_instruction);
+        OUTPUT_LIT(out, "}\n");
+    }
+}
+
+static void json_stack_size(Output *out, int64_t size) {
+    if (size == STACK_SIZE_TOP) {
+        OUTPUT_LIT(out, "null");
+    } else {
+        output_i64(out, size);
+    }
+}
+
+static void json_max_stack(Output *out, TbNode *n) {
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        OUTPUT_LIT(out, "{\"type\":\"max_stack\",\"block\":");
+        json_address(out, n->address);
+        OUTPUT_LIT(out, ",\"index\":");
+        output_u64(out, i);
+        OUTPUT_LIT(out, ",\"max_ld\":");
+        json_stack_size(out, n->stack_state[i].max_ld_size);
+        OUTPUT_LIT(out, ",\"max_st\":");
+        json_stack_size(out, n->stack_state[i].max_st_size);
+        OUTPUT_LIT(out, "}\n");
+    }
+}
+
+static void json_reg_src(Output *out, TbNode *n) {
+    if (n->reg_src_info == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        SrcInfo *info = n->reg_src_info[i];
+        if (info == NULL) {
+            continue;
+        }
+        OUTPUT_LIT(out, "{\"type\":\"reg_src\",\"block\":");
+        json_address(out, n->address);
+        OUTPUT_LIT(out, ",\"index\":");
+        output_u64(out, i);
+        OUTPUT_LIT(out, ",\"op_index\":");
+        output_i64(out, info->op_index);
+        OUTPUT_LIT(out, "}\n");
+    }
+}
+
+void json_export(LibTcgInterface *libtcg, Output *out, TbNode *root,
+                 bool analyze_max_stack, bool analyze_reg_src) {
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        json_block(libtcg, out, n);
+        json_edges(out, n);
+        if (analyze_max_stack) {
+            json_max_stack(out, n);
+        }
+        if (analyze_reg_src) {
+            json_reg_src(out, n);
+        }
+    }
+}
+
+void json_external_edges(Output *out, const ExternalEdge *edges, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        OUTPUT_LIT(out, "{\"type\":\"external\",\"src\":");
+        json_address(out, edges[i].src);
+        OUTPUT_LIT(out, ",\"dst\":");
+        json_address(out, edges[i].dst);
+        OUTPUT_LIT(out, ",\"kind\":\"");
+        output_str(out, edge_type_names[edges[i].type]);
+        OUTPUT_LIT(out, "\",\"src_instruction\":");
+        output_u64(out, edges[i].src_instruction);
+        OUTPUT_LIT(out, "}\n");
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Output Output;
+typedef struct TbNode TbNode;
+typedef struct LibTcgInterface LibTcgInterface;
+typedef struct ExternalEdge ExternalEdge;
+
+void json_string(Output *out, const char *str);
+
+// Streams the lifted IR, CFG and analysis results as JSON lines, one
+// record per line:
+//
+//   {"type":"block","address":"0x..","size":N,"ops":[...]}
+//   {"type":"edge","src":"0x..","dst":"0x..","kind":"direct","src_instruction":N}
+//   {"type":"max_stack","block":"0x..","index":N,"max_ld":N,"max_st":N}
+//   {"type":"reg_src","block":"0x..","index":N,"op_index":N}
+//
+// Each op in a block record holds "op", the guest address "addr" of
+// the instruction it belongs to, and "oargs"/"iargs"/"cargs". Temps are
+// written as {"temp":name,"kind":kind} and constant temps as
+// {"const":N}. Unknown max_stack values (STACK_SIZE_TOP) are null.
+void json_export(LibTcgInterface *libtcg, Output *out, TbNode *root,
+                 bool analyze_max_stack, bool analyze_reg_src);
+
+// Edges to blocks that were not exported with the same root, one
+// record each, with the same fields as edge records:
+//
+//   {"type":"external","src":"0x..","dst":"0x..","kind":"direct","src_instruction":N}
+void json_external_edges(Output *out, const ExternalEdge *edges, size_t count);
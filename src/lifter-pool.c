@@ -0,0 +1,41 @@
+#include "lifter-pool.h"
+#include "stack_alloc.h"
+#include "stats.h"
+#include <assert.h>
+
+static _Thread_local StackAllocator *arena;
+
+void *lifter_alloc(size_t size) {
+    assert(arena != NULL);
+    return stack_alloc_tagged(arena, size, MEM_TAG_LIBTCG_IR);
+}
+
+void lifter_set_arena(StackAllocator *stack) {
+    arena = stack;
+}
+
+void lifter_pool_init(LifterPool *pool, LibTcgDesc desc) {
+    *pool = (LifterPool) {
+        .desc = desc,
+    };
+}
+
+Lifter *lifter_pool_get(LifterPool *pool, LibTcgArch arch) {
+    assert(arch > LIBTCG_ARCH_NONE && arch < LIBTCG_ARCH_NUM);
+    Lifter *lifter = &pool->lifters[arch];
+    if (lifter->context == NULL) {
+        uint64_t t = stats_begin();
+        libtcg_open(arch, &pool->desc, &lifter->libtcg, &lifter->context);
+        stats_end(STATS_TIMER_LIBTCG_OPEN, t);
+    }
+    return lifter;
+}
+
+void lifter_pool_close(LifterPool *pool) {
+    for (int arch = LIBTCG_ARCH_NONE + 1; arch < LIBTCG_ARCH_NUM; ++arch) {
+        if (pool->lifters[arch].context != NULL) {
+            libtcg_close(arch);
+            pool->lifters[arch].context = NULL;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <qemu/libtcg/libtcg.h>
+#include <qemu/libtcg/libtcg_loader.h>
+
+typedef struct StackAllocator StackAllocator;
+
+typedef struct Lifter {
+    LibTcgInterface libtcg;
+    LibTcgContext *context;
+} Lifter;
+
+// Lifters of different architectures, each opened on first use and
+// kept open until lifter_pool_close(). ARM and Thumb code share the
+// ARM lifter, the mode is picked per block with
+// LIBTCG_TRANSLATE_ARM_THUMB, see cfg_lift().
+typedef struct LifterPool {
+    LibTcgDesc desc;
+    // Indexed by arch, context is NULL until opened
+    Lifter lifters[LIBTCG_ARCH_NUM];
+} LifterPool;
+
+// mem_alloc callback for lifters, libtcg only passes the size so the
+// arena is set per thread with lifter_set_arena(). Lets other threads
+// lift with a lifter of their own, or one handed to them, without
+// sharing an arena.
+void *lifter_alloc(size_t size);
+void lifter_set_arena(StackAllocator *stack);
+
+void lifter_pool_init(LifterPool *pool, LibTcgDesc desc);
+Lifter *lifter_pool_get(LifterPool *pool, LibTcgArch arch);
+void lifter_pool_close(LifterPool *pool);
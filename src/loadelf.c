@@ -1,5 +1,6 @@
 #include "loadelf.h"
 #include "util.h"
+#include "stack_alloc.h"
 #include "linux-headers/elf.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -108,7 +109,7 @@ static LibTcgArch elf_machine_to_libtcg(bool little_endian,
         }                                                                   \
     } while (0)
 
-#define FIND_SYMBOL(Sym, data, s_hdr, ekind, ename, sym)                    \
+#define FIND_SYMBOL(Sym, data, s_hdr, strtab, ekind, ename, sym)            \
     do {                                                                    \
         for (uint64_t off = 0;                                              \
              off < bswaptl(data, s_hdr->sh_size);                           \
@@ -117,9 +118,10 @@ static LibTcgArch elf_machine_to_libtcg(bool little_endian,
                               bswaptl(data, s_hdr->sh_offset) +             \
                               off);                                         \
             uint64_t name_off = bswap32(data, s->st_name);                  \
-            const char *name = (const char *) (data->strtable + name_off);  \
+            const char *name = (const char *) (strtab + name_off);          \
             uint8_t type = ELF64_ST_TYPE(s->st_info);                       \
             if ((type == ekind || type == STT_NOTYPE) &&                    \
+                bswap16(data, s->st_shndx) != SHN_UNDEF &&                  \
                 strcmp(name, ename) == 0) {                                 \
                 sym = s;                                                    \
                 break;                                                      \
@@ -127,26 +129,221 @@ static LibTcgArch elf_machine_to_libtcg(bool little_endian,
         }                                                                   \
     } while (0)
 
-#define POPULATE_ELF_DATA(Ehdr, Shdr, data)                                 \
+// Counts all defined STT_FUNC symbols with a non-zero size in a
+// section that is backed by file data, and stores them to functions
+// unless it is NULL.
+#define COLLECT_FUNCTIONS(Shdr, Sym, data, s_hdr, functions, count)         \
+    do {                                                                    \
+        for (uint64_t off = 0;                                              \
+             off < bswaptl(data, s_hdr->sh_size);                           \
+             off += bswaptl(data, s_hdr->sh_entsize)) {                     \
+            Sym *s = (Sym *) (data->buffer +                                \
+                              bswaptl(data, s_hdr->sh_offset) +             \
+                              off);                                         \
+            uint16_t shndx = bswap16(data, s->st_shndx);                    \
+            uint64_t fn_size = bswaptl(data, s->st_size);                   \
+            if (ELF64_ST_TYPE(s->st_info) != STT_FUNC || fn_size == 0 ||    \
+                shndx == SHN_UNDEF || shndx >= data->shnum) {               \
+                continue;                                                   \
+            }                                                               \
+            Shdr *sec = (Shdr *) (data->buffer + data->shoff +              \
+                                  shndx*data->shentsize);                   \
+            uint64_t sec_addr = bswaptl(data, sec->sh_addr);                \
+            uint64_t sec_size = bswaptl(data, sec->sh_size);                \
+            uint64_t fn_addr = bswaptl(data, s->st_value);                  \
+            if (bswap32(data, sec->sh_type) == SHT_NOBITS ||                \
+                fn_addr < sec_addr ||                                       \
+                fn_addr - sec_addr + fn_size > sec_size) {                  \
+                continue;                                                   \
+            }                                                               \
+            if ((functions) != NULL) {                                      \
+                ElfFunction *fn = &(functions)[count];                      \
+                fn->name = (const char *) (data->strtable +                 \
+                                           bswap32(data, s->st_name));      \
+                fn->view.address = fn_addr;                                 \
+                fn->view.data = data->buffer +                              \
+                                bswaptl(data, sec->sh_offset) +             \
+                                (fn_addr - sec_addr);                       \
+                fn->view.size = fn_size;                                    \
+            }                                                               \
+            ++count;                                                        \
+        }                                                                   \
+    } while (0)
+
+// Counts defined function symbols of a symbol table section and stores
+// them to symbols unless it is NULL.
+#define COLLECT_SYMBOLS(Sym, data, s_hdr, strtab, symbols, count)           \
+    do {                                                                    \
+        uint64_t entsize = bswaptl(data, s_hdr->sh_entsize);                \
+        uint64_t size = bswaptl(data, s_hdr->sh_size);                      \
+        uint64_t offset = bswaptl(data, s_hdr->sh_offset);                  \
+        if (entsize < sizeof(Sym) || offset > data->size ||                 \
+            size > data->size - offset) {                                   \
+            break;                                                          \
+        }                                                                   \
+        for (uint64_t off = 0; off + entsize <= size; off += entsize) {     \
+            Sym *s = (Sym *) (data->buffer + offset + off);                 \
+            uint8_t type = ELF64_ST_TYPE(s->st_info);                       \
+            uint64_t value = bswaptl(data, s->st_value);                    \
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||              \
+                bswap16(data, s->st_shndx) == SHN_UNDEF || value == 0) {    \
+                continue;                                                   \
+            }                                                               \
+            if ((symbols) != NULL) {                                        \
+                /* Thumb functions have the lowest bit set */               \
+                if (data->machine == EM_ARM) {                              \
+                    value &= ~((uint64_t) 1);                               \
+                }                                                           \
+                (symbols)[count] = (ElfSymbol) {                            \
+                    .address = value,                                       \
+                    .size = bswaptl(data, s->st_size),                      \
+                    .name = (const char *) (strtab +                        \
+                                            bswap32(data, s->st_name)),     \
+                    .kind = ELF_SYMBOL_FUNCTION,                            \
+                };                                                          \
+            }                                                               \
+            ++count;                                                        \
+        }                                                                   \
+    } while (0)
+
+// Counts the .rel(a).plt entries in rel_hdr that refer to a named
+// symbol and, unless symbols is NULL, stores a stub symbol for each
+// one that a stub address is found for.
+#define COLLECT_PLT_STUBS(Shdr, Sym, Rel, R_SYM, stack, data, rel_hdr,      \
+                          plt, plt_sec, symbols, count)                     \
+    do {                                                                    \
+        uint32_t link = bswap32(data, rel_hdr->sh_link);                    \
+        if (link == SHN_UNDEF || link >= data->shnum) {                     \
+            break;                                                          \
+        }                                                                   \
+        Shdr *sym_hdr = (Shdr *) (data->buffer + data->shoff +              \
+                                  link*data->shentsize);                    \
+        uint8_t *strtab = linked_strtab(data,                               \
+                                        bswap32(data, sym_hdr->sh_link));   \
+        uint64_t sym_entsize = bswaptl(data, sym_hdr->sh_entsize);          \
+        uint64_t sym_offset = bswaptl(data, sym_hdr->sh_offset);            \
+        uint64_t num_syms = (sym_entsize > 0)                               \
+                          ? bswaptl(data, sym_hdr->sh_size)/sym_entsize     \
+                          : 0;                                              \
+        uint64_t entsize = bswaptl(data, rel_hdr->sh_entsize);              \
+        uint64_t size = bswaptl(data, rel_hdr->sh_size);                    \
+        uint64_t offset = bswaptl(data, rel_hdr->sh_offset);                \
+        if (strtab == NULL || sym_entsize < sizeof(Sym) ||                  \
+            sym_offset > data->size ||                                      \
+            num_syms*sym_entsize > data->size - sym_offset ||               \
+            entsize < sizeof(Rel) || offset > data->size ||                 \
+            size > data->size - offset) {                                   \
+            break;                                                          \
+        }                                                                   \
+        for (uint64_t i = 0; (i+1)*entsize <= size; ++i) {                  \
+            Rel *r = (Rel *) (data->buffer + offset + i*entsize);           \
+            uint64_t sym_index = R_SYM(bswaptl(data, r->r_info));           \
+            if (sym_index == 0 || sym_index >= num_syms) {                  \
+                continue;                                                   \
+            }                                                               \
+            Sym *s = (Sym *) (data->buffer + sym_offset +                   \
+                              sym_index*sym_entsize);                       \
+            const char *name = (const char *) (strtab +                     \
+                                               bswap32(data, s->st_name));  \
+            uint64_t got = bswaptl(data, r->r_offset);                      \
+            uint64_t stub = plt_stub_address(data, plt, plt_sec, i, got);   \
+            if (stub == 0 || *name == 0) {                                  \
+                continue;                                                   \
+            }                                                               \
+            if ((symbols) != NULL) {                                        \
+                size_t len = strlen(name) + sizeof("@plt");                 \
+                char *plt_name = stack_alloc_tagged(stack, len,             \
+                                                    MEM_TAG_OTHER);         \
+                snprintf(plt_name, len, "%s@plt", name);                    \
+                (symbols)[count] = (ElfSymbol) {                            \
+                    .address = stub,                                        \
+                    .size = plt.entry_size,                                 \
+                    .name = plt_name,                                       \
+                    .kind = ELF_SYMBOL_PLT,                                 \
+                };                                                          \
+            }                                                               \
+            ++count;                                                        \
+        }                                                                   \
+    } while (0)
+
+// Section headers are only used if they are fully inside the file and
+// the section name string table is valid, otherwise shnum is set to 0
+// so that section and symbol lookups fail instead of reading garbage.
+#define POPULATE_ELF_DATA(Ehdr, Shdr, Phdr, stack, data)                   \
     do {                                                                    \
         Ehdr *e_hdr = (Ehdr *) data->buffer;                                \
         data->shoff     = bswaptl(data, e_hdr->e_shoff);                    \
         data->shentsize = bswap16(data, e_hdr->e_shentsize);                \
         data->shnum     = bswap16(data, e_hdr->e_shnum);                    \
+        data->shstrtable = NULL;                                            \
+        data->strtable = NULL;                                              \
         uint16_t shstrndx = bswap16(data, e_hdr->e_shstrndx);               \
-        Shdr *strtable_hdr = (Shdr *) (data->buffer +                       \
-                                       data->shoff +                        \
-                                       shstrndx*data->shentsize);           \
-        assert(bswap32(data, strtable_hdr->sh_type) == SHT_STRTAB);         \
-        data->shstrtable = data->buffer +                                   \
-                           bswaptl(data, strtable_hdr->sh_offset);          \
+        if (data->shnum > 0 &&                                              \
+            (data->shentsize < sizeof(Shdr) ||                              \
+             data->shoff > data->size ||                                    \
+             (uint64_t) data->shnum*data->shentsize >                       \
+                 data->size - data->shoff ||                                \
+             shstrndx >= data->shnum)) {                                    \
+            fprintf(stderr, "Ignoring invalid section headers\n");          \
+            data->shnum = 0;                                                \
+        }                                                                   \
+        if (data->shnum > 0) {                                              \
+            Shdr *strtable_hdr = (Shdr *) (data->buffer +                   \
+                                           data->shoff +                    \
+                                           shstrndx*data->shentsize);       \
+            if (bswap32(data, strtable_hdr->sh_type) != SHT_STRTAB ||       \
+                bswaptl(data, strtable_hdr->sh_offset) >= data->size) {     \
+                fprintf(stderr, "Ignoring section headers without a valid " \
+                                "name string table\n");                     \
+                data->shnum = 0;                                            \
+            } else {                                                        \
+                data->shstrtable = data->buffer +                           \
+                                   bswaptl(data, strtable_hdr->sh_offset);  \
+            }                                                               \
+        }                                                                   \
         Shdr *s_hdr = NULL;                                                 \
         FIND_SECTION_HEADER(Shdr, data, SHT_STRTAB, ".strtab", s_hdr);      \
-        if (s_hdr != NULL) {                                                \
+        if (s_hdr != NULL &&                                                \
+            bswaptl(data, s_hdr->sh_offset) < data->size) {                 \
             data->strtable = data->buffer +                                 \
                              bswaptl(data, s_hdr->sh_offset);               \
-        } else {                                                            \
-            data->strtable = 0;                                             \
+        }                                                                   \
+        uint64_t phoff = bswaptl(data, e_hdr->e_phoff);                     \
+        uint16_t phentsize = bswap16(data, e_hdr->e_phentsize);             \
+        uint16_t phnum = bswap16(data, e_hdr->e_phnum);                     \
+        if (phnum > 0 &&                                                    \
+            (phentsize < sizeof(Phdr) ||                                    \
+             phoff > data->size ||                                          \
+             (uint64_t) phnum*phentsize > data->size - phoff)) {            \
+            fprintf(stderr, "Ignoring invalid program headers\n");          \
+            phnum = 0;                                                      \
+        }                                                                   \
+        data->num_segments = 0;                                             \
+        data->eh_frame_hdr = 0;                                             \
+        data->segments = stack_alloc_tagged(stack,                          \
+                                            phnum*sizeof(ElfSegment),       \
+                                            MEM_TAG_OTHER);                 \
+        for (int i = 0; i < phnum; ++i) {                                   \
+            Phdr *p_hdr = (Phdr *) (data->buffer + phoff + i*phentsize);    \
+            if (bswap32(data, p_hdr->p_type) == PT_GNU_EH_FRAME) {          \
+                data->eh_frame_hdr = bswaptl(data, p_hdr->p_vaddr);         \
+                continue;                                                   \
+            }                                                               \
+            if (bswap32(data, p_hdr->p_type) != PT_LOAD) {                  \
+                continue;                                                   \
+            }                                                               \
+            ElfSegment *seg = &data->segments[data->num_segments++];        \
+            seg->address = bswaptl(data, p_hdr->p_vaddr);                   \
+            seg->mem_size = bswaptl(data, p_hdr->p_memsz);                  \
+            seg->offset = bswaptl(data, p_hdr->p_offset);                   \
+            seg->file_size = bswaptl(data, p_hdr->p_filesz);                \
+            seg->executable = (bswap32(data, p_hdr->p_flags) & PF_X) != 0;  \
+            /* Truncated images keep whatever part is present */            \
+            if (seg->offset > data->size) {                                 \
+                seg->file_size = 0;                                         \
+            } else if (seg->file_size > data->size - seg->offset) {         \
+                seg->file_size = data->size - seg->offset;                  \
+            }                                                               \
         }                                                                   \
         data->machine = bswap16(data, e_hdr->e_machine);                    \
         data->arch = elf_machine_to_libtcg(data->little_endian,             \
@@ -166,7 +363,8 @@ bool elf_data(StackAllocator *stack, const char *file, ElfData *data) {
     data->size = bytes.size;
 
     /* Verify ELF header */
-    if (data->buffer[EI_MAG0] != ELFMAG0 ||
+    if (data->size < EI_NIDENT ||
+        data->buffer[EI_MAG0] != ELFMAG0 ||
         data->buffer[EI_MAG1] != ELFMAG1 ||
         data->buffer[EI_MAG2] != ELFMAG2 ||
         data->buffer[EI_MAG3] != ELFMAG3) {
@@ -177,16 +375,21 @@ bool elf_data(StackAllocator *stack, const char *file, ElfData *data) {
     data->little_endian = data->buffer[EI_DATA] == ELFDATA2LSB;
     data->is64bit = data->buffer[EI_CLASS] == ELFCLASS64;
 
+    size_t ehdr_size = (data->is64bit) ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    if (data->size < ehdr_size) {
+        fprintf(stderr, "Truncated ELF header for file %s!\n", file);
+        goto fail;
+    }
+
     if (data->is64bit) {
-        POPULATE_ELF_DATA(Elf64_Ehdr, Elf64_Shdr, data);
+        POPULATE_ELF_DATA(Elf64_Ehdr, Elf64_Shdr, Elf64_Phdr, stack, data);
     } else {
-        POPULATE_ELF_DATA(Elf32_Ehdr, Elf32_Shdr, data);
+        POPULATE_ELF_DATA(Elf32_Ehdr, Elf32_Shdr, Elf32_Phdr, stack, data);
     }
 
-    return data;
+    return true;
 fail:
-    free(data);
-    return NULL;
+    return false;
 }
 
 bool elf_section(ElfData *data, const char *section, ElfByteView *view) {
@@ -217,17 +420,64 @@ bool elf_section(ElfData *data, const char *section, ElfByteView *view) {
     return true;
 }
 
+// String table referenced by the sh_link of a section, NULL if it is
+// not a valid string table.
+static uint8_t *linked_strtab(ElfData *data, uint32_t index) {
+    if (index == SHN_UNDEF || index >= data->shnum) {
+        return NULL;
+    }
+    uint8_t *hdr = data->buffer + data->shoff + index*data->shentsize;
+    uint32_t type;
+    uint64_t offset;
+    if (data->is64bit) {
+        Elf64_Shdr *sh = (Elf64_Shdr *) hdr;
+        type = bswap32(data, sh->sh_type);
+        offset = bswaptl(data, sh->sh_offset);
+    } else {
+        Elf32_Shdr *sh = (Elf32_Shdr *) hdr;
+        type = bswap32(data, sh->sh_type);
+        offset = bswaptl(data, sh->sh_offset);
+    }
+    if (type != SHT_STRTAB || offset >= data->size) {
+        return NULL;
+    }
+    return data->buffer + offset;
+}
+
+// Returns the file data of size bytes at virtual address, NULL if the
+// range isn't file backed.
+static uint8_t *segment_data(ElfData *data, uint64_t address, size_t size) {
+    for (size_t i = 0; i < data->num_segments; ++i) {
+        ElfSegment *seg = &data->segments[i];
+        if (address >= seg->address &&
+            address - seg->address < seg->file_size &&
+            size <= seg->file_size - (address - seg->address)) {
+            return data->buffer + seg->offset + (address - seg->address);
+        }
+    }
+    return NULL;
+}
+
 bool elf_function(ElfData *data, const char *fnname, ElfByteView *view) {
     if (data->is64bit) {
         /* Loop over all section headers and look for .text */
         Elf64_Shdr *s_hdr = NULL;
+        Elf64_Sym *sym = NULL;
         FIND_SECTION_HEADER(Elf64_Shdr, data, SHT_SYMTAB, ".symtab", s_hdr);
-        if (s_hdr == NULL) {
-            fprintf(stderr, "Couldn't find symbol table\n");
-            return false;
+        if (s_hdr != NULL) {
+            FIND_SYMBOL(Elf64_Sym, data, s_hdr, data->strtable, STT_FUNC, fnname, sym);
+        }
+        // Stripped shared objects still export their functions
+        if (sym == NULL) {
+            s_hdr = NULL;
+            FIND_SECTION_HEADER(Elf64_Shdr, data, SHT_DYNSYM, ".dynsym", s_hdr);
+            if (s_hdr != NULL) {
+                uint8_t *dynstr = linked_strtab(data, bswap32(data, s_hdr->sh_link));
+                if (dynstr != NULL) {
+                    FIND_SYMBOL(Elf64_Sym, data, s_hdr, dynstr, STT_FUNC, fnname, sym);
+                }
+            }
         }
-        Elf64_Sym *sym = NULL;
-        FIND_SYMBOL(Elf64_Sym, data, s_hdr, STT_FUNC, fnname, sym);
         if (sym == NULL) {
             fprintf(stderr, "Unable to find function symbol \"%s\"\n", fnname);
             return false;
@@ -240,13 +490,22 @@ bool elf_function(ElfData *data, const char *fnname, ElfByteView *view) {
     } else {
         /* Loop over all section headers and look for .text */
         Elf32_Shdr *s_hdr = NULL;
+        Elf32_Sym *sym = NULL;
         FIND_SECTION_HEADER(Elf32_Shdr, data, SHT_SYMTAB, ".symtab", s_hdr);
-        if (s_hdr == NULL) {
-            fprintf(stderr, "Couldn't find symbol table\n");
-            return false;
+        if (s_hdr != NULL) {
+            FIND_SYMBOL(Elf32_Sym, data, s_hdr, data->strtable, STT_FUNC, fnname, sym);
+        }
+        // Stripped shared objects still export their functions
+        if (sym == NULL) {
+            s_hdr = NULL;
+            FIND_SECTION_HEADER(Elf32_Shdr, data, SHT_DYNSYM, ".dynsym", s_hdr);
+            if (s_hdr != NULL) {
+                uint8_t *dynstr = linked_strtab(data, bswap32(data, s_hdr->sh_link));
+                if (dynstr != NULL) {
+                    FIND_SYMBOL(Elf32_Sym, data, s_hdr, dynstr, STT_FUNC, fnname, sym);
+                }
+            }
         }
-        Elf32_Sym *sym = NULL;
-        FIND_SYMBOL(Elf32_Sym, data, s_hdr, STT_FUNC, fnname, sym);
         if (sym == NULL) {
             fprintf(stderr, "Unable to find function symbol \"%s\"\n", fnname);
             return false;
@@ -260,3 +519,782 @@ bool elf_function(ElfData *data, const char *fnname, ElfByteView *view) {
 
     return true;
 }
+
+// Functions of stripped binaries, taken from the symbol table built by
+// elf_symbol_table() which includes the .dynsym exports and FDE ranges.
+static size_t table_functions(StackAllocator *stack, ElfData *data,
+                              ElfFunction **functions) {
+    ElfSymbolTable table;
+    elf_symbol_table(stack, data, &table);
+    *functions = stack_alloc_tagged(stack, table.count*sizeof(ElfFunction), MEM_TAG_OTHER);
+    size_t count = 0;
+    for (size_t i = 0; i < table.count; ++i) {
+        ElfSymbol *sym = &table.symbols[i];
+        uint8_t *bytes = segment_data(data, sym->address, sym->size);
+        if (sym->kind == ELF_SYMBOL_PLT || sym->size == 0 || bytes == NULL) {
+            continue;
+        }
+        (*functions)[count++] = (ElfFunction) {
+            .name = sym->name,
+            .view = {sym->address, bytes, sym->size},
+        };
+    }
+    if (count == 0) {
+        fprintf(stderr, "Couldn't find symbol table or unwind information\n");
+    }
+    return count;
+}
+
+size_t elf_functions(StackAllocator *stack, ElfData *data,
+                     ElfFunction **functions) {
+    if (data->strtable == NULL) {
+        return table_functions(stack, data, functions);
+    }
+
+    // First pass counts, second pass fills in
+    size_t count = 0;
+    *functions = NULL;
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t num_functions = 0;
+        if (data->is64bit) {
+            Elf64_Shdr *s_hdr = NULL;
+            FIND_SECTION_HEADER(Elf64_Shdr, data, SHT_SYMTAB, ".symtab", s_hdr);
+            if (s_hdr == NULL) {
+                return table_functions(stack, data, functions);
+            }
+            COLLECT_FUNCTIONS(Elf64_Shdr, Elf64_Sym, data, s_hdr,
+                              *functions, num_functions);
+        } else {
+            Elf32_Shdr *s_hdr = NULL;
+            FIND_SECTION_HEADER(Elf32_Shdr, data, SHT_SYMTAB, ".symtab", s_hdr);
+            if (s_hdr == NULL) {
+                return table_functions(stack, data, functions);
+            }
+            COLLECT_FUNCTIONS(Elf32_Shdr, Elf32_Sym, data, s_hdr,
+                              *functions, num_functions);
+        }
+        if (pass == 0) {
+            count = num_functions;
+            *functions = stack_alloc_tagged(stack, count*sizeof(ElfFunction), MEM_TAG_OTHER);
+        }
+    }
+
+    return count;
+}
+
+bool elf_address_range(ElfData *data, uint64_t address, size_t size,
+                       ElfByteView *view) {
+    for (size_t i = 0; i < data->num_segments; ++i) {
+        ElfSegment *seg = &data->segments[i];
+        if (address < seg->address || address - seg->address >= seg->mem_size) {
+            continue;
+        }
+        uint64_t off = address - seg->address;
+        if (off >= seg->file_size) {
+            fprintf(stderr, "Address 0x%lx is not backed by file data\n", address);
+            return false;
+        }
+        if (size == 0) {
+            size = seg->file_size - off;
+        } else if (size > seg->file_size - off) {
+            fprintf(stderr, "Range 0x%lx-0x%lx extends past the end of its segment\n",
+                    address, address + size);
+            return false;
+        }
+        view->address = address;
+        view->data = data->buffer + seg->offset + off;
+        view->size = size;
+        return true;
+    }
+    fprintf(stderr, "Address 0x%lx is not in any loadable segment\n", address);
+    return false;
+}
+
+typedef struct PltSection {
+    uint64_t address;
+    uint64_t size;
+    uint64_t header_size;
+    uint64_t entry_size;
+} PltSection;
+
+// Lazy binding PLTs start with a header followed by one stub per
+// .rel(a).plt entry, in order. Returns false for unknown layouts.
+static bool plt_layout(ElfData *data, PltSection *plt) {
+    switch (data->machine) {
+    case EM_386:
+    case EM_X86_64:  plt->header_size = 16; plt->entry_size = 16; return true;
+    case EM_AARCH64: plt->header_size = 32; plt->entry_size = 16; return true;
+    case EM_ARM:     plt->header_size = 20; plt->entry_size = 12; return true;
+    default:         return false;
+    }
+}
+
+static uint64_t plt_stub_address(ElfData *data, PltSection plt,
+                                 PltSection plt_sec, uint64_t index,
+                                 uint64_t got) {
+    // With IBT, calls go through .plt.sec which has no header
+    if (plt_sec.size > 0) {
+        uint64_t stub = plt_sec.address + index*plt_sec.entry_size;
+        return (stub < plt_sec.address + plt_sec.size) ? stub : 0;
+    }
+    if (plt.size == 0) {
+        return 0;
+    }
+    // Before the dynamic linker runs, the GOT entry of a lazily bound
+    // function points into its stub, or to the PLT header on some
+    // architectures.
+    size_t word_size = (data->is64bit) ? 8 : 4;
+    uint8_t *entry = segment_data(data, got, word_size);
+    if (entry != NULL) {
+        uint64_t target = (data->is64bit)
+                        ? bswap64(data, *(uint64_t *) entry)
+                        : bswap32(data, *(uint32_t *) entry);
+        uint64_t stubs = plt.address + plt.header_size;
+        if (target >= stubs && target < plt.address + plt.size) {
+            return stubs + ((target - stubs)/plt.entry_size)*plt.entry_size;
+        }
+    }
+    uint64_t stub = plt.address + plt.header_size + index*plt.entry_size;
+    return (stub < plt.address + plt.size) ? stub : 0;
+}
+
+#define FIND_PLT_SECTIONS(Shdr, data, plt, plt_sec)                         \
+    do {                                                                    \
+        Shdr *plt_hdr = NULL;                                               \
+        FIND_SECTION_HEADER(Shdr, data, SHT_PROGBITS, ".plt", plt_hdr);     \
+        if (plt_hdr != NULL && plt_layout(data, &plt)) {                    \
+            plt.address = bswaptl(data, plt_hdr->sh_addr);                  \
+            plt.size = bswaptl(data, plt_hdr->sh_size);                     \
+        }                                                                   \
+        plt_hdr = NULL;                                                     \
+        FIND_SECTION_HEADER(Shdr, data, SHT_PROGBITS, ".plt.sec", plt_hdr); \
+        if (plt_hdr != NULL && (data->machine == EM_386 ||                  \
+                                 data->machine == EM_X86_64)) {             \
+            plt_sec.address = bswaptl(data, plt_hdr->sh_addr);              \
+            plt_sec.size = bswaptl(data, plt_hdr->sh_size);                 \
+            plt_sec.entry_size = 16;                                        \
+        }                                                                   \
+    } while (0)
+
+#define COLLECT_ALL_SYMBOLS(Shdr, Sym, Rel, Rela, R_SYM, stack, data,       \
+                            symbols, count)                                 \
+    do {                                                                    \
+        PltSection plt = {0};                                               \
+        PltSection plt_sec = {0};                                           \
+        FIND_PLT_SECTIONS(Shdr, data, plt, plt_sec);                        \
+        for (int i = 0; i < data->shnum; ++i) {                             \
+            Shdr *sh = (Shdr *) (data->buffer + data->shoff +               \
+                                 i*data->shentsize);                        \
+            uint32_t type = bswap32(data, sh->sh_type);                     \
+            const char *name = (const char *) (data->shstrtable +           \
+                                               bswap32(data, sh->sh_name)); \
+            if (type == SHT_SYMTAB || type == SHT_DYNSYM) {                 \
+                uint8_t *strtab = linked_strtab(data,                       \
+                                                bswap32(data, sh->sh_link));\
+                if (strtab != NULL) {                                       \
+                    COLLECT_SYMBOLS(Sym, data, sh, strtab, symbols, count); \
+                }                                                           \
+            } else if (type == SHT_RELA && strcmp(name, ".rela.plt") == 0) {\
+                COLLECT_PLT_STUBS(Shdr, Sym, Rela, R_SYM, stack, data, sh,  \
+                                  plt, plt_sec, symbols, count);            \
+            } else if (type == SHT_REL && strcmp(name, ".rel.plt") == 0) {  \
+                COLLECT_PLT_STUBS(Shdr, Sym, Rel, R_SYM, stack, data, sh,   \
+                                  plt, plt_sec, symbols, count);            \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+// File data of the section called name, of any type other than
+// SHT_NOBITS. Unlike elf_section() a missing section is not an error.
+static bool find_section_data(ElfData *data, const char *name,
+                              ElfByteView *view) {
+    for (int i = 0; i < data->shnum; ++i) {
+        uint8_t *hdr = data->buffer + data->shoff + i*data->shentsize;
+        uint32_t name_off, type;
+        uint64_t address, offset, size;
+        if (data->is64bit) {
+            Elf64_Shdr *sh = (Elf64_Shdr *) hdr;
+            name_off = bswap32(data, sh->sh_name);
+            type = bswap32(data, sh->sh_type);
+            address = bswaptl(data, sh->sh_addr);
+            offset = bswaptl(data, sh->sh_offset);
+            size = bswaptl(data, sh->sh_size);
+        } else {
+            Elf32_Shdr *sh = (Elf32_Shdr *) hdr;
+            name_off = bswap32(data, sh->sh_name);
+            type = bswap32(data, sh->sh_type);
+            address = bswaptl(data, sh->sh_addr);
+            offset = bswaptl(data, sh->sh_offset);
+            size = bswaptl(data, sh->sh_size);
+        }
+        if (strcmp((const char *) data->shstrtable + name_off, name) != 0) {
+            continue;
+        }
+        if (type == SHT_NOBITS || offset > data->size ||
+            size > data->size - offset) {
+            return false;
+        }
+        view->address = address;
+        view->data = data->buffer + offset;
+        view->size = size;
+        return true;
+    }
+    return false;
+}
+
+//
+// Call frame information
+//
+// Both .eh_frame and .debug_frame are a sequence of CIE and FDE records,
+// each FDE covering the pc range [pc_begin, pc_begin + pc_range) of one
+// function. The layout differs slightly between the two, see the
+// DWARF standard and the LSB for .eh_frame specifics.
+//
+
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+typedef struct FrameCursor {
+    ElfData *data;
+    // Section start and its virtual address, for pc relative pointers
+    const uint8_t *base;
+    uint64_t address;
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok;
+} FrameCursor;
+
+static uint64_t read_frame_bytes(FrameCursor *c, size_t size) {
+    if (!c->ok || (size_t) (c->end - c->p) < size) {
+        c->ok = false;
+        return 0;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; ++i) {
+        size_t shift = (c->data->little_endian) ? i : size - 1 - i;
+        v |= (uint64_t) c->p[i] << (8*shift);
+    }
+    c->p += size;
+    return v;
+}
+
+static uint64_t read_uleb128(FrameCursor *c) {
+    uint64_t v = 0;
+    for (unsigned shift = 0; c->ok; shift += 7) {
+        if (c->p == c->end) {
+            c->ok = false;
+            break;
+        }
+        uint8_t b = *c->p++;
+        if (shift < 64) {
+            v |= (uint64_t) (b & 0x7f) << shift;
+        }
+        if ((b & 0x80) == 0) {
+            break;
+        }
+    }
+    return v;
+}
+
+static int64_t read_sleb128(FrameCursor *c) {
+    uint64_t v = 0;
+    unsigned shift = 0;
+    uint8_t b = 0;
+    for (; c->ok; shift += 7) {
+        if (c->p == c->end) {
+            c->ok = false;
+            break;
+        }
+        b = *c->p++;
+        if (shift < 64) {
+            v |= (uint64_t) (b & 0x7f) << shift;
+        }
+        if ((b & 0x80) == 0) {
+            shift += 7;
+            break;
+        }
+    }
+    if (shift < 64 && (b & 0x40)) {
+        v |= ~(uint64_t) 0 << shift;
+    }
+    return (int64_t) v;
+}
+
+static inline int64_t sign_extend(uint64_t v, size_t size) {
+    unsigned shift = 64 - 8*size;
+    return (int64_t) (v << shift) >> shift;
+}
+
+// Reads a pointer in the DW_EH_PE_* encoding enc. Only absolute and pc
+// relative pointers are supported, others clear c->ok.
+static uint64_t read_encoded(FrameCursor *c, uint8_t enc, size_t address_size) {
+    uint64_t field = c->address + (uint64_t) (c->p - c->base);
+    uint64_t v;
+    switch (enc & 0x0f) {
+    case DW_EH_PE_absptr:  v = read_frame_bytes(c, address_size); break;
+    case DW_EH_PE_uleb128: v = read_uleb128(c); break;
+    case DW_EH_PE_udata2:  v = read_frame_bytes(c, 2); break;
+    case DW_EH_PE_udata4:  v = read_frame_bytes(c, 4); break;
+    case DW_EH_PE_udata8:  v = read_frame_bytes(c, 8); break;
+    case DW_EH_PE_sleb128: v = read_sleb128(c); break;
+    case DW_EH_PE_sdata2:  v = sign_extend(read_frame_bytes(c, 2), 2); break;
+    case DW_EH_PE_sdata4:  v = sign_extend(read_frame_bytes(c, 4), 4); break;
+    case DW_EH_PE_sdata8:  v = read_frame_bytes(c, 8); break;
+    default: c->ok = false; return 0;
+    }
+    switch (enc & 0x70) {
+    case 0: break;
+    case DW_EH_PE_pcrel: v += field; break;
+    default: c->ok = false; return 0;
+    }
+    if (address_size < 8) {
+        v &= (1ull << 8*address_size) - 1;
+    }
+    return v;
+}
+
+typedef struct FrameSection {
+    const uint8_t *data;
+    uint64_t address;
+    size_t size;
+    bool is_eh_frame;
+} FrameSection;
+
+// Reads the length and CIE id/pointer that start every record, returns
+// false at the end of the section.
+static bool read_record_header(ElfData *data, FrameSection sec, uint64_t off,
+                               FrameCursor *c, bool *dwarf64, uint64_t *id) {
+    *c = (FrameCursor) {
+        .data = data,
+        .base = sec.data,
+        .address = sec.address,
+        .p = sec.data + off,
+        .end = sec.data + sec.size,
+        .ok = off < sec.size,
+    };
+    uint64_t length = read_frame_bytes(c, 4);
+    *dwarf64 = (length == 0xffffffff);
+    if (*dwarf64) {
+        length = read_frame_bytes(c, 8);
+    }
+    // A zero length terminates .eh_frame
+    if (!c->ok || length == 0 || length > (uint64_t) (c->end - c->p)) {
+        return false;
+    }
+    c->end = c->p + length;
+    *id = read_frame_bytes(c, (*dwarf64) ? 8 : 4);
+    return c->ok;
+}
+
+// Parses the CIE at off for the encoding of FDE pc ranges, pointers
+// without an encoding use the target address size.
+static bool read_cie(ElfData *data, FrameSection sec, uint64_t off,
+                     uint8_t *fde_encoding, size_t *address_size) {
+    FrameCursor c;
+    bool dwarf64;
+    uint64_t id;
+    if (!read_record_header(data, sec, off, &c, &dwarf64, &id)) {
+        return false;
+    }
+    uint64_t cie_id = (sec.is_eh_frame) ? 0 : (dwarf64) ? UINT64_MAX : 0xffffffff;
+    if (id != cie_id) {
+        return false;
+    }
+
+    uint8_t version = read_frame_bytes(&c, 1);
+    const char *augmentation = (const char *) c.p;
+    const uint8_t *nul = memchr(c.p, 0, c.end - c.p);
+    if (!c.ok || nul == NULL) {
+        return false;
+    }
+    c.p = nul + 1;
+    *fde_encoding = DW_EH_PE_absptr;
+    *address_size = (data->is64bit) ? 8 : 4;
+    if (version >= 4) {
+        *address_size = read_frame_bytes(&c, 1);
+        read_frame_bytes(&c, 1);
+    }
+    read_uleb128(&c);
+    read_sleb128(&c);
+    if (version == 1) {
+        read_frame_bytes(&c, 1);
+    } else {
+        read_uleb128(&c);
+    }
+    if (augmentation[0] != 'z') {
+        // Without augmentation data only the empty augmentation can be
+        // skipped over
+        return c.ok && augmentation[0] == 0 &&
+               (*address_size == 4 || *address_size == 8);
+    }
+    read_uleb128(&c);
+    for (const char *a = augmentation + 1; *a != 0 && c.ok; ++a) {
+        switch (*a) {
+        case 'R':
+            *fde_encoding = read_frame_bytes(&c, 1);
+            return c.ok;
+        case 'P': {
+            uint8_t enc = read_frame_bytes(&c, 1);
+            read_encoded(&c, enc & ~DW_EH_PE_indirect, *address_size);
+            break;
+        }
+        case 'L':
+            read_frame_bytes(&c, 1);
+            break;
+        case 'S':
+        case 'B':
+            break;
+        default:
+            return false;
+        }
+    }
+    return c.ok;
+}
+
+// Counts the FDEs of sec with a non-empty pc range and stores them to
+// symbols named "sub_<address>" unless symbols is NULL.
+static size_t collect_frame_ranges(StackAllocator *stack, ElfData *data,
+                                   FrameSection sec, ElfSymbol *symbols) {
+    size_t count = 0;
+    FrameCursor c;
+    bool dwarf64;
+    uint64_t id;
+    uint64_t cie_id = (sec.is_eh_frame) ? 0 : UINT64_MAX;
+    for (uint64_t off = 0;
+         read_record_header(data, sec, off, &c, &dwarf64, &id);
+         off = c.end - sec.data) {
+        if (!dwarf64 && !sec.is_eh_frame && id == 0xffffffff) {
+            id = UINT64_MAX;
+        }
+        if (id == cie_id) {
+            continue;
+        }
+
+        // .eh_frame FDEs point back to their CIE relative to the
+        // pointer, .debug_frame ones hold an offset into the section
+        uint64_t cie_off = id;
+        if (sec.is_eh_frame) {
+            uint64_t id_off = (c.p - sec.data) - ((dwarf64) ? 8 : 4);
+            cie_off = id_off - id;
+        }
+        uint8_t enc;
+        size_t address_size;
+        if (!read_cie(data, sec, cie_off, &enc, &address_size)) {
+            continue;
+        }
+        uint64_t pc_begin = read_encoded(&c, enc, address_size);
+        uint64_t pc_range = read_encoded(&c, enc & 0x0f, address_size);
+        // Functions removed by the linker keep their FDE with a zero
+        // pc_begin in .debug_frame
+        if (!c.ok || pc_begin == 0 || pc_range == 0) {
+            continue;
+        }
+
+        if (symbols != NULL) {
+            size_t len = sizeof("sub_") + 16;
+            char *name = stack_alloc_tagged(stack, len, MEM_TAG_OTHER);
+            snprintf(name, len, "sub_%lx", pc_begin);
+            symbols[count] = (ElfSymbol) {
+                .address = pc_begin,
+                .size = pc_range,
+                .name = name,
+                .kind = ELF_SYMBOL_FDE,
+            };
+        }
+        ++count;
+    }
+    return count;
+}
+
+// .eh_frame is found through its section header, or through the
+// eh_frame_ptr of .eh_frame_hdr if there are no section headers. In
+// the latter case the size is bounded by the end of the segment.
+static bool find_eh_frame(ElfData *data, FrameSection *sec) {
+    ElfByteView view;
+    if (find_section_data(data, ".eh_frame", &view)) {
+        *sec = (FrameSection) {view.data, view.address, view.size, true};
+        return true;
+    }
+    if (data->eh_frame_hdr == 0) {
+        return false;
+    }
+    // version, eh_frame_ptr_enc, fde_count_enc, table_enc, eh_frame_ptr
+    size_t address_size = (data->is64bit) ? 8 : 4;
+    uint8_t *hdr = segment_data(data, data->eh_frame_hdr, 4 + address_size);
+    if (hdr == NULL || hdr[0] != 1) {
+        return false;
+    }
+    FrameCursor c = {
+        .data = data,
+        .base = hdr,
+        .address = data->eh_frame_hdr,
+        .p = hdr + 4,
+        .end = hdr + 4 + address_size,
+        .ok = true,
+    };
+    uint64_t address = read_encoded(&c, hdr[1], address_size);
+    if (!c.ok || hdr[1] == DW_EH_PE_omit) {
+        return false;
+    }
+    for (size_t i = 0; i < data->num_segments; ++i) {
+        ElfSegment *seg = &data->segments[i];
+        if (address >= seg->address && address - seg->address < seg->file_size) {
+            uint64_t off = address - seg->address;
+            *sec = (FrameSection) {
+                .data = data->buffer + seg->offset + off,
+                .address = address,
+                .size = seg->file_size - off,
+                .is_eh_frame = true,
+            };
+            return true;
+        }
+    }
+    return false;
+}
+
+// Counts the FDE ranges of .eh_frame and .debug_frame
+static size_t collect_frames(StackAllocator *stack, ElfData *data,
+                             ElfSymbol *symbols) {
+    size_t count = 0;
+    FrameSection sec;
+    if (find_eh_frame(data, &sec)) {
+        count += collect_frame_ranges(stack, data, sec,
+                                      (symbols != NULL) ? symbols + count : NULL);
+    }
+    ElfByteView view;
+    if (find_section_data(data, ".debug_frame", &view)) {
+        sec = (FrameSection) {view.data, view.address, view.size, false};
+        count += collect_frame_ranges(stack, data, sec,
+                                      (symbols != NULL) ? symbols + count : NULL);
+    }
+    return count;
+}
+
+static size_t collect_symbols(StackAllocator *stack, ElfData *data,
+                              ElfSymbol *symbols) {
+    size_t count = 0;
+    if (data->is64bit) {
+        COLLECT_ALL_SYMBOLS(Elf64_Shdr, Elf64_Sym, Elf64_Rel, Elf64_Rela,
+                            ELF64_R_SYM, stack, data, symbols, count);
+    } else {
+        COLLECT_ALL_SYMBOLS(Elf32_Shdr, Elf32_Sym, Elf32_Rel, Elf32_Rela,
+                            ELF32_R_SYM, stack, data, symbols, count);
+    }
+    count += collect_frames(stack, data, (symbols != NULL) ? symbols + count : NULL);
+    return count;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    const ElfSymbol *x = a;
+    const ElfSymbol *y = b;
+    if (x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return (int) x->kind - (int) y->kind;
+}
+
+void elf_symbol_table(StackAllocator *stack, ElfData *data,
+                      ElfSymbolTable *table) {
+    // First pass counts, second pass fills in
+    size_t count = collect_symbols(stack, data, NULL);
+    ElfSymbol *symbols = stack_alloc_tagged(stack, count*sizeof(ElfSymbol), MEM_TAG_OTHER);
+    count = collect_symbols(stack, data, symbols);
+
+    qsort(symbols, count, sizeof(ElfSymbol), compare_symbols);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (num_unique == 0 || symbols[num_unique-1].address != symbols[i].address) {
+            symbols[num_unique++] = symbols[i];
+        }
+    }
+
+    table->symbols = symbols;
+    table->count = num_unique;
+}
+
+// Returns the number of symbols starting at or below address, the
+// last of which is the only one that may contain it.
+static size_t symbols_up_to(const ElfSymbolTable *table, uint64_t address) {
+    size_t lo = 0;
+    size_t hi = table->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (table->symbols[mid].address <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline bool symbol_contains(const ElfSymbol *sym, uint64_t address) {
+    uint64_t size = (sym->size > 0) ? sym->size : 1;
+    return address - sym->address < size;
+}
+
+const ElfSymbol *elf_symbol_at(const ElfSymbolTable *table, uint64_t address) {
+    size_t i = symbols_up_to(table, address);
+    if (i == 0 || table->symbols[i-1].address != address) {
+        return NULL;
+    }
+    return &table->symbols[i-1];
+}
+
+const ElfSymbol *elf_symbol_containing(const ElfSymbolTable *table,
+                                       uint64_t address) {
+    size_t i = symbols_up_to(table, address);
+    if (i == 0 || !symbol_contains(&table->symbols[i-1], address)) {
+        return NULL;
+    }
+    return &table->symbols[i-1];
+}
+
+ElfSymbolIter elf_symbols_in_range(const ElfSymbolTable *table,
+                                   uint64_t begin, uint64_t end) {
+    // Starts at the symbol containing begin, if any
+    size_t i = symbols_up_to(table, begin);
+    if (i > 0 && symbol_contains(&table->symbols[i-1], begin)) {
+        --i;
+    }
+    return (ElfSymbolIter) {
+        .next = table->symbols + i,
+        .last = table->symbols + table->count,
+        .end = end,
+    };
+}
+
+// Mapping symbols are named $a, $t or $d, optionally followed by a
+// period and any suffix
+static ElfMode mapping_symbol_mode(const char *name) {
+    if (name[0] != '$' || name[1] == 0 || (name[2] != 0 && name[2] != '.')) {
+        return ELF_MODE_DEFAULT;
+    }
+    switch (name[1]) {
+    case 'a': return ELF_MODE_ARM;
+    case 't': return ELF_MODE_THUMB;
+    case 'd': return ELF_MODE_DATA;
+    default:  return ELF_MODE_DEFAULT;
+    }
+}
+
+// Counts the mode changes implied by the mapping symbols, or the
+// function symbols if mapping is false, and stores them to changes
+// unless it is NULL. Only used for ARM, which is always ELFCLASS32.
+static size_t collect_mode_changes(ElfData *data, bool mapping,
+                                   ElfModeChange *changes) {
+    size_t count = 0;
+    for (int i = 0; i < data->shnum; ++i) {
+        Elf32_Shdr *sh = (Elf32_Shdr *) (data->buffer + data->shoff +
+                                         i*data->shentsize);
+        if (bswap32(data, sh->sh_type) != SHT_SYMTAB) {
+            continue;
+        }
+        uint8_t *strtab = linked_strtab(data, bswap32(data, sh->sh_link));
+        uint64_t entsize = bswap32(data, sh->sh_entsize);
+        uint64_t size = bswap32(data, sh->sh_size);
+        uint64_t offset = bswap32(data, sh->sh_offset);
+        if (strtab == NULL || entsize < sizeof(Elf32_Sym) ||
+            offset > data->size || size > data->size - offset) {
+            continue;
+        }
+        for (uint64_t off = 0; off + entsize <= size; off += entsize) {
+            Elf32_Sym *s = (Elf32_Sym *) (data->buffer + offset + off);
+            uint8_t type = ELF32_ST_TYPE(s->st_info);
+            uint64_t value = bswap32(data, s->st_value);
+            if (bswap16(data, s->st_shndx) == SHN_UNDEF) {
+                continue;
+            }
+            if (mapping) {
+                const char *name = (const char *) (strtab + bswap32(data, s->st_name));
+                ElfMode mode = mapping_symbol_mode(name);
+                if (type != STT_NOTYPE || mode == ELF_MODE_DEFAULT) {
+                    continue;
+                }
+                if (changes != NULL) {
+                    changes[count] = (ElfModeChange) {value, mode};
+                }
+                ++count;
+            } else {
+                uint64_t fn_size = bswap32(data, s->st_size);
+                if (type != STT_FUNC || fn_size == 0) {
+                    continue;
+                }
+                // Functions are followed by a change back to the default
+                if (changes != NULL) {
+                    ElfMode mode = (value & 1) ? ELF_MODE_THUMB : ELF_MODE_ARM;
+                    value &= ~((uint64_t) 1);
+                    changes[count] = (ElfModeChange) {value, mode};
+                    changes[count+1] = (ElfModeChange) {value + fn_size, ELF_MODE_DEFAULT};
+                }
+                count += 2;
+            }
+        }
+    }
+    return count;
+}
+
+// Orders changes at the same address so that the first one is not a
+// change back to the default, that one is kept
+static int compare_mode_changes(const void *a, const void *b) {
+    const ElfModeChange *x = a;
+    const ElfModeChange *y = b;
+    if (x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return (int) y->mode - (int) x->mode;
+}
+
+void elf_mode_map(StackAllocator *stack, ElfData *data, ElfModeMap *map) {
+    *map = (ElfModeMap) {0};
+    if (data->machine != EM_ARM || data->is64bit) {
+        return;
+    }
+    bool mapping = true;
+    size_t count = collect_mode_changes(data, mapping, NULL);
+    if (count == 0) {
+        mapping = false;
+        count = collect_mode_changes(data, mapping, NULL);
+    }
+    if (count == 0) {
+        return;
+    }
+    ElfModeChange *changes = stack_alloc_tagged(stack, count*sizeof(ElfModeChange), MEM_TAG_OTHER);
+    collect_mode_changes(data, mapping, changes);
+
+    qsort(changes, count, sizeof(ElfModeChange), compare_mode_changes);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (num_unique == 0 || changes[num_unique-1].address != changes[i].address) {
+            changes[num_unique++] = changes[i];
+        }
+    }
+
+    map->changes = changes;
+    map->count = num_unique;
+}
+
+ElfMode elf_mode_at(const ElfModeMap *map, uint64_t address, uint64_t *end) {
+    size_t lo = 0;
+    size_t hi = map->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (map->changes[mid].address <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *end = (lo < map->count) ? map->changes[lo].address : UINT64_MAX;
+    return (lo > 0) ? map->changes[lo-1].mode : ELF_MODE_DEFAULT;
+}
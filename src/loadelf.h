@@ -7,6 +7,16 @@
 
 typedef struct StackAllocator StackAllocator;
 
+// PT_LOAD segment, file_size bytes at offset in the file are mapped
+// at address, possibly followed by zero filled memory up to mem_size.
+typedef struct {
+    uint64_t address;
+    uint64_t mem_size;
+    uint64_t offset;
+    uint64_t file_size;
+    bool executable;
+} ElfSegment;
+
 typedef struct {
     uint8_t *buffer;
     size_t size;
@@ -20,6 +30,12 @@ typedef struct {
     uint64_t machine;
     LibTcgArch arch;
     uint64_t entrypoint;
+    // PT_LOAD segments in program header order, usable even if the section
+    // headers are missing or broken, in which case shnum is 0.
+    ElfSegment *segments;
+    size_t num_segments;
+    // Address of the PT_GNU_EH_FRAME segment, 0 if there is none
+    uint64_t eh_frame_hdr;
 } ElfData;
 
 typedef struct {
@@ -28,6 +44,116 @@ typedef struct {
     size_t size;
 } ElfByteView;
 
+typedef struct {
+    const char *name;
+    ElfByteView view;
+} ElfFunction;
+
+typedef enum {
+    ELF_SYMBOL_FUNCTION = 0,
+    // Lazy binding stub of an imported function, named "name@plt"
+    ELF_SYMBOL_PLT,
+    // Function without a symbol, covered by an .eh_frame/.debug_frame
+    // FDE and named "sub_<address>"
+    ELF_SYMBOL_FDE,
+} ElfSymbolKind;
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    const char *name;
+    ElfSymbolKind kind;
+} ElfSymbol;
+
+// Function symbols sorted by address, one per address
+typedef struct ElfSymbolTable {
+    ElfSymbol *symbols;
+    size_t count;
+} ElfSymbolTable;
+
 bool elf_data(StackAllocator *stack, const char *file, ElfData *data);
 bool elf_section(ElfData *data, const char *section, ElfByteView *view);
 bool elf_function(ElfData *data, const char *fnname, ElfByteView *view);
+
+// Maps size bytes at virtual address to the file through the PT_LOAD
+// segments, the range has to lie within the file backed part of a
+// single segment. A size of 0 extends the range to the end of it.
+bool elf_address_range(ElfData *data, uint64_t address, size_t size,
+                       ElfByteView *view);
+
+// Collects all defined function symbols with a non-zero size from
+// .symtab, in symbol table order. Stripped binaries fall back to the
+// functions of elf_symbol_table() other than PLT stubs, in address
+// order. Returns the number of functions, or 0 if none are found.
+size_t elf_functions(StackAllocator *stack, ElfData *data,
+                     ElfFunction **functions);
+
+// Collects functions from .symtab and .dynsym, and the PLT stubs of
+// the functions imported through .rela.plt/.rel.plt. Stub addresses
+// are taken from the initial GOT entries where those point back into
+// the PLT, otherwise from the PLT layout of the architecture. FDEs of
+// .eh_frame and .debug_frame add the function ranges of stripped
+// binaries. Only one symbol is kept per address, functions are
+// preferred over stubs and stubs over FDE ranges.
+void elf_symbol_table(StackAllocator *stack, ElfData *data,
+                      ElfSymbolTable *table);
+
+// Binary search for the symbol starting exactly at address, NULL if
+// there is none.
+const ElfSymbol *elf_symbol_at(const ElfSymbolTable *table, uint64_t address);
+
+// Binary search for the symbol whose range [address, address + size)
+// contains address, symbols without a size only contain their start.
+const ElfSymbol *elf_symbol_containing(const ElfSymbolTable *table,
+                                       uint64_t address);
+
+// Iterates the symbols overlapping an address range in address order:
+//
+//   ElfSymbolIter it = elf_symbols_in_range(table, begin, end);
+//   for (const ElfSymbol *sym; (sym = elf_symbol_iter_next(&it)) != NULL;)
+typedef struct {
+    const ElfSymbol *next;
+    const ElfSymbol *last;
+    uint64_t end;
+} ElfSymbolIter;
+
+ElfSymbolIter elf_symbols_in_range(const ElfSymbolTable *table,
+                                   uint64_t begin, uint64_t end);
+
+static inline const ElfSymbol *elf_symbol_iter_next(ElfSymbolIter *iter) {
+    if (iter->next == iter->last || iter->next->address >= iter->end) {
+        return NULL;
+    }
+    return iter->next++;
+}
+
+// Instruction set of a range of an ARM ELF file
+typedef enum {
+    // Not covered by the file, use the mode the lifter was asked for
+    ELF_MODE_DEFAULT = 0,
+    ELF_MODE_ARM,
+    ELF_MODE_THUMB,
+    // Literal pools and other data within code, not lifted
+    ELF_MODE_DATA,
+} ElfMode;
+
+typedef struct {
+    uint64_t address;
+    ElfMode mode;
+} ElfModeChange;
+
+// Mode changes sorted by address, each one applies up to the next
+typedef struct ElfModeMap {
+    ElfModeChange *changes;
+    size_t count;
+} ElfModeMap;
+
+// Collects the $a/$t/$d mapping symbols of an ARM ELF file. If there
+// are none, the ranges of function symbols are used instead, Thumb
+// functions being the ones with the lowest bit set. The map is empty
+// for other architectures.
+void elf_mode_map(StackAllocator *stack, ElfData *data, ElfModeMap *map);
+
+// Binary search for the mode at address, end is set to the address of
+// the next mode change, UINT64_MAX if there is none.
+ElfMode elf_mode_at(const ElfModeMap *map, uint64_t address, uint64_t *end);
@@ -0,0 +1,163 @@
+#include "output.h"
+#include "common.h"
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Initial size of the buffer handed to dump_instruction_to_buffer(),
+// doubled for instructions that don't fit.
+#define DUMP_INSTRUCTION_SIZE 128
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void output_init(Output *out, StackAllocator *stack, int fd, size_t size) {
+    assert(size > 0);
+    *out = (Output) {
+        .fd = fd,
+        .buffer = stack_alloc(stack, size),
+        .size = size,
+    };
+}
+
+bool output_flush(Output *out) {
+    if (out->used > 0 && !out->failed) {
+        if (!write_all(out->fd, out->buffer, out->used)) {
+            fprintf(stderr, "[error]: Failed writing output\n");
+            out->failed = true;
+        }
+    }
+    out->used = 0;
+    return !out->failed;
+}
+
+void output_write(Output *out, const void *data, size_t size) {
+    if (likely(out->size - out->used >= size)) {
+        memcpy(out->buffer + out->used, data, size);
+        out->used += size;
+        return;
+    }
+
+    // Writes larger than the buffer go out together with whatever is
+    // buffered in a single writev(), without copying.
+    if (size >= out->size) {
+        if (out->failed) {
+            out->used = 0;
+            return;
+        }
+        struct iovec iov[2] = {
+            {.iov_base = out->buffer,   .iov_len = out->used},
+            {.iov_base = (void *) data, .iov_len = size},
+        };
+        ssize_t n;
+        do {
+            n = writev(out->fd, iov, ARRLEN(iov));
+        } while (n < 0 && errno == EINTR);
+        bool ok = n >= 0;
+        if (ok && (size_t) n < out->used + size) {
+            // Partial write, finish off what remains
+            size_t done = n;
+            if (done < out->used) {
+                ok = write_all(out->fd, out->buffer + done, out->used - done);
+                done = out->used;
+            }
+            ok = ok && write_all(out->fd, (const uint8_t *) data + (done - out->used),
+                                 size - (done - out->used));
+        }
+        if (!ok) {
+            fprintf(stderr, "[error]: Failed writing output\n");
+            out->failed = true;
+        }
+        out->used = 0;
+        return;
+    }
+
+    output_flush(out);
+    memcpy(out->buffer, data, size);
+    out->used = size;
+}
+
+char *output_reserve(Output *out, size_t size) {
+    assert(size <= out->size);
+    if (out->size - out->used < size) {
+        output_flush(out);
+    }
+    return (char *) out->buffer + out->used;
+}
+
+void output_u64(Output *out, uint64_t value) {
+    char tmp[20];
+    size_t len = 0;
+    do {
+        tmp[len++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    char *buf = output_reserve(out, len);
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = tmp[len - 1 - i];
+    }
+    output_commit(out, len);
+}
+
+void output_i64(Output *out, int64_t value) {
+    if (value < 0) {
+        output_char(out, '-');
+        output_u64(out, -(uint64_t) value);
+    } else {
+        output_u64(out, value);
+    }
+}
+
+void output_hex(Output *out, uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    size_t len = 1;
+    for (uint64_t v = value >> 4; v > 0; v >>= 4) {
+        ++len;
+    }
+    char *buf = output_reserve(out, len);
+    for (size_t i = len; i > 0; --i) {
+        buf[i-1] = digits[value & 0xf];
+        value >>= 4;
+    }
+    output_commit(out, len);
+}
+
+// Formats instructions directly into the output buffer. If the
+// formatted string fills the space it was given it might have been
+// truncated, so retry with twice the space, up to the whole buffer.
+void output_tb_ir(Output *out, LibTcgInterface *libtcg,
+                  LibTcgTranslationBlock *tb) {
+    for (size_t i = 0; i < tb->instruction_count; ++i) {
+        size_t size = DUMP_INSTRUCTION_SIZE;
+        while (true) {
+            char *buf = output_reserve(out, size);
+            buf[0] = 0;
+            libtcg->dump_instruction_to_buffer(&tb->list[i], buf, size);
+            const char *nul = memchr(buf, 0, size);
+            if (nul != NULL && (size_t) (nul - buf) + 1 < size) {
+                output_commit(out, nul - buf);
+                break;
+            }
+            if (size == out->size) {
+                output_commit(out, (nul != NULL) ? (size_t) (nul - buf) : size);
+                break;
+            }
+            size = MIN(2*size, out->size);
+        }
+        output_char(out, '\n');
+    }
+}
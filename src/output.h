@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct StackAllocator StackAllocator;
+typedef struct LibTcgInterface LibTcgInterface;
+typedef struct LibTcgTranslationBlock LibTcgTranslationBlock;
+
+#define OUTPUT_BUFFER_SIZE (1024*1024)
+
+// Buffered writer on top of a raw file descriptor, bypasses stdio
+// entirely. Data is accumulated in a large arena-backed buffer and
+// written out with write(2)/writev(2) when full or on output_flush().
+typedef struct Output {
+    int fd;
+    uint8_t *buffer;
+    size_t used;
+    size_t size;
+    bool failed;
+} Output;
+
+void output_init(Output *out, StackAllocator *stack, int fd, size_t size);
+bool output_flush(Output *out);
+void output_write(Output *out, const void *data, size_t size);
+// Returns a pointer to at least size bytes of free space in the buffer,
+// flushing it if needed. size may not exceed the size of the buffer,
+// which never grows: it lives on an arena that callers reset to
+// markers taken after output_init(). Follow with output_commit() to
+// append the bytes that were actually written.
+char *output_reserve(Output *out, size_t size);
+void output_u64(Output *out, uint64_t value);
+void output_i64(Output *out, int64_t value);
+// Lowercase hex without prefix or padding, same as "%lx".
+void output_hex(Output *out, uint64_t value);
+
+// Dumps the IR of tb, one instruction per line.
+void output_tb_ir(Output *out, LibTcgInterface *libtcg,
+                  LibTcgTranslationBlock *tb);
+
+// Writes a string literal without going through strlen()
+#define OUTPUT_LIT(out, lit) output_write(out, lit, sizeof(lit) - 1)
+
+static inline void output_commit(Output *out, size_t size) {
+    out->used += size;
+}
+
+static inline void output_char(Output *out, char c) {
+    if (out->used == out->size) {
+        output_flush(out);
+    }
+    out->buffer[out->used++] = (uint8_t) c;
+}
+
+static inline void output_str(Output *out, const char *str) {
+    output_write(out, str, strlen(str));
+}
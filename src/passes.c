@@ -0,0 +1,825 @@
+#define _POSIX_C_SOURCE 200809L
+#include "passes.h"
+#include "common.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *pass_names[NUM_PASS_KINDS] = {
+    [PASS_CONSTPROP] = "constprop",
+    [PASS_COPYPROP]  = "copyprop",
+    [PASS_DCE]       = "dce",
+    [PASS_INSN_DCE]  = "insn-dce",
+};
+
+typedef struct PassContext {
+    LibTcgInterface *libtcg;
+    Memory *memory;
+    TbNode *root;
+    size_t num_nodes;
+    // One past the largest temp index, and largest global index
+    size_t num_temps;
+    size_t num_globals;
+    // Index handed to the next constant temp created by constprop
+    uint32_t next_temp_index;
+    // Number of args or ops rewritten by the current pass
+    size_t num_rewritten;
+} PassContext;
+
+typedef enum ValueKind {
+    VALUE_UNDEF = 0,
+    VALUE_CONST,
+    VALUE_NAC,
+} ValueKind;
+
+typedef struct Value {
+    uint64_t value;
+    ValueKind kind;
+} Value;
+
+bool pass_pipeline_from_str(const char *str, PassPipeline *pipeline) {
+    *pipeline = (PassPipeline) {0};
+    while (*str != 0) {
+        const char *end = strchr(str, ',');
+        if (end == NULL) {
+            end = str + strlen(str);
+        }
+        size_t len = end - str;
+
+        size_t kind = 0;
+        for (; kind < NUM_PASS_KINDS; ++kind) {
+            if (strlen(pass_names[kind]) == len &&
+                strncmp(pass_names[kind], str, len) == 0) {
+                break;
+            }
+        }
+        if (kind == NUM_PASS_KINDS) {
+            fprintf(stderr, "[error]: Unknown pass \"%.*s\"\n", (int) len, str);
+            return false;
+        }
+        if (pipeline->num_passes == MAX_PASSES) {
+            fprintf(stderr, "[error]: At most %d passes are supported\n", MAX_PASSES);
+            return false;
+        }
+        pipeline->passes[pipeline->num_passes++] = kind;
+
+        str = (*end == ',') ? end + 1 : end;
+    }
+    return pipeline->num_passes > 0;
+}
+
+//
+// Opcode properties
+//
+
+// Ops without side effects that only depend on their inputs
+static bool is_pure(LibTcgOpcode opcode) {
+    switch (opcode) {
+    case LIBTCG_op_mov_i32:
+    case LIBTCG_op_setcond_i32:
+    case LIBTCG_op_movcond_i32:
+    case LIBTCG_op_add_i32:
+    case LIBTCG_op_sub_i32:
+    case LIBTCG_op_mul_i32:
+    case LIBTCG_op_and_i32:
+    case LIBTCG_op_or_i32:
+    case LIBTCG_op_xor_i32:
+    case LIBTCG_op_shl_i32:
+    case LIBTCG_op_shr_i32:
+    case LIBTCG_op_sar_i32:
+    case LIBTCG_op_neg_i32:
+    case LIBTCG_op_not_i32:
+    case LIBTCG_op_ext8s_i32:
+    case LIBTCG_op_ext16s_i32:
+    case LIBTCG_op_ext8u_i32:
+    case LIBTCG_op_ext16u_i32:
+    case LIBTCG_op_mov_i64:
+    case LIBTCG_op_setcond_i64:
+    case LIBTCG_op_movcond_i64:
+    case LIBTCG_op_add_i64:
+    case LIBTCG_op_sub_i64:
+    case LIBTCG_op_mul_i64:
+    case LIBTCG_op_and_i64:
+    case LIBTCG_op_or_i64:
+    case LIBTCG_op_xor_i64:
+    case LIBTCG_op_shl_i64:
+    case LIBTCG_op_shr_i64:
+    case LIBTCG_op_sar_i64:
+    case LIBTCG_op_neg_i64:
+    case LIBTCG_op_not_i64:
+    case LIBTCG_op_ext8s_i64:
+    case LIBTCG_op_ext16s_i64:
+    case LIBTCG_op_ext32s_i64:
+    case LIBTCG_op_ext8u_i64:
+    case LIBTCG_op_ext16u_i64:
+    case LIBTCG_op_ext32u_i64:
+    case LIBTCG_op_ext_i32_i64:
+    case LIBTCG_op_extu_i32_i64:
+    case LIBTCG_op_extrl_i64_i32:
+    case LIBTCG_op_extrh_i64_i32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool has_i32_output(LibTcgOpcode opcode) {
+    switch (opcode) {
+    case LIBTCG_op_mov_i32:
+    case LIBTCG_op_setcond_i32:
+    case LIBTCG_op_movcond_i32:
+    case LIBTCG_op_add_i32:
+    case LIBTCG_op_sub_i32:
+    case LIBTCG_op_mul_i32:
+    case LIBTCG_op_and_i32:
+    case LIBTCG_op_or_i32:
+    case LIBTCG_op_xor_i32:
+    case LIBTCG_op_shl_i32:
+    case LIBTCG_op_shr_i32:
+    case LIBTCG_op_sar_i32:
+    case LIBTCG_op_neg_i32:
+    case LIBTCG_op_not_i32:
+    case LIBTCG_op_ext8s_i32:
+    case LIBTCG_op_ext16s_i32:
+    case LIBTCG_op_ext8u_i32:
+    case LIBTCG_op_ext16u_i32:
+    case LIBTCG_op_extrl_i64_i32:
+    case LIBTCG_op_extrh_i64_i32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Ops that may write globals behind the back of their explicit outputs
+static bool clobbers_globals(LibTcgInterface *libtcg, LibTcgInstruction *inst) {
+    switch (inst->opcode) {
+    case LIBTCG_op_call:
+        return (libtcg->get_helper_info(inst).func_flags & LIBTCG_CALL_NO_WRITE_GLOBALS) == 0;
+    case LIBTCG_op_st_i32:
+    case LIBTCG_op_st_i64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Constants of i32 temps are kept sign extended
+static inline uint64_t sext32(uint64_t value) {
+    return (uint64_t) (int64_t) (int32_t) value;
+}
+
+// Evaluates a pure op on constant inputs, returns false for ops that
+// are not folded.
+static bool fold(LibTcgOpcode opcode, const uint64_t *in, uint64_t *out) {
+    uint64_t a = in[0];
+    uint64_t b = in[1];
+    switch (opcode) {
+    case LIBTCG_op_mov_i32:      *out = sext32(a); return true;
+    case LIBTCG_op_add_i32:      *out = sext32(a + b); return true;
+    case LIBTCG_op_sub_i32:      *out = sext32(a - b); return true;
+    case LIBTCG_op_mul_i32:      *out = sext32(a * b); return true;
+    case LIBTCG_op_and_i32:      *out = sext32(a & b); return true;
+    case LIBTCG_op_or_i32:       *out = sext32(a | b); return true;
+    case LIBTCG_op_xor_i32:      *out = sext32(a ^ b); return true;
+    case LIBTCG_op_neg_i32:      *out = sext32(-a); return true;
+    case LIBTCG_op_not_i32:      *out = sext32(~a); return true;
+    case LIBTCG_op_ext8s_i32:    *out = sext32((int8_t) a); return true;
+    case LIBTCG_op_ext16s_i32:   *out = sext32((int16_t) a); return true;
+    case LIBTCG_op_ext8u_i32:    *out = (uint8_t) a; return true;
+    case LIBTCG_op_ext16u_i32:   *out = (uint16_t) a; return true;
+    case LIBTCG_op_shl_i32:
+    case LIBTCG_op_shr_i32:
+    case LIBTCG_op_sar_i32:
+        // Out of range shifts are undefined in TCG
+        if ((b & 0xffffffff) >= 32) {
+            return false;
+        }
+        if (opcode == LIBTCG_op_shl_i32) {
+            *out = sext32((uint32_t) a << b);
+        } else if (opcode == LIBTCG_op_shr_i32) {
+            *out = sext32((uint32_t) a >> b);
+        } else {
+            *out = sext32((uint32_t) ((int32_t) a >> b));
+        }
+        return true;
+
+    case LIBTCG_op_mov_i64:      *out = a; return true;
+    case LIBTCG_op_add_i64:      *out = a + b; return true;
+    case LIBTCG_op_sub_i64:      *out = a - b; return true;
+    case LIBTCG_op_mul_i64:      *out = a * b; return true;
+    case LIBTCG_op_and_i64:      *out = a & b; return true;
+    case LIBTCG_op_or_i64:       *out = a | b; return true;
+    case LIBTCG_op_xor_i64:      *out = a ^ b; return true;
+    case LIBTCG_op_neg_i64:      *out = -a; return true;
+    case LIBTCG_op_not_i64:      *out = ~a; return true;
+    case LIBTCG_op_ext8s_i64:    *out = (int64_t) (int8_t) a; return true;
+    case LIBTCG_op_ext16s_i64:   *out = (int64_t) (int16_t) a; return true;
+    case LIBTCG_op_ext32s_i64:   *out = (int64_t) (int32_t) a; return true;
+    case LIBTCG_op_ext8u_i64:    *out = (uint8_t) a; return true;
+    case LIBTCG_op_ext16u_i64:   *out = (uint16_t) a; return true;
+    case LIBTCG_op_ext32u_i64:   *out = (uint32_t) a; return true;
+    case LIBTCG_op_ext_i32_i64:  *out = (int64_t) (int32_t) a; return true;
+    case LIBTCG_op_extu_i32_i64: *out = (uint32_t) a; return true;
+    case LIBTCG_op_extrl_i64_i32: *out = sext32(a); return true;
+    case LIBTCG_op_extrh_i64_i32: *out = sext32(a >> 32); return true;
+    case LIBTCG_op_shl_i64:
+    case LIBTCG_op_shr_i64:
+    case LIBTCG_op_sar_i64:
+        if (b >= 64) {
+            return false;
+        }
+        if (opcode == LIBTCG_op_shl_i64) {
+            *out = a << b;
+        } else if (opcode == LIBTCG_op_shr_i64) {
+            *out = a >> b;
+        } else {
+            *out = (uint64_t) ((int64_t) a >> b);
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static inline bool is_global(LibTcgTemp *temp) {
+    return temp->kind == LIBTCG_TEMP_GLOBAL;
+}
+
+static inline bool is_local(LibTcgTemp *temp) {
+    return temp->kind == LIBTCG_TEMP_EBB || temp->kind == LIBTCG_TEMP_TB;
+}
+
+// Returns true if the temps of n continue in n->next, which happens
+// when CFG construction split a TB in two. Not inferred from the lists
+// being adjacent, compact_block() moves the end of n's list.
+static inline bool temps_flow_into_next(TbNode *n) {
+    return n->next != NULL && n->split_into_next;
+}
+
+static double elapsed_ms(struct timespec begin, struct timespec end) {
+    return (end.tv_sec - begin.tv_sec)*1e3 + (end.tv_nsec - begin.tv_nsec)/1e6;
+}
+
+static size_t count_instructions(TbNode *root) {
+    size_t count = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        count += n->tb.instruction_count;
+    }
+    return count;
+}
+
+// Removes instructions marked in removed[] and moves edge source
+// instructions to the closest preceding instruction that remains.
+static void compact_block(PassContext *ctx, TbNode *n, bool *removed) {
+    size_t count = n->tb.instruction_count;
+    uint32_t *new_index = stack_alloc_tagged(&ctx->memory->temporary,
+                                             count*sizeof(uint32_t),
+                                             MEM_TAG_OTHER);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!removed[i] || (kept == 0 && i == count - 1)) {
+            n->tb.list[kept++] = n->tb.list[i];
+        }
+        new_index[i] = (kept > 0) ? kept - 1 : 0;
+    }
+    n->tb.instruction_count = kept;
+    for (size_t i = 0; i < n->num_succ; ++i) {
+        n->succ[i].src_instruction = new_index[n->succ[i].src_instruction];
+    }
+}
+
+//
+// Constant propagation
+//
+
+typedef struct ConstState {
+    Value *globals;
+    Value *locals;
+    // Meet of the states at all exits of the block
+    Value *out;
+} ConstState;
+
+static inline Value lookup(PassContext *ctx, ConstState *state, LibTcgTemp *temp) {
+    if (temp->kind == LIBTCG_TEMP_CONST) {
+        return (Value) {.kind = VALUE_CONST, .value = temp->val};
+    } else if (is_global(temp) && temp->index < ctx->num_globals) {
+        return state->globals[temp->index];
+    } else if (is_local(temp)) {
+        return state->locals[temp->index];
+    }
+    return (Value) {.kind = VALUE_NAC};
+}
+
+static inline void assign(PassContext *ctx, ConstState *state, LibTcgTemp *temp, Value value) {
+    if (is_global(temp) && temp->index < ctx->num_globals) {
+        state->globals[temp->index] = value;
+    } else if (is_local(temp)) {
+        state->locals[temp->index] = value;
+    }
+}
+
+static void set_all(Value *values, size_t count, ValueKind kind) {
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = (Value) {.kind = kind};
+    }
+}
+
+// Merges src into dst, returns true if dst changed
+static bool meet(Value *dst, const Value *src, size_t count) {
+    bool changed = false;
+    for (size_t i = 0; i < count; ++i) {
+        if (src[i].kind == VALUE_UNDEF || dst[i].kind == VALUE_NAC) {
+            continue;
+        }
+        if (dst[i].kind == VALUE_UNDEF) {
+            dst[i] = src[i];
+            changed = true;
+        } else if (src[i].kind == VALUE_NAC || src[i].value != dst[i].value) {
+            dst[i].kind = VALUE_NAC;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static LibTcgTemp *const_temp(PassContext *ctx, uint64_t value) {
+    LibTcgTemp *temp = stack_alloc_zero_tagged(&ctx->memory->persistent,
+                                               sizeof(LibTcgTemp),
+                                               MEM_TAG_LIBTCG_IR);
+    temp->kind = LIBTCG_TEMP_CONST;
+    temp->val = value;
+    temp->index = ctx->next_temp_index++;
+    snprintf(temp->name, sizeof(temp->name), "$0x%lx", value);
+    return temp;
+}
+
+// Runs the transfer function over n starting from state->globals. With
+// rewrite set, constant inputs of pure ops are replaced by constant
+// temps and foldable ops by movs.
+static void constprop_block(PassContext *ctx, ConstState *state, TbNode *n, bool rewrite) {
+    set_all(state->locals, ctx->num_temps, VALUE_NAC);
+    set_all(state->out, ctx->num_globals, VALUE_UNDEF);
+
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
+
+        switch (inst->opcode) {
+        case LIBTCG_op_set_label:
+            // Reached from branches we don't track
+            set_all(state->globals, ctx->num_globals, VALUE_NAC);
+            set_all(state->locals, ctx->num_temps, VALUE_NAC);
+            continue;
+        case LIBTCG_op_exit_tb:
+        case LIBTCG_op_goto_ptr:
+            meet(state->out, state->globals, ctx->num_globals);
+            continue;
+        default:
+            break;
+        }
+
+        if (!is_pure(inst->opcode)) {
+            if (clobbers_globals(ctx->libtcg, inst)) {
+                set_all(state->globals, ctx->num_globals, VALUE_NAC);
+            }
+            for (int j = 0; j < inst->nb_oargs; ++j) {
+                if (inst->output_args[j].kind == LIBTCG_ARG_TEMP) {
+                    assign(ctx, state, inst->output_args[j].temp, (Value) {.kind = VALUE_NAC});
+                }
+            }
+            continue;
+        }
+
+        uint64_t in[LIBTCG_MAX_ARGS] = {0};
+        bool all_const = true;
+        for (int j = 0; j < inst->nb_iargs; ++j) {
+            LibTcgArgument *arg = &inst->input_args[j];
+            if (arg->kind != LIBTCG_ARG_TEMP) {
+                all_const = false;
+                continue;
+            }
+            Value value = lookup(ctx, state, arg->temp);
+            if (value.kind != VALUE_CONST) {
+                all_const = false;
+                continue;
+            }
+            in[j] = value.value;
+            if (rewrite && arg->temp->kind != LIBTCG_TEMP_CONST) {
+                arg->temp = const_temp(ctx, value.value);
+                ++ctx->num_rewritten;
+            }
+        }
+
+        uint64_t result;
+        if (inst->nb_oargs == 1 && all_const && fold(inst->opcode, in, &result)) {
+            assign(ctx, state, inst->output_args[0].temp,
+                   (Value) {.kind = VALUE_CONST, .value = result});
+            bool is_mov = inst->opcode == LIBTCG_op_mov_i32 ||
+                          inst->opcode == LIBTCG_op_mov_i64;
+            if (rewrite && !is_mov) {
+                inst->opcode = has_i32_output(inst->opcode) ? LIBTCG_op_mov_i32
+                                                            : LIBTCG_op_mov_i64;
+                inst->nb_iargs = 1;
+                inst->nb_cargs = 0;
+                inst->input_args[0] = (LibTcgArgument) {
+                    .kind = LIBTCG_ARG_TEMP,
+                    .temp = const_temp(ctx, result),
+                };
+                ++ctx->num_rewritten;
+            }
+        } else {
+            for (int j = 0; j < inst->nb_oargs; ++j) {
+                if (inst->output_args[j].kind == LIBTCG_ARG_TEMP) {
+                    assign(ctx, state, inst->output_args[j].temp, (Value) {.kind = VALUE_NAC});
+                }
+            }
+        }
+    }
+
+    size_t count = n->tb.instruction_count;
+    if (count == 0 ||
+        (n->tb.list[count-1].opcode != LIBTCG_op_exit_tb &&
+         n->tb.list[count-1].opcode != LIBTCG_op_goto_ptr)) {
+        meet(state->out, state->globals, ctx->num_globals);
+    }
+}
+
+static int compare_node_addresses(const void *a, const void *b) {
+    const TbNode *x = *(TbNode *const *) a;
+    const TbNode *y = *(TbNode *const *) b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+// Returns the node starting at address, nodes is sorted by address
+static TbNode *find_node_starting_at(TbNode **nodes, size_t count, uint64_t address) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (nodes[mid]->address < address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < count && nodes[lo]->address == address) ? nodes[lo] : NULL;
+}
+
+// Marks blocks that may be entered through control flow the CFG has no
+// edges for, which are indirect jumps such as returns:
+//
+//   - blocks without predecessors,
+//   - blocks whose address is used as a constant other than by a direct
+//     jump, such as the return address stored by a call,
+//   - blocks following a block that ends right before them but doesn't
+//     fall through into them, such as the return site of a call.
+static bool *find_unmodeled_entries(PassContext *ctx) {
+    StackAllocator *stack = &ctx->memory->temporary;
+    LibTcgArchInfo arch_info = ctx->libtcg->get_arch_info();
+    bool *unmodeled = stack_alloc_zero_tagged(stack, ctx->num_nodes*sizeof(bool), MEM_TAG_OTHER);
+    TbNode **nodes = stack_alloc_tagged(stack, ctx->num_nodes*sizeof(TbNode *), MEM_TAG_OTHER);
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        nodes[n->id] = n;
+        unmodeled[n->id] = n->num_pred == 0;
+    }
+    qsort(nodes, ctx->num_nodes, sizeof(TbNode *), compare_node_addresses);
+
+    for (size_t k = 1; k < ctx->num_nodes; ++k) {
+        TbNode *prev = nodes[k-1];
+        TbNode *n = nodes[k];
+        if (prev->address + prev->tb.size_in_bytes != n->address) {
+            continue;
+        }
+        bool falls_through = false;
+        for (size_t i = 0; i < prev->num_succ; ++i) {
+            if (prev->succ[i].dst_node == n && prev->succ[i].type == FALLTHROUGH) {
+                falls_through = true;
+            }
+        }
+        unmodeled[n->id] |= !falls_through;
+    }
+
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+            if (is_pc_write(arch_info, inst, NULL, NULL)) {
+                continue;
+            }
+            for (int j = 0; j < inst->nb_iargs; ++j) {
+                LibTcgArgument *arg = &inst->input_args[j];
+                if (arg->kind != LIBTCG_ARG_TEMP ||
+                    arg->temp->kind != LIBTCG_TEMP_CONST) {
+                    continue;
+                }
+                TbNode *target = find_node_starting_at(nodes, ctx->num_nodes,
+                                                       arg->temp->val);
+                if (target != NULL) {
+                    unmodeled[target->id] = true;
+                }
+            }
+        }
+    }
+
+    return unmodeled;
+}
+
+static void constprop(PassContext *ctx) {
+    StackAllocator *stack = &ctx->memory->temporary;
+    size_t num_globals = ctx->num_globals;
+
+    // Block entry states, UNDEF until a predecessor has been processed.
+    // Blocks that may be entered other than through their predecessors
+    // start out NAC, see find_unmodeled_entries().
+    bool *unmodeled = find_unmodeled_entries(ctx);
+    Value *in = stack_alloc_zero_tagged(stack, ctx->num_nodes*num_globals*sizeof(Value), MEM_TAG_OTHER);
+    bool *queued = stack_alloc_zero_tagged(stack, ctx->num_nodes*sizeof(bool), MEM_TAG_OTHER);
+    bool *reached = stack_alloc_zero_tagged(stack, ctx->num_nodes*sizeof(bool), MEM_TAG_OTHER);
+    TbNode **queue = stack_alloc_tagged(stack, ctx->num_nodes*sizeof(TbNode *), MEM_TAG_WORKLIST);
+    size_t bottom = 0;
+    size_t used = 0;
+
+    ConstState state = {
+        .globals = stack_alloc_tagged(stack, num_globals*sizeof(Value), MEM_TAG_OTHER),
+        .locals = stack_alloc_tagged(stack, ctx->num_temps*sizeof(Value), MEM_TAG_OTHER),
+        .out = stack_alloc_tagged(stack, num_globals*sizeof(Value), MEM_TAG_OTHER),
+    };
+
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        if (n == ctx->root || unmodeled[n->id]) {
+            set_all(&in[n->id*num_globals], num_globals, VALUE_NAC);
+            queue[(bottom + used++) % ctx->num_nodes] = n;
+            queued[n->id] = true;
+            reached[n->id] = true;
+        }
+    }
+
+    while (used > 0) {
+        TbNode *n = queue[bottom];
+        bottom = (bottom + 1) % ctx->num_nodes;
+        --used;
+        queued[n->id] = false;
+
+        memcpy(state.globals, &in[n->id*num_globals], num_globals*sizeof(Value));
+        constprop_block(ctx, &state, n, false);
+
+        for (size_t i = 0; i < n->num_succ; ++i) {
+            TbNode *succ = n->succ[i].dst_node;
+            bool changed = meet(&in[succ->id*num_globals], state.out, num_globals);
+            if ((changed || !reached[succ->id]) && !queued[succ->id]) {
+                queue[(bottom + used++) % ctx->num_nodes] = succ;
+                queued[succ->id] = true;
+            }
+            reached[succ->id] = true;
+        }
+    }
+
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        if (!reached[n->id]) {
+            continue;
+        }
+        memcpy(state.globals, &in[n->id*num_globals], num_globals*sizeof(Value));
+        constprop_block(ctx, &state, n, true);
+    }
+}
+
+//
+// Copy propagation
+//
+
+typedef struct Copy {
+    LibTcgTemp *src;
+    // Valid while epoch matches and src has not been redefined
+    uint32_t epoch;
+    uint32_t src_version;
+} Copy;
+
+static void copyprop(PassContext *ctx) {
+    StackAllocator *stack = &ctx->memory->temporary;
+    Copy *copies = stack_alloc_zero_tagged(stack, ctx->num_temps*sizeof(Copy), MEM_TAG_OTHER);
+    uint32_t *versions = stack_alloc_zero_tagged(stack, ctx->num_temps*sizeof(uint32_t), MEM_TAG_OTHER);
+    uint32_t epoch = 0;
+
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        ++epoch;
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+
+            if (inst->opcode != LIBTCG_op_call) {
+                for (int j = 0; j < inst->nb_iargs; ++j) {
+                    LibTcgArgument *arg = &inst->input_args[j];
+                    if (arg->kind != LIBTCG_ARG_TEMP ||
+                        arg->temp->kind == LIBTCG_TEMP_CONST) {
+                        continue;
+                    }
+                    Copy *copy = &copies[arg->temp->index];
+                    if (copy->src != NULL && copy->epoch == epoch &&
+                        versions[copy->src->index] == copy->src_version) {
+                        arg->temp = copy->src;
+                        ++ctx->num_rewritten;
+                    }
+                }
+            }
+
+            // Copies don't survive control flow or ops that might write
+            // globals behind our back.
+            if (!is_pure(inst->opcode) && inst->opcode != LIBTCG_op_insn_start) {
+                ++epoch;
+            }
+
+            for (int j = 0; j < inst->nb_oargs; ++j) {
+                LibTcgArgument *arg = &inst->output_args[j];
+                if (arg->kind == LIBTCG_ARG_TEMP) {
+                    ++versions[arg->temp->index];
+                    copies[arg->temp->index].src = NULL;
+                }
+            }
+
+            bool is_mov = inst->opcode == LIBTCG_op_mov_i32 ||
+                          inst->opcode == LIBTCG_op_mov_i64;
+            if (is_mov &&
+                inst->output_args[0].kind == LIBTCG_ARG_TEMP &&
+                inst->input_args[0].kind == LIBTCG_ARG_TEMP) {
+                LibTcgTemp *dst = inst->output_args[0].temp;
+                LibTcgTemp *src = inst->input_args[0].temp;
+                if (src != dst &&
+                    src->index != dst->index &&
+                    (is_global(src) || is_local(src))) {
+                    copies[dst->index] = (Copy) {
+                        .src = src,
+                        .epoch = epoch,
+                        .src_version = versions[src->index],
+                    };
+                }
+            }
+        }
+    }
+}
+
+//
+// Dead code elimination
+//
+
+typedef struct Liveness {
+    // Marks are only valid for the current epoch, unmarked temps are
+    // live if default_live is set, globals always are.
+    uint32_t *epochs;
+    bool *live;
+    uint32_t epoch;
+    bool default_live;
+} Liveness;
+
+static inline bool is_live(Liveness *l, LibTcgTemp *temp) {
+    if (l->epochs[temp->index] == l->epoch) {
+        return l->live[temp->index];
+    }
+    return l->default_live || !is_local(temp);
+}
+
+static inline void mark(Liveness *l, LibTcgTemp *temp, bool live) {
+    l->epochs[temp->index] = l->epoch;
+    l->live[temp->index] = live;
+}
+
+static void dce(PassContext *ctx) {
+    StackAllocator *stack = &ctx->memory->temporary;
+    Liveness l = {
+        .epochs = stack_alloc_zero_tagged(stack, ctx->num_temps*sizeof(uint32_t), MEM_TAG_OTHER),
+        .live = stack_alloc_zero_tagged(stack, ctx->num_temps*sizeof(bool), MEM_TAG_OTHER),
+    };
+
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        StackMarker marker = stack_marker(stack);
+        bool *removed = stack_alloc_zero_tagged(stack, n->tb.instruction_count*sizeof(bool), MEM_TAG_OTHER);
+        size_t num_removed = 0;
+
+        ++l.epoch;
+        l.default_live = temps_flow_into_next(n);
+
+        for (size_t i = n->tb.instruction_count; i > 0; --i) {
+            LibTcgInstruction *inst = &n->tb.list[i-1];
+            if (inst->opcode == LIBTCG_op_insn_start) {
+                continue;
+            }
+
+            if (is_pure(inst->opcode) && inst->nb_oargs > 0) {
+                bool live = false;
+                for (int j = 0; j < inst->nb_oargs; ++j) {
+                    if (is_live(&l, inst->output_args[j].temp)) {
+                        live = true;
+                    }
+                }
+                if (!live) {
+                    removed[i-1] = true;
+                    ++num_removed;
+                    continue;
+                }
+                for (int j = 0; j < inst->nb_oargs; ++j) {
+                    mark(&l, inst->output_args[j].temp, false);
+                }
+            } else {
+                // Anything might be read past control flow, helpers and
+                // memory ops which can fault.
+                ++l.epoch;
+                l.default_live = true;
+            }
+
+            for (int j = 0; j < inst->nb_iargs; ++j) {
+                LibTcgArgument *arg = &inst->input_args[j];
+                if (arg->kind == LIBTCG_ARG_TEMP &&
+                    arg->temp->kind != LIBTCG_TEMP_CONST) {
+                    mark(&l, arg->temp, true);
+                }
+            }
+        }
+
+        if (num_removed > 0) {
+            compact_block(ctx, n, removed);
+            ctx->num_rewritten += num_removed;
+        }
+        stack_reset_to_marker(stack, marker);
+    }
+}
+
+static void insn_dce(PassContext *ctx) {
+    StackAllocator *stack = &ctx->memory->temporary;
+    for (TbNode *n = ctx->root; n != NULL; n = n->next) {
+        StackMarker marker = stack_marker(stack);
+        size_t count = n->tb.instruction_count;
+        bool *removed = stack_alloc_zero_tagged(stack, count*sizeof(bool), MEM_TAG_OTHER);
+        size_t num_removed = 0;
+        bool first = true;
+        for (size_t i = 0; i < count; ++i) {
+            if (n->tb.list[i].opcode != LIBTCG_op_insn_start) {
+                continue;
+            }
+            bool empty = (i + 1 == count ||
+                          n->tb.list[i+1].opcode == LIBTCG_op_insn_start);
+            if (empty && !first) {
+                removed[i] = true;
+                ++num_removed;
+            }
+            first = false;
+        }
+        if (num_removed > 0) {
+            compact_block(ctx, n, removed);
+            ctx->num_rewritten += num_removed;
+        }
+        stack_reset_to_marker(stack, marker);
+    }
+}
+
+void run_passes(LibTcgInterface *libtcg, Memory *memory, TbNode *root,
+                PassPipeline *pipeline, FILE *report) {
+    PassContext ctx = {
+        .libtcg = libtcg,
+        .memory = memory,
+        .root = root,
+        .num_nodes = number_nodes(root),
+    };
+
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            LibTcgInstruction *inst = &n->tb.list[i];
+            for (int j = 0; j < inst->nb_oargs + inst->nb_iargs; ++j) {
+                LibTcgArgument *arg = (j < inst->nb_oargs)
+                                    ? &inst->output_args[j]
+                                    : &inst->input_args[j - inst->nb_oargs];
+                if (arg->kind != LIBTCG_ARG_TEMP) {
+                    continue;
+                }
+                ctx.num_temps = MAX(ctx.num_temps, arg->temp->index + 1);
+                if (is_global(arg->temp)) {
+                    ctx.num_globals = MAX(ctx.num_globals, arg->temp->index + 1);
+                }
+            }
+        }
+    }
+    ctx.next_temp_index = ctx.num_temps;
+
+    for (size_t i = 0; i < pipeline->num_passes; ++i) {
+        PassKind kind = pipeline->passes[i];
+        size_t before = count_instructions(root);
+        ctx.num_rewritten = 0;
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        StackMarker marker = stack_marker(&memory->temporary);
+        switch (kind) {
+        case PASS_CONSTPROP: constprop(&ctx); break;
+        case PASS_COPYPROP:  copyprop(&ctx);  break;
+        case PASS_DCE:       dce(&ctx);       break;
+        case PASS_INSN_DCE:  insn_dce(&ctx);  break;
+        default: assert(0);
+        }
+        stack_reset_to_marker(&memory->temporary, marker);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (report != NULL) {
+            fprintf(report, "pass %-10s %10.3f ms %10lu -> %-10lu instructions %10lu rewritten\n",
+                    pass_names[kind], elapsed_ms(begin, end),
+                    before, count_instructions(root), ctx.num_rewritten);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct LibTcgInterface LibTcgInterface;
+typedef struct Memory Memory;
+typedef struct TbNode TbNode;
+
+#define MAX_PASSES 16
+
+// IR cleanup passes over a built CFG, run in the order given:
+//
+//   constprop  forward constant propagation and folding of pure ops,
+//              globals are tracked across blocks along CFG edges,
+//              nothing is known on entry to blocks that indirect
+//              jumps such as returns may reach
+//   copyprop   block-local propagation of mov sources into uses
+//   dce        removes pure ops whose outputs are dead within a block
+//   insn-dce   removes insn_start markers left without any ops,
+//              except the one starting a block
+//
+// Passes only ever remove or rewrite side effect free ops, edges are
+// remapped to the new instruction indices.
+typedef enum PassKind {
+    PASS_CONSTPROP = 0,
+    PASS_COPYPROP,
+    PASS_DCE,
+    PASS_INSN_DCE,
+    NUM_PASS_KINDS,
+} PassKind;
+
+typedef struct PassPipeline {
+    PassKind passes[MAX_PASSES];
+    size_t num_passes;
+} PassPipeline;
+
+// Parses a comma separated list of pass names, e.g. "constprop,dce".
+bool pass_pipeline_from_str(const char *str, PassPipeline *pipeline);
+
+// Runs all passes of pipeline over the CFG starting at root. If report
+// is non-NULL, time spent and instruction counts are printed per pass.
+void run_passes(LibTcgInterface *libtcg, Memory *memory, TbNode *root,
+                PassPipeline *pipeline, FILE *report);
@@ -0,0 +1,185 @@
+#include "profile.h"
+#include "common.h"
+#include <stdlib.h> // for abort()
+#include <string.h>
+
+#if defined(MEM_PROFILE)
+
+static const char *mem_tag_names[NUM_MEM_TAGS] = {
+    [MEM_TAG_OTHER]       = "other",
+    [MEM_TAG_INPUT]       = "input",
+    [MEM_TAG_LIBTCG_IR]   = "libtcg-ir",
+    [MEM_TAG_TB_NODE]     = "tb-node",
+    [MEM_TAG_SRC_INFO]    = "src-info",
+    [MEM_TAG_STACK_STATE] = "stack-state",
+    [MEM_TAG_WORKLIST]    = "worklist",
+    [MEM_TAG_DOT_COLOR]   = "dot-color",
+};
+
+static const char *phase_names[NUM_PHASES] = {
+    [PHASE_LOAD]      = "load",
+    [PHASE_LIFT]      = "lift",
+    [PHASE_CFG]       = "cfg",
+    [PHASE_PASSES]    = "passes",
+    [PHASE_REG_SRC]   = "reg-src",
+    [PHASE_MAX_STACK] = "max-stack",
+    [PHASE_OUTPUT]    = "output",
+};
+
+typedef struct TagStats {
+    size_t bytes;
+    size_t count;
+} TagStats;
+
+typedef struct PhaseStats {
+    bool visited;
+    size_t persistent_growth;
+    size_t persistent_peak;
+    size_t temporary_peak;
+    TagStats tags[NUM_MEM_TAGS];
+} PhaseStats;
+
+// Per thread, allocations of the --arch auto lifting threads end up in
+// their own copy and are not reported
+static _Thread_local struct {
+    bool in_phase;
+    ProfilePhase phase;
+    size_t persistent_begin;
+    TagStats tags[NUM_MEM_TAGS];
+    PhaseStats phases[NUM_PHASES];
+} profile = {0};
+
+void profile_record_alloc(MemTag tag, size_t size) {
+    profile.tags[tag].bytes += size;
+    ++profile.tags[tag].count;
+    if (profile.in_phase) {
+        profile.phases[profile.phase].tags[tag].bytes += size;
+        ++profile.phases[profile.phase].tags[tag].count;
+    }
+}
+
+void profile_begin(Memory *memory, ProfilePhase phase) {
+    assert(!profile.in_phase);
+    profile.in_phase = true;
+    profile.phase = phase;
+    profile.persistent_begin = memory->persistent.used;
+    memory->persistent.peak = memory->persistent.used;
+    memory->temporary.peak = memory->temporary.used;
+}
+
+void profile_end(Memory *memory) {
+    assert(profile.in_phase);
+    PhaseStats *stats = &profile.phases[profile.phase];
+    stats->visited = true;
+    if (memory->persistent.used > profile.persistent_begin) {
+        stats->persistent_growth += memory->persistent.used - profile.persistent_begin;
+    }
+    stats->persistent_peak = MAX(stats->persistent_peak, memory->persistent.peak);
+    stats->temporary_peak = MAX(stats->temporary_peak, memory->temporary.peak);
+    profile.in_phase = false;
+}
+
+#endif
+
+bool mem_report_format_from_str(const char *str, MemReportFormat *format) {
+    if (strcmp(str, "text") == 0) {
+        *format = MEM_REPORT_TEXT;
+    } else if (strcmp(str, "json") == 0) {
+        *format = MEM_REPORT_JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void report_text(FILE *fd, Memory *memory) {
+    StackSize size;
+    fputs("Memory report:\n", fd);
+    size = stack_size(&memory->persistent);
+    fprintf(fd, "  persistent memory %lu/%lu kiB in %lu blocks\n", size.total_used/1024, size.total_size/1024, size.num_blocks);
+    size = stack_size(&memory->temporary);
+    fprintf(fd, "  temporary memory  %lu/%lu kiB in %lu blocks\n", size.total_used/1024, size.total_size/1024, size.num_blocks);
+
+#if defined(MEM_PROFILE)
+    fprintf(fd, "\n  %-12s%16s%16s%16s\n", "phase", "growth kiB", "peak pers. kiB", "peak temp. kiB");
+    for (size_t i = 0; i < NUM_PHASES; ++i) {
+        PhaseStats *stats = &profile.phases[i];
+        if (!stats->visited) {
+            continue;
+        }
+        fprintf(fd, "  %-12s%16lu%16lu%16lu\n", phase_names[i],
+                stats->persistent_growth/1024,
+                stats->persistent_peak/1024,
+                stats->temporary_peak/1024);
+    }
+
+    fprintf(fd, "\n  %-12s%16s%16s", "tag", "total kiB", "allocations");
+    for (size_t i = 0; i < NUM_PHASES; ++i) {
+        if (profile.phases[i].visited) {
+            fprintf(fd, "%12s", phase_names[i]);
+        }
+    }
+    fputs("\n", fd);
+    for (size_t t = 0; t < NUM_MEM_TAGS; ++t) {
+        if (profile.tags[t].count == 0) {
+            continue;
+        }
+        fprintf(fd, "  %-12s%16lu%16lu", mem_tag_names[t],
+                profile.tags[t].bytes/1024, profile.tags[t].count);
+        for (size_t i = 0; i < NUM_PHASES; ++i) {
+            if (profile.phases[i].visited) {
+                fprintf(fd, "%12lu", profile.phases[i].tags[t].bytes/1024);
+            }
+        }
+        fputs("\n", fd);
+    }
+#else
+    fputs("  (build with MEM_PROFILE=1 for a per-phase and per-tag breakdown)\n", fd);
+#endif
+}
+
+static void report_json(FILE *fd, Memory *memory) {
+    StackSize p = stack_size(&memory->persistent);
+    StackSize t = stack_size(&memory->temporary);
+    fprintf(fd, "{\"persistent\":{\"used\":%lu,\"size\":%lu,\"blocks\":%lu},", p.total_used, p.total_size, p.num_blocks);
+    fprintf(fd, "\"temporary\":{\"used\":%lu,\"size\":%lu,\"blocks\":%lu}", t.total_used, t.total_size, t.num_blocks);
+
+#if defined(MEM_PROFILE)
+    fputs(",\"tags\":{", fd);
+    for (size_t i = 0; i < NUM_MEM_TAGS; ++i) {
+        fprintf(fd, "%s\"%s\":{\"bytes\":%lu,\"count\":%lu}", (i > 0) ? "," : "",
+                mem_tag_names[i], profile.tags[i].bytes, profile.tags[i].count);
+    }
+    fputs("},\"phases\":[", fd);
+    bool first = true;
+    for (size_t i = 0; i < NUM_PHASES; ++i) {
+        PhaseStats *stats = &profile.phases[i];
+        if (!stats->visited) {
+            continue;
+        }
+        fprintf(fd, "%s{\"name\":\"%s\",\"persistent_growth\":%lu,\"persistent_peak\":%lu,\"temporary_peak\":%lu,\"tags\":{",
+                (first) ? "" : ",", phase_names[i],
+                stats->persistent_growth, stats->persistent_peak, stats->temporary_peak);
+        for (size_t j = 0; j < NUM_MEM_TAGS; ++j) {
+            fprintf(fd, "%s\"%s\":%lu", (j > 0) ? "," : "", mem_tag_names[j], stats->tags[j].bytes);
+        }
+        fputs("}}", fd);
+        first = false;
+    }
+    fputs("]", fd);
+#endif
+    fputs("}\n", fd);
+}
+
+void mem_report(FILE *fd, Memory *memory, MemReportFormat format) {
+    switch (format) {
+    case MEM_REPORT_TEXT:
+        report_text(fd, memory);
+        break;
+    case MEM_REPORT_JSON:
+        report_json(fd, memory);
+        break;
+    default:
+        abort();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct Memory Memory;
+
+// Tags attributing arena allocations to the data structure they hold.
+// Only tracked when compiled with -DMEM_PROFILE (make MEM_PROFILE=1),
+// otherwise tagged allocations compile down to plain stack_alloc().
+typedef enum MemTag {
+    MEM_TAG_OTHER = 0,
+    MEM_TAG_INPUT,
+    MEM_TAG_LIBTCG_IR,
+    MEM_TAG_TB_NODE,
+    MEM_TAG_SRC_INFO,
+    MEM_TAG_STACK_STATE,
+    MEM_TAG_WORKLIST,
+    MEM_TAG_DOT_COLOR,
+    NUM_MEM_TAGS,
+} MemTag;
+
+typedef enum ProfilePhase {
+    PHASE_LOAD = 0,
+    PHASE_LIFT,
+    PHASE_CFG,
+    PHASE_PASSES,
+    PHASE_REG_SRC,
+    PHASE_MAX_STACK,
+    PHASE_OUTPUT,
+    NUM_PHASES,
+} ProfilePhase;
+
+typedef enum MemReportFormat {
+    MEM_REPORT_TEXT = 0,
+    MEM_REPORT_JSON,
+} MemReportFormat;
+
+#if defined(MEM_PROFILE)
+void profile_record_alloc(MemTag tag, size_t size);
+void profile_begin(Memory *memory, ProfilePhase phase);
+void profile_end(Memory *memory);
+#else
+#define profile_record_alloc(tag, size) ((void) 0)
+#define profile_begin(memory, phase)    ((void) 0)
+#define profile_end(memory)             ((void) 0)
+#endif
+
+bool mem_report_format_from_str(const char *str, MemReportFormat *format);
+void mem_report(FILE *fd, Memory *memory, MemReportFormat format);
@@ -0,0 +1,553 @@
+#define _POSIX_C_SOURCE 200809L
+#include "server.h"
+#include "common.h"
+#include "cfg.h"
+#include "cmdline.h"
+#include "output.h"
+#include "graphviz.h"
+#include "json-export.h"
+#include "analyze-reg-src.h"
+#include "analyze-max-stack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define MAX_REQUEST_ARGS 8
+// Connections that don't deliver a complete request or take the response
+// in time are dropped so that they can't block the server
+#define REQUEST_TIMEOUT_SEC 5
+
+typedef enum Command {
+    COMMAND_LIFT = 0,
+    COMMAND_CFG,
+    COMMAND_MAX_STACK,
+    COMMAND_REG_SRC,
+    COMMAND_BLOCK,
+    COMMAND_JSON,
+    COMMAND_STATS,
+    COMMAND_SHUTDOWN,
+    NUM_COMMANDS,
+} Command;
+
+static const struct {
+    const char *name;
+    // Arguments preceding the target
+    size_t num_args;
+    bool has_target;
+} commands[NUM_COMMANDS] = {
+    [COMMAND_LIFT]      = {"lift",      0, true},
+    [COMMAND_CFG]       = {"cfg",       0, true},
+    [COMMAND_MAX_STACK] = {"max-stack", 0, true},
+    [COMMAND_REG_SRC]   = {"reg-src",   1, true},
+    [COMMAND_BLOCK]     = {"block",     1, true},
+    [COMMAND_JSON]      = {"json",      0, true},
+    [COMMAND_STATS]     = {"stats",     0, false},
+    [COMMAND_SHUTDOWN]  = {"shutdown",  0, false},
+};
+
+// Lifted CFG of a target, kept until the server exits
+typedef struct ServerGraph {
+    // Target in normalized form, "address" with canonical hex and length
+    const char *target;
+    TbNode *root;
+    size_t num_nodes;
+    // Set once stack_state of all nodes is filled in
+    bool max_stack;
+    struct ServerGraph *next;
+} ServerGraph;
+
+typedef struct Server {
+    LibTcgInterface *libtcg;
+    LibTcgContext *context;
+    Memory *memory;
+    // Scratch memory of a single request, reset after each
+    Memory request;
+    ElfData *data;
+    const ElfSymbolTable *symbols;
+    const ElfModeMap *modes;
+    uint32_t flags;
+    ServerGraph *graphs;
+    size_t num_graphs;
+    size_t num_requests;
+    size_t num_cache_hits;
+} Server;
+
+static bool read_all(int fd, void *data, size_t size) {
+    uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    *addr = (struct sockaddr_un) {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "[error]: Socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static int connect_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+    // Sockets left behind by a server that didn't shut down are
+    // replaced, live ones and anything that isn't a socket are not.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "[error]: %s exists and is not a socket\n", path);
+            return -1;
+        }
+        int live = connect_socket(path);
+        if (live != -1) {
+            close(live);
+            fprintf(stderr, "[error]: A server is already listening on %s\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "[error]: Failed to listen on %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static void respond_error(Output *out, const char *message) {
+    OUTPUT_LIT(out, "error ");
+    output_str(out, message);
+    output_char(out, '\n');
+}
+
+// Looks up the CFG of the target in argv, lifting it and building the
+// CFG on first use. Returns NULL and sets error if the target is
+// invalid or could not be lifted.
+static ServerGraph *find_graph(Server *server, char **argv, size_t argc,
+                               const char **error) {
+    char target[SERVER_MAX_REQUEST + 64];
+    uint64_t vaddr = 0;
+    unsigned long size = 0;
+    bool is_address = argc >= 2 && argc <= 3 && strcmp(argv[0], "address") == 0;
+    if (is_address) {
+        char *end;
+        vaddr = strtoull(argv[1], &end, 16);
+        if (*end != 0 || (argc == 3 && (size = strtoul(argv[2], &end, 10), *end != 0))) {
+            *error = "invalid address or length";
+            return NULL;
+        }
+        snprintf(target, sizeof(target), "address %lx %lu", vaddr, size);
+    } else if (argc == 2 && (strcmp(argv[0], "function") == 0 ||
+                             strcmp(argv[0], "section") == 0)) {
+        snprintf(target, sizeof(target), "%s %s", argv[0], argv[1]);
+    } else {
+        *error = "invalid target, expected function <name>, section <name> or address <hex> [length]";
+        return NULL;
+    }
+
+    for (ServerGraph *g = server->graphs; g != NULL; g = g->next) {
+        if (strcmp(g->target, target) == 0) {
+            ++server->num_cache_hits;
+            return g;
+        }
+    }
+
+    ElfData *data = server->data;
+    ElfByteView view;
+    bool found;
+    if (is_address) {
+        // Thumb addresses have the lowest bit set
+        uint64_t address = vaddr;
+        if (data->arch == LIBTCG_ARCH_ARM) {
+            address &= ~((uint64_t) 1);
+        }
+        found = elf_address_range(data, address, size, &view);
+        view.address = vaddr;
+    } else if (argv[0][0] == 'f') {
+        found = elf_function(data, argv[1], &view);
+    } else {
+        found = elf_section(data, argv[1], &view);
+    }
+    if (!found) {
+        *error = "target not found";
+        return NULL;
+    }
+
+    uint32_t flags = server->flags;
+    if (data->arch == LIBTCG_ARCH_ARM && ((view.address & 1) != 0)) {
+        flags |= LIBTCG_TRANSLATE_ARM_THUMB;
+        view.address &= ~((uint64_t) 1);
+    }
+    StackAllocator *stack = &server->memory->persistent;
+    TbNode *root = cfg_lift(server->libtcg, server->context, NULL, stack,
+                            view.data, view.size, view.address, flags,
+                            server->modes);
+    if (root == NULL) {
+        *error = "no blocks lifted";
+        return NULL;
+    }
+    cfg_build(server->libtcg, stack, root);
+
+    size_t len = strlen(target);
+    char *copy = stack_alloc_tagged(stack, len + 1, MEM_TAG_OTHER);
+    memcpy(copy, target, len + 1);
+    ServerGraph *graph = stack_alloc_tagged(stack, sizeof(ServerGraph), MEM_TAG_OTHER);
+    *graph = (ServerGraph) {
+        .target = copy,
+        .root = root,
+        .num_nodes = number_nodes(root),
+        .next = server->graphs,
+    };
+    server->graphs = graph;
+    ++server->num_graphs;
+    return graph;
+}
+
+static void analyze_max_stack(Server *server, ServerGraph *graph) {
+    if (graph->max_stack) {
+        return;
+    }
+    // stack_state of the nodes is allocated along with the CFG, in the
+    // persistent memory of the server rather than that of the request
+    bool stack_grows_down = true;
+    compute_max_stack_size(server->libtcg, server->memory, graph->root,
+                           server->symbols, stack_grows_down);
+    graph->max_stack = true;
+}
+
+static void handle_request(Server *server, Output *out, char *request,
+                           bool *shutdown) {
+    char *argv[MAX_REQUEST_ARGS];
+    size_t argc = 0;
+    for (char *tok = strtok(request, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+        if (argc == MAX_REQUEST_ARGS) {
+            respond_error(out, "too many arguments");
+            return;
+        }
+        argv[argc++] = tok;
+    }
+    if (argc == 0) {
+        respond_error(out, "empty request");
+        return;
+    }
+
+    Command command = 0;
+    while (command < NUM_COMMANDS && strcmp(commands[command].name, argv[0]) != 0) {
+        ++command;
+    }
+    if (command == NUM_COMMANDS) {
+        respond_error(out, "unknown command");
+        return;
+    }
+    size_t num_args = commands[command].num_args;
+    if (argc < 1 + num_args || (!commands[command].has_target && argc > 1)) {
+        respond_error(out, "wrong number of arguments");
+        return;
+    }
+
+    if (command == COMMAND_SHUTDOWN) {
+        *shutdown = true;
+        OUTPUT_LIT(out, "ok\n");
+        return;
+    }
+    if (command == COMMAND_STATS) {
+        StackSize size = stack_size(&server->memory->persistent);
+        OUTPUT_LIT(out, "ok\nrequests ");
+        output_u64(out, server->num_requests);
+        OUTPUT_LIT(out, "\ncfgs ");
+        output_u64(out, server->num_graphs);
+        OUTPUT_LIT(out, "\ncache-hits ");
+        output_u64(out, server->num_cache_hits);
+        OUTPUT_LIT(out, "\npersistent-kib ");
+        output_u64(out, size.total_used/1024);
+        output_char(out, '\n');
+        return;
+    }
+
+    CmdLineRegTuple reg_src = {0};
+    uint64_t block_address = 0;
+    if (command == COMMAND_REG_SRC) {
+        CmdLineOption option = {.type = CMDLINE_OPTION_REG_TUPLE, .reg_tuple = &reg_src};
+        if (!parse_option(&option, argv[1])) {
+            respond_error(out, "invalid register, expected hex:ulong:ulong");
+            return;
+        }
+    } else if (command == COMMAND_BLOCK) {
+        char *end;
+        block_address = strtoull(argv[1], &end, 16);
+        if (*end != 0) {
+            respond_error(out, "invalid block address");
+            return;
+        }
+    }
+
+    const char *error = NULL;
+    ServerGraph *graph = find_graph(server, argv + 1 + num_args,
+                                    argc - 1 - num_args, &error);
+    if (graph == NULL) {
+        respond_error(out, error);
+        return;
+    }
+
+    TbNode *root = graph->root;
+    TbNode *reg_src_node = NULL;
+    int reg_src_index = 0;
+    if (command == COMMAND_REG_SRC) {
+        uint64_t address = reg_src.src_instruction_address;
+        reg_src_node = find_tb_containing(root, address);
+        reg_src_index = (reg_src_node != NULL)
+            ? find_instruction_from_address(reg_src_node, address)
+            : -1;
+        if (reg_src_index == -1) {
+            respond_error(out, "no instruction at register address");
+            return;
+        }
+        reg_src_index += reg_src.tcg_instruction_offset;
+        if ((size_t) reg_src_index >= reg_src_node->tb.instruction_count) {
+            respond_error(out, "TCG instruction offset out of range");
+            return;
+        }
+        LibTcgInstruction *inst = &reg_src_node->tb.list[reg_src_index];
+        if (reg_src.operand_index < inst->nb_oargs ||
+            reg_src.operand_index >= inst->nb_oargs + inst->nb_iargs) {
+            respond_error(out, "operand index is not an input of the instruction");
+            return;
+        }
+        SrcInfo *info = find_sources(server->libtcg->get_arch_info(),
+                                     &server->request, reg_src_node,
+                                     reg_src_index, reg_src.operand_index);
+        flatten_sources(&server->request.temporary, info);
+    } else if (command == COMMAND_BLOCK) {
+        TbNode *n = find_tb_containing(root, block_address);
+        if (n == NULL) {
+            respond_error(out, "no block at address");
+            return;
+        }
+        // Detached copy, so that only the block itself is drawn
+        root = stack_alloc_tagged(&server->request.temporary, sizeof(TbNode), MEM_TAG_OTHER);
+        *root = *n;
+        root->next = NULL;
+        root->num_succ = 0;
+        root->num_pred = 0;
+    } else if (command == COMMAND_MAX_STACK || command == COMMAND_JSON) {
+        analyze_max_stack(server, graph);
+    }
+
+    OUTPUT_LIT(out, "ok\n");
+    GraphvizSettings settings = {
+        .nodesep = 1.0f,
+        .ranksep = 1.0f,
+        .dashed_fallthrough_edges = false,
+        .compact_args = true,
+        .symbols = server->symbols,
+    };
+    switch (command) {
+    case COMMAND_LIFT:
+        for (TbNode *n = root; n != NULL; n = n->next) {
+            output_tb_ir(out, server->libtcg, &n->tb);
+        }
+        break;
+    case COMMAND_CFG:
+    case COMMAND_MAX_STACK:
+    case COMMAND_REG_SRC:
+    case COMMAND_BLOCK:
+        graphviz_output(server->libtcg, &server->request.temporary, settings,
+                        out, root, command == COMMAND_MAX_STACK, reg_src,
+                        reg_src_node, reg_src_index);
+        break;
+    case COMMAND_JSON:
+        json_export(server->libtcg, out, root, true, false);
+        break;
+    default:
+        break;
+    }
+
+    // Sources point into the scratch memory of this request
+    if (reg_src_node != NULL) {
+        for (TbNode *n = graph->root; n != NULL; n = n->next) {
+            n->reg_src_info = NULL;
+        }
+    }
+}
+
+bool serve(LibTcgInterface *libtcg, LibTcgContext *context, Memory *memory,
+           ElfData *data, const ElfSymbolTable *symbols,
+           const ElfModeMap *modes, uint32_t flags, const char *path) {
+    // Clients going away mid-response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    int listen_fd = listen_socket(path);
+    if (listen_fd == -1) {
+        return false;
+    }
+
+    Server server = {
+        .libtcg = libtcg,
+        .context = context,
+        .memory = memory,
+        .data = data,
+        .symbols = symbols,
+        .modes = modes,
+        .flags = flags,
+    };
+    bool ok = true;
+    bool shutdown = false;
+    char request[SERVER_MAX_REQUEST];
+    while (!shutdown) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "[error]: Failed to accept connection on %s: %s\n", path, strerror(errno));
+            ok = false;
+            break;
+        }
+        struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT_SEC};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        uint32_t size;
+        if (read_all(fd, &size, sizeof(size)) &&
+            size < SERVER_MAX_REQUEST &&
+            read_all(fd, request, size)) {
+            request[size] = 0;
+            ++server.num_requests;
+            Output out;
+            output_init(&out, &server.request.temporary, fd, OUTPUT_BUFFER_SIZE);
+            handle_request(&server, &out, request, &shutdown);
+            output_flush(&out);
+        }
+        close(fd);
+        stack_reset(&server.request.temporary);
+        stack_reset(&server.request.persistent);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    stack_free_all(&server.request.temporary);
+    stack_free_all(&server.request.persistent);
+    return ok;
+}
+
+// Sends a single request and copies the response, minus the status
+// line, to out.
+static bool send_request(const char *path, const char *request, Output *out) {
+    int fd = connect_socket(path);
+    if (fd == -1) {
+        fprintf(stderr, "[error]: Failed to connect to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    uint32_t size = strlen(request);
+    if (!write_all(fd, &size, sizeof(size)) || !write_all(fd, request, size)) {
+        fprintf(stderr, "[error]: Failed to send request to %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    char status[256];
+    size_t status_len = 0;
+    bool in_status = true;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size_t i = 0;
+        while (in_status && i < (size_t) n) {
+            char c = buf[i++];
+            if (c == '\n') {
+                in_status = false;
+            } else if (status_len < sizeof(status) - 1) {
+                status[status_len++] = c;
+            }
+        }
+        output_write(out, buf + i, n - i);
+    }
+    close(fd);
+    status[status_len] = 0;
+
+    if (in_status) {
+        fprintf(stderr, "[error]: No response to \"%s\"\n", request);
+        return false;
+    }
+    if (strcmp(status, "ok") != 0) {
+        const char *message = (strncmp(status, "error ", 6) == 0) ? status + 6 : status;
+        fprintf(stderr, "[error]: \"%s\": %s\n", request, message);
+        return false;
+    }
+    return true;
+}
+
+bool query(const char *path, FILE *fd, Output *out) {
+    bool ok = true;
+    char line[SERVER_MAX_REQUEST];
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0) {
+            continue;
+        }
+        ok = send_request(path, line, out) && ok;
+    }
+    return ok;
+}
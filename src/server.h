@@ -0,0 +1,51 @@
+#pragma once
+
+#include "loadelf.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Memory Memory;
+typedef struct Output Output;
+
+// Largest request frame the server accepts
+#define SERVER_MAX_REQUEST 4096
+
+// Listens on a Unix domain socket at path and answers requests against
+// the ELF file in data until a shutdown request. The ELF file and lifted
+// CFGs stay resident, so repeated requests for the same target only pay
+// for the analysis and output they ask for. Lifted CFGs are allocated on
+// memory->persistent, through libtcg as well. memory->temporary is
+// unused. modes may be NULL, see cfg_lift().
+//
+// Each connection carries a single request, a native endian uint32_t
+// length followed by that many bytes of text:
+//
+//   lift <target>              IR of each block
+//   cfg <target>               CFG in DOT format
+//   max-stack <target>         CFG in DOT format with max stack offsets
+//   reg-src <hex:ulong:ulong> <target>
+//                              CFG in DOT format with the sources of
+//                              the register, same as --analyze-reg-src
+//   block <hex> <target>       DOT of the single block containing hex
+//   json <target>              IR, edges and max stack offsets as JSON
+//                              lines, see json_export()
+//   stats                      number of requests and cached CFGs
+//   shutdown                   stop the server
+//
+// where <target> is one of
+//
+//   function <name>
+//   section <name>
+//   address <hex> [length]
+//
+// The response is a line "ok" or "error <message>", followed by the
+// output of the request up to the end of the connection.
+bool serve(LibTcgInterface *libtcg, LibTcgContext *context, Memory *memory,
+           ElfData *data, const ElfSymbolTable *symbols,
+           const ElfModeMap *modes, uint32_t flags, const char *path);
+
+// Sends each line of fd as a request to the server at path and writes
+// the responses to out. Returns false if any request failed.
+bool query(const char *path, FILE *fd, Output *out);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Power of two
+#define SPSC_QUEUE_SIZE 1024
+#define SPSC_CACHE_LINE 64
+
+// Lock-free bounded queue of pointers between exactly one producer and
+// one consumer thread. head and tail only ever increase, each is
+// written by one side and kept on its own cache line.
+typedef struct SpscQueue {
+    void *items[SPSC_QUEUE_SIZE];
+    atomic_size_t tail;
+    char pad0[SPSC_CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t head;
+    char pad1[SPSC_CACHE_LINE - sizeof(atomic_size_t)];
+} SpscQueue;
+
+static inline void spsc_init(SpscQueue *q) {
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+}
+
+// Producer side, returns false if the queue is full
+static inline bool spsc_push(SpscQueue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == SPSC_QUEUE_SIZE) {
+        return false;
+    }
+    q->items[tail & (SPSC_QUEUE_SIZE - 1)] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer side, returns false if the queue is empty
+static inline bool spsc_pop(SpscQueue *q, void **item) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *item = q->items[head & (SPSC_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
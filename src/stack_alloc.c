@@ -43,7 +43,7 @@ static inline void initialize(StackAllocator *stack) {
     }
 }
 
-void *stack_alloc(StackAllocator *stack, size_t size) {
+static void *alloc(StackAllocator *stack, size_t size) {
     initialize(stack);
 
     if (unlikely(stack->root == NULL)) {
@@ -69,9 +69,32 @@ void *stack_alloc(StackAllocator *stack, size_t size) {
     uint8_t *ptr = stack->last->memory + stack->last->used;
     stack->last->used += size;
 
+#if defined(MEM_PROFILE)
+    stack->used += size;
+    stack->peak = MAX(stack->peak, stack->used);
+#endif
+
     return (void *) ptr;
 }
 
+void *stack_alloc(StackAllocator *stack, size_t size) {
+    profile_record_alloc(MEM_TAG_OTHER, size);
+    return alloc(stack, size);
+}
+
+#if defined(MEM_PROFILE)
+void *stack_alloc_tagged(StackAllocator *stack, size_t size, MemTag tag) {
+    profile_record_alloc(tag, size);
+    return alloc(stack, size);
+}
+
+void *stack_alloc_zero_tagged(StackAllocator *stack, size_t size, MemTag tag) {
+    void *ptr = stack_alloc_tagged(stack, size, tag);
+    memset(ptr, 0, size);
+    return ptr;
+}
+#endif
+
 void *stack_alloc_zero(StackAllocator *stack, size_t size) {
     void *ptr = stack_alloc(stack, size);
     memset(ptr, 0, size);
@@ -105,6 +128,9 @@ void stack_reset(StackAllocator *stack) {
         b->used = 0;
     }
     stack->last = stack->root;
+#if defined(MEM_PROFILE)
+    stack->used = 0;
+#endif
 }
 
 void stack_reset_to_marker(StackAllocator *stack, StackMarker marker) {
@@ -116,6 +142,12 @@ void stack_reset_to_marker(StackAllocator *stack, StackMarker marker) {
     }
     stack->last = marker.block;
     stack->last->used = marker.offset;
+#if defined(MEM_PROFILE)
+    stack->used = 0;
+    for (StackBlock *b = stack->root; b != NULL; b = b->next) {
+        stack->used += b->used;
+    }
+#endif
 }
 
 void stack_free_all(StackAllocator *stack) {
@@ -129,3 +161,57 @@ void stack_free_all(StackAllocator *stack) {
         free(tmp);
     } while(head != NULL);
 }
+
+void stack_adopt(StackAllocator *dst, StackAllocator *src) {
+    if (src->root == NULL) {
+        return;
+    }
+    initialize(dst);
+    // Unused blocks of dst past last go after the adopted ones
+    StackBlock *rest = dst->last->next;
+    StackBlock *tail = src->root;
+    while (tail->next != NULL) {
+        tail = tail->next;
+    }
+    dst->last->next = src->root;
+    tail->next = rest;
+    dst->last = src->last;
+#if defined(MEM_PROFILE)
+    dst->used += src->used;
+    dst->peak = MAX(dst->peak, dst->used);
+#endif
+    *src = (StackAllocator) {0};
+}
+
+StackBlock *stack_block_grow(StackBlock *block, size_t size) {
+    size = round_to_page_size(size);
+    void *ptr = realloc(block, sizeof(StackBlock) + size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate block of size %lu\n", size);
+        exit(-1);
+    }
+
+    StackBlock *grown = ptr;
+    grown->memory = (uint8_t *) (grown + 1);
+    if (block == NULL) {
+        grown->used = 0;
+        grown->next = NULL;
+    }
+    grown->size = size;
+
+    return grown;
+}
+
+void stack_adopt_block(StackAllocator *stack, StackBlock *block, MemTag tag) {
+    (void) tag;
+    profile_record_alloc(tag, block->used);
+    initialize(stack);
+    // Unused blocks of stack past last go after the adopted one
+    block->next = stack->last->next;
+    stack->last->next = block;
+    stack->last = block;
+#if defined(MEM_PROFILE)
+    stack->used += block->used;
+    stack->peak = MAX(stack->peak, stack->used);
+#endif
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "profile.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -15,6 +16,12 @@ typedef struct StackBlock {
 typedef struct StackAllocator {
     StackBlock *root;
     StackBlock *last;
+#if defined(MEM_PROFILE)
+    // Bytes currently handed out and the high-water mark since the
+    // last profile_begin().
+    size_t used;
+    size_t peak;
+#endif
 } StackAllocator;
 
 typedef struct StackMarker {
@@ -35,3 +42,21 @@ StackSize   stack_size(StackAllocator *stack);
 void        stack_reset(StackAllocator *stack);
 void        stack_reset_to_marker(StackAllocator *stack, StackMarker marker);
 void        stack_free_all(StackAllocator *stack);
+// Moves all blocks of src on top of dst, allocations made from src then
+// live as long as those of dst. src is left empty.
+void        stack_adopt(StackAllocator *dst, StackAllocator *src);
+// Blocks of their own for data of unknown size, such as all of stdin.
+// stack_block_grow() resizes block (NULL for a new one) with realloc(),
+// which for large blocks usually remaps pages rather than copying them.
+// stack_adopt_block() then hands block over to stack, its used bytes
+// live as long as the other allocations of stack.
+StackBlock  *stack_block_grow(StackBlock *block, size_t size_in_bytes);
+void        stack_adopt_block(StackAllocator *stack, StackBlock *block, MemTag tag);
+
+#if defined(MEM_PROFILE)
+void        *stack_alloc_tagged(StackAllocator *stack, size_t size_in_bytes, MemTag tag);
+void        *stack_alloc_zero_tagged(StackAllocator *stack, size_t size_in_bytes, MemTag tag);
+#else
+#define stack_alloc_tagged(stack, size, tag)      stack_alloc(stack, size)
+#define stack_alloc_zero_tagged(stack, size, tag) stack_alloc_zero(stack, size)
+#endif
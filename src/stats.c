@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <stdlib.h> // for abort()
+#include <time.h>
+
+_Thread_local Stats stats = {0};
+
+static const char *timer_names[NUM_STATS_TIMERS] = {
+    [STATS_TIMER_ELF_LOAD]     = "elf-load",
+    [STATS_TIMER_LIBTCG_OPEN]  = "libtcg-open",
+    [STATS_TIMER_ARCH_DETECT]  = "arch-detect",
+    [STATS_TIMER_TRANSLATE]    = "translate",
+    [STATS_TIMER_CFG]          = "cfg",
+    [STATS_TIMER_PASSES]       = "passes",
+    [STATS_TIMER_FIND_SOURCES] = "find-sources",
+    [STATS_TIMER_MAX_STACK]    = "max-stack",
+    [STATS_TIMER_OUTPUT]       = "output",
+};
+
+static const char *counter_names[NUM_STATS_COUNTERS] = {
+    [STATS_TBS_LIFTED]           = "tbs-lifted",
+    [STATS_TCG_OPS]              = "tcg-ops",
+    [STATS_EDGES]                = "edges",
+    [STATS_BLOCK_SPLITS]         = "block-splits",
+    [STATS_WORKLIST_POPS]        = "worklist-pops",
+    [STATS_FIND_SOURCES_CALLS]   = "find-sources-calls",
+    [STATS_FIND_SOURCES_SCANNED] = "find-sources-scanned",
+    [STATS_WINDOWS]              = "windows",
+    [STATS_EXTERNAL_EDGES]       = "external-edges",
+};
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void stats_enable(void) {
+    stats.enabled = true;
+    stats.begin_ns = stats_now_ns();
+}
+
+void stats_merge(const Stats *other) {
+    for (size_t i = 0; i < NUM_STATS_TIMERS; ++i) {
+        stats.timer_ns[i] += other->timer_ns[i];
+        stats.timer_runs[i] += other->timer_runs[i];
+    }
+    for (size_t i = 0; i < NUM_STATS_COUNTERS; ++i) {
+        stats.counters[i] += other->counters[i];
+    }
+}
+
+static void report_text(FILE *fd, uint64_t total_ns) {
+    fputs("Stats:\n", fd);
+    fprintf(fd, "  %-22s%12s%8s%10s\n", "timer", "ms", "%", "runs");
+    for (size_t i = 0; i < NUM_STATS_TIMERS; ++i) {
+        if (stats.timer_runs[i] == 0) {
+            continue;
+        }
+        fprintf(fd, "  %-22s%12.3f%8.1f%10lu\n", timer_names[i],
+                stats.timer_ns[i]/1e6,
+                (total_ns > 0) ? 100.0*stats.timer_ns[i]/total_ns : 0.0,
+                stats.timer_runs[i]);
+    }
+    fprintf(fd, "  %-22s%12.3f\n\n", "total", total_ns/1e6);
+
+    fprintf(fd, "  %-22s%12s\n", "counter", "value");
+    for (size_t i = 0; i < NUM_STATS_COUNTERS; ++i) {
+        fprintf(fd, "  %-22s%12lu\n", counter_names[i], stats.counters[i]);
+    }
+}
+
+static void report_json(FILE *fd, uint64_t total_ns) {
+    fprintf(fd, "{\"total_ns\":%lu,\"timers\":{", total_ns);
+    for (size_t i = 0; i < NUM_STATS_TIMERS; ++i) {
+        fprintf(fd, "%s\"%s\":{\"ns\":%lu,\"runs\":%lu}", (i > 0) ? "," : "",
+                timer_names[i], stats.timer_ns[i], stats.timer_runs[i]);
+    }
+    fputs("},\"counters\":{", fd);
+    for (size_t i = 0; i < NUM_STATS_COUNTERS; ++i) {
+        fprintf(fd, "%s\"%s\":%lu", (i > 0) ? "," : "",
+                counter_names[i], stats.counters[i]);
+    }
+    fputs("}}\n", fd);
+}
+
+void stats_report(FILE *fd, StatsFormat format) {
+    uint64_t total_ns = stats_now_ns() - stats.begin_ns;
+    switch (format) {
+    case STATS_TEXT:
+        report_text(fd, total_ns);
+        break;
+    case STATS_JSON:
+        report_json(fd, total_ns);
+        break;
+    default:
+        abort();
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+// Wall clock time spent in each step, accumulated over all times the
+// step is run. find-sources also runs as part of max-stack, so the
+// sum of all timers may exceed the total.
+typedef enum StatsTimer {
+    STATS_TIMER_ELF_LOAD = 0,
+    STATS_TIMER_LIBTCG_OPEN,
+    STATS_TIMER_ARCH_DETECT,
+    STATS_TIMER_TRANSLATE,
+    STATS_TIMER_CFG,
+    STATS_TIMER_PASSES,
+    STATS_TIMER_FIND_SOURCES,
+    STATS_TIMER_MAX_STACK,
+    STATS_TIMER_OUTPUT,
+    NUM_STATS_TIMERS,
+} StatsTimer;
+
+typedef enum StatsCounter {
+    STATS_TBS_LIFTED = 0,
+    STATS_TCG_OPS,
+    STATS_EDGES,
+    STATS_BLOCK_SPLITS,
+    STATS_WORKLIST_POPS,
+    STATS_FIND_SOURCES_CALLS,
+    STATS_FIND_SOURCES_SCANNED,
+    STATS_WINDOWS,
+    STATS_EXTERNAL_EDGES,
+    NUM_STATS_COUNTERS,
+} StatsCounter;
+
+typedef enum StatsFormat {
+    STATS_TEXT = 0,
+    STATS_JSON,
+} StatsFormat;
+
+typedef struct Stats {
+    bool enabled;
+    uint64_t begin_ns;
+    uint64_t timer_ns[NUM_STATS_TIMERS];
+    uint64_t timer_runs[NUM_STATS_TIMERS];
+    uint64_t counters[NUM_STATS_COUNTERS];
+} Stats;
+
+// Per thread, threads that lift or build CFGs hand their counts back
+// with stats_merge()
+extern _Thread_local Stats stats;
+
+// Enables timers and starts the clock for the total run time. Counters
+// are always updated, they are plain increments.
+void stats_enable(void);
+uint64_t stats_now_ns(void);
+
+// Timers only read the clock if stats are enabled:
+//
+//   uint64_t t = stats_begin();
+//   ...
+//   stats_end(STATS_TIMER_CFG, t);
+static inline uint64_t stats_begin(void) {
+    return (stats.enabled) ? stats_now_ns() : 0;
+}
+
+static inline void stats_end(StatsTimer timer, uint64_t begin) {
+    if (stats.enabled) {
+        stats.timer_ns[timer] += stats_now_ns() - begin;
+        ++stats.timer_runs[timer];
+    }
+}
+
+static inline void stats_add(StatsCounter counter, uint64_t n) {
+    stats.counters[counter] += n;
+}
+
+// Adds the timers and counters of other, collected on another thread,
+// to those of the calling thread
+void stats_merge(const Stats *other);
+
+void stats_report(FILE *fd, StatsFormat format);
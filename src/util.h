@@ -7,9 +7,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
 #define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
 
+#define STDIN_CHUNK_SIZE (64*1024)
+
 typedef struct StackAllocator StackAllocator;
 
 typedef struct ByteView {
@@ -17,21 +20,43 @@ typedef struct ByteView {
     size_t size;
 } ByteView;
 
-static inline ByteView read_bytes_from_stdin(StackAllocator *stack) {
+static inline FILE *reopen_stdin_binary(void) {
     FILE *fd = freopen(NULL, "rb", stdin);
     assert(fd != NULL);
+    return fd;
+}
 
-    // TODO: We just assume a maximum fixed size on the data coming
-    // in from stdin, clearly not a good idea. Should probably allocate
-    // in chunks or similar.
-    size_t size = 1024;
-    void *ptr = stack_alloc(stack, size);
-    size_t bytes_read = fread(ptr, 1, size, fd);
+// Reads all of stdin into a single contiguous allocation on stack.
+// Since the total size is not known up front, data is read into a block
+// of its own that doubles in size whenever it fills up, and the block is
+// handed over to stack once EOF is hit.
+static inline ByteView read_bytes_from_stdin(StackAllocator *stack) {
+    FILE *fd = reopen_stdin_binary();
+
+    StackBlock *block = stack_block_grow(NULL, STDIN_CHUNK_SIZE);
+    while (!feof(fd) && !ferror(fd)) {
+        if (block->used == block->size) {
+            block = stack_block_grow(block, 2*block->size);
+        }
+        size_t size = fread(block->memory + block->used, 1,
+                            block->size - block->used, fd);
+        if (size == 0) {
+            break;
+        }
+        block->used += size;
+    }
+    bool failed = ferror(fd);
     fclose(fd);
 
+    if (failed || block->used == 0) {
+        free(block);
+        return (ByteView) {0};
+    }
+
+    stack_adopt_block(stack, block, MEM_TAG_INPUT);
     return (ByteView) {
-        .data = ptr,
-        .size = bytes_read,
+        .data = block->memory,
+        .size = block->used,
     };
 }
 
@@ -50,7 +75,7 @@ static inline ByteView read_bytes_from_file(StackAllocator *stack,
     }
     fseek(fd, offset, SEEK_SET);
 
-    void *ptr = stack_alloc(stack, size);
+    void *ptr = stack_alloc_tagged(stack, size, MEM_TAG_INPUT);
     size_t bytes_read = fread(ptr, 1, size, fd);
     assert(bytes_read == size);
     fclose(fd);
@@ -0,0 +1,205 @@
+#include "window.h"
+#include "analyze-max-stack.h"
+#include "cfg-pipeline.h"
+#include "cfg.h"
+#include "common.h"
+#include "json-export.h"
+#include "loadelf.h"
+#include "output.h"
+#include "passes.h"
+#include "profile.h"
+#include "stats.h"
+
+// Offset into r at which the window starting at off ends, the last
+// function start within max_size bytes if there is one
+static size_t window_limit(const CfgRange *r, size_t off,
+                           const WindowSettings *settings) {
+    size_t limit = (r->size - off > settings->max_size) ? off + settings->max_size : r->size;
+    if (limit == r->size || settings->symbols == NULL) {
+        return limit;
+    }
+    uint64_t begin = r->address + off;
+    uint64_t end = r->address + limit;
+    uint64_t last_start = 0;
+    ElfSymbolIter it = elf_symbols_in_range(settings->symbols, begin + 1, end + 1);
+    for (const ElfSymbol *sym; (sym = elf_symbol_iter_next(&it)) != NULL;) {
+        if (sym->address > begin && sym->address <= end) {
+            last_start = sym->address;
+        }
+    }
+    return (last_start != 0) ? last_start - r->address : limit;
+}
+
+static bool in_ranges(const CfgRange *ranges, size_t num_ranges,
+                      uint64_t address) {
+    for (size_t i = 0; i < num_ranges; ++i) {
+        if (address >= ranges[i].address &&
+            address < ranges[i].address + ranges[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Direct jumps from the window [begin, end) into the ranges outside of
+// it, and the fallthrough of its last block if the window ends before
+// its range does. Jumps leaving all ranges have no edge either way.
+static size_t find_external_edges(LibTcgArchInfo arch_info,
+                                  StackAllocator *stack, TbNode *root,
+                                  uint64_t begin, uint64_t end, bool cut,
+                                  const CfgRange *ranges, size_t num_ranges,
+                                  ExternalEdge **edges_out) {
+    size_t max_edges = 1;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            max_edges += is_pc_write(arch_info, &n->tb.list[i], NULL, NULL);
+        }
+    }
+    ExternalEdge *edges = stack_alloc(stack, max_edges*sizeof(ExternalEdge));
+    size_t count = 0;
+
+    TbNode *last = NULL;
+    size_t last_jumps = 0;
+    for (TbNode *n = root; n != NULL; n = n->next) {
+        size_t num_jumps = 0;
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            bool is_direct;
+            uint64_t address;
+            if (!is_pc_write(arch_info, &n->tb.list[i], &is_direct, &address)) {
+                continue;
+            }
+            ++num_jumps;
+            if (is_direct && (address < begin || address >= end) &&
+                in_ranges(ranges, num_ranges, address)) {
+                edges[count++] = (ExternalEdge) {
+                    .src = n->address,
+                    .dst = address,
+                    .src_instruction = i,
+                    .type = DIRECT,
+                };
+            }
+        }
+        last = n;
+        last_jumps = num_jumps;
+    }
+
+    // Same condition as the fallthrough edges of cfg_build_node()
+    if (cut && last != NULL &&
+        (last->num_exits == 0 || last_jumps < last->num_exits)) {
+        edges[count++] = (ExternalEdge) {
+            .src = last->address,
+            .dst = end,
+            .src_instruction = last->tb.instruction_count - 1,
+            .type = FALLTHROUGH,
+        };
+    }
+
+    stats_add(STATS_EXTERNAL_EDGES, count);
+    *edges_out = edges;
+    return count;
+}
+
+// Lifts, analyzes and writes the window of r starting at *off and
+// advances *off past its last block
+static void run_window(LibTcgInterface *libtcg, LibTcgContext *context,
+                       Memory *memory, const CfgRange *ranges,
+                       size_t num_ranges, const CfgRange *r, size_t *off,
+                       const WindowSettings *settings) {
+    StackMarker persistent_marker = stack_marker(&memory->persistent);
+    StackMarker temporary_marker = stack_marker(&memory->temporary);
+    const size_t limit = window_limit(r, *off, settings);
+    const uint64_t begin = r->address + *off;
+
+    profile_begin(memory, PHASE_LIFT);
+    TbNode *root = NULL;
+    TbNode *top = NULL;
+    TbNode *n;
+    while (*off < limit &&
+           (n = cfg_lift_next(libtcg, context, NULL, &memory->persistent,
+                              r->data, r->size, r->address, settings->flags,
+                              settings->modes, off)) != NULL) {
+        if (root == NULL) {
+            root = n;
+        } else {
+            top->next = n;
+        }
+        top = n;
+    }
+    profile_end(memory);
+    const uint64_t end = r->address + *off;
+
+    if (root == NULL) {
+        stack_reset_to_marker(&memory->persistent, persistent_marker);
+        stack_reset_to_marker(&memory->temporary, temporary_marker);
+        return;
+    }
+    stats_add(STATS_WINDOWS, 1);
+
+    ExternalEdge *external = NULL;
+    size_t num_external = 0;
+    if (settings->build_cfg) {
+        profile_begin(memory, PHASE_CFG);
+        cfg_build(libtcg, &memory->persistent, root);
+        num_external = find_external_edges(libtcg->get_arch_info(),
+                                           &memory->persistent, root,
+                                           begin, end, *off < r->size,
+                                           ranges, num_ranges, &external);
+        profile_end(memory);
+
+        if (settings->passes != NULL) {
+            profile_begin(memory, PHASE_PASSES);
+            uint64_t t = stats_begin();
+            run_passes(libtcg, memory, root, settings->passes,
+                       settings->pass_report);
+            stats_end(STATS_TIMER_PASSES, t);
+            profile_end(memory);
+        }
+
+        if (settings->analyze_max_stack) {
+            profile_begin(memory, PHASE_MAX_STACK);
+            bool stack_grows_down = true;
+            compute_max_stack_size(libtcg, memory, root, settings->symbols,
+                                   stack_grows_down);
+            profile_end(memory);
+        }
+    }
+
+    profile_begin(memory, PHASE_OUTPUT);
+    uint64_t t = stats_begin();
+    if (settings->ir_out != NULL) {
+        for (TbNode *n = root; n != NULL; n = n->next) {
+            output_tb_ir(settings->ir_out, libtcg, &n->tb);
+        }
+    }
+    if (settings->dot_out != NULL) {
+        GraphvizSettings graphviz = settings->graphviz;
+        graphviz.external = external;
+        graphviz.num_external = num_external;
+        graphviz_output(libtcg, &memory->persistent, graphviz,
+                        settings->dot_out, root, settings->analyze_max_stack,
+                        (CmdLineRegTuple) {0}, NULL, 0);
+    }
+    if (settings->json_out != NULL) {
+        json_export(libtcg, settings->json_out, root,
+                    settings->analyze_max_stack, false);
+        json_external_edges(settings->json_out, external, num_external);
+    }
+    stats_end(STATS_TIMER_OUTPUT, t);
+    profile_end(memory);
+
+    stack_reset_to_marker(&memory->persistent, persistent_marker);
+    stack_reset_to_marker(&memory->temporary, temporary_marker);
+}
+
+void window_run(LibTcgInterface *libtcg, LibTcgContext *context,
+                Memory *memory, const CfgRange *ranges, size_t num_ranges,
+                const WindowSettings *settings) {
+    assert(settings->max_size > 0);
+    for (size_t i = 0; i < num_ranges; ++i) {
+        size_t off = 0;
+        while (off < ranges[i].size) {
+            run_window(libtcg, context, memory, ranges, num_ranges,
+                       &ranges[i], &off, settings);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "graphviz.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Memory Memory;
+typedef struct Output Output;
+typedef struct CfgRange CfgRange;
+typedef struct ElfModeMap ElfModeMap;
+typedef struct PassPipeline PassPipeline;
+
+typedef struct WindowSettings {
+    // Bytes translated per window. Windows end at the last function
+    // start within this many bytes if there is one, and never within a
+    // block, so the last block may extend past it.
+    size_t max_size;
+    // Function starts to end windows at, may be NULL
+    const ElfSymbolTable *symbols;
+    const ElfModeMap *modes;
+    uint32_t flags;
+    // Build the CFG of each window, implied by passes, analyses and CFG
+    // output
+    bool build_cfg;
+    // May be NULL
+    PassPipeline *passes;
+    FILE *pass_report;
+    bool analyze_max_stack;
+    // Outputs written per window, NULL if not requested. dot_out gets a
+    // digraph per window, with edges leaving it drawn to stub nodes.
+    Output *ir_out;
+    Output *dot_out;
+    Output *json_out;
+    GraphvizSettings graphviz;
+} WindowSettings;
+
+// Lifts and analyzes the ranges in windows of settings->max_size bytes,
+// so memory use depends on the window size rather than on the size of
+// the ranges. Each window has its blocks translated, its CFG built,
+// passes and analyses run and its results written before everything it
+// allocated from memory is released again.
+//
+// Jumps and fallthroughs into other windows become ExternalEdges, which
+// are written along with the window. Blocks are not split by jumps
+// from other windows, and calls into other windows are not summarized
+// by the analyses.
+void window_run(LibTcgInterface *libtcg, LibTcgContext *context,
+                Memory *memory, const CfgRange *ranges, size_t num_ranges,
+                const WindowSettings *settings);
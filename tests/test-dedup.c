@@ -0,0 +1,99 @@
+// Reuse of rebased blocks by the dedup cache, with a stub lifter whose
+// IR holds constants derived from masked addresses
+
+#include "test.h"
+#include "../src/dedup.h"
+#include <qemu/libtcg/libtcg_loader.h>
+
+static Memory memory = {0};
+
+#define BLOCK_SIZE 16
+
+static size_t num_translated = 0;
+static uint32_t next_index = 0;
+
+// Lifts any bytes to a 16 byte block of
+//
+//   insn_start address
+//   mov r1, $(address & ~0xfff)          like AArch64 ADRP
+//   mov r2, $((address + 4) & ~3)        like ARM Thumb Align(PC, 4)
+//   mov r3, $(address + 0x20)            plain PC-relative
+static LibTcgTranslationBlock test_translate_block(LibTcgContext *context,
+                                                   const unsigned char *buffer,
+                                                   size_t size,
+                                                   uint64_t address,
+                                                   uint32_t flags) {
+    (void) context;
+    (void) buffer;
+    (void) size;
+    (void) flags;
+    ++num_translated;
+    StackAllocator *stack = &memory.persistent;
+    TbNode *n = test_block(stack, NULL, address, BLOCK_SIZE);
+    test_insn_start(n, address);
+    const uint64_t values[] = {
+        address & ~0xfffull,
+        (address + 4) & ~3ull,
+        address + 0x20,
+    };
+    for (size_t i = 0; i < sizeof(values)/sizeof(values[0]); ++i) {
+        LibTcgTemp *r = test_temp(stack, LIBTCG_TEMP_GLOBAL, i, "r", 24 + 8*i);
+        test_mov(n, r, test_const(stack, next_index++, values[i]));
+    }
+    return n->tb;
+}
+
+// Translates the same bytes at address and checks the IR is what the
+// stub lifts there, whether it came from the cache or not
+static void check_translate(DedupCache *cache, LibTcgInterface *libtcg,
+                            const uint8_t *data, uint64_t address) {
+    LibTcgTranslationBlock tb = dedup_translate(cache, libtcg, NULL, data,
+                                                2*BLOCK_SIZE, address);
+    CHECK(tb.instruction_count == 4 && tb.size_in_bytes == BLOCK_SIZE);
+    if (tb.instruction_count != 4) {
+        return;
+    }
+    CHECK(tb.list[0].constant_args[0].constant == address);
+    CHECK(tb.list[1].input_args[0].temp->val == (address & ~0xfffull));
+    CHECK(tb.list[2].input_args[0].temp->val == ((address + 4) & ~3ull));
+    CHECK(tb.list[3].input_args[0].temp->val == address + 0x20);
+}
+
+int main(void) {
+    LibTcgInterface libtcg = test_libtcg();
+    libtcg.translate_block = test_translate_block;
+    DedupCache *cache = dedup_create(&memory.persistent, LIBTCG_ARCH_AARCH64, 0);
+
+    uint8_t data[2*BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = i;
+    }
+
+    // Lifted, then lifted again to learn the relocations, then reused
+    check_translate(cache, &libtcg, data, 0x1008);
+    check_translate(cache, &libtcg, data, 0x3008);
+    CHECK(num_translated == 2);
+    check_translate(cache, &libtcg, data, 0x5008);
+    CHECK(num_translated == 2);
+
+    // Duplicates at a different alignment and at a different offset
+    // within the page, where the masked constants don't move along
+    check_translate(cache, &libtcg, data, 0x500a);
+    CHECK(num_translated == 3);
+    check_translate(cache, &libtcg, data, 0x5108);
+    CHECK(num_translated == 4);
+
+    // Each is cached in its own right
+    check_translate(cache, &libtcg, data, 0x700a);
+    check_translate(cache, &libtcg, data, 0x900a);
+    CHECK(num_translated == 5);
+
+    DedupStats stats = dedup_stats(cache);
+    CHECK(stats.num_lifted == 5);
+    CHECK(stats.num_reused == 2);
+    CHECK(stats.num_rejected == 0);
+
+    stack_free_all(&memory.persistent);
+    stack_free_all(&memory.temporary);
+    return test_exit_status("test-dedup");
+}
@@ -0,0 +1,180 @@
+// Round trip through the --dump-bin writer and the irfile.h reader,
+// along with files the reader has to reject.
+
+#define _DEFAULT_SOURCE
+#include "test.h"
+#include "../src/irfile.h"
+#include "../src/irfile-writer.h"
+#include "../src/output.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+static Memory memory = {0};
+
+static char path[] = "/tmp/test-irfile-XXXXXX";
+
+static void write_file(const void *data, size_t size) {
+    FILE *fd = fopen(path, "wb");
+    CHECK(fd != NULL && fwrite(data, 1, size, fd) == size);
+    fclose(fd);
+}
+
+// Opens a copy of the file in data with the uint32_t or uint64_t at
+// offset replaced by value, expecting the reader to reject it
+static bool open_patched(const uint8_t *data, size_t size, size_t offset,
+                         uint64_t value, size_t width) {
+    uint8_t *copy = malloc(size);
+    memcpy(copy, data, size);
+    if (width == sizeof(uint32_t)) {
+        uint32_t v = value;
+        memcpy(copy + offset, &v, sizeof(v));
+    } else {
+        memcpy(copy + offset, &value, sizeof(value));
+    }
+    write_file(copy, size);
+    free(copy);
+    IrFile file;
+    bool ok = irfile_open(path, &file);
+    irfile_close(&file);
+    return ok;
+}
+
+int main(void) {
+    LibTcgInterface libtcg = test_libtcg();
+    StackAllocator *stack = &memory.persistent;
+
+    LibTcgTemp *r1 = test_temp(stack, LIBTCG_TEMP_GLOBAL, 0, "r1", 24);
+    LibTcgTemp *sp = test_temp(stack, LIBTCG_TEMP_GLOBAL, 1, "sp", TEST_SP_OFFSET);
+    LibTcgTemp *tmp = test_temp(stack, LIBTCG_TEMP_EBB, 2, "tmp2", 0);
+    LibTcgTemp *five = test_const(stack, 3, 5);
+
+    // 0x1000: r1 = 5; tmp2 = sp + r1; st tmp2, [sp] with an iarg that
+    //         is not a temp, falls through to
+    // 0x1008: r1 = r1 + tmp2, jumps back
+    TbNode *tail = NULL;
+    TbNode *a = test_block(stack, &tail, 0x1000, 8);
+    TbNode *b = test_block(stack, &tail, 0x1008, 4);
+    test_insn_start(a, 0x1000);
+    test_mov(a, r1, five);
+    test_binop(a, LIBTCG_op_add_i64, tmp, sp, r1);
+    LibTcgInstruction *st = test_op(a, LIBTCG_op_st_i64);
+    test_iarg(st, tmp);
+    test_iarg_constant(st, 0x40);
+    test_carg(st, 16);
+    test_insn_start(b, 0x1008);
+    test_binop(b, LIBTCG_op_add_i64, r1, r1, tmp);
+    test_op(b, LIBTCG_op_exit_tb);
+    test_edge(a, 3, b, FALLTHROUGH);
+    test_edge(b, 2, a, DIRECT);
+
+    for (TbNode *n = a; n != NULL; n = n->next) {
+        n->stack_state = stack_alloc_zero(stack, n->tb.instruction_count*sizeof(MfpStackState));
+        for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+            n->stack_state[i] = (MfpStackState) {
+                .max_st_size = -(int64_t) i,
+                .max_ld_size = (int64_t) n->address,
+            };
+        }
+    }
+
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    Output out;
+    output_init(&out, stack, fd, OUTPUT_BUFFER_SIZE);
+    irfile_write(&libtcg, &memory.temporary, &out, LIBTCG_ARCH_X86_64, a, true);
+    CHECK(output_flush(&out));
+    close(fd);
+
+    IrFile file;
+    CHECK(irfile_open(path, &file));
+    CHECK(file.header->arch == LIBTCG_ARCH_X86_64);
+    CHECK(file.num_blocks == 2);
+    CHECK(file.num_insts == 7);
+    CHECK(file.num_edges == 2);
+    CHECK(file.num_temps == 4);
+
+    const IrFileBlock *fa = &file.blocks[0];
+    const IrFileBlock *fb = &file.blocks[1];
+    CHECK(fa->address == 0x1000 && fa->size_in_bytes == 8 && fa->num_insts == 4);
+    CHECK(fb->address == 0x1008 && fb->size_in_bytes == 4 && fb->num_insts == 3);
+
+    const IrFileInst *insts = irfile_block_insts(&file, fa);
+    char name[32];
+    snprintf(name, sizeof(name), "op%d", (int) LIBTCG_op_insn_start);
+    CHECK(insts[0].opcode == LIBTCG_op_insn_start);
+    CHECK(strcmp(irfile_string(&file, insts[0].name), name) == 0);
+    CHECK(irfile_carg(&file, &insts[0], 0) == 0x1000);
+
+    // mov r1, $0x5
+    const IrFileTemp *t = irfile_oarg(&file, &insts[1], 0);
+    CHECK(t != NULL && strcmp(irfile_string(&file, t->name), "r1") == 0);
+    CHECK(t != NULL && t->kind == LIBTCG_TEMP_GLOBAL && t->value == 24);
+    t = irfile_iarg(&file, &insts[1], 0);
+    CHECK(t != NULL && t->kind == LIBTCG_TEMP_CONST && t->value == 5);
+
+    // add tmp2, sp, r1
+    t = irfile_oarg(&file, &insts[2], 0);
+    CHECK(t != NULL && strcmp(irfile_string(&file, t->name), "tmp2") == 0);
+    t = irfile_iarg(&file, &insts[2], 0);
+    CHECK(t != NULL && t->value == TEST_SP_OFFSET);
+
+    // st tmp2, 0x40, 16: the second iarg is a constant, not a temp
+    CHECK(insts[3].opcode == LIBTCG_op_st_i64);
+    CHECK(insts[3].nb_oargs == 0 && insts[3].nb_iargs == 2 && insts[3].nb_cargs == 1);
+    CHECK(irfile_iarg(&file, &insts[3], 0) != NULL);
+    CHECK(irfile_iarg(&file, &insts[3], 1) == NULL);
+    CHECK(irfile_iarg_value(&file, &insts[3], 1) == 0x40);
+    CHECK(irfile_carg(&file, &insts[3], 0) == 16);
+
+    // Temps are interned, r1 and tmp2 of the second block are the same
+    const IrFileInst *add = &irfile_block_insts(&file, fb)[1];
+    CHECK(irfile_oarg(&file, add, 0) == irfile_oarg(&file, &insts[1], 0));
+    CHECK(irfile_iarg(&file, add, 1) == irfile_oarg(&file, &insts[2], 0));
+
+    const IrFileEdge *edges = irfile_block_edges(&file, fa);
+    CHECK(fa->num_edges == 1 && edges[0].dst_block == 1 &&
+          edges[0].src_instruction == 3 && edges[0].type == FALLTHROUGH);
+    edges = irfile_block_edges(&file, fb);
+    CHECK(fb->num_edges == 1 && edges[0].src_block == 1 &&
+          edges[0].dst_block == 0 && edges[0].type == DIRECT);
+
+    CHECK(file.stack_states != NULL);
+    CHECK(file.stack_states[2].max_st_size == -2);
+    CHECK(file.stack_states[4].max_ld_size == 0x1008);
+
+    // Corrupt copies, each changing one field the accessors rely on
+    size_t size = file.size;
+    uint8_t *data = malloc(size);
+    memcpy(data, file.data, size);
+    const IrFileSection *sections = file.header->sections;
+    // The mov's output, a temp
+    size_t mov_arg = sections[IRFILE_SECTION_ARGS].offset + insts[1].first_arg*sizeof(IrFileArg);
+    size_t insts_offset = sections[IRFILE_SECTION_INSTS].offset;
+    size_t blocks = sections[IRFILE_SECTION_BLOCKS].offset;
+    size_t edges_offset = sections[IRFILE_SECTION_EDGES].offset;
+    irfile_close(&file);
+
+    CHECK(!open_patched(data, size, mov_arg + offsetof(IrFileArg, value), 1000, sizeof(uint64_t)));
+    CHECK(!open_patched(data, size, mov_arg + offsetof(IrFileArg, kind), 7, sizeof(uint32_t)));
+    CHECK(!open_patched(data, size, insts_offset + offsetof(IrFileInst, first_arg), 1000, sizeof(uint32_t)));
+    CHECK(!open_patched(data, size, insts_offset + offsetof(IrFileInst, name), 1 << 20, sizeof(uint32_t)));
+    CHECK(!open_patched(data, size, blocks + offsetof(IrFileBlock, num_insts), 100, sizeof(uint32_t)));
+    CHECK(!open_patched(data, size, edges_offset + offsetof(IrFileEdge, dst_block), 2, sizeof(uint32_t)));
+    CHECK(!open_patched(data, size,
+                        offsetof(IrFileHeader, sections) +
+                        IRFILE_SECTION_ARGS*sizeof(IrFileSection) +
+                        offsetof(IrFileSection, count),
+                        UINT64_MAX / 2, sizeof(uint64_t)));
+    // Unchanged copy is accepted, truncated ones are not
+    CHECK(open_patched(data, size, 0, *(uint64_t *) data, sizeof(uint64_t)));
+    write_file(data, size - 8);
+    CHECK(!irfile_open(path, &file));
+    write_file(data, sizeof(IrFileHeader) - 1);
+    CHECK(!irfile_open(path, &file));
+
+    free(data);
+    unlink(path);
+    stack_free_all(&memory.persistent);
+    stack_free_all(&memory.temporary);
+    return test_exit_status("test-irfile");
+}
@@ -0,0 +1,179 @@
+// IR passes over small CFGs built by cfg_build()
+
+#include "test.h"
+#include "../src/cfg.h"
+#include "../src/passes.h"
+
+static Memory memory = {0};
+
+typedef struct Globals {
+    LibTcgTemp *pc;
+    LibTcgTemp *sp;
+    LibTcgTemp *r1;
+    LibTcgTemp *r2;
+} Globals;
+
+static uint32_t next_index = 0;
+
+static LibTcgTemp *temp(LibTcgTempKind kind, const char *name, intptr_t mem_offset) {
+    return test_temp(&memory.persistent, kind, next_index++, name, mem_offset);
+}
+
+static LibTcgTemp *constant(uint64_t value) {
+    return test_const(&memory.persistent, next_index++, value);
+}
+
+static void jump(TbNode *n, Globals *g, uint64_t address) {
+    test_mov(n, g->pc, constant(address));
+    test_op(n, LIBTCG_op_exit_tb);
+}
+
+static void store(TbNode *n, LibTcgTemp *value, LibTcgTemp *address) {
+    LibTcgInstruction *inst = test_op(n, LIBTCG_op_qemu_st_a64_i64);
+    test_iarg(inst, value);
+    test_iarg(inst, address);
+    test_carg(inst, 3);
+}
+
+static void run(TbNode *root, const char *passes) {
+    LibTcgInterface libtcg = test_libtcg();
+    PassPipeline pipeline;
+    CHECK(pass_pipeline_from_str(passes, &pipeline));
+    cfg_build(&libtcg, &memory.persistent, root);
+    run_passes(&libtcg, &memory, root, &pipeline, NULL);
+}
+
+static LibTcgInstruction *find_op(TbNode *n, LibTcgTemp *output) {
+    for (size_t i = 0; i < n->tb.instruction_count; ++i) {
+        LibTcgInstruction *inst = &n->tb.list[i];
+        if (inst->nb_oargs > 0 && inst->output_args[0].temp == output) {
+            return inst;
+        }
+    }
+    return NULL;
+}
+
+// A return site is entered by the return of the function called before
+// it, which the CFG has no edge for. Constants reaching it along the
+// edges the CFG does have may not be propagated.
+static void test_constprop_return_site(Globals *g) {
+    TbNode *root = NULL;
+    TbNode *tail = NULL;
+
+    // 0x50: jmp 0x300
+    root = test_block(&memory.persistent, &tail, 0x50, 0x8);
+    test_insn_start(root, 0x50);
+    jump(root, g, 0x300);
+
+    // 0x100: r1 = 1; r2 = 0; call 0x200
+    TbNode *call = test_block(&memory.persistent, &tail, 0x100, 0x18);
+    test_insn_start(call, 0x100);
+    test_mov(call, g->r1, constant(1));
+    test_mov(call, g->r2, constant(0));
+    test_insn_start(call, 0x108);
+    LibTcgTemp *ret = temp(LIBTCG_TEMP_EBB, "ret", 0);
+    test_mov(call, ret, constant(0x118));
+    store(call, ret, g->sp);
+    test_insn_start(call, 0x110);
+    jump(call, g, 0x200);
+
+    // 0x118: r2 = r2 + r1; jmp 0x300
+    TbNode *site = test_block(&memory.persistent, &tail, 0x118, 0x8);
+    test_insn_start(site, 0x118);
+    test_binop(site, LIBTCG_op_add_i64, g->r2, g->r2, g->r1);
+    jump(site, g, 0x300);
+
+    // 0x200: r1 = 9; ret
+    TbNode *fn = test_block(&memory.persistent, &tail, 0x200, 0x10);
+    test_insn_start(fn, 0x200);
+    test_mov(fn, g->r1, constant(9));
+    test_insn_start(fn, 0x208);
+    LibTcgTemp *addr = temp(LIBTCG_TEMP_EBB, "addr", 0);
+    LibTcgInstruction *ld = test_op(fn, LIBTCG_op_qemu_ld_a64_i64);
+    test_oarg(ld, addr);
+    test_iarg(ld, g->sp);
+    test_carg(ld, 3);
+    test_mov(fn, g->pc, addr);
+    test_op(fn, LIBTCG_op_exit_tb);
+
+    // 0x300: r1 = 1; r2 = 0; jmp 0x118 (with r1 = 1), jmp 0x400
+    TbNode *loop = test_block(&memory.persistent, &tail, 0x300, 0x8);
+    test_insn_start(loop, 0x300);
+    test_mov(loop, g->r1, constant(1));
+    test_mov(loop, g->r2, constant(0));
+    test_mov(loop, g->pc, constant(0x118));
+    test_op(loop, LIBTCG_op_exit_tb);
+    jump(loop, g, 0x400);
+
+    // 0x400: r2 = r1 + r1, only entered from 0x300
+    TbNode *only = test_block(&memory.persistent, &tail, 0x400, 0x8);
+    test_insn_start(only, 0x400);
+    LibTcgTemp *sum = temp(LIBTCG_TEMP_EBB, "sum", 0);
+    test_binop(only, LIBTCG_op_add_i64, sum, g->r1, g->r1);
+    store(only, sum, g->sp);
+    test_op(only, LIBTCG_op_exit_tb);
+
+    run(root, "constprop");
+
+    // r1 is 9 when the call returns, not 1
+    LibTcgInstruction *add = find_op(site, g->r2);
+    CHECK(add != NULL && add->opcode == LIBTCG_op_add_i64);
+    CHECK(add != NULL && add->input_args[1].temp == g->r1);
+
+    // Still folded where all entries are known
+    add = find_op(only, sum);
+    CHECK(add != NULL && add->opcode == LIBTCG_op_mov_i64);
+    CHECK(add != NULL && add->input_args[0].temp->kind == LIBTCG_TEMP_CONST &&
+          add->input_args[0].temp->val == 2);
+}
+
+// Temps defined before a jump target that splits the TB are read after
+// it, also once dce has compacted the first half
+static void test_dce_split_block(Globals *g) {
+    TbNode *root = NULL;
+    TbNode *tail = NULL;
+
+    // 0x500: t = r1 + r1; u = r1 + 5; u = r1 + 6
+    // 0x508: st t; st u
+    TbNode *split = test_block(&memory.persistent, &tail, 0x500, 0x10);
+    root = split;
+    LibTcgTemp *t = temp(LIBTCG_TEMP_TB, "t", 0);
+    LibTcgTemp *u = temp(LIBTCG_TEMP_TB, "u", 0);
+    test_insn_start(split, 0x500);
+    test_binop(split, LIBTCG_op_add_i64, t, g->r1, g->r1);
+    test_binop(split, LIBTCG_op_add_i64, u, g->r1, constant(5));
+    test_binop(split, LIBTCG_op_add_i64, u, g->r1, constant(6));
+    test_insn_start(split, 0x508);
+    store(split, t, g->sp);
+    store(split, u, g->sp);
+
+    // 0x600: jmp 0x508
+    TbNode *jumper = test_block(&memory.persistent, &tail, 0x600, 0x8);
+    test_insn_start(jumper, 0x600);
+    jump(jumper, g, 0x508);
+
+    run(root, "dce,dce");
+
+    CHECK(split->split_into_next);
+    CHECK(split->next->address == 0x508);
+    CHECK(split->tb.instruction_count == 3);
+    CHECK(find_op(split, t) != NULL);
+    LibTcgInstruction *def = find_op(split, u);
+    CHECK(def != NULL && def->input_args[1].temp->val == 6);
+}
+
+int main(void) {
+    Globals g = {
+        .pc = temp(LIBTCG_TEMP_GLOBAL, "pc", TEST_PC_OFFSET),
+        .sp = temp(LIBTCG_TEMP_GLOBAL, "sp", TEST_SP_OFFSET),
+        .r1 = temp(LIBTCG_TEMP_GLOBAL, "r1", 24),
+        .r2 = temp(LIBTCG_TEMP_GLOBAL, "r2", 32),
+    };
+
+    test_constprop_return_site(&g);
+    test_dce_split_block(&g);
+
+    stack_free_all(&memory.persistent);
+    stack_free_all(&memory.temporary);
+    return test_exit_status("test-passes");
+}
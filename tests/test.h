@@ -0,0 +1,186 @@
+#pragma once
+
+// Helpers shared by the unit tests in tests/. Each test-*.c is a
+// program of its own, built and run by `make check`, that exits with 1
+// if any CHECK() failed. Tests build their IR by hand with the
+// functions below instead of lifting it, so they don't depend on the
+// instruction sets the installed libtcg decodes.
+
+#include "../src/common.h"
+#include <qemu/libtcg/libtcg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_MAX_INSTRUCTIONS 64
+
+// Env offsets of the pc and sp globals of the stub lifter
+#define TEST_PC_OFFSET 8
+#define TEST_SP_OFFSET 16
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            ++test_failures;                                            \
+        }                                                               \
+    } while (0)
+
+static inline int test_exit_status(const char *name) {
+    if (test_failures > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+//
+// Stub lifter interface, enough for the passes, analyses and writers
+//
+
+static LibTcgArchInfo test_get_arch_info(void) {
+    return (LibTcgArchInfo) {
+        .pc = TEST_PC_OFFSET,
+        .sp = TEST_SP_OFFSET,
+    };
+}
+
+static LibTcgHelperInfo test_get_helper_info(LibTcgInstruction *inst) {
+    (void) inst;
+    return (LibTcgHelperInfo) {.func_name = "helper"};
+}
+
+static void test_dump_instruction_name(LibTcgInstruction *inst, char *buf,
+                                       size_t size) {
+    snprintf(buf, size, "op%d", (int) inst->opcode);
+}
+
+static void test_dump_instruction(LibTcgInstruction *inst, char *buf,
+                                  size_t size) {
+    test_dump_instruction_name(inst, buf, size);
+}
+
+static inline LibTcgInterface test_libtcg(void) {
+    return (LibTcgInterface) {
+        .get_helper_info = test_get_helper_info,
+        .get_arch_info = test_get_arch_info,
+        .dump_instruction_to_buffer = test_dump_instruction,
+        .dump_instruction_name_to_buffer = test_dump_instruction_name,
+    };
+}
+
+//
+// IR construction
+//
+
+// index has to be unique among the temps of a test, globals also need
+// the env offset the arch info refers to them by.
+static inline LibTcgTemp *test_temp(StackAllocator *stack, LibTcgTempKind kind,
+                                    uint32_t index, const char *name,
+                                    intptr_t mem_offset) {
+    LibTcgTemp *temp = stack_alloc_zero(stack, sizeof(LibTcgTemp));
+    temp->kind = kind;
+    temp->index = index;
+    temp->mem_offset = mem_offset;
+    snprintf(temp->name, sizeof(temp->name), "%s", name);
+    return temp;
+}
+
+static inline LibTcgTemp *test_const(StackAllocator *stack, uint32_t index,
+                                     uint64_t value) {
+    LibTcgTemp *temp = test_temp(stack, LIBTCG_TEMP_CONST, index, "", 0);
+    temp->val = value;
+    snprintf(temp->name, sizeof(temp->name), "$0x%lx", value);
+    return temp;
+}
+
+// Block with room for TEST_MAX_INSTRUCTIONS, appended to *tail if it
+// is non-NULL
+static inline TbNode *test_block(StackAllocator *stack, TbNode **tail,
+                                 uint64_t address, size_t size_in_bytes) {
+    TbNode *n = stack_alloc_zero(stack, sizeof(TbNode));
+    n->address = address;
+    n->tb.size_in_bytes = size_in_bytes;
+    n->tb.list = stack_alloc_zero(stack, TEST_MAX_INSTRUCTIONS*sizeof(LibTcgInstruction));
+    if (tail != NULL) {
+        if (*tail != NULL) {
+            (*tail)->next = n;
+        }
+        *tail = n;
+    }
+    return n;
+}
+
+static inline LibTcgInstruction *test_op(TbNode *n, LibTcgOpcode opcode) {
+    assert(n->tb.instruction_count < TEST_MAX_INSTRUCTIONS);
+    LibTcgInstruction *inst = &n->tb.list[n->tb.instruction_count++];
+    memset(inst, 0, sizeof(*inst));
+    inst->opcode = opcode;
+    return inst;
+}
+
+static inline void test_oarg(LibTcgInstruction *inst, LibTcgTemp *temp) {
+    inst->output_args[inst->nb_oargs++] = (LibTcgArgument) {
+        .kind = LIBTCG_ARG_TEMP,
+        .temp = temp,
+    };
+}
+
+static inline void test_iarg(LibTcgInstruction *inst, LibTcgTemp *temp) {
+    inst->input_args[inst->nb_iargs++] = (LibTcgArgument) {
+        .kind = LIBTCG_ARG_TEMP,
+        .temp = temp,
+    };
+}
+
+// Input argument that is not a temp
+static inline void test_iarg_constant(LibTcgInstruction *inst, uint64_t value) {
+    inst->input_args[inst->nb_iargs++] = (LibTcgArgument) {
+        .kind = LIBTCG_ARG_CONSTANT,
+        .constant = value,
+    };
+}
+
+static inline void test_carg(LibTcgInstruction *inst, uint64_t value) {
+    inst->constant_args[inst->nb_cargs++] = (LibTcgArgument) {
+        .kind = LIBTCG_ARG_CONSTANT,
+        .constant = value,
+    };
+}
+
+static inline void test_insn_start(TbNode *n, uint64_t address) {
+    test_carg(test_op(n, LIBTCG_op_insn_start), address);
+}
+
+// dst = src, or dst = value if src is a constant temp
+static inline void test_mov(TbNode *n, LibTcgTemp *dst, LibTcgTemp *src) {
+    LibTcgInstruction *inst = test_op(n, LIBTCG_op_mov_i64);
+    test_oarg(inst, dst);
+    test_iarg(inst, src);
+}
+
+static inline void test_binop(TbNode *n, LibTcgOpcode opcode, LibTcgTemp *dst,
+                              LibTcgTemp *a, LibTcgTemp *b) {
+    LibTcgInstruction *inst = test_op(n, opcode);
+    test_oarg(inst, dst);
+    test_iarg(inst, a);
+    test_iarg(inst, b);
+}
+
+static inline void test_edge(TbNode *src, size_t src_instruction,
+                             TbNode *dst, EdgeType type) {
+    assert(src->num_succ < MAX_EDGES && dst->num_pred < MAX_EDGES);
+    src->succ[src->num_succ++] = (Edge) {
+        .src_instruction = src_instruction,
+        .dst_node = dst,
+        .type = type,
+    };
+    dst->pred[dst->num_pred++] = (Edge) {
+        .src_instruction = src_instruction,
+        .dst_node = src,
+        .type = type,
+    };
+}